@@ -10,14 +10,34 @@ LOCAL_SRC_FILES := \
 	recovery.c \
 	bootloader.c \
 	commands.c \
+	dirhash.c \
 	firmware.c \
+	gzblock.c \
+	image.c \
 	install.c \
+	keys.c \
+	logger.c \
+	manifest.c \
+	progress.c \
+	restore.c \
 	roots.c \
+	sdindex.c \
+	sha1.c \
+	snapshot.c \
+	stats.c \
+	tar.c \
+	trace.c \
 	ui.c \
 	verifier.c
 
 LOCAL_SRC_FILES += test_roots.c
 
+# The multi-message SHA-1 in NEON, picked at runtime if the CPU has it.
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_SRC_FILES += sha1_lanes.c.neon
+LOCAL_CFLAGS += -DSHA1_HAVE_LANES
+endif
+
 LOCAL_MODULE := recovery
 
 LOCAL_FORCE_STATIC_EXECUTABLE := true
@@ -25,6 +45,12 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 RECOVERY_API_VERSION := 2.1.3
 LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION)
 
+# Set if the bootloader reads run-length encoded busy/fail bitmaps in a
+# firmware update (UPDATE_VERSION_RLE, see bootloader.c).
+ifeq ($(BOARD_RECOVERY_RLE_UPDATE_BITMAPS),true)
+LOCAL_CFLAGS += -DRECOVERY_RLE_UPDATE_BITMAPS
+endif
+
 # This binary is in the recovery ramdisk, which is otherwise a copy of root.
 # It gets copied there in config/Makefile.  LOCAL_MODULE_TAGS suppresses
 # a (redundant) copy of the binary in /system/bin for user builds.
@@ -32,10 +58,22 @@ LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION)
 
 LOCAL_MODULE_TAGS := eng
 
-LOCAL_STATIC_LIBRARIES := libminzip libunz libamend libmtdutils libmincrypt
+LOCAL_STATIC_LIBRARIES := libminzip libz libamend libmtdutils libmincrypt
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
+# res/images, decoded now into a table ui.c hands to minui, so the
+# device doesn't run libpng before it can show anything.
+LOCAL_MODULE_CLASS := EXECUTABLES
+intermediates := $(call local-intermediates-dir)
+recovery_images_c := $(intermediates)/recovery_images.c
+recovery_image_files := $(wildcard $(LOCAL_PATH)/res/images/*.png)
+$(recovery_images_c): PRIVATE_IMAGES := $(recovery_image_files)
+$(recovery_images_c): $(HOST_OUT_EXECUTABLES)/minui_mkimages $(recovery_image_files)
+	@mkdir -p $(dir $@)
+	$(hide) $(HOST_OUT_EXECUTABLES)/minui_mkimages $@ $(PRIVATE_IMAGES)
+LOCAL_GENERATED_SOURCES += $(recovery_images_c)
+
 include $(BUILD_EXECUTABLE)
 
 include $(commands_recovery_local_path)/minui/Android.mk
@@ -14,16 +14,22 @@
  * limitations under the License.
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include "symtab.h"
 
-#define DEFAULT_TABLE_SIZE 16
+#define DEFAULT_TABLE_SIZE 16   /* slots; always a power of two */
 
+/* An open-addressed hash table keyed on (symbol, flags); a slot with
+ * a NULL symbol is empty.  Nothing is ever removed, so lookups can
+ * stop at the first empty slot.
+ */
 typedef struct {
     char *symbol;
     const void *cookie;
     unsigned int flags;
+    unsigned int hash;
 } SymbolTableEntry;
 
 struct SymbolTable {
@@ -32,6 +38,64 @@ struct SymbolTable {
     int maxSize;
 };
 
+static unsigned int
+hashSymbol(const char *symbol, unsigned int flags)
+{
+    /* FNV-1a, with the flags mixed in last.
+     */
+    unsigned int h = 2166136261u;
+    const unsigned char *p;
+    for (p = (const unsigned char *)symbol; *p != '\0'; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return (h ^ flags) * 16777619u;
+}
+
+/* Returns the slot holding (symbol, flags), or the empty slot where it
+ * would go.
+ */
+static SymbolTableEntry *
+findSlot(const SymbolTable *tab, const char *symbol, unsigned int flags,
+        unsigned int hash)
+{
+    unsigned int mask = tab->maxSize - 1;
+    unsigned int i = hash & mask;
+    while (true) {
+        SymbolTableEntry *e = &tab->table[i];
+        if (e->symbol == NULL ||
+                (e->hash == hash && e->flags == flags &&
+                 strcmp(e->symbol, symbol) == 0))
+        {
+            return e;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int
+growSymbolTable(SymbolTable *tab)
+{
+    SymbolTable bigger;
+    int i;
+
+    bigger.maxSize = tab->maxSize * 2;
+    bigger.numEntries = tab->numEntries;
+    bigger.table = (SymbolTableEntry *)calloc(bigger.maxSize,
+                        sizeof(SymbolTableEntry));
+    if (bigger.table == NULL) {
+        return -1;
+    }
+    for (i = 0; i < tab->maxSize; i++) {
+        const SymbolTableEntry *e = &tab->table[i];
+        if (e->symbol != NULL) {
+            *findSlot(&bigger, e->symbol, e->flags, e->hash) = *e;
+        }
+    }
+    free(tab->table);
+    *tab = bigger;
+    return 0;
+}
+
 SymbolTable *
 createSymbolTable()
 {
@@ -41,8 +105,8 @@ createSymbolTable()
     if (tab != NULL) {
         tab->numEntries = 0;
         tab->maxSize = DEFAULT_TABLE_SIZE;
-        tab->table = (SymbolTableEntry *)malloc(
-                            tab->maxSize * sizeof(SymbolTableEntry));
+        tab->table = (SymbolTableEntry *)calloc(
+                            tab->maxSize, sizeof(SymbolTableEntry));
         if (tab->table == NULL) {
             free(tab);
             tab = NULL;
@@ -55,77 +119,64 @@ void
 deleteSymbolTable(SymbolTable *tab)
 {
     if (tab != NULL) {
-        while (tab->numEntries > 0) {
-            free(tab->table[--tab->numEntries].symbol);
+        int i;
+        for (i = 0; i < tab->maxSize; i++) {
+            free(tab->table[i].symbol);
         }
         free(tab->table);
+        free(tab);
     }
 }
 
 void *
 findInSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags)
 {
-    int i;
+    const SymbolTableEntry *e;
 
     if (tab == NULL || symbol == NULL) {
         return NULL;
     }
 
-    // TODO: Sort the table and binary search
-    for (i = 0; i < tab->numEntries; i++) {
-        if (strcmp(tab->table[i].symbol, symbol) == 0 &&
-                tab->table[i].flags == flags)
-        {
-            return (void *)tab->table[i].cookie;
-        }
-    }
-
-    return NULL;
+    e = findSlot(tab, symbol, flags, hashSymbol(symbol, flags));
+    return e->symbol != NULL ? (void *)e->cookie : NULL;
 }
 
 int
 addToSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags,
         const void *cookie)
 {
+    SymbolTableEntry *e;
+    unsigned int hash;
+
     if (tab == NULL || symbol == NULL || cookie == NULL) {
         return -1;
     }
 
-    /* Make sure that this symbol isn't already in the table.
+    /* Keep the table at most half full, so probes stay short.
      */
-    if (findInSymbolTable(tab, symbol, flags) != NULL) {
-        return -2;
+    if ((tab->numEntries + 1) * 2 > tab->maxSize) {
+        if (growSymbolTable(tab) != 0) {
+            return -1;
+        }
     }
 
-    /* Make sure there's enough space for the new entry.
+    /* Make sure that this symbol isn't already in the table.
      */
-    if (tab->numEntries == tab->maxSize) {
-        SymbolTableEntry *newTable;
-        int newSize;
-
-        newSize = tab->numEntries * 2;
-        if (newSize < DEFAULT_TABLE_SIZE) {
-            newSize = DEFAULT_TABLE_SIZE;
-        }
-        newTable = (SymbolTableEntry *)realloc(tab->table,
-                            newSize * sizeof(SymbolTableEntry));
-        if (newTable == NULL) {
-            return -1;
-        }
-        tab->maxSize = newSize;
-        tab->table = newTable;
+    hash = hashSymbol(symbol, flags);
+    e = findSlot(tab, symbol, flags, hash);
+    if (e->symbol != NULL) {
+        return -2;
     }
 
     /* Insert the new entry.
      */
-    symbol = strdup(symbol);
-    if (symbol == NULL) {
+    e->symbol = strdup(symbol);
+    if (e->symbol == NULL) {
         return -1;
     }
-    // TODO: Sort the table
-    tab->table[tab->numEntries].symbol = (char *)symbol;
-    tab->table[tab->numEntries].cookie = cookie;
-    tab->table[tab->numEntries].flags = flags;
+    e->cookie = cookie;
+    e->flags = flags;
+    e->hash = hash;
     tab->numEntries++;
 
     return 0;
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #undef NDEBUG
 #include <assert.h>
@@ -25,6 +26,7 @@ test_symtab()
     SymbolTable *tab;
     void *cookie;
     int ret;
+    int i;
 
     /* Test creation */
     tab = createSymbolTable();
@@ -138,6 +140,28 @@ test_symtab()
     cookie = findInSymbolTable(tab, "one", 0);
     assert((int)cookie == 1);
 
+    /* Add enough entries to make the table grow several times, and
+     * make sure they (and the old ones) can all still be found.
+     */
+    for (i = 0; i < 1000; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "sym%d", i);
+        ret = addToSymbolTable(tab, name, i % 3, (void *)(i + 100));
+        assert(ret == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "sym%d", i);
+        cookie = findInSymbolTable(tab, name, i % 3);
+        assert((int)cookie == i + 100);
+        cookie = findInSymbolTable(tab, name, (i + 1) % 3);
+        assert(cookie == NULL);
+        ret = addToSymbolTable(tab, name, i % 3, (void *)1);
+        assert(ret == -2);
+    }
+    cookie = findInSymbolTable(tab, "one", 333);
+    assert((int)cookie == 11);
+
     /* Try deleting again, now that there's stuff in the table.
      */
     deleteSymbolTable(tab);
@@ -21,7 +21,9 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static const char *CACHE_NAME = "CACHE:";
 static const char *MISC_NAME = "MISC:";
@@ -41,59 +43,74 @@ static void dump_data(const char *data, int len) {
 }
 #endif
 
-int get_bootloader_message(struct bootloader_message *out) {
-    size_t write_size;
-    const MtdPartition *part = get_root_mtd_partition(MISC_NAME);
-    if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
-//        LOGE("Can't find %s\n", MISC_NAME);
-        return -1;
+/* The misc pages, read from flash the first time they're needed and
+ * kept; nothing but recovery writes them while it runs.  gMisc is NULL
+ * until read, and again after a write that failed, since the flash
+ * could then hold anything.
+ */
+static const MtdPartition *gMiscPart = NULL;
+static size_t gMiscPageSize = 0;
+static char *gMisc = NULL;
+
+static int load_misc(void) {
+    if (gMisc != NULL) return 0;
+
+    if (gMiscPart == NULL) {
+        const MtdPartition *part = get_root_mtd_partition(MISC_NAME);
+        if (part == NULL ||
+            mtd_partition_info(part, NULL, NULL, &gMiscPageSize)) {
+//            LOGE("Can't find %s\n", MISC_NAME);
+            return -1;
+        }
+        gMiscPart = part;
     }
 
-    MtdReadContext *read = mtd_read_partition(part);
+    MtdReadContext *read = mtd_read_partition(gMiscPart);
     if (read == NULL) {
         LOGE("Can't open %s\n(%s)\n", MISC_NAME, strerror(errno));
         return -1;
     }
 
-    const ssize_t size = write_size * MISC_PAGES;
-    char data[size];
-    ssize_t r = mtd_read_data(read, data, size);
+    const ssize_t size = gMiscPageSize * MISC_PAGES;
+    char *data = malloc(size);
+    ssize_t r = data != NULL ? mtd_read_data(read, data, size) : -1;
     if (r != size) LOGE("Can't read %s\n(%s)\n", MISC_NAME, strerror(errno));
     mtd_read_close(read);
-    if (r != size) return -1;
+    if (r != size) {
+        free(data);
+        return -1;
+    }
 
 #ifdef LOG_VERBOSE
-    printf("\n--- get_bootloader_message ---\n");
+    printf("\n--- load_misc ---\n");
     dump_data(data, size);
     printf("\n");
 #endif
 
-    memcpy(out, &data[write_size * MISC_COMMAND_PAGE], sizeof(*out));
+    gMisc = data;
+    return 0;
+}
+
+int get_bootloader_message(struct bootloader_message *out) {
+    if (load_misc() != 0) return -1;
+    memcpy(out, &gMisc[gMiscPageSize * MISC_COMMAND_PAGE], sizeof(*out));
     return 0;
 }
 
 int set_bootloader_message(const struct bootloader_message *in) {
-    size_t write_size;
-    const MtdPartition *part = get_root_mtd_partition(MISC_NAME);
-    if (part == NULL || mtd_partition_info(part, NULL, NULL, &write_size)) {
-//        LOGE("Can't find %s\n", MISC_NAME);
-        return -1;
-    }
+    if (load_misc() != 0) return -1;
 
-    MtdReadContext *read = mtd_read_partition(part);
-    if (read == NULL) {
-        LOGE("Can't open %s\n(%s)\n", MISC_NAME, strerror(errno));
-        return -1;
+    char *message = &gMisc[gMiscPageSize * MISC_COMMAND_PAGE];
+    if (memcmp(message, in, sizeof(*in)) == 0) {
+        LOGI("Boot command \"%s\" already set\n",
+             in->command[0] != 255 ? in->command : "");
+        return 0;
     }
 
-    ssize_t size = write_size * MISC_PAGES;
+    const ssize_t size = gMiscPageSize * MISC_PAGES;
     char data[size];
-    ssize_t r = mtd_read_data(read, data, size);
-    if (r != size) LOGE("Can't read %s\n(%s)\n", MISC_NAME, strerror(errno));
-    mtd_read_close(read);
-    if (r != size) return -1;
-
-    memcpy(&data[write_size * MISC_COMMAND_PAGE], in, sizeof(*in));
+    memcpy(data, gMisc, size);
+    memcpy(&data[gMiscPageSize * MISC_COMMAND_PAGE], in, sizeof(*in));
 
 #ifdef LOG_VERBOSE
     printf("\n--- set_bootloader_message ---\n");
@@ -101,11 +118,17 @@ int set_bootloader_message(const struct bootloader_message *in) {
     printf("\n");
 #endif
 
-    MtdWriteContext *write = mtd_write_partition(part);
+    MtdWriteContext *write = mtd_write_partition(gMiscPart);
     if (write == NULL) {
         LOGE("Can't open %s\n(%s)\n", MISC_NAME, strerror(errno));
         return -1;
     }
+
+    // Where the pages span erase blocks, only those that change are
+    // erased and programmed.
+    mtd_write_set_skip_unchanged(write, 1);
+    free(gMisc);
+    gMisc = NULL;
     if (mtd_write_data(write, data, size) != size) {
         LOGE("Can't write %s\n(%s)\n", MISC_NAME, strerror(errno));
         mtd_write_close(write);
@@ -116,6 +139,8 @@ int set_bootloader_message(const struct bootloader_message *in) {
         return -1;
     }
 
+    gMisc = malloc(size);
+    if (gMisc != NULL) memcpy(gMisc, data, size);
     LOGI("Set boot command \"%s\"\n", in->command[0] != 255 ? in->command : "");
     return 0;
 }
@@ -129,11 +154,16 @@ int set_bootloader_message(const struct bootloader_message *in) {
  * - offsets are in BYTES from the start of the update header
  * - two raw bitmaps will be included, the "busy" and "fail" bitmaps
  * - for dream, the bitmaps will be 320x480x16bpp RGB565
+ * - in UPDATE_VERSION_RLE, 16bpp bitmaps are run-length encoded as
+ *   (count, pixel) pairs of unsigned shorts, like initlogo.rle, and
+ *   their lengths are of the encoded data; only bootloaders that know
+ *   it can be sent one (see RECOVERY_RLE_UPDATE_BITMAPS)
  */
 
 #define UPDATE_MAGIC       "MSM-RADIO-UPDATE"
 #define UPDATE_MAGIC_SIZE  16
 #define UPDATE_VERSION     0x00010000
+#define UPDATE_VERSION_RLE 0x00020000
 
 struct update_header {
     unsigned char MAGIC[UPDATE_MAGIC_SIZE];
@@ -155,10 +185,52 @@ struct update_header {
     unsigned fail_bitmap_length;
 };
 
-int write_update_for_bootloader(
-        const char *update, int update_length,
+// Copy "length" bytes from "fd" to "write", a block at a time.
+static int copy_update(MtdWriteContext *write, int fd, int length) {
+    char buf[16384];
+    while (length > 0) {
+        ssize_t n = read(fd, buf, length < (int) sizeof(buf) ?
+                length : (int) sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;  // the image was short
+            return -1;
+        }
+        if (mtd_write_data(write, buf, n) != n) return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+#ifdef RECOVERY_RLE_UPDATE_BITMAPS
+// Encode "pixels" 16bpp pixels for UPDATE_VERSION_RLE.  Returns a
+// malloc'd buffer, with its size in *length, or NULL.
+static char *rle_bitmap(const char *bitmap, int pixels, int *length) {
+    const unsigned short *in = (const unsigned short *) bitmap;
+    unsigned short *out = malloc(pixels * 2 * sizeof(*out));  // worst case
+    if (out == NULL) return NULL;
+
+    int i = 0, n = 0;
+    while (i < pixels) {
+        unsigned short pixel = in[i];
+        int run = 1;
+        while (i + run < pixels && run < 0xffff && in[i + run] == pixel) {
+            ++run;
+        }
+        out[n++] = run;
+        out[n++] = pixel;
+        i += run;
+    }
+    *length = n * sizeof(*out);
+    return (char *) out;
+}
+#endif
+
+static int write_update(
+        int update_fd, int update_length, unsigned version,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
-        const char *busy_bitmap, const char *fail_bitmap) {
+        const char *busy_bitmap, int busy_length,
+        const char *fail_bitmap, int fail_length) {
     if (ensure_root_path_unmounted(CACHE_NAME)) {
         LOGE("Can't unmount %s\n", CACHE_NAME);
         return -1;
@@ -195,13 +267,13 @@ int write_update_for_bootloader(
      */
 
     memcpy(&header.MAGIC, UPDATE_MAGIC, UPDATE_MAGIC_SIZE);
-    header.version = UPDATE_VERSION;
+    header.version = version;
     header.size = header_size;
 
     header.image_offset = mtd_erase_blocks(write, 0);
     header.image_length = update_length;
     if ((int) header.image_offset == -1 ||
-        mtd_write_data(write, update, update_length) != update_length) {
+        copy_update(write, update_fd, update_length) != 0) {
         LOGE("Can't write update to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
@@ -211,21 +283,19 @@ int write_update_for_bootloader(
     header.bitmap_height = bitmap_height;
     header.bitmap_bpp = bitmap_bpp;
 
-    int bitmap_length = (bitmap_bpp + 7) / 8 * bitmap_width * bitmap_height;
-
     header.busy_bitmap_offset = mtd_erase_blocks(write, 0);
-    header.busy_bitmap_length = busy_bitmap != NULL ? bitmap_length : 0;
+    header.busy_bitmap_length = busy_bitmap != NULL ? busy_length : 0;
     if ((int) header.busy_bitmap_offset == -1 ||
-        mtd_write_data(write, busy_bitmap, bitmap_length) != bitmap_length) {
+        mtd_write_data(write, busy_bitmap, busy_length) != busy_length) {
         LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
     }
 
     header.fail_bitmap_offset = mtd_erase_blocks(write, 0);
-    header.fail_bitmap_length = fail_bitmap != NULL ? bitmap_length : 0;
+    header.fail_bitmap_length = fail_bitmap != NULL ? fail_length : 0;
     if ((int) header.fail_bitmap_offset == -1 ||
-        mtd_write_data(write, fail_bitmap, bitmap_length) != bitmap_length) {
+        mtd_write_data(write, fail_bitmap, fail_length) != fail_length) {
         LOGE("Can't write bitmap to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
@@ -265,3 +335,37 @@ int write_update_for_bootloader(
 
     return 0;
 }
+
+int write_update_for_bootloader(
+        int update_fd, int update_length,
+        int bitmap_width, int bitmap_height, int bitmap_bpp,
+        const char *busy_bitmap, const char *fail_bitmap) {
+    int bitmap_length = (bitmap_bpp + 7) / 8 * bitmap_width * bitmap_height;
+
+#ifdef RECOVERY_RLE_UPDATE_BITMAPS
+    // The icons are mostly background, so this usually saves all but
+    // one erase block of each.
+    if (bitmap_bpp == 16 && busy_bitmap != NULL && fail_bitmap != NULL) {
+        int pixels = bitmap_width * bitmap_height;
+        int busy_length = 0, fail_length = 0;
+        char *busy_rle = rle_bitmap(busy_bitmap, pixels, &busy_length);
+        char *fail_rle = rle_bitmap(fail_bitmap, pixels, &fail_length);
+        if (busy_rle != NULL && fail_rle != NULL) {
+            LOGI("Bitmaps encoded to %d and %d of %d bytes\n",
+                 busy_length, fail_length, bitmap_length);
+            int ret = write_update(update_fd, update_length,
+                    UPDATE_VERSION_RLE, bitmap_width, bitmap_height,
+                    bitmap_bpp, busy_rle, busy_length, fail_rle, fail_length);
+            free(busy_rle);
+            free(fail_rle);
+            return ret;
+        }
+        free(busy_rle);
+        free(fail_rle);
+    }
+#endif
+
+    return write_update(update_fd, update_length, UPDATE_VERSION,
+            bitmap_width, bitmap_height, bitmap_bpp,
+            busy_bitmap, bitmap_length, fail_bitmap, bitmap_length);
+}
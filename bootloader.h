@@ -48,11 +48,13 @@ int get_bootloader_message(struct bootloader_message *out);
 int set_bootloader_message(const struct bootloader_message *in);
 
 /* Write an update to the cache partition for update-radio or update-hboot.
+ * The update_len bytes of the image are read from update_fd as they're
+ * written, so it needn't fit in memory.
  * Note, this destroys any filesystem on the cache partition!
  * The expected bitmap format is 240x320, 16bpp (2Bpp), RGB 5:6:5.
  */
 int write_update_for_bootloader(
-        const char *update, int update_len,
+        int update_fd, int update_len,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
         const char *busy_bitmap, const char *error_bitmap);
 
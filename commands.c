@@ -34,10 +34,15 @@
 #include "common.h"
 #include "cutils/misc.h"
 #include "cutils/properties.h"
+#include "dirhash.h"
 #include "firmware.h"
+#include "install.h"
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
+#include "mtdutils/mounts.h"
 #include "roots.h"
+#include "stats.h"
+#include "verifier.h"
 
 static int gDidShowProgress = 0;
 
@@ -105,7 +110,10 @@ cmd_format(const char *name, void *cookie, int argc, const char *argv[])
     const char *root = argv[0];
     ui_print("Formatting %s...\n", root);
 
+    StatsTimer timer;
+    stats_start(&timer, "format");
     int ret = format_root_device(root);
+    stats_stop(&timer, 0, 0);
     if (ret != 0) {
         LOGE("Can't format %s\n", root);
         return 1;
@@ -177,16 +185,41 @@ typedef struct {
     int num_total;
 } ExtractContext;
 
-static void extract_count_cb(const char *fn, void *cookie)
+/* Count the files copy_dir will unpack from under "zip_dir" straight
+ * from the package's sorted entries, the way mzExtractRecursive() picks
+ * them with MZ_EXTRACT_FILES_ONLY, instead of a dry run through the
+ * extractor.  Also totals their size for the stats.
+ */
+static int count_extract_files(const ZipArchive *package,
+        const char *zip_dir, long long *bytes)
 {
-   ++((ExtractContext*) cookie)->num_total;
+    size_t len = strlen(zip_dir);
+    char prefix[len + 2];
+    strcpy(prefix, zip_dir);
+    if (len > 0 && prefix[len - 1] != '/') strcpy(prefix + len, "/");
+
+    unsigned int first, count, i;
+    int files = 0;
+    *bytes = 0;
+    count = mzFindZipEntriesWithPrefix(package, prefix, &first);
+    for (i = 0; i < count; ++i) {
+        const ZipEntry *entry = mzGetSortedZipEntry(package, first + i);
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        if (fn.len == 0 || fn.str[fn.len - 1] == '/') continue;
+        if (mzIsZipEntrySymlink(entry)) continue;
+        ++files;
+        *bytes += mzGetZipEntryUncompLen(entry);
+    }
+    return files;
 }
 
 static void extract_cb(const char *fn, void *cookie)
 {
     // minzip writes the filename to the log, so we don't need to
     ExtractContext *ctx = (ExtractContext*) cookie;
-    ui_set_progress((float) ++ctx->num_done / ctx->num_total);
+    ++ctx->num_done;
+    ui_set_progress(ctx->num_done >= ctx->num_total ? 1.0f :
+            (float) ctx->num_done / ctx->num_total);
 }
 
 /* copy_dir <src-dir> <dst-dir> [<timestamp>]
@@ -265,19 +298,24 @@ cmd_copy_dir(const char *name, void *cookie, int argc, const char *argv[])
         }
 
         /* Extract the files.  Set MZ_EXTRACT_FILES_ONLY, because only files
-         * are validated by the signature.  Do a dry run first to count how
-         * many there are (and find some errors early).
+         * are validated by the signature.  The count for the progress bar
+         * comes from the package index, so this is the only pass over
+         * the files; it's the same parallel, batch-synced extraction
+         * edify's package_extract_dir() does.
          */
         ExtractContext ctx;
+        long long bytes;
         ctx.num_done = 0;
-        ctx.num_total = 0;
-
-        if (!mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DRY_RUN,
-                    &timestamp, extract_count_cb, (void *) &ctx) ||
-            !mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY,
-                    &timestamp, extract_cb, (void *) &ctx)) {
+        ctx.num_total = count_extract_files(package, src_path, &bytes);
+
+        StatsTimer timer;
+        stats_start(&timer, "extract");
+        bool ok = mzExtractRecursiveParallel(package, src_path, dst_path,
+                    MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_SYNC,
+                    &timestamp, extract_cb, (void *) &ctx,
+                    install_threads());
+        stats_stop(&timer, ok ? bytes : 0, ctx.num_done);
+        if (!ok) {
             LOGW("Command %s: couldn't extract \"%s\" to \"%s\"\n",
                     name, src_root_path, dst_root_path);
             return 1;
@@ -343,6 +381,12 @@ cmd_run_program(const char *name, void *cookie, int argc, const char *argv[])
         return 1;
     }
 
+    // The program could do anything, so the package must check out first.
+    if (!verify_pipelined_commit()) {
+        LOGE("Command %s: package failed verification\n", name);
+        return 1;
+    }
+
     // Create a copy of argv to NULL-terminate it, as execv requires
     char **args = (char **) malloc(sizeof(char*) * (argc + 1));
     memcpy(args, argv, sizeof(char*) * argc);
@@ -357,6 +401,7 @@ cmd_run_program(const char *name, void *cookie, int argc, const char *argv[])
 
     int status;
     waitpid(pid, &status, 0);
+    invalidate_mounted_volumes();  // the program may have (un)mounted things
     if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
         return 0;
     } else {
@@ -409,7 +454,8 @@ cmd_set_perm(const char *name, void *cookie, int argc, const char *argv[])
         }
 
         if (recurse
-                ? dirSetHierarchyPermissions(path, n[0], n[1], n[2], n[3])
+                ? dirSetHierarchyPermissions(path, n[0], n[1], n[2], n[3],
+                        install_threads())
                 : (chown(path, n[0], n[1]) || chmod(path, n[2]))) {
            LOGE("Can't chown/mod %s\n(%s)\n", path, strerror(errno));
            return 1;
@@ -492,25 +538,6 @@ cmd_symlink(const char *name, void *cookie, int argc, const char *argv[])
     return 0;
 }
 
-struct FirmwareContext {
-    size_t total_bytes, done_bytes;
-    char *data;
-};
-
-static bool firmware_fn(const unsigned char *data, int data_len, void *cookie)
-{
-    struct FirmwareContext *context = (struct FirmwareContext*) cookie;
-    if (context->done_bytes + data_len > context->total_bytes) {
-        LOGE("Data overrun in firmware\n");
-        return false;  // Should not happen, but let's be safe.
-    }
-
-    memcpy(context->data + context->done_bytes, data, data_len);
-    context->done_bytes += data_len;
-    ui_set_progress(context->done_bytes * 1.0 / context->total_bytes);
-    return true;
-}
-
 /* write_radio_image <src-image>
  * write_hboot_image <src-image>
  * Doesn't actually take effect until the rest of installation finishes.
@@ -543,7 +570,6 @@ cmd_write_firmware_image(const char *name, void *cookie,
         return 1;
     }
 
-    ui_print("Extracting %s image...\n", type);
     char path[PATH_MAX];
     const ZipArchive *package;
     if (!translate_package_root_path(argv[0], path, sizeof(path), &package)) {
@@ -551,32 +577,9 @@ cmd_write_firmware_image(const char *name, void *cookie,
         return 1;
     }
 
-    const ZipEntry *entry = mzFindZipEntry(package, path);
-    if (entry == NULL) {
-        LOGE("Can't find %s\n", path);
-        return 1;
-    }
-
-    // Load the update image into RAM.
-    struct FirmwareContext context;
-    context.total_bytes = mzGetZipEntryUncompLen(entry);
-    context.done_bytes = 0;
-    context.data = malloc(context.total_bytes);
-    if (context.data == NULL) {
-        LOGE("Can't allocate %d bytes for %s\n", context.total_bytes, argv[0]);
-        return 1;
-    }
-
-    if (!mzProcessZipEntryContents(package, entry, firmware_fn, &context) ||
-        context.done_bytes != context.total_bytes) {
-        LOGE("Can't read %s\n", argv[0]);
-        free(context.data);
-        return 1;
-    }
-
-    if (remember_firmware_update(type, context.data, context.total_bytes)) {
+    // The image is inflated straight into cache when it's installed.
+    if (remember_firmware_entry(type, package, path)) {
         LOGE("Can't store %s image\n", type);
-        free(context.data);
         return 1;
     }
 
@@ -641,6 +644,14 @@ cmd_write_raw_image(const char *name, void *cookie,
         return 1;
     }
 
+    /* A bad raw image can leave the device unable to boot, so nothing
+     * is written until the whole package has been verified.
+     */
+    if (!verify_pipelined_commit()) {
+        LOGE("Command %s: package failed verification\n", name);
+        return 1;
+    }
+
     /* Unmount the destination root if it isn't already.
      */
     int ret = ensure_root_path_unmounted(dst_root_path);
@@ -656,14 +667,19 @@ cmd_write_raw_image(const char *name, void *cookie,
         LOGE("Can't find %s\n", dst_root_path);
         return 1;
     }
-    MtdWriteContext *context = mtd_write_partition(partition);
+    MtdWriteContext *context = mtd_write_partition_async(partition, 0);
     if (context == NULL) {
         LOGE("Can't open %s\n", dst_root_path);
         return 1;
     }
+    mtd_write_set_verify(context, MTD_VERIFY_DEFERRED);
+    mtd_write_set_skip_unchanged(context, 1);
+    mtd_write_set_skip_erased(context, 1);
 
     /* Extract and write the image.
      */
+    StatsTimer timer;
+    stats_start(&timer, "flash");
     bool ok = mzProcessZipEntryContents(package, entry,
             write_raw_image_process_fn, context);
     if (!ok) {
@@ -677,8 +693,12 @@ cmd_write_raw_image(const char *name, void *cookie,
         mtd_write_close(context);
         return -1;
     }
+    LOGI("%d unchanged blocks of %s left alone\n",
+            mtd_write_skipped_blocks(context), dst_root_path);
 
-    if (mtd_write_close(context)) {
+    ret = mtd_write_close(context);
+    stats_stop(&timer, mzGetZipEntryUncompLen(entry), 1);
+    if (ret) {
         LOGE("Error closing %s\n", dst_root_path);
         return -1;
     }
@@ -808,27 +828,70 @@ fn_get_mark(const char *name, void *cookie, int argc, const char *argv[],
 }
 
 /* hash_dir(<path-to-directory>)
+ * Returns the SHA-1 (in hex) of the whole tree; see dirhash.h.  Per-file
+ * digests are cached in HASH_DIR_CACHE_PREFIX<root>, so checking the
+ * same tree again only reads what changed.
  */
+#define HASH_DIR_CACHE_PREFIX "CACHE:recovery/hash_dir."
+
 static int
 fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
         char **result, size_t *resultLen)
 {
-    int ret = -1;
-
-    UNUSED(name);
     UNUSED(cookie);
     CHECK_FN();
 
-    const char *dir;
     if (argc != 1) {
         fprintf(stderr, "%s: wrong number of arguments (%d)\n",
                 name, argc);
         return 1;
-    } else {
-        dir = argv[0];
     }
 
-    return ret;
+    char pathbuf[PATH_MAX];
+    const char *root_path = argv[0];
+    const char *dir = translate_root_path(root_path, pathbuf, sizeof(pathbuf));
+    if (dir == NULL) {
+        LOGE("Command %s: bad path \"%s\"\n", name, root_path);
+        return 1;
+    }
+    if (ensure_root_path_mounted(root_path)) {
+        LOGE("Can't mount %s\n", root_path);
+        return 1;
+    }
+
+    // One cache per tree, named after its path: "SYSTEM:app" ->
+    // ".../hash_dir.SYSTEM-app".  Without /cache, just don't cache.
+    char cache_root[PATH_MAX], cachebuf[PATH_MAX];
+    const char *cache_path = NULL;
+    snprintf(cache_root, sizeof(cache_root), "%s%s",
+            HASH_DIR_CACHE_PREFIX, root_path);
+    char *p;
+    for (p = cache_root + strlen(HASH_DIR_CACHE_PREFIX); *p != '\0'; ++p) {
+        if (*p == '/' || *p == ':') *p = '-';
+    }
+    if (ensure_root_path_mounted(cache_root) == 0) {
+        cache_path = translate_root_path(cache_root,
+                cachebuf, sizeof(cachebuf));
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (dirhash_compute(dir, cache_path, digest) != 0) {
+        LOGE("Command %s: can't hash %s\n", name, root_path);
+        return 1;
+    }
+
+    *result = malloc(SHA_DIGEST_SIZE * 2 + 1);
+    if (*result == NULL) {
+        return 1;
+    }
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+        sprintf(*result + i * 2, "%02x", digest[i]);
+    }
+    if (resultLen != NULL) {
+        *resultLen = SHA_DIGEST_SIZE * 2;
+    }
+    return 0;
 }
 
 /* matches(<str>, <str1> [, <strN>...])
@@ -32,6 +32,9 @@ void ui_clear_key_queue();
 // The screen is small, and users may need to report these messages to support,
 // so keep the output short and not too cryptic.
 void ui_print(const char *fmt, ...);
+// Like ui_print() for "len" bytes of plain text, of any length, with just
+// one redraw however many lines it has.
+void ui_print_text(const char *text, size_t len);
 
 // Display some header text followed by a menu of items, which appears
 // at the top of the screen (in place of any scrolling ui_print()
@@ -76,6 +79,9 @@ static const float DEFAULT_IMAGE_PROGRESS_FRACTION = 0.1;
 // Show a rotating "barberpole" for ongoing operations.  Updates automatically.
 void ui_show_indeterminate_progress();
 
+// Show a line of text (e.g. rate and time left) under the progress bar.
+void ui_set_progress_text(const char *text);
+
 // Hide and reset the progress bar.
 void ui_reset_progress();
 
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dirhash.h"
+
+#define DIRHASH_BUFFER_SIZE (64 * 1024)
+#define CACHE_MAGIC         "hash_dir cache 1\n"
+
+typedef struct {
+    char *path;                 // relative to the top; "." for the top
+    struct stat st;
+    uint8_t digest[SHA_DIGEST_SIZE];    // plain files only
+    int cached;                 // digest came from the cache
+} HashEntry;
+
+typedef struct {
+    HashEntry *entries;         // in walk order
+    int count;
+    int allocd;
+    dev_t skip_dev;             // the cache file, left out
+    ino_t skip_ino;
+} HashTree;
+
+typedef struct {
+    unsigned long long ino;
+    long long size;
+    long long mtime;
+    long long ctime;
+    uint8_t digest[SHA_DIGEST_SIZE];
+} CachedDigest;
+
+typedef struct {
+    const char *dir;
+    HashTree *tree;
+    pthread_mutex_t lock;
+    int next;                   // entry to look at next
+    int failed;
+} HashJob;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static int compare_inodes(const void *a, const void *b) {
+    const CachedDigest *ca = (const CachedDigest *) a;
+    const CachedDigest *cb = (const CachedDigest *) b;
+    if (ca->ino != cb->ino) return ca->ino < cb->ino ? -1 : 1;
+    return 0;
+}
+
+static HashEntry *add_entry(HashTree *tree, const char *path,
+        const struct stat *st) {
+    if (tree->count == tree->allocd) {
+        int allocd = tree->allocd ? tree->allocd * 2 : 256;
+        HashEntry *grown = realloc(tree->entries, allocd * sizeof(HashEntry));
+        if (grown == NULL) return NULL;
+        tree->entries = grown;
+        tree->allocd = allocd;
+    }
+    HashEntry *e = &tree->entries[tree->count];
+    e->path = strdup(path);
+    if (e->path == NULL) return NULL;
+    e->st = *st;
+    e->cached = 0;
+    ++tree->count;
+    return e;
+}
+
+// Add what's in "top"/"rel" to the tree, sorted by name, each
+// directory followed by its contents.
+static int walk(const char *top, const char *rel, HashTree *tree) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", top, rel);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char **names = NULL;
+    int count = 0, allocd = 0, ret = 0, i;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (count == allocd) {
+            allocd = allocd ? allocd * 2 : 32;
+            char **grown = realloc(names, allocd * sizeof(char *));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            names = grown;
+        }
+        if ((names[count] = strdup(de->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        ++count;
+    }
+    closedir(d);
+    if (ret == 0) qsort(names, count, sizeof(char *), compare_names);
+
+    for (i = 0; i < count && ret == 0; ++i) {
+        char child[PATH_MAX];
+        struct stat st;
+        if (!strcmp(rel, ".")) {
+            strlcpy(child, names[i], sizeof(child));
+        } else {
+            snprintf(child, sizeof(child), "%s/%s", rel, names[i]);
+        }
+        snprintf(path, sizeof(path), "%s/%s", top, child);
+        if (lstat(path, &st) != 0) {
+            LOGE("Can't stat %s\n(%s)\n", path, strerror(errno));
+            ret = -1;
+        } else if (st.st_dev == tree->skip_dev &&
+                st.st_ino == tree->skip_ino) {
+            continue;
+        } else if (add_entry(tree, child, &st) == NULL) {
+            LOGE("Out of memory hashing %s\n", top);
+            ret = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            ret = walk(top, child, tree);
+        }
+    }
+
+    for (i = 0; i < count; ++i) free(names[i]);
+    free(names);
+    return ret;
+}
+
+static int load_cache(const char *cache_path, CachedDigest **cache) {
+    *cache = NULL;
+    FILE *f = fopen(cache_path, "r");
+    if (f == NULL) return 0;
+
+    char line[256];
+    int count = 0, allocd = 0;
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, CACHE_MAGIC)) {
+        fclose(f);
+        return 0;               // not ours; it'll be rewritten
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        CachedDigest c;
+        char hex[SHA_DIGEST_SIZE * 2 + 1];
+        int i;
+        if (sscanf(line, "%llu %lld %lld %lld %40s", &c.ino, &c.size,
+                &c.mtime, &c.ctime, hex) != 5 ||
+                strlen(hex) != SHA_DIGEST_SIZE * 2) {
+            continue;
+        }
+        for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+            unsigned int byte;
+            sscanf(hex + i * 2, "%2x", &byte);
+            c.digest[i] = byte;
+        }
+        if (count == allocd) {
+            allocd = allocd ? allocd * 2 : 256;
+            CachedDigest *grown = realloc(*cache, allocd * sizeof(c));
+            if (grown == NULL) break;
+            *cache = grown;
+        }
+        (*cache)[count++] = c;
+    }
+    fclose(f);
+    qsort(*cache, count, sizeof(CachedDigest), compare_inodes);
+    return count;
+}
+
+static const CachedDigest *find_cached(const CachedDigest *cache, int count,
+        const struct stat *st) {
+    if (count == 0) return NULL;
+    CachedDigest key;
+    key.ino = st->st_ino;
+    const CachedDigest *c = bsearch(&key, cache, count, sizeof(key),
+            compare_inodes);
+    if (c != NULL && c->size == st->st_size && c->mtime == st->st_mtime &&
+            c->ctime == st->st_ctime) {
+        return c;
+    }
+    return NULL;
+}
+
+static int save_cache(const char *cache_path, const HashTree *tree) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) return -1;
+
+    fputs(CACHE_MAGIC, f);
+    int i, j;
+    for (i = 0; i < tree->count; ++i) {
+        const HashEntry *e = &tree->entries[i];
+        if (!S_ISREG(e->st.st_mode)) continue;
+        fprintf(f, "%llu %lld %lld %lld ", (unsigned long long) e->st.st_ino,
+                (long long) e->st.st_size, (long long) e->st.st_mtime,
+                (long long) e->st.st_ctime);
+        for (j = 0; j < SHA_DIGEST_SIZE; ++j) fprintf(f, "%02x", e->digest[j]);
+        putc('\n', f);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache_path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int hash_file(const char *path, char *buffer,
+        uint8_t digest[SHA_DIGEST_SIZE]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buffer, DIRHASH_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        SHA_update(&ctx, buffer, n);
+    }
+    close(fd);
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+// Hash the plain files not found in the cache, until there are none
+// left or one can't be read.
+static void *hash_thread(void *cookie) {
+    HashJob *job = (HashJob *) cookie;
+    char *buffer = malloc(DIRHASH_BUFFER_SIZE);
+    if (buffer == NULL) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        HashEntry *e = NULL;
+        pthread_mutex_lock(&job->lock);
+        while (!job->failed && job->next < job->tree->count) {
+            HashEntry *candidate = &job->tree->entries[job->next++];
+            if (S_ISREG(candidate->st.st_mode) && !candidate->cached) {
+                e = candidate;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&job->lock);
+        if (e == NULL) break;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", job->dir, e->path);
+        if (hash_file(path, buffer, e->digest) != 0) {
+            LOGE("Can't read %s\n(%s)\n", path, strerror(errno));
+            pthread_mutex_lock(&job->lock);
+            job->failed = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int hash_entry(SHA_CTX *ctx, const char *dir, const HashEntry *e) {
+    const struct stat *st = &e->st;
+    char type = S_ISREG(st->st_mode) ? 'f' : S_ISDIR(st->st_mode) ? 'd' :
+            S_ISLNK(st->st_mode) ? 'l' : S_ISCHR(st->st_mode) ? 'c' :
+            S_ISBLK(st->st_mode) ? 'b' : S_ISFIFO(st->st_mode) ? 'p' : 's';
+    char header[PATH_MAX + 64];
+    int len = snprintf(header, sizeof(header), "%c %o %d %d %s", type,
+            (int) (st->st_mode & 07777), (int) st->st_uid, (int) st->st_gid,
+            e->path);
+    SHA_update(ctx, header, len + 1);   // with the NUL
+
+    if (type == 'f') {
+        SHA_update(ctx, e->digest, SHA_DIGEST_SIZE);
+    } else if (type == 'l') {
+        char path[PATH_MAX], target[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->path);
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n < 0) {
+            LOGE("Can't read link %s\n(%s)\n", path, strerror(errno));
+            return -1;
+        }
+        target[n] = '\0';
+        SHA_update(ctx, target, n + 1);
+    } else if (type == 'c' || type == 'b') {
+        len = snprintf(header, sizeof(header), "%llu",
+                (unsigned long long) st->st_rdev);
+        SHA_update(ctx, header, len + 1);
+    }
+    return 0;
+}
+
+int dirhash_compute(const char *dir, const char *cache_path,
+        uint8_t digest[SHA_DIGEST_SIZE]) {
+    HashTree tree;
+    memset(&tree, 0, sizeof(tree));
+    struct stat st;
+    if (cache_path != NULL && stat(cache_path, &st) == 0) {
+        tree.skip_dev = st.st_dev;
+        tree.skip_ino = st.st_ino;
+    }
+
+    int ret = -1, i;
+    CachedDigest *cache = NULL;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        LOGE("Can't hash %s: not a directory\n", dir);
+        goto done;
+    }
+    if (add_entry(&tree, ".", &st) == NULL || walk(dir, ".", &tree) != 0) {
+        goto done;
+    }
+
+    int cached = 0, files = 0;
+    int cache_count = cache_path != NULL ? load_cache(cache_path, &cache) : 0;
+    for (i = 0; i < tree.count; ++i) {
+        HashEntry *e = &tree.entries[i];
+        if (!S_ISREG(e->st.st_mode)) continue;
+        ++files;
+        const CachedDigest *c = find_cached(cache, cache_count, &e->st);
+        if (c != NULL) {
+            memcpy(e->digest, c->digest, SHA_DIGEST_SIZE);
+            e->cached = 1;
+            ++cached;
+        }
+    }
+
+    // This thread is one of the hashers.
+    HashJob job;
+    job.dir = dir;
+    job.tree = &tree;
+    pthread_mutex_init(&job.lock, NULL);
+    job.next = 0;
+    job.failed = 0;
+    int threads = files - cached < DIRHASH_MAX_THREADS ?
+            files - cached : DIRHASH_MAX_THREADS;
+    pthread_t thread[DIRHASH_MAX_THREADS];
+    int started;
+    for (started = 0; started < threads - 1; ++started) {
+        if (pthread_create(&thread[started], NULL, hash_thread, &job) != 0) {
+            break;
+        }
+    }
+    hash_thread(&job);
+    for (i = 0; i < started; ++i) pthread_join(thread[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    if (job.failed) goto done;
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    for (i = 0; i < tree.count; ++i) {
+        if (hash_entry(&ctx, dir, &tree.entries[i]) != 0) goto done;
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    ret = 0;
+
+    LOGI("Hashed %s: %d entries, %d of %d files from the cache\n",
+            dir, tree.count, cached, files);
+    if (cache_path != NULL && (cached < files || cache_count != files) &&
+            save_cache(cache_path, &tree) != 0) {
+        LOGW("Can't write %s\n(%s)\n", cache_path, strerror(errno));
+    }
+
+done:
+    for (i = 0; i < tree.count; ++i) free(tree.entries[i].path);
+    free(tree.entries);
+    free(cache);
+    return ret;
+}
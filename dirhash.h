@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_DIRHASH_H
+#define _RECOVERY_DIRHASH_H
+
+#include <stdint.h>
+
+#include "mincrypt/sha.h"
+
+/* One SHA-1 for a whole directory tree, for hash_dir().
+ *
+ * The tree is walked in sorted order, and every entry adds its path
+ * (relative to the top), type, mode and owner to the digest; a plain
+ * file adds the SHA-1 of its contents, a symlink its target and a
+ * device its number.  So two trees hash the same only if they'd look
+ * the same to anything on the device.  Contents are hashed on several
+ * threads, and the per-file digests combined in walk order.
+ *
+ * The per-file digests can be kept in a cache file, keyed by inode,
+ * size, mtime and ctime, so hashing the same tree again only reads the
+ * files that changed.
+ */
+
+#define DIRHASH_MAX_THREADS 4
+
+/* Hash the tree at "dir" into "digest".  "cache_path" names the cache
+ * for this tree, read first and rewritten afterwards, or is NULL for
+ * none; the cache file itself is left out of the hash.  Returns 0, or
+ * -1 (having logged why) if anything in the tree can't be read.
+ */
+int dirhash_compute(const char *dir, const char *cache_path,
+        uint8_t digest[SHA_DIGEST_SIZE]);
+
+#endif  /* _RECOVERY_DIRHASH_H */
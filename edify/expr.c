@@ -14,31 +14,45 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
 
 // Functions should:
 //
-//    - return a malloc()'d string
+//    - return a malloc()'d string, a shared constant from BoolValue()
+//      or EmptyValue(), or (unchanged) one of their arguments' values
+//    - release the argument values they don't return with FreeValue()
 //    - if Evaluate() on any argument returns NULL, return NULL.
 
 int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+static bool BranchCancelled();
+static char* ProfiledEvaluate(State* state, Expr* expr);
+// Checked without a lock: a stale answer only delays cancelling.
+static volatile int parallel_calls = 0;  // under way, on any thread
+static bool profiling = false;
+
 char* Evaluate(State* state, Expr* expr) {
+    if (parallel_calls > 0 && BranchCancelled()) return NULL;
+    if (profiling && expr->fn != Literal && expr->fn != SequenceFn) {
+        return ProfiledEvaluate(state, expr);
+    }
     return expr->fn(expr->name, state, expr->argc, expr->argv);
 }
 
 char* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
-        return strdup("");
+        return EmptyValue();
     }
     char** strings = malloc(argc * sizeof(char*));
     int i;
@@ -65,8 +79,9 @@ char* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
 
   done:
     for (i = 0; i < argc; ++i) {
-        free(strings[i]);
+        FreeValue(strings[i]);
     }
+    free(strings);
     return result;
 }
 
@@ -82,11 +97,11 @@ char* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (BooleanString(cond) == true) {
-        free(cond);
+        FreeValue(cond);
         return Evaluate(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
+            FreeValue(cond);
             return Evaluate(state, argv[2]);
         } else {
             return cond;
@@ -101,7 +116,7 @@ char* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
     free(state->errmsg);
     if (msg) {
-        state->errmsg = msg;
+        state->errmsg = OwnValue(msg);
     } else {
         state->errmsg = strdup("called abort()");
     }
@@ -116,7 +131,7 @@ char* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
         int b = BooleanString(v);
-        free(v);
+        FreeValue(v);
         if (!b) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
@@ -130,7 +145,7 @@ char* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
     }
-    return strdup("");
+    return EmptyValue();
 }
 
 char* SleepFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -151,9 +166,9 @@ char* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
         fputs(v, stdout);
-        free(v);
+        FreeValue(v);
     }
-    return strdup("");
+    return EmptyValue();
 }
 
 char* LogicalAndFn(const char* name, State* state,
@@ -161,7 +176,7 @@ char* LogicalAndFn(const char* name, State* state,
     char* left = Evaluate(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == true) {
-        free(left);
+        FreeValue(left);
         return Evaluate(state, argv[1]);
     } else {
         return left;
@@ -173,7 +188,7 @@ char* LogicalOrFn(const char* name, State* state,
     char* left = Evaluate(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == false) {
-        free(left);
+        FreeValue(left);
         return Evaluate(state, argv[1]);
     } else {
         return left;
@@ -185,12 +200,8 @@ char* LogicalNotFn(const char* name, State* state,
     char* val = Evaluate(state, argv[0]);
     if (val == NULL) return NULL;
     bool bv = BooleanString(val);
-    free(val);
-    if (bv) {
-        return strdup("");
-    } else {
-        return strdup("t");
-    }
+    FreeValue(val);
+    return BoolValue(!bv);
 }
 
 char* SubstringFn(const char* name, State* state,
@@ -199,13 +210,13 @@ char* SubstringFn(const char* name, State* state,
     if (needle == NULL) return NULL;
     char* haystack = Evaluate(state, argv[1]);
     if (haystack == NULL) {
-        free(needle);
+        FreeValue(needle);
         return NULL;
     }
 
-    char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
+    char* result = BoolValue(strstr(haystack, needle) != NULL);
+    FreeValue(needle);
+    FreeValue(haystack);
     return result;
 }
 
@@ -214,13 +225,13 @@ char* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (left == NULL) return NULL;
     char* right = Evaluate(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
+    char* result = BoolValue(strcmp(left, right) == 0);
+    FreeValue(left);
+    FreeValue(right);
     return result;
 }
 
@@ -229,20 +240,20 @@ char* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (left == NULL) return NULL;
     char* right = Evaluate(state, argv[1]);
     if (right == NULL) {
-        free(left);
+        FreeValue(left);
         return NULL;
     }
 
-    char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
+    char* result = BoolValue(strcmp(left, right) != 0);
+    FreeValue(left);
+    FreeValue(right);
     return result;
 }
 
 char* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* left = Evaluate(state, argv[0]);
     if (left == NULL) return NULL;
-    free(left);
+    FreeValue(left);
     return Evaluate(state, argv[1]);
 }
 
@@ -275,9 +286,9 @@ char* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
-    return strdup(result ? "t" : "");
+    FreeValue(left);
+    FreeValue(right);
+    return BoolValue(result);
 }
 
 char* GreaterThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -294,18 +305,19 @@ char* GreaterThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     return LessThanIntFn(name, state, 2, temp);
 }
 
+// The literal's text is in the parse tree; lend it out rather than copy.
 char* Literal(const char* name, State* state, int argc, Expr* argv[]) {
-    return strdup(name);
+    return (char*)name;
 }
 
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
-    Expr* e = malloc(sizeof(Expr));
+    Expr* e = ArenaAlloc(sizeof(Expr));
     e->fn = fn;
     e->name = "(operator)";
     e->argc = count;
-    e->argv = malloc(count * sizeof(Expr*));
+    e->argv = ArenaAlloc(count * sizeof(Expr*));
     int i;
     for (i = 0; i < count; ++i) {
         e->argv[i] = va_arg(v, Expr*);
@@ -313,9 +325,143 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_end(v);
     e->start = loc.start;
     e->end = loc.end;
+    e->profile = NULL;
     return e;
 }
 
+// -----------------------------------------------------------------
+//   the expression arena
+// -----------------------------------------------------------------
+
+#define ARENA_ALIGN(n)    (((n) + 7) & ~(size_t)7)
+#define MIN_BLOCK_SIZE    (16 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+struct ExprArena {
+    ArenaBlock* blocks;     // the one being filled first
+    size_t next_size;
+    struct ExprArena* next; // in all_arenas
+};
+
+static ExprArena* current_arena = NULL;
+static ExprArena* all_arenas = NULL;
+
+static ArenaBlock* AddArenaBlock(ExprArena* arena, size_t need) {
+    size_t size = arena->next_size;
+    if (size < need) size = need;
+    ArenaBlock* b = malloc(ARENA_ALIGN(sizeof(ArenaBlock)) + size);
+    if (b == NULL) {
+        fprintf(stderr, "out of memory parsing script\n");
+        exit(1);
+    }
+    b->next = arena->blocks;
+    b->size = size;
+    b->used = 0;
+    arena->blocks = b;
+    arena->next_size = size * 2;
+    return b;
+}
+
+ExprArena* NewExprArena(size_t size_hint) {
+    ExprArena* arena = malloc(sizeof(ExprArena));
+    if (arena == NULL) return NULL;
+    arena->blocks = NULL;
+    arena->next = all_arenas;
+    all_arenas = arena;
+    // A script's tree takes a few times its own length.
+    arena->next_size = size_hint * 4 > MIN_BLOCK_SIZE ?
+            ARENA_ALIGN(size_hint * 4) : MIN_BLOCK_SIZE;
+    current_arena = arena;
+    return arena;
+}
+
+void FreeExprArena(ExprArena* arena) {
+    if (arena == NULL) return;
+    while (arena->blocks != NULL) {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    if (current_arena == arena) current_arena = NULL;
+    ExprArena** p;
+    for (p = &all_arenas; *p != NULL; p = &(*p)->next) {
+        if (*p == arena) {
+            *p = arena->next;
+            break;
+        }
+    }
+    free(arena);
+}
+
+// Whether "p" points into a parse tree.
+static bool InArena(const char* p) {
+    const ExprArena* arena;
+    for (arena = all_arenas; arena != NULL; arena = arena->next) {
+        const ArenaBlock* b;
+        for (b = arena->blocks; b != NULL; b = b->next) {
+            const char* data = (const char*)b + ARENA_ALIGN(sizeof(ArenaBlock));
+            if (p >= data && p < data + b->used) return true;
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------
+//   values
+// -----------------------------------------------------------------
+
+// Shared values; writable only because Function returns char*.
+static char true_value[] = "t";
+static char empty_value[] = "";
+
+char* BoolValue(int b) {
+    return b ? true_value : empty_value;
+}
+
+char* EmptyValue() {
+    return empty_value;
+}
+
+static bool IsOwned(const char* value) {
+    return value != true_value && value != empty_value && !InArena(value);
+}
+
+void FreeValue(char* value) {
+    if (value != NULL && IsOwned(value)) free(value);
+}
+
+char* OwnValue(char* value) {
+    if (value == NULL || IsOwned(value)) return value;
+    return strdup(value);
+}
+
+void* ArenaAlloc(size_t size) {
+    if (current_arena == NULL && NewExprArena(0) == NULL) {
+        fprintf(stderr, "out of memory parsing script\n");
+        exit(1);
+    }
+    size = ARENA_ALIGN(size);
+    ArenaBlock* b = current_arena->blocks;
+    if (b == NULL || b->size - b->used < size) {
+        b = AddArenaBlock(current_arena, size);
+    }
+    void* p = (char*)b + ARENA_ALIGN(sizeof(ArenaBlock)) + b->used;
+    b->used += size;
+    return p;
+}
+
+char* ArenaStrdup(const char* s) {
+    size_t len = strlen(s) + 1;
+    char* copy = ArenaAlloc(len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -355,6 +501,340 @@ Function FindFunction(const char* name) {
     return nf->fn;
 }
 
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+#define PROFILE_TOP_CALLS 20
+
+typedef struct ExprProfile {
+    Expr* expr;
+    int calls;
+    double inclusive;           // seconds
+    double exclusive;
+    long long bytes;            // including the calls inside
+    struct ExprProfile* next;   // in all_profiles
+} ExprProfile;
+
+// A call under way, on the stack of the thread making it.
+typedef struct ProfileFrame {
+    struct ProfileFrame* outer;
+    double inner;               // seconds spent in calls it made
+    long long bytes;
+} ProfileFrame;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t frame_key;
+static ExprProfile* all_profiles = NULL;
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void EnableProfiling() {
+    if (!profiling) pthread_key_create(&frame_key, NULL);
+    profiling = true;
+}
+
+int ProfilingEnabled() {
+    return profiling;
+}
+
+void ProfileBytes(long long bytes) {
+    if (!profiling) return;
+    ProfileFrame* frame = pthread_getspecific(frame_key);
+    if (frame != NULL) frame->bytes += bytes;
+}
+
+static char* ProfiledEvaluate(State* state, Expr* expr) {
+    ProfileFrame frame;
+    frame.outer = pthread_getspecific(frame_key);
+    frame.inner = 0;
+    frame.bytes = 0;
+    pthread_setspecific(frame_key, &frame);
+
+    double start = Now();
+    char* result = expr->fn(expr->name, state, expr->argc, expr->argv);
+    double elapsed = Now() - start;
+
+    pthread_setspecific(frame_key, frame.outer);
+    if (frame.outer != NULL) {
+        frame.outer->inner += elapsed;
+        frame.outer->bytes += frame.bytes;
+    }
+
+    // Branches of parallel() overlap, so they can add up to more than
+    // the call that ran them took.
+    double exclusive = elapsed - frame.inner;
+    if (exclusive < 0) exclusive = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    ExprProfile* p = expr->profile;
+    if (p == NULL) {
+        p = calloc(1, sizeof(ExprProfile));
+        if (p != NULL) {
+            p->expr = expr;
+            p->next = all_profiles;
+            all_profiles = p;
+            expr->profile = p;
+        }
+    }
+    if (p != NULL) {
+        p->calls++;
+        p->inclusive += elapsed;
+        p->exclusive += exclusive;
+        p->bytes += frame.bytes;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return result;
+}
+
+static int CompareInclusive(const void* a, const void* b) {
+    const ExprProfile* pa = *(const ExprProfile**)a;
+    const ExprProfile* pb = *(const ExprProfile**)b;
+    if (pa->inclusive != pb->inclusive) return pa->inclusive < pb->inclusive ? 1 : -1;
+    return 0;
+}
+
+static int CompareExclusive(const void* a, const void* b) {
+    const ExprProfile* pa = (const ExprProfile*)a;
+    const ExprProfile* pb = (const ExprProfile*)b;
+    if (pa->exclusive != pb->exclusive) return pa->exclusive < pb->exclusive ? 1 : -1;
+    return 0;
+}
+
+void PrintProfile(FILE* f, const char* script) {
+    int count = 0;
+    ExprProfile* p;
+    for (p = all_profiles; p != NULL; p = p->next) ++count;
+    if (count == 0) return;
+
+    ExprProfile** sites = malloc(count * sizeof(ExprProfile*));
+    ExprProfile* funcs = calloc(count, sizeof(ExprProfile));
+    if (sites == NULL || funcs == NULL) {
+        free(sites);
+        free(funcs);
+        return;
+    }
+
+    // One line per function name, adding up its call sites.  (A
+    // function called inside itself has its inclusive time counted
+    // twice.)
+    int nsites = 0, nfuncs = 0, i;
+    for (p = all_profiles; p != NULL; p = p->next) {
+        sites[nsites++] = p;
+        for (i = 0; i < nfuncs; ++i) {
+            if (strcmp(funcs[i].expr->name, p->expr->name) == 0) break;
+        }
+        if (i == nfuncs) funcs[nfuncs++].expr = p->expr;
+        funcs[i].calls += p->calls;
+        funcs[i].inclusive += p->inclusive;
+        funcs[i].exclusive += p->exclusive;
+        funcs[i].bytes += p->bytes;
+    }
+    qsort(funcs, nfuncs, sizeof(ExprProfile), CompareExclusive);
+    qsort(sites, nsites, sizeof(ExprProfile*), CompareInclusive);
+
+    fprintf(f, "profile by function (exclusive time):\n");
+    fprintf(f, "   calls   incl ms   excl ms       bytes  function\n");
+    for (i = 0; i < nfuncs; ++i) {
+        fprintf(f, "%8d %9.1f %9.1f %11lld  %s\n", funcs[i].calls,
+                funcs[i].inclusive * 1000, funcs[i].exclusive * 1000,
+                funcs[i].bytes, funcs[i].expr->name);
+    }
+
+    fprintf(f, "profile by call (inclusive time):\n");
+    fprintf(f, "   calls   incl ms   excl ms       bytes  line: call\n");
+    for (i = 0; i < nsites && i < PROFILE_TOP_CALLS; ++i) {
+        const Expr* e = sites[i]->expr;
+        int line = 1, j;
+        for (j = 0; j < e->start && script[j] != '\0'; ++j) {
+            if (script[j] == '\n') ++line;
+        }
+        // The first line of the call's text, cut short if need be.
+        int len = 0;
+        while (len < 48 && e->start + len < e->end &&
+                script[e->start + len] != '\n' &&
+                script[e->start + len] != '\0') {
+            ++len;
+        }
+        fprintf(f, "%8d %9.1f %9.1f %11lld  %d: %.*s%s\n", sites[i]->calls,
+                sites[i]->inclusive * 1000, sites[i]->exclusive * 1000,
+                sites[i]->bytes, line, len, script + e->start,
+                e->start + len < e->end ? "..." : "");
+    }
+
+    free(sites);
+    free(funcs);
+}
+
+// -----------------------------------------------------------------
+//   parallel()
+// -----------------------------------------------------------------
+
+typedef struct {
+    State* state;           // the caller's
+    int argc;
+    Expr** argv;
+    char** results;
+    struct Branch* outer;   // the caller's branch, if it's in one
+    ProfileFrame* frame;    // the caller's call, if profiling
+
+    pthread_mutex_t lock;
+    int next;               // argument to start next
+    volatile bool failed;   // nothing more is to be started
+    char* errmsg;           // from the first argument to abort
+} ParallelCall;
+
+typedef struct Branch {
+    ParallelCall* call;
+    void* data;             // from branch_start
+} Branch;
+
+static BranchStartFn branch_start = NULL;
+static BranchEndFn branch_end = NULL;
+
+static pthread_key_t branch_key;
+static pthread_once_t branch_key_once = PTHREAD_ONCE_INIT;
+
+static void MakeBranchKey() {
+    pthread_key_create(&branch_key, NULL);
+}
+
+void SetParallelHooks(BranchStartFn start, BranchEndFn end) {
+    branch_start = start;
+    branch_end = end;
+}
+
+void* CurrentBranchData() {
+    if (parallel_calls == 0) return NULL;
+    Branch* b = pthread_getspecific(branch_key);
+    return b == NULL ? NULL : b->data;
+}
+
+// Whether some parallel() the calling thread is inside has failed.
+static bool BranchCancelled() {
+    Branch* b;
+    for (b = pthread_getspecific(branch_key); b != NULL; b = b->call->outer) {
+        if (b->call->failed) return true;
+    }
+    return false;
+}
+
+// Evaluate arguments of "call" until there are none left to start.
+static void* ParallelWorker(void* cookie) {
+    ParallelCall* call = (ParallelCall*) cookie;
+    Branch* saved = pthread_getspecific(branch_key);
+
+    // Branches count towards the parallel() call, whichever thread
+    // runs them, but that call's frame is the caller's to update.
+    ProfileFrame frame;
+    ProfileFrame* saved_frame = NULL;
+    if (call->frame != NULL) {
+        saved_frame = pthread_getspecific(frame_key);
+        frame.outer = NULL;
+        frame.inner = 0;
+        frame.bytes = 0;
+        pthread_setspecific(frame_key, &frame);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&call->lock);
+        int i = call->failed ? call->argc : call->next++;
+        pthread_mutex_unlock(&call->lock);
+        if (i >= call->argc) break;
+
+        State state = *call->state;
+        state.errmsg = NULL;
+        Branch b;
+        b.call = call;
+        b.data = NULL;
+        pthread_setspecific(branch_key, &b);
+        if (branch_start != NULL) b.data = branch_start(&state, i);
+
+        char* result = Evaluate(&state, call->argv[i]);
+
+        if (branch_end != NULL) branch_end(&state, b.data);
+        pthread_setspecific(branch_key, saved);
+
+        pthread_mutex_lock(&call->lock);
+        if (result == NULL && !call->failed) {
+            call->failed = true;
+            call->errmsg = state.errmsg;
+            state.errmsg = NULL;
+        }
+        pthread_mutex_unlock(&call->lock);
+        call->results[i] = result;
+        free(state.errmsg);
+    }
+
+    if (call->frame != NULL) {
+        pthread_setspecific(frame_key, saved_frame);
+        pthread_mutex_lock(&profile_lock);
+        call->frame->inner += frame.inner;
+        call->frame->bytes += frame.bytes;
+        pthread_mutex_unlock(&profile_lock);
+    }
+    return NULL;
+}
+
+char* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return EmptyValue();
+    }
+    pthread_once(&branch_key_once, MakeBranchKey);
+
+    ParallelCall call;
+    call.state = state;
+    call.argc = argc;
+    call.argv = argv;
+    call.results = calloc(argc, sizeof(char*));
+    if (call.results == NULL) {
+        return ErrorAbort(state, "%s: out of memory", name);
+    }
+    call.outer = pthread_getspecific(branch_key);
+    call.frame = profiling ? pthread_getspecific(frame_key) : NULL;
+    pthread_mutex_init(&call.lock, NULL);
+    call.next = 0;
+    call.failed = false;
+    call.errmsg = NULL;
+    __sync_fetch_and_add(&parallel_calls, 1);
+
+    // This thread is one of the workers.
+    pthread_t threads[MAX_PARALLEL - 1];
+    int count = (argc < MAX_PARALLEL ? argc : MAX_PARALLEL) - 1;
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (pthread_create(&threads[i], NULL, ParallelWorker, &call) != 0) {
+            count = i;      // make do with the ones there are
+            break;
+        }
+    }
+    ParallelWorker(&call);
+    for (i = 0; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    __sync_fetch_and_sub(&parallel_calls, 1);
+    pthread_mutex_destroy(&call.lock);
+
+    char* result = NULL;
+    if (call.failed) {
+        free(state->errmsg);
+        state->errmsg = call.errmsg;
+    } else {
+        result = call.results[argc-1];
+        call.results[argc-1] = NULL;
+    }
+    for (i = 0; i < argc; ++i) {
+        FreeValue(call.results[i]);
+    }
+    free(call.results);
+    return result;
+}
+
 void RegisterBuiltins() {
     RegisterFunction("ifelse", IfElseFn);
     RegisterFunction("abort", AbortFn);
@@ -363,6 +843,7 @@ void RegisterBuiltins() {
     RegisterFunction("is_substring", SubstringFn);
     RegisterFunction("stdout", StdoutFn);
     RegisterFunction("sleep", SleepFn);
+    RegisterFunction("parallel", ParallelFn);
 
     RegisterFunction("less_than_int", LessThanIntFn);
     RegisterFunction("greater_than_int", GreaterThanIntFn);
@@ -377,7 +858,7 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
+    char* args[count > 0 ? count : 1];
     va_list v;
     va_start(v, count);
     int i;
@@ -387,7 +868,7 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
             va_end(v);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                FreeValue(args[j]);
             }
             return -1;
         }
@@ -409,7 +890,7 @@ char** ReadVarArgs(State* state, int argc, Expr* argv[]) {
         if (args[i] == NULL) {
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                FreeValue(args[j]);
             }
             free(args);
             return NULL;
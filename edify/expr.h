@@ -17,6 +17,9 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 #include "yydefs.h"
 
 #define MAX_STRING_LEN 1024
@@ -39,6 +42,11 @@ typedef struct {
     char* errmsg;
 } State;
 
+// A value is a NUL-terminated string.  Functions return one they've
+// malloc()ed, or one that needs no allocation: the shared constants
+// BoolValue() and EmptyValue() return, or a literal from the parse
+// tree.  Either way the caller gets it to release with FreeValue(),
+// never free(), and must not modify it without OwnValue() first.
 typedef char* (*Function)(const char* name, State* state,
                           int argc, Expr* argv[]);
 
@@ -48,6 +56,7 @@ struct Expr {
     int argc;
     Expr** argv;
     int start, end;
+    struct ExprProfile* profile;    // NULL until profiled
 };
 
 char* Evaluate(State* state, Expr* expr);
@@ -71,6 +80,22 @@ char* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// The parser takes every Expr, argv array and literal string from the
+// current arena: a few large blocks, filled in parse order (so each
+// node follows its children), and freed all at once.
+typedef struct ExprArena ExprArena;
+
+// Make a new arena current.  "size_hint" (say, the length of the
+// script about to be parsed) sizes its first block.
+ExprArena* NewExprArena(size_t size_hint);
+
+// Free "arena" and every expression parsed into it.
+void FreeExprArena(ExprArena* arena);
+
+// Allocate from the current arena (starting one if there's none).
+void* ArenaAlloc(size_t size);
+char* ArenaStrdup(const char* s);
+
 // Global builtins, registered by RegisterBuiltins().
 char* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 char* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -105,6 +130,61 @@ void FinishRegistration();
 Function FindFunction(const char* name);
 
 
+// --- parallel() ---
+
+// parallel(expr, ...) evaluates its arguments at once, on up to
+// MAX_PARALLEL threads, and returns the value of the last one.  The
+// first argument to abort makes the call abort with its error; the
+// arguments not yet started are skipped, and those under way give up
+// at their next Evaluate().  So every Function a script calls inside
+// parallel() must be safe to run alongside the others.
+#define MAX_PARALLEL 4
+
+char* ParallelFn(const char* name, State* state, int argc, Expr* argv[]);
+
+// An application can keep state for each branch of a parallel():
+// "start" is called on the thread about to evaluate argument "index",
+// and returns what CurrentBranchData() gives that thread until "end"
+// is called with it, once the argument has been evaluated.
+typedef void* (*BranchStartFn)(State* state, int index);
+typedef void (*BranchEndFn)(State* state, void* data);
+void SetParallelHooks(BranchStartFn start, BranchEndFn end);
+
+// The data for the innermost parallel() branch the calling thread is
+// evaluating, or NULL if it's outside any.
+void* CurrentBranchData();
+
+
+// --- profiling ---
+
+// After EnableProfiling(), Evaluate() records for each function call
+// in the script how many times it ran, its wall time with and without
+// that of the calls inside it, and the bytes it said it moved.
+void EnableProfiling();
+int ProfilingEnabled();
+
+// Credit "bytes" extracted or written to the call this thread is in.
+void ProfileBytes(long long bytes);
+
+// Print what was recorded to "f": per function, then the costliest
+// calls, with their place in "script", most expensive first.
+void PrintProfile(FILE* f, const char* script);
+
+
+// --- values ---
+
+// "t" or "", shared; no allocation.
+char* BoolValue(int b);
+char* EmptyValue();
+
+// Release a value from Evaluate() (or a Function): free() it unless
+// it's a shared constant or part of a parse tree.  NULL is ignored.
+void FreeValue(char* value);
+
+// Return "value", or a malloc()ed copy of it (the original is then
+// released) if it isn't the caller's to modify or keep.
+char* OwnValue(char* value);
+
 // --- convenience functions for use in functions ---
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
@@ -30,6 +30,7 @@ int expect(const char* expr_str, const char* expected, int* errors) {
 
     printf(".");
 
+    ExprArena* arena = NewExprArena(strlen(expr_str));
     yy_scan_string(expr_str);
     int error_count = 0;
     error = yyparse(&e, &error_count);
@@ -37,6 +38,7 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
                 expr_str, error_count);
         ++*errors;
+        FreeExprArena(arena);
         return 0;
     }
 
@@ -45,7 +47,9 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     state.script = expr_str;
     state.errmsg = NULL;
 
-    result = Evaluate(&state, e);
+    // A literal's value lives in the arena, so take a copy first.
+    result = OwnValue(Evaluate(&state, e));
+    FreeExprArena(arena);
     free(state.errmsg);
     if (result == NULL && expected != NULL) {
         fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
@@ -61,11 +65,11 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
                 expr_str, expected, result);
         ++*errors;
-        free(result);
+        FreeValue(result);
         return 0;
     }
 
-    free(result);
+    FreeValue(result);
     return 1;
 }
 
@@ -153,6 +157,14 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // parallel
+    expect("parallel()", "", &errors);
+    expect("parallel(a, b, c)", "c", &errors);
+    expect("parallel(a, b, c, d, e, f, g, h, concat(i, j))", "ij", &errors);
+    expect("parallel(a, parallel(b, c) + d)", "cd", &errors);
+    expect("parallel(a, abort(), c)", NULL, &errors);
+    expect("parallel(a, b, parallel(c, assert(\"\")), d)", NULL, &errors);
+
     printf("\n");
 
     return errors;
@@ -188,6 +200,7 @@ int main(int argc, char** argv) {
 
     Expr* root;
     int error_count = 0;
+    NewExprArena(size);
     yy_scan_bytes(buffer, size);
     int error = yyparse(&root, &error_count);
     printf("parse returned %d; %d errors encountered\n", error, error_count);
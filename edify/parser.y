@@ -66,13 +66,14 @@ input:  expr           { *root = $1; }
 ;
 
 expr:  STRING {
-    $$ = malloc(sizeof(Expr));
+    $$ = ArenaAlloc(sizeof(Expr));
     $$->fn = Literal;
     $$->name = $1;
     $$->argc = 0;
     $$->argv = NULL;
     $$->start = @$.start;
     $$->end = @$.end;
+    $$->profile = NULL;
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
@@ -87,7 +88,7 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    $$ = malloc(sizeof(Expr));
+    $$ = ArenaAlloc(sizeof(Expr));
     $$->fn = FindFunction($1);
     if ($$->fn == NULL) {
         char buffer[256];
@@ -97,9 +98,16 @@ expr:  STRING {
     }
     $$->name = $1;
     $$->argc = $3.argc;
-    $$->argv = $3.argv;
+    $$->argv = NULL;
+    if ($3.argc > 0) {
+        // the list was gathered on the heap; keep it with the tree
+        $$->argv = ArenaAlloc($3.argc * sizeof(Expr*));
+        memcpy($$->argv, $3.argv, $3.argc * sizeof(Expr*));
+        free($3.argv);
+    }
     $$->start = @$.start;
     $$->end = @$.end;
+    $$->profile = NULL;
 }
 ;
 
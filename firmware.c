@@ -20,28 +20,186 @@
 #include "roots.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
 
 static const char *update_type = NULL;
-static const char *update_data = NULL;
+static int update_fd = -1;              // the image, or
+static ZipArchive update_zip;           // the package holding it
+static const ZipEntry *update_entry = NULL;
 static int update_length = 0;
 
-int remember_firmware_update(const char *type, const char *data, int length) {
-    if (update_type != NULL || update_data != NULL) {
+// A file that lives only in memory, for an image that can't stay put.
+static int open_anonymous(void) {
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "firmware", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+        char path[] = "/tmp/firmware-XXXXXX";
+        fd = mkstemp(path);
+        if (fd >= 0) unlink(path);
+    }
+    return fd;
+}
+
+// Whether "fd" is a file on the cache partition, which the image is
+// about to overwrite.
+static int on_cache(int fd) {
+    char path[PATH_MAX];
+    struct stat st, cache;
+    return is_root_path_mounted("CACHE:") > 0 &&
+            translate_root_path("CACHE:", path, sizeof(path)) != NULL &&
+            stat(path, &cache) == 0 && fstat(fd, &st) == 0 &&
+            st.st_dev == cache.st_dev;
+}
+
+static int set_update(const char *type, int length) {
+    if (update_type != NULL) {
         LOGE("Multiple firmware images\n");
         return -1;
     }
-
     update_type = type;
-    update_data = data;
     update_length = length;
     return 0;
 }
 
+int remember_firmware_update(const char *type, int fd, int length) {
+    if (on_cache(fd)) {
+        int copy = open_anonymous();
+        char buf[16384];
+        ssize_t n = 0;
+        while (copy >= 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+            if (write(copy, buf, n) != n) n = -1;
+            if (n < 0) break;
+        }
+        close(fd);
+        if (copy < 0 || n < 0 || lseek(copy, 0, SEEK_SET) != 0) {
+            LOGE("Can't copy %s image off cache\n(%s)\n", type, strerror(errno));
+            if (copy >= 0) close(copy);
+            return -1;
+        }
+        fd = copy;
+    }
+
+    if (set_update(type, length) != 0) {
+        close(fd);
+        return -1;
+    }
+    update_fd = fd;
+    return 0;
+}
+
+int remember_firmware_entry(const char *type, const ZipArchive *zip,
+        const char *name) {
+    if (update_type != NULL) {
+        LOGE("Multiple firmware images\n");
+        return -1;
+    }
+    const ZipEntry *entry = mzFindZipEntry(zip, name);
+    if (entry == NULL) {
+        LOGE("Can't find %s\n", name);
+        return -1;
+    }
+    int length = mzGetZipEntryUncompLen(entry);
+
+    if (on_cache(zip->fd)) {
+        int fd = open_anonymous();
+        if (fd < 0 || !mzExtractZipEntryToFile(zip, entry, fd) ||
+                lseek(fd, 0, SEEK_SET) != 0) {
+            LOGE("Can't extract %s\n", name);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return remember_firmware_update(type, fd, length);
+    }
+
+    // The caller will close its copy of the package long before then.
+    int fd = dup(zip->fd);
+    if (fd < 0 || mzOpenZipArchiveFd(fd, -1, &update_zip) != 0) {
+        LOGE("Can't reopen package for %s\n", name);
+        return -1;
+    }
+    fcntl(update_zip.fd, F_SETFD, FD_CLOEXEC);
+    update_entry = mzFindZipEntry(&update_zip, name);
+    if (update_entry == NULL) {
+        mzCloseZipArchive(&update_zip);
+        return -1;
+    }
+    return set_update(type, length);
+}
+
 // Return true if there is a firmware update pending.
 int firmware_update_pending() {
-  return update_data != NULL && update_length > 0;
+  return update_type != NULL && update_length > 0;
+}
+
+/* Where the writer reads an entry from: a thread inflates it into one
+ * end of a socket pair.  (Unlike a pipe, a send() to a reader that has
+ * given up fails instead of raising SIGPIPE.)
+ */
+typedef struct {
+    ZipEntryReader *reader;
+    int fd;
+    pthread_t thread;
+} EntryFeed;
+
+static void *feed_entry(void *cookie) {
+    EntryFeed *feed = (EntryFeed *) cookie;
+    char buf[16384];
+    ssize_t n;
+    while ((n = mzReadZipEntryReader(feed->reader, buf, sizeof(buf))) > 0) {
+        const char *p = buf;
+        while (n > 0) {
+            ssize_t sent = send(feed->fd, p, n, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) goto done;
+            p += sent;
+            n -= sent;
+        }
+    }
+done:
+    close(feed->fd);  // the writer sees the image end, early on error
+    return NULL;
+}
+
+// Open the saved image for reading; returns an fd, or -1.
+static int open_update(EntryFeed *feed) {
+    feed->reader = NULL;
+    if (update_entry == NULL) return update_fd;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+    feed->reader = mzOpenZipEntryReader(&update_zip, update_entry);
+    feed->fd = sv[1];
+    if (feed->reader == NULL ||
+            pthread_create(&feed->thread, NULL, feed_entry, feed) != 0) {
+        mzCloseZipEntryReader(feed->reader);
+        feed->reader = NULL;
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    return sv[0];
+}
+
+static void close_update(EntryFeed *feed, int fd) {
+    if (feed->reader == NULL) return;
+    close(fd);
+    pthread_join(feed->thread, NULL);
+    mzCloseZipEntryReader(feed->reader);
 }
 
 /* Bootloader / Recovery Flow
@@ -77,7 +235,7 @@ int firmware_update_pending() {
  */
 
 int maybe_install_firmware_update(const char *send_intent) {
-    if (update_data == NULL || update_length == 0) return 0;
+    if (!firmware_update_pending()) return 0;
 
     /* We destroy the cache partition to pass the update image to the
      * bootloader, so all we can really do afterwards is wipe cache and reboot.
@@ -102,9 +260,13 @@ int maybe_install_firmware_update(const char *send_intent) {
         BACKGROUND_ICON_FIRMWARE_ERROR, &width, &height, &bpp);
 
     ui_print("Writing %s image...\n", update_type);
-    if (write_update_for_bootloader(
-            update_data, update_length,
-            width, height, bpp, busy_image, fail_image)) {
+    EntryFeed feed;
+    int fd = open_update(&feed);
+    int error = fd < 0 || write_update_for_bootloader(
+            fd, update_length,
+            width, height, bpp, busy_image, fail_image);
+    close_update(&feed, fd);
+    if (error) {
         LOGE("Can't write %s image\n(%s)\n", update_type, strerror(errno));
         format_root_device("CACHE:");  // Attempt to clean cache up, at least.
         return -1;
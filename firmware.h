@@ -17,11 +17,22 @@
 #ifndef _RECOVERY_FIRMWARE_H
 #define _RECOVERY_FIRMWARE_H
 
-/* Save a radio or bootloader update image for later installation.
+#include "minzip/Zip.h"
+
+/* Save a radio or bootloader update image for later installation, to
+ * be read from "fd" (open at its start) when it's written to cache.
  * The type should be one of "hboot" or "radio".
- * Takes ownership of type and data.  Returns nonzero on error.
+ * Takes ownership of type and fd.  Returns nonzero on error.
+ */
+int remember_firmware_update(const char *type, int fd, int length);
+
+/* Like remember_firmware_update(), for the entry "name" of "zip": the
+ * package is kept open and the entry is inflated straight into the
+ * cache partition, so the image is never held in memory.  (A package
+ * on the cache partition itself has to be copied out first.)
  */
-int remember_firmware_update(const char *type, const char *data, int length);
+int remember_firmware_entry(const char *type, const ZipArchive *zip,
+        const char *name);
 
 /* Returns true if a firmware update has been saved. */
 int firmware_update_pending();
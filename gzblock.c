@@ -0,0 +1,725 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "gzblock.h"
+
+#define GZBLOCK_MAX_THREADS 8
+#define GZBLOCK_LEVEL       Z_BEST_SPEED    // the sdcard is slow, not the CPU
+
+// Room for a block that doesn't compress: deflate's stored blocks cost
+// 5 bytes per (at most) 16K, plus the gzip header and trailer.
+#define GZBLOCK_BOUND(n)    ((n) + ((n) >> 10) + 64)
+
+// Largest uncompressed block size a reader will accept.
+#define GZBLOCK_MAX_SIZE    (16 * 1024 * 1024)
+
+/* The index is a gzip member with an empty body and this subfield in
+ * its FEXTRA header field:
+ *
+ *    'R' 'B' len16 | block_size32 | count32 | count x compressed_size32
+ *
+ * all little-endian.  The whole extra field must fit in 64K.
+ */
+#define INDEX_SI1           'R'
+#define INDEX_SI2           'B'
+#define INDEX_HEADER        (10 + 2 + 4 + 8)   // gzip, XLEN, subfield, fields
+#define INDEX_TRAILER       (2 + 8)            // empty deflate, CRC, ISIZE
+#define INDEX_MAX_BLOCKS    ((65535 - 4 - 8) / 4)
+
+enum { SLOT_FREE, SLOT_FULL, SLOT_DONE, SLOT_FAILED };
+
+typedef struct {
+    int state;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+} GzSlot;
+
+struct GzBlockWriter {
+    int fd;
+    int error;                  // errno of the first failure, or 0
+    int nthreads;
+    pthread_t threads[GZBLOCK_MAX_THREADS];
+    int nslots;
+    GzSlot *slots;              // block n lives in slots[n % nslots]
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a block was queued, or stopping was set
+    pthread_cond_t done;        // a block was compressed
+    long long filled;           // blocks queued for compression
+    long long taken;            // blocks picked up by a compressor
+    long long written;          // blocks written to fd
+    int stopping;
+    unsigned int *sizes;        // compressed size of each written block
+    int sizes_alloc;
+};
+
+static int thread_count(int threads) {
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? n : 1;
+    }
+    return threads > GZBLOCK_MAX_THREADS ? GZBLOCK_MAX_THREADS : threads;
+}
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pread_fully(int fd, void *data, size_t len, off_t offset) {
+    char *p = (char *) data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EIO;    // truncated
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void put_le(unsigned char *p, unsigned int value, int bytes) {
+    int i;
+    for (i = 0; i < bytes; ++i) p[i] = value >> (8 * i);
+}
+
+static unsigned int get_le(const unsigned char *p, int bytes) {
+    unsigned int value = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+}
+
+static void free_slots(GzSlot *slots, int count) {
+    int i;
+    if (slots == NULL) return;
+    for (i = 0; i < count; ++i) {
+        free(slots[i].in);
+        free(slots[i].out);
+    }
+    free(slots);
+}
+
+static GzSlot *alloc_slots(int count, size_t in_size, size_t out_size) {
+    GzSlot *slots = calloc(count, sizeof(*slots));
+    int i;
+    if (slots == NULL) return NULL;
+    for (i = 0; i < count; ++i) {
+        slots[i].in = malloc(in_size);
+        slots[i].out = malloc(out_size);
+        if (slots[i].in == NULL || slots[i].out == NULL) {
+            free_slots(slots, count);
+            return NULL;
+        }
+    }
+    return slots;
+}
+
+static int compress_block(z_stream *z, GzSlot *slot) {
+    if (deflateReset(z) != Z_OK) return -1;
+    z->next_in = slot->in;
+    z->avail_in = slot->in_len;
+    z->next_out = slot->out;
+    z->avail_out = GZBLOCK_BOUND(GZBLOCK_SIZE);
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) return -1;
+    slot->out_len = z->total_out;
+    return 0;
+}
+
+static void *compress_thread(void *cookie) {
+    GzBlockWriter *w = (GzBlockWriter *) cookie;
+
+    // windowBits 15 + 16 wraps every block in a gzip header and trailer
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int ok = deflateInit2(&z, GZBLOCK_LEVEL, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) == Z_OK;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->stopping && w->taken == w->filled) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        if (w->taken == w->filled) break;
+        GzSlot *slot = &w->slots[w->taken++ % w->nslots];
+        pthread_mutex_unlock(&w->lock);
+
+        int ret = ok ? compress_block(&z, slot) : -1;
+
+        pthread_mutex_lock(&w->lock);
+        slot->state = ret ? SLOT_FAILED : SLOT_DONE;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (ok) deflateEnd(&z);
+    return NULL;
+}
+
+// Write compressed blocks out in order, waiting until at least "until"
+// of them have been written.  Called with w->lock held.
+static void write_finished(GzBlockWriter *w, long long until) {
+    while (w->written < w->filled) {
+        GzSlot *slot = &w->slots[w->written % w->nslots];
+        if (slot->state == SLOT_FULL) {
+            if (w->written >= until) break;
+            pthread_cond_wait(&w->done, &w->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&w->lock);
+        if (w->error) {
+            // keep draining so the compressors can finish
+        } else if (slot->state == SLOT_FAILED) {
+            LOGE("Can't compress block %lld\n", w->written);
+            w->error = EIO;
+        } else if (write_fully(w->fd, slot->out, slot->out_len)) {
+            w->error = errno;
+            LOGE("Can't write backup (%s)\n", strerror(errno));
+        } else {
+            if (w->written >= w->sizes_alloc) {
+                int alloc = w->sizes_alloc ? w->sizes_alloc * 2 : 256;
+                unsigned int *sizes = realloc(w->sizes, alloc * sizeof(*sizes));
+                if (sizes == NULL) {
+                    w->error = ENOMEM;
+                } else {
+                    w->sizes = sizes;
+                    w->sizes_alloc = alloc;
+                }
+            }
+            if (!w->error) w->sizes[w->written] = slot->out_len;
+        }
+        pthread_mutex_lock(&w->lock);
+        slot->state = SLOT_FREE;
+        slot->in_len = 0;
+        ++w->written;
+    }
+}
+
+// Queue the block being filled, and wait until the next one is free.
+static void queue_block(GzBlockWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    w->slots[w->filled % w->nslots].state = SLOT_FULL;
+    ++w->filled;
+    pthread_cond_signal(&w->work);
+    write_finished(w, w->filled - w->nslots + 1);
+    pthread_mutex_unlock(&w->lock);
+}
+
+GzBlockWriter *gzblock_open_writer(int fd, int threads) {
+    GzBlockWriter *w = calloc(1, sizeof(*w));
+    if (w == NULL) return NULL;
+    w->fd = fd;
+    threads = thread_count(threads);
+    w->nslots = threads * 2;    // one being compressed, one being filled
+    w->slots = alloc_slots(w->nslots, GZBLOCK_SIZE,
+            GZBLOCK_BOUND(GZBLOCK_SIZE));
+    if (w->slots == NULL) {
+        LOGE("Can't allocate compression buffers\n");
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    for (w->nthreads = 0; w->nthreads < threads; ++w->nthreads) {
+        if (pthread_create(&w->threads[w->nthreads], NULL,
+                compress_thread, w)) {
+            break;
+        }
+    }
+    if (w->nthreads == 0) {
+        LOGE("Can't start compression threads\n");
+        w->error = EAGAIN;
+        gzblock_close_writer(w);
+        return NULL;
+    }
+    return w;
+}
+
+int gzblock_write(GzBlockWriter *w, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    while (len > 0 && !w->error) {
+        GzSlot *slot = &w->slots[w->filled % w->nslots];
+        size_t n = GZBLOCK_SIZE - slot->in_len;
+        if (n > len) n = len;
+        memcpy(slot->in + slot->in_len, p, n);
+        slot->in_len += n;
+        p += n;
+        len -= n;
+        if (slot->in_len == GZBLOCK_SIZE) queue_block(w);
+    }
+    if (w->error) {
+        errno = w->error;
+        return -1;
+    }
+    return 0;
+}
+
+static int write_index(GzBlockWriter *w) {
+    if (w->written > INDEX_MAX_BLOCKS) {
+        // Still a good gzip file; restore just can't use many threads
+        LOGW("Too many blocks (%lld) to index\n", w->written);
+        return 0;
+    }
+    int count = w->written;
+    size_t len = INDEX_HEADER + 4 * count + INDEX_TRAILER;
+    unsigned char *buf = calloc(1, len);
+    if (buf == NULL) return -1;
+
+    buf[0] = 0x1f;                      // gzip magic
+    buf[1] = 0x8b;
+    buf[2] = Z_DEFLATED;
+    buf[3] = 0x04;                      // FEXTRA
+    buf[9] = 3;                         // OS: unix
+    put_le(buf + 10, 4 + 8 + 4 * count, 2);
+    buf[12] = INDEX_SI1;
+    buf[13] = INDEX_SI2;
+    put_le(buf + 14, 8 + 4 * count, 2);
+    put_le(buf + 16, GZBLOCK_SIZE, 4);
+    put_le(buf + 20, count, 4);
+    int i;
+    for (i = 0; i < count; ++i) put_le(buf + 24 + 4 * i, w->sizes[i], 4);
+    buf[INDEX_HEADER + 4 * count] = 0x03;  // final, empty fixed-Huffman block
+
+    int ret = write_fully(w->fd, buf, len);
+    free(buf);
+    return ret;
+}
+
+int gzblock_close_writer(GzBlockWriter *w) {
+    if (!w->error && w->slots[w->filled % w->nslots].in_len > 0) {
+        queue_block(w);
+    }
+    pthread_mutex_lock(&w->lock);
+    write_finished(w, w->filled);
+    w->stopping = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    int i;
+    for (i = 0; i < w->nthreads; ++i) pthread_join(w->threads[i], NULL);
+
+    if (!w->error && write_index(w)) {
+        w->error = errno;
+        LOGE("Can't write backup index (%s)\n", strerror(errno));
+    }
+
+    int err = w->error;
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free_slots(w->slots, w->nslots);
+    free(w->sizes);
+    free(w);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int gzblock_read_index(int fd, GzBlockIndex *index) {
+    struct stat st;
+    if (fstat(fd, &st)) return -1;
+
+    // The index member ends the stream; look for a gzip header that
+    // describes exactly the bytes from there to the end of the file.
+    size_t tail = 10 + 2 + 65535 + INDEX_TRAILER;
+    if ((off_t) tail > st.st_size) tail = st.st_size;
+    unsigned char *buf = malloc(tail);
+    if (buf == NULL) return -1;
+    if (pread_fully(fd, buf, tail, st.st_size - tail)) {
+        free(buf);
+        return -1;
+    }
+
+    size_t p;
+    for (p = 0; p + INDEX_HEADER + INDEX_TRAILER <= tail; ++p) {
+        const unsigned char *h = buf + p;
+        if (h[0] != 0x1f || h[1] != 0x8b || h[2] != Z_DEFLATED ||
+                h[3] != 0x04) {
+            continue;
+        }
+        size_t xlen = get_le(h + 10, 2);
+        if (p + 12 + xlen + INDEX_TRAILER != tail) continue;
+        if (h[12] != INDEX_SI1 || h[13] != INDEX_SI2) continue;
+        if (get_le(h + 14, 2) + 4 != xlen) continue;
+        unsigned int block_size = get_le(h + 16, 4);
+        unsigned int count = get_le(h + 20, 4);
+        if (xlen != 4 + 8 + 4 * count) continue;
+        if (block_size == 0 || block_size > GZBLOCK_MAX_SIZE) continue;
+
+        long long *offsets = malloc((count + 1) * sizeof(*offsets));
+        if (offsets == NULL) break;
+        unsigned int i;
+        offsets[0] = 0;
+        for (i = 0; i < count; ++i) {
+            offsets[i + 1] = offsets[i] + get_le(h + 24 + 4 * i, 4);
+        }
+        if (offsets[count] != st.st_size - (off_t) (tail - p)) {
+            free(offsets);
+            continue;
+        }
+        index->block_size = block_size;
+        index->count = count;
+        index->offsets = offsets;
+        free(buf);
+        return 0;
+    }
+    free(buf);
+    return -1;
+}
+
+void gzblock_free_index(GzBlockIndex *index) {
+    free(index->offsets);
+    index->offsets = NULL;
+    index->count = 0;
+}
+
+int gzblock_is_gzip(int fd) {
+    unsigned char magic[2];
+    if (pread_fully(fd, magic, sizeof(magic), 0)) return 0;
+    return magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+struct GzBlockReader {
+    int fd;
+    int error;                  // errno of the first failure, or 0
+
+    // Indexed streams: one thread reads the blocks in order, the others
+    // inflate them; the caller takes them in order again.
+    GzBlockIndex index;
+    int indexed;
+    int nslots;
+    GzSlot *slots;              // block n lives in slots[n % nslots]
+    int inflaters;              // threads to start (besides the fetcher)
+    int nthreads;               // started, including the fetcher
+    pthread_t threads[GZBLOCK_MAX_THREADS + 1];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // any slot changed state, or stopping was set
+    long long first;            // block the reading started at
+    long long fetched;          // blocks read from fd, counting from 0
+    long long taken;            // blocks picked up by an inflater
+    long long consumed;         // blocks the caller is done with
+    int stopping;
+    GzSlot *current;            // block being handed to the caller
+    size_t offset;              // ...and how much of it has been
+    size_t skip;                // to skip of the first block, after a seek
+
+    // Anything else is inflated by the caller, member after member
+    z_stream z;
+    int z_ret;
+    int pending;                // inflate may have more output buffered
+    unsigned char *in;
+};
+
+static void *fetch_thread(void *cookie) {
+    GzBlockReader *r = (GzBlockReader *) cookie;
+    const GzBlockIndex *index = &r->index;
+    long long n;
+
+    pthread_mutex_lock(&r->lock);
+    for (n = r->first; n < index->count; ++n) {
+        while (!r->stopping && n - r->consumed >= r->nslots) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->stopping) break;
+        GzSlot *slot = &r->slots[n % r->nslots];
+        pthread_mutex_unlock(&r->lock);
+
+        // Reading in order keeps the sdcard streaming
+        size_t len = index->offsets[n + 1] - index->offsets[n];
+        int ok = len <= GZBLOCK_BOUND(index->block_size) &&
+                pread_fully(r->fd, slot->in, len, index->offsets[n]) == 0;
+        if (!ok) LOGE("Can't read compressed block %lld\n", n);
+
+        pthread_mutex_lock(&r->lock);
+        slot->in_len = len;
+        slot->state = ok ? SLOT_FULL : SLOT_FAILED;
+        r->fetched = n + 1;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static int inflate_block(GzBlockReader *r, z_stream *z, long long n,
+        GzSlot *slot) {
+    const GzBlockIndex *index = &r->index;
+    if (inflateReset(z) != Z_OK) return -1;
+    z->next_in = slot->in;
+    z->avail_in = slot->in_len;
+    z->next_out = slot->out;
+    z->avail_out = index->block_size;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END || z->avail_in != 0) return -1;
+    slot->out_len = z->total_out;
+
+    // Only the last block may be short
+    if (n + 1 < index->count && slot->out_len != index->block_size) return -1;
+    return 0;
+}
+
+static void *inflate_thread(void *cookie) {
+    GzBlockReader *r = (GzBlockReader *) cookie;
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    int ok = inflateInit2(&z, 15 + 16) == Z_OK;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->stopping && r->taken == r->fetched &&
+                r->taken < r->index.count) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->stopping || r->taken >= r->index.count) break;
+        long long n = r->taken++;
+        GzSlot *slot = &r->slots[n % r->nslots];
+        if (slot->state == SLOT_FAILED) continue;
+        pthread_mutex_unlock(&r->lock);
+
+        int ret = ok ? inflate_block(r, &z, n, slot) : -1;
+        if (ret) LOGE("Can't uncompress block %lld\n", n);
+
+        pthread_mutex_lock(&r->lock);
+        slot->state = ret ? SLOT_FAILED : SLOT_DONE;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    if (ok) inflateEnd(&z);
+    return NULL;
+}
+
+// Start the fetcher and the inflaters at block "first"; -1 if they can't
+// all be started (those that were are left for stop_threads()).
+static int start_threads(GzBlockReader *r) {
+    r->stopping = 0;
+    r->fetched = r->taken = r->consumed = r->first;
+    if (pthread_create(&r->threads[0], NULL, fetch_thread, r) != 0) return -1;
+    for (r->nthreads = 1; r->nthreads <= r->inflaters; ++r->nthreads) {
+        if (pthread_create(&r->threads[r->nthreads], NULL, inflate_thread, r)) {
+            break;
+        }
+    }
+    return r->nthreads < 2 ? -1 : 0;
+}
+
+static void stop_threads(GzBlockReader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stopping = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    int i;
+    for (i = 0; i < r->nthreads; ++i) pthread_join(r->threads[i], NULL);
+    r->nthreads = 0;
+}
+
+GzBlockReader *gzblock_open_reader(int fd, int threads) {
+    GzBlockReader *r = calloc(1, sizeof(*r));
+    if (r == NULL) return NULL;
+    r->fd = fd;
+
+    if (gzblock_read_index(fd, &r->index) != 0) {
+        r->in = malloc(GZBLOCK_SIZE);
+        if (r->in == NULL || lseek(fd, 0, SEEK_SET) < 0 ||
+                inflateInit2(&r->z, 15 + 16) != Z_OK) {
+            free(r->in);
+            free(r);
+            return NULL;
+        }
+        r->z_ret = Z_OK;
+        return r;
+    }
+
+    r->indexed = 1;
+    threads = thread_count(threads);
+    r->nslots = threads * 2;
+    r->slots = alloc_slots(r->nslots, GZBLOCK_BOUND(r->index.block_size),
+            r->index.block_size);
+    if (r->slots == NULL) {
+        LOGE("Can't allocate decompression buffers\n");
+        gzblock_free_index(&r->index);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->inflaters = threads;
+    if (start_threads(r)) {
+        LOGE("Can't start decompression threads\n");
+        gzblock_close_reader(r);
+        return NULL;
+    }
+    return r;
+}
+
+static ssize_t read_indexed(GzBlockReader *r, unsigned char *data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        if (r->current == NULL) {
+            if (r->consumed >= r->index.count) break;
+            GzSlot *slot = &r->slots[r->consumed % r->nslots];
+            pthread_mutex_lock(&r->lock);
+            while (slot->state == SLOT_FREE || slot->state == SLOT_FULL) {
+                pthread_cond_wait(&r->cond, &r->lock);
+            }
+            pthread_mutex_unlock(&r->lock);
+            if (slot->state == SLOT_FAILED) {
+                r->error = EIO;
+                return -1;
+            }
+            r->current = slot;
+            r->offset = r->skip;
+            r->skip = 0;
+            if (r->offset > slot->out_len) r->offset = slot->out_len;
+        }
+
+        size_t n = r->current->out_len - r->offset;
+        if (n > len - got) n = len - got;
+        memcpy(data + got, r->current->out + r->offset, n);
+        got += n;
+        r->offset += n;
+        if (r->offset == r->current->out_len) {
+            pthread_mutex_lock(&r->lock);
+            r->current->state = SLOT_FREE;
+            ++r->consumed;
+            pthread_cond_broadcast(&r->cond);
+            pthread_mutex_unlock(&r->lock);
+            r->current = NULL;
+        }
+    }
+    return got;
+}
+
+static ssize_t read_stream(GzBlockReader *r, unsigned char *data, size_t len) {
+    z_stream *z = &r->z;
+    size_t got = 0;
+    while (got < len) {
+        if (z->avail_in == 0 && !r->pending) {
+            ssize_t n = read(r->fd, r->in, GZBLOCK_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                r->error = errno;
+                return -1;
+            }
+            if (n == 0) {
+                if (r->z_ret == Z_STREAM_END) break;
+                LOGE("Compressed data is truncated\n");
+                r->error = EIO;
+                return -1;
+            }
+            z->next_in = r->in;
+            z->avail_in = n;
+        }
+        // gzip allows several members back to back
+        if (r->z_ret == Z_STREAM_END && inflateReset(z) != Z_OK) {
+            r->error = EIO;
+            return -1;
+        }
+
+        z->next_out = data + got;
+        z->avail_out = len - got;
+        int ret = inflate(z, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR && z->avail_in == 0) ret = Z_OK;  // no more out
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            LOGE("Can't uncompress data (%d)\n", ret);
+            r->error = EIO;
+            return -1;
+        }
+        got = len - z->avail_out;
+        r->pending = ret == Z_OK && z->avail_out == 0;
+        r->z_ret = ret;
+    }
+    return got;
+}
+
+ssize_t gzblock_read(GzBlockReader *r, void *data, size_t len) {
+    if (r->error) {
+        errno = r->error;
+        return -1;
+    }
+    ssize_t ret = r->indexed ? read_indexed(r, (unsigned char *) data, len) :
+            read_stream(r, (unsigned char *) data, len);
+    if (ret < 0) errno = r->error;
+    return ret;
+}
+
+int gzblock_seek(GzBlockReader *r, long long offset) {
+    if (!r->indexed) {
+        errno = ESPIPE;
+        return -1;
+    }
+    long long block = offset / r->index.block_size;
+    if (offset < 0 || block > r->index.count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Blocks already read ahead are thrown away; it's simplest to start
+    // the threads again from the new block.
+    stop_threads(r);
+    int i;
+    for (i = 0; i < r->nslots; ++i) r->slots[i].state = SLOT_FREE;
+    r->current = NULL;
+    r->error = 0;
+    r->first = block;
+    r->skip = offset % r->index.block_size;
+    if (start_threads(r)) {
+        LOGE("Can't start decompression threads\n");
+        r->error = EAGAIN;
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+void gzblock_close_reader(GzBlockReader *r) {
+    if (r->indexed) {
+        stop_threads(r);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free_slots(r->slots, r->nslots);
+        gzblock_free_index(&r->index);
+    } else {
+        inflateEnd(&r->z);
+        free(r->in);
+    }
+    free(r);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_GZBLOCK_H
+#define _RECOVERY_GZBLOCK_H
+
+#include <sys/types.h>
+
+/* Block-compressed gzip streams.
+ *
+ * The data is cut into GZBLOCK_SIZE pieces, each compressed on its own
+ * (on as many threads as there are cores) into a complete gzip member.
+ * The stream ends with an empty member whose header "extra" field holds
+ * the compressed size of every block, so a reader can find any block
+ * without inflating the ones before it.  All of this is plain gzip:
+ * "gunzip" and "tar -z" read the result like any other .gz file.
+ */
+
+#define GZBLOCK_SIZE        (1024 * 1024)
+
+typedef struct GzBlockWriter GzBlockWriter;
+
+/* Start a stream written to "fd" by "threads" compressor threads (0
+ * means one per online CPU).  Returns NULL on failure.
+ */
+GzBlockWriter *gzblock_open_writer(int fd, int threads);
+
+/* Returns 0 on success, -1 (with errno set) if this or any earlier
+ * block couldn't be compressed or written.
+ */
+int gzblock_write(GzBlockWriter *w, const void *data, size_t len);
+
+/* Flush the last block, write the index and free "w".  The fd is left
+ * open.  Returns 0 on success, -1 with errno set.
+ */
+int gzblock_close_writer(GzBlockWriter *w);
+
+typedef struct {
+    unsigned int block_size;    // uncompressed size of all but the last
+    int count;
+    long long *offsets;         // count + 1 entries; the last is the index
+} GzBlockIndex;
+
+/* Read the index at the end of the stream open on "fd".  Returns 0 on
+ * success, -1 if there's no usable index (e.g., an ordinary .gz file).
+ */
+int gzblock_read_index(int fd, GzBlockIndex *index);
+void gzblock_free_index(GzBlockIndex *index);
+
+// Nonzero if the file open on "fd" starts with the gzip magic number.
+int gzblock_is_gzip(int fd);
+
+typedef struct GzBlockReader GzBlockReader;
+
+/* Start uncompressing the gzip stream on "fd".  Indexed streams are read
+ * ahead by a thread of their own and inflated by "threads" more (0 means
+ * one per online CPU); others are inflated in a single pass by
+ * gzblock_read() itself.  Returns NULL on failure.
+ */
+GzBlockReader *gzblock_open_reader(int fd, int threads);
+
+/* Fill "data" with up to "len" bytes of uncompressed data; only the end
+ * of the stream makes it short.  Returns the number of bytes stored, 0
+ * at the end, or -1 if the stream can't be read or is corrupt.
+ */
+ssize_t gzblock_read(GzBlockReader *r, void *data, size_t len);
+
+/* Carry on reading from "offset" bytes into the uncompressed data.  Only
+ * indexed streams can seek; reading starts from the block holding
+ * "offset".  Returns 0 on success, -1 with errno set.
+ */
+int gzblock_seek(GzBlockReader *r, long long offset);
+
+// Stop any threads and free "r".  The fd is left open.
+void gzblock_close_reader(GzBlockReader *r);
+
+#endif  /* _RECOVERY_GZBLOCK_H */
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>       // for BLKGETSIZE64
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "image.h"
+#include "mtdutils/mtdutils.h"
+#include "roots.h"
+
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+
+/* An image is an ImageHeader followed by ImageRecords, each describing
+ * the next "blocks" blocks of the partition: IMAGE_DATA records are
+ * followed by the data itself, IMAGE_FILL records stand for blocks full
+ * of the "fill" byte.  The last block may be short; "size" says where
+ * the partition data ends.
+ */
+#define IMAGE_MAGIC         "RIMAGE1"
+#define IMAGE_DATA          1
+#define IMAGE_FILL          2
+
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t size;
+} ImageHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t fill;
+    uint32_t blocks;
+} ImageRecord;
+
+// Block devices are read with this block size, 1MB at a time.  MTD
+// partitions use their erase block size.
+#define IMAGE_BLOCK_SIZE    4096
+#define IMAGE_BUFFER_SIZE   (1024 * 1024)
+
+typedef struct {
+    int fd;                     // the block device, or -1 for MTD
+    MtdReadContext *mtd_in;
+    MtdWriteContext *mtd_out;
+    size_t block_size;
+    long long size;
+    int zeroed;                 // discarded, and now reads as zeros
+} ImagePartition;
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t read_fully(int fd, void *data, size_t len) {
+    char *p = (char *) data;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+static int block_filled(const char *data, size_t size, char c) {
+    return size > 0 && data[0] == c && memcmp(data, data + 1, size - 1) == 0;
+}
+
+// Whole blocks of zeros (unused filesystem space) or 0xff (erased flash)
+static int block_blank(const char *data, size_t size, size_t block_size) {
+    return size == block_size &&
+            (block_filled(data, size, 0) || block_filled(data, size, (char) 0xff));
+}
+
+static int open_partition(const char *root, int writing, ImagePartition *p) {
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    if (ensure_root_path_unmounted(root) != 0) {
+        LOGE("Can't unmount %s\n", root);
+        return -1;
+    }
+
+    const MtdPartition *mtd = get_root_mtd_partition(root);
+    if (mtd != NULL) {
+        size_t total_size, erase_size;
+        if (mtd_partition_info(mtd, &total_size, &erase_size, NULL)) {
+            LOGE("Can't get info for %s\n", root);
+            return -1;
+        }
+        p->block_size = erase_size;
+        p->size = total_size;
+        if (writing) {
+            p->mtd_out = mtd_write_partition(mtd);
+        } else if ((p->mtd_in = mtd_read_partition(mtd)) != NULL) {
+            mtd_read_set_readahead(p->mtd_in, IMAGE_BUFFER_SIZE / erase_size);
+        }
+        if (p->mtd_in == NULL && p->mtd_out == NULL) {
+            LOGE("Can't open %s\n", root);
+            return -1;
+        }
+        return 0;
+    }
+
+    const char *device = get_root_block_device(root);
+    if (device == NULL) {
+        LOGE("No partition behind %s\n", root);
+        return -1;
+    }
+    p->fd = open(device, writing ? O_WRONLY : O_RDONLY);
+    if (p->fd < 0) {
+        LOGE("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    uint64_t size;
+    if (ioctl(p->fd, BLKGETSIZE64, &size) == 0) {
+        p->size = size;
+    } else {
+        p->size = lseek(p->fd, 0, SEEK_END);
+        lseek(p->fd, 0, SEEK_SET);
+    }
+    p->block_size = IMAGE_BLOCK_SIZE;
+
+    // If discarded blocks read back as zeros, a discard up front means
+    // the zero runs in an image needn't be written at all.
+    unsigned int zeroes = 0;
+    if (writing && ioctl(p->fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes &&
+            discard_block_device(device, 0) == 0) {
+        p->zeroed = 1;
+    }
+    return 0;
+}
+
+// Returns the number of bytes read, 0 at the end, -1 on error.
+static ssize_t read_partition(ImagePartition *p, char *data, size_t len) {
+    if (p->mtd_in == NULL) return read_fully(p->fd, data, len);
+
+    // One erase block at a time, so that running into the end of the
+    // partition doesn't lose what was read before it.
+    size_t got = 0;
+    while (got + p->block_size <= len) {
+        ssize_t n = mtd_read_data(p->mtd_in, data + got, p->block_size);
+        if (n < 0 && errno == ENOSPC) break;
+        if (n < 0) return -1;
+        got += n;
+    }
+    return got;
+}
+
+static int write_partition(ImagePartition *p, const char *data, size_t len) {
+    if (p->mtd_out == NULL) return write_fully(p->fd, data, len);
+    return mtd_write_data(p->mtd_out, data, len) == (ssize_t) len ? 0 : -1;
+}
+
+static int close_partition(ImagePartition *p) {
+    int ret = 0;
+    if (p->mtd_in != NULL) mtd_read_close(p->mtd_in);
+    if (p->mtd_out != NULL) {
+        // Nothing left in the image?  Leave the rest of it erased.
+        if (mtd_erase_blocks(p->mtd_out, -1) == (off_t) -1) ret = -1;
+        if (mtd_write_close(p->mtd_out)) ret = -1;
+    }
+    if (p->fd >= 0) {
+        if (fsync(p->fd) && errno != EINVAL) ret = -1;
+        if (close(p->fd)) ret = -1;
+    }
+    return ret;
+}
+
+typedef struct {
+    int fd;
+    ImageRecord fill;           // run of blank blocks not yet written
+} ImageWriter;
+
+static int flush_fill(ImageWriter *w) {
+    if (w->fill.blocks == 0) return 0;
+    int ret = write_fully(w->fd, &w->fill, sizeof(w->fill));
+    w->fill.blocks = 0;
+    return ret;
+}
+
+// Record "len" bytes of partition data; runs of blank blocks are merged
+// across calls.
+static int write_blocks(ImageWriter *w, const char *data, size_t len,
+        size_t block_size) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t size = len - pos < block_size ? len - pos : block_size;
+        const char *block = data + pos;
+        if (block_blank(block, size, block_size)) {
+            uint32_t fill = (unsigned char) block[0];
+            if (w->fill.blocks > 0 && w->fill.fill != fill && flush_fill(w)) {
+                return -1;
+            }
+            w->fill.type = IMAGE_FILL;
+            w->fill.fill = fill;
+            ++w->fill.blocks;
+            pos += size;
+            continue;
+        }
+
+        // A run of data blocks, stored as they are
+        size_t end = pos;
+        while (end < len) {
+            size_t n = len - end < block_size ? len - end : block_size;
+            if (block_blank(data + end, n, block_size)) break;
+            end += n;
+        }
+        ImageRecord record;
+        record.type = IMAGE_DATA;
+        record.fill = 0;
+        record.blocks = (end - pos + block_size - 1) / block_size;
+        if (flush_fill(w) ||
+                write_fully(w->fd, &record, sizeof(record)) ||
+                write_fully(w->fd, data + pos, end - pos)) {
+            return -1;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+int image_backup(const char *root, const char *image_path,
+        TarProgressFunction progress, void *cookie) {
+    ImagePartition part;
+    if (open_partition(root, 0, &part) != 0) return -1;
+
+    ImageWriter w;
+    memset(&w, 0, sizeof(w));
+    w.fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t buffer_size = IMAGE_BUFFER_SIZE - IMAGE_BUFFER_SIZE % part.block_size;
+    if (buffer_size == 0) buffer_size = part.block_size;
+    char *buffer = malloc(buffer_size);
+    if (w.fd < 0 || buffer == NULL) {
+        LOGE("Can't create %s (%s)\n", image_path, strerror(errno));
+        if (w.fd >= 0) close(w.fd);
+        unlink(image_path);
+        free(buffer);
+        close_partition(&part);
+        return -1;
+    }
+
+    // The size is filled in at the end; bad MTD blocks make it shorter
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.block_size = part.block_size;
+    int ret = write_fully(w.fd, &header, sizeof(header));
+
+    TarProgress done;
+    memset(&done, 0, sizeof(done));
+    done.total_bytes = part.size;
+    while (ret == 0) {
+        ssize_t n = read_partition(&part, buffer, buffer_size);
+        if (n < 0) {
+            LOGE("Can't read %s (%s)\n", root, strerror(errno));
+            ret = -1;
+        }
+        if (n <= 0) break;
+        if (write_blocks(&w, buffer, n, part.block_size)) {
+            LOGE("Can't write %s (%s)\n", image_path, strerror(errno));
+            ret = -1;
+        }
+        header.size += n;
+        done.bytes += n;
+        if (progress != NULL) progress(&done, cookie);
+    }
+
+    if (ret == 0) ret = flush_fill(&w);
+    if (ret == 0 && (lseek(w.fd, 0, SEEK_SET) != 0 ||
+            write_fully(w.fd, &header, sizeof(header)) || fsync(w.fd))) {
+        LOGE("Can't write %s (%s)\n", image_path, strerror(errno));
+        ret = -1;
+    }
+    if (close(w.fd)) ret = -1;
+    if (close_partition(&part)) ret = -1;
+    if (ret != 0) unlink(image_path);
+    free(buffer);
+    return ret;
+}
+
+int image_restore(const char *image_path, const char *root,
+        TarProgressFunction progress, void *cookie) {
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", image_path, strerror(errno));
+        return -1;
+    }
+    ImageHeader header;
+    if (read_fully(fd, &header, sizeof(header)) != sizeof(header) ||
+            memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.block_size == 0 || header.block_size > IMAGE_BUFFER_SIZE) {
+        LOGE("%s isn't a partition image\n", image_path);
+        close(fd);
+        return -1;
+    }
+
+    ImagePartition part;
+    if (open_partition(root, 1, &part) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((long long) header.size > part.size) {
+        LOGE("%s is bigger than %s\n", image_path, root);
+        close_partition(&part);
+        close(fd);
+        return -1;
+    }
+
+    size_t buffer_size = IMAGE_BUFFER_SIZE - IMAGE_BUFFER_SIZE % header.block_size;
+    char *buffer = malloc(buffer_size);
+    int ret = buffer != NULL ? 0 : -1;
+    TarProgress done;
+    memset(&done, 0, sizeof(done));
+    done.total_bytes = header.size;
+
+    long long pos = 0;
+    while (ret == 0 && pos < (long long) header.size) {
+        ImageRecord record;
+        if (read_fully(fd, &record, sizeof(record)) != sizeof(record) ||
+                (record.type != IMAGE_DATA && record.type != IMAGE_FILL)) {
+            LOGE("%s is truncated or corrupt\n", image_path);
+            ret = -1;
+            break;
+        }
+        long long left = (long long) record.blocks * header.block_size;
+        if (left > (long long) header.size - pos) left = header.size - pos;
+
+        // The blank runs are written too, unless the whole partition was
+        // just discarded to zeros: otherwise it may hold anything
+        if (record.type == IMAGE_FILL && record.fill == 0 && part.zeroed) {
+            if (lseek(part.fd, left, SEEK_CUR) < 0) ret = -1;
+            pos += left;
+            done.bytes += left;
+            left = 0;
+        } else if (record.type == IMAGE_FILL) {
+            memset(buffer, record.fill, buffer_size);
+        }
+        while (ret == 0 && left > 0) {
+            size_t n = left < (long long) buffer_size ? left : buffer_size;
+            if (record.type == IMAGE_DATA &&
+                    read_fully(fd, buffer, n) != (ssize_t) n) {
+                LOGE("%s is truncated\n", image_path);
+                ret = -1;
+            } else if (write_partition(&part, buffer, n)) {
+                LOGE("Can't write %s (%s)\n", root, strerror(errno));
+                ret = -1;
+            }
+            left -= n;
+            pos += n;
+            done.bytes += n;
+        }
+        if (progress != NULL) progress(&done, cookie);
+    }
+
+    if (close_partition(&part)) ret = -1;
+    close(fd);
+    free(buffer);
+    return ret;
+}
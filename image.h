@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_IMAGE_H
+#define _RECOVERY_IMAGE_H
+
+#include "tar.h"
+
+/* Raw partition images.
+ *
+ * The partition behind a root (a block device such as /dev/stl6, or an
+ * MTD partition) is read front to back in large pieces.  Blocks that
+ * are all zeros, or all 0xff, are recorded as runs instead of being
+ * stored, so a mostly empty partition makes a small image.
+ */
+
+/* Save the partition behind "root" (e.g. "DATA:") to "image_path".
+ * The root is unmounted first.  "progress" reports bytes of the
+ * partition.  Returns 0 on success, -1 (and no image) on failure.
+ */
+int image_backup(const char *root, const char *image_path,
+        TarProgressFunction progress, void *cookie);
+
+/* Write the image at "image_path" back to the partition behind "root",
+ * which is unmounted first.  Returns 0 on success, -1 on failure.
+ */
+int image_restore(const char *image_path, const char *root,
+        TarProgressFunction progress, void *cookie);
+
+#endif  /* _RECOVERY_IMAGE_H */
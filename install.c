@@ -18,26 +18,58 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "amend/amend.h"
 #include "common.h"
 #include "install.h"
-#include "mincrypt/rsa.h"
+#include "keys.h"
 #include "minui/minui.h"
 #include "minzip/SysUtil.h"
 #include "minzip/Zip.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "stats.h"
+#include "updater/protocol.h"
 #include "verifier.h"
 #include "firmware.h"
 
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
-// #define PUBLIC_KEYS_FILE "/res/keys"
+#define UPDATE_BINARY_PATH          "/tmp/update_binary"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#define PUBLIC_KEYS_FILE "/res/keys"
+
+static int gVerifyMode = INSTALL_VERIFY_NONE;
+
+void
+install_set_verify_mode(int mode)
+{
+    gVerifyMode = mode;
+}
+
+static int gThreads = MZ_EXTRACT_THREADS;
+
+void
+install_set_threads(int threads)
+{
+    gThreads = threads > 0 ? threads : 1;
+}
+
+int
+install_threads()
+{
+    return gThreads;
+}
 
 static const ZipEntry *
 find_update_script(ZipArchive *zip)
@@ -83,6 +115,11 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
         LOGE("Can't read update script\n");
         return INSTALL_ERROR;
     }
+    if (!verify_pipelined_buffer(update_script_entry, script_data, script_len)) {
+        LOGE("Verification failed\n");
+        free(script_data);
+        return INSTALL_CORRUPT;
+    }
 
     /* Parse the script.  Note that the script and parse tree are never freed.
      */
@@ -107,7 +144,13 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
             if (next != NULL) *next++ = '\0';
         }
         LOGE("Failure at line %d:\n%s\n", num, next ? line : "(not found)");
-        return INSTALL_ERROR;
+        // A file with the wrong digest stops the script where it's found
+        return verify_pipelined_failed() ? INSTALL_CORRUPT : INSTALL_ERROR;
+    }
+
+    if (!verify_pipelined_commit()) {
+        LOGE("Verification failed\n");
+        return INSTALL_CORRUPT;
     }
 
     LOGI("Installation complete.\n");
@@ -118,60 +161,365 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
 // that up.  Takes ownership of type and filename.
 static int
 handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
-    unsigned int data_size;
-    const ZipEntry* entry = NULL;
+    LOGI("type is %s; file is %s\n", type, filename);
 
+    // The image is read again when it's written to cache, after the
+    // install; it isn't loaded into memory now.
     if (strncmp(filename, "PACKAGE:", 8) == 0) {
-        entry = mzFindZipEntry(zip, filename+8);
-        if (entry == NULL) {
-            LOGE("Failed to find \"%s\" in package", filename+8);
+        if (remember_firmware_entry(type, zip, filename+8)) {
+            LOGE("Can't store %s image\n", type);
             return INSTALL_ERROR;
         }
-        data_size = entry->uncompLen;
     } else {
+        int fd = open(filename, O_RDONLY);
         struct stat st_data;
-        if (stat(filename, &st_data) < 0) {
-            LOGE("Error stat'ing %s: %s\n", filename, strerror(errno));
+        if (fd < 0 || fstat(fd, &st_data) < 0) {
+            LOGE("Error opening %s: %s\n", filename, strerror(errno));
+            if (fd >= 0) close(fd);
+            return INSTALL_ERROR;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (remember_firmware_update(type, fd, st_data.st_size)) {
+            LOGE("Can't store %s image\n", type);
             return INSTALL_ERROR;
         }
-        data_size = st_data.st_size;
     }
+    free(filename);
 
-    LOGI("type is %s; size is %d; file is %s\n",
-         type, data_size, filename);
+    return INSTALL_SUCCESS;
+}
 
-    char* data = malloc(data_size);
-    if (data == NULL) {
-        LOGI("Can't allocate %d bytes for firmware data\n", data_size);
-        return INSTALL_ERROR;
+static bool
+write_binary_data(const unsigned char *data, int len, void *cookie) {
+    int fd = *(int *) cookie;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Inflate "entry" into "fd", checking its CRC on the way.
+static int
+copy_update_binary(ZipArchive *zip, const ZipEntry *entry, int fd) {
+    bool crc_ok;
+    if (!mzProcessZipEntryContentsCheckCrc(zip, entry, write_binary_data,
+            &fd, &crc_ok) || !crc_ok) {
+        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
+        return -1;
     }
+    return 0;
+}
 
-    if (entry) {
-        if (mzReadZipEntry(zip, entry, data, data_size) == false) {
-            LOGE("Failed to read \"%s\" from package", filename+8);
-            return INSTALL_ERROR;
+// Whether the file at "binary" already holds "entry"'s contents.
+static int
+binary_matches(const char *binary, const ZipEntry *entry) {
+    struct stat st;
+    if (stat(binary, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size != mzGetZipEntryUncompLen(entry)) {
+        return 0;
+    }
+    int fd = open(binary, O_RDONLY);
+    if (fd < 0) return 0;
+    unsigned char buffer[32 * 1024];
+    uLong crc = crc32(0L, Z_NULL, 0);
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        crc = crc32(crc, buffer, n);
+    }
+    close(fd);
+    return n == 0 && crc == (uLong) mzGetZipEntryCrc32(entry);
+}
+
+/* Get the update binary somewhere it can be exec()ed from, and put its
+ * path in "binary".  It's inflated straight into an anonymous memory
+ * file where the kernel has memfd_create(), so nothing is staged in /tmp,
+ * and that file is kept for the next package with the same binary.  On
+ * older kernels it goes to /tmp as before, unless a copy with the right
+ * CRC is already there.
+ */
+static int
+prepare_update_binary(ZipArchive *zip, const ZipEntry *entry,
+        char *binary, size_t size) {
+    static int cached_fd = -1;
+    static long cached_crc, cached_len;
+
+    if (cached_fd >= 0 && cached_crc == mzGetZipEntryCrc32(entry) &&
+            cached_len == mzGetZipEntryUncompLen(entry)) {
+        snprintf(binary, size, "/proc/self/fd/%d", cached_fd);
+        return 0;
+    }
+
+#ifdef __NR_memfd_create
+    int fd = syscall(__NR_memfd_create, "update_binary", MFD_CLOEXEC);
+    if (fd >= 0) {
+        // exec() refuses a file anyone has open for writing, so swap
+        // this descriptor for a read-only one once it's filled
+        char writer[32];
+        snprintf(writer, sizeof(writer), "/proc/self/fd/%d", fd);
+        int ret = copy_update_binary(zip, entry, fd);
+        int reader = ret == 0 ? open(writer, O_RDONLY) : -1;
+        close(fd);
+        if (reader < 0) {
+            if (ret == 0) LOGE("Can't reopen update binary (%s)\n", strerror(errno));
+            return -1;
+        }
+        fcntl(reader, F_SETFD, FD_CLOEXEC);
+        fd = reader;
+        if (cached_fd >= 0) close(cached_fd);
+        cached_fd = fd;
+        cached_crc = mzGetZipEntryCrc32(entry);
+        cached_len = mzGetZipEntryUncompLen(entry);
+        snprintf(binary, size, "/proc/self/fd/%d", fd);
+        return 0;
+    }
+#endif
+
+    strlcpy(binary, UPDATE_BINARY_PATH, size);
+    if (binary_matches(binary, entry)) {
+        LOGI("Using %s already extracted\n", binary);
+        return 0;
+    }
+    unlink(binary);
+    int out = open(binary, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (out < 0) {
+        LOGE("Can't make %s\n", binary);
+        return -1;
+    }
+    int ret = copy_update_binary(zip, entry, out);
+    if (close(out) != 0) ret = -1;
+    if (ret != 0) unlink(binary);
+    return ret;
+}
+
+/* Write the package's parsed index somewhere the updater can inherit.
+ * Returns the fd, or -1 (the updater will just parse the package again).
+ */
+static int
+write_package_index(ZipArchive *zip) {
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "update_index", 0);
+#endif
+    if (fd < 0) {
+        static const char *path = "/tmp/update_index";
+        unlink(path);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        unlink(path);
+        if (fd < 0) return -1;
+    }
+    if (!mzWriteZipArchiveIndex(zip, fd)) {
+        LOGW("Can't pass package index to updater\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Remember the one firmware update the updater may ask for.
+static void
+set_firmware(char** firmware_type, char** firmware_filename,
+        const char* type, const char* filename) {
+    if (*firmware_type != NULL) {
+        LOGE("ignoring attempt to do multiple firmware updates");
+        return;
+    }
+    *firmware_type = strdup(type);
+    *firmware_filename = strdup(filename);
+}
+
+// One text command from the updater, without its newline.
+static void
+handle_text_command(char* line, char** firmware_type,
+        char** firmware_filename) {
+    LOGI("read: %s\n", line);
+
+    char* command = strtok(line, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+        if (fraction_s == NULL || seconds_s == NULL) return;
+
+        float fraction = strtof(fraction_s, NULL);
+        int seconds = strtol(seconds_s, NULL, 10);
+
+        ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                         seconds);
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        if (fraction_s == NULL) return;
+        float fraction = strtof(fraction_s, NULL);
+        ui_set_progress(fraction);
+    } else if (strcmp(command, "firmware") == 0) {
+        char* type = strtok(NULL, " \n");
+        char* filename = strtok(NULL, " \n");
+
+        if (type != NULL && filename != NULL) {
+            set_firmware(firmware_type, firmware_filename, type, filename);
+        }
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        if (str) {
+            ui_print("%s", str);
+        } else {
+            ui_print("\n");
         }
     } else {
-        FILE* f = fopen(filename, "rb");
-        if (f == NULL) {
-            LOGE("Failed to open %s: %s\n", filename, strerror(errno));
-            return INSTALL_ERROR;
+        LOGE("unknown command [%s]\n", command);
+    }
+}
+
+/* Act on the whole frames (updater/protocol.h) at the start of "data".
+ * A set_progress is only shown if nothing later in the batch replaces it.
+ * Returns how many bytes were used, or -1 if the frames make no sense.
+ */
+static ssize_t
+handle_frames(const char* data, size_t len, char** firmware_type,
+        char** firmware_filename) {
+    size_t used = 0;
+    int have_fraction = 0;
+    float fraction = 0;
+    while (len - used >= sizeof(UpdaterFrameHeader)) {
+        UpdaterFrameHeader h;
+        memcpy(&h, data + used, sizeof(h));
+        if (h.length > UPDATER_FRAME_MAX) {
+            LOGE("Bad frame from update binary\n");
+            return -1;
         }
-        if (fread(data, 1, data_size, f) != data_size) {
-            LOGE("Failed to read firmware data: %s\n", strerror(errno));
-            return INSTALL_ERROR;
+        if (len - used - sizeof(h) < h.length) break;
+        const char* payload = data + used + sizeof(h);
+        used += sizeof(h) + h.length;
+
+        UpdaterProgress p;
+        memset(&p, 0, sizeof(p));
+        if (h.type == UPDATER_FRAME_PROGRESS ||
+                h.type == UPDATER_FRAME_SET_PROGRESS) {
+            memcpy(&p, payload, h.length < sizeof(p) ? h.length : sizeof(p));
+        }
+        switch (h.type) {
+            case UPDATER_FRAME_PROGRESS:
+                // A new segment; what was set before belongs to the old one
+                if (have_fraction) ui_set_progress(fraction);
+                have_fraction = 0;
+                ui_show_progress(p.fraction *
+                        (1-VERIFICATION_PROGRESS_FRACTION), p.seconds);
+                break;
+            case UPDATER_FRAME_SET_PROGRESS:
+                fraction = p.fraction;
+                have_fraction = 1;
+                break;
+            case UPDATER_FRAME_FIRMWARE: {
+                const char* type = payload;
+                const char* end = memchr(type, '\0', h.length);
+                const char* filename = end != NULL ? end + 1 : NULL;
+                if (filename == NULL || memchr(filename, '\0',
+                        payload + h.length - filename) == NULL) {
+                    LOGE("Bad firmware frame from update binary\n");
+                    break;
+                }
+                set_firmware(firmware_type, firmware_filename, type, filename);
+                break;
+            }
+            case UPDATER_FRAME_PRINT:
+                ui_print_text(payload, h.length);
+                break;
+            default:
+                LOGE("unknown frame type %u\n", h.type);
+                break;
         }
-        fclose(f);
     }
+    if (have_fraction) ui_set_progress(fraction);
+    return used;
+}
 
-    if (remember_firmware_update(type, data, data_size)) {
-        LOGE("Can't store %s image\n", type);
-        free(data);
-        return INSTALL_ERROR;
+/* Read what the updater sends on "fd" until it closes it: text commands,
+ * or frames if it starts with UPDATER_PROTOCOL_MAGIC.  Everything that
+ * has arrived is dealt with at once, so a burst of frames costs one read
+ * and one redraw.
+ */
+static void
+read_updater_commands(int fd, char** firmware_type, char** firmware_filename) {
+    size_t alloc = 4096;
+    size_t used = 0;
+    int framed = -1;            // not known yet
+    int skipping = 0;           // the rest of an overlong text line
+    char* buffer = malloc(alloc + 1);
+    if (buffer == NULL) return;
+
+    for (;;) {
+        if (used == alloc) {
+            // Room for the longest frame (or text line) there can be
+            size_t more = alloc * 2;
+            char* bigger = more <= UPDATER_FRAME_MAX * 2 ?
+                    realloc(buffer, more + 1) : NULL;
+            if (bigger == NULL && framed) {
+                LOGE("Too much at once from update binary\n");
+                break;
+            }
+            if (bigger == NULL) {
+                // Take what fits of the line, and drop the rest
+                buffer[used] = '\0';
+                handle_text_command(buffer, firmware_type, firmware_filename);
+                used = 0;
+                skipping = 1;
+                continue;
+            }
+            buffer = bigger;
+            alloc = more;
+        }
+        ssize_t n = read(fd, buffer + used, alloc - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+
+        if (framed < 0) {
+            size_t check = used < UPDATER_PROTOCOL_MAGIC_LEN ?
+                    used : UPDATER_PROTOCOL_MAGIC_LEN;
+            framed = memcmp(buffer, UPDATER_PROTOCOL_MAGIC, check) == 0;
+            if (framed && used < UPDATER_PROTOCOL_MAGIC_LEN) {
+                framed = -1;
+                continue;
+            }
+            if (framed) {
+                used -= UPDATER_PROTOCOL_MAGIC_LEN;
+                memmove(buffer, buffer + UPDATER_PROTOCOL_MAGIC_LEN, used);
+            }
+        }
+
+        size_t done = 0;
+        if (framed) {
+            ssize_t got = handle_frames(buffer, used, firmware_type,
+                    firmware_filename);
+            if (got < 0) break;
+            done = got;
+        } else {
+            char* nl;
+            while ((nl = memchr(buffer + done, '\n', used - done)) != NULL) {
+                *nl = '\0';
+                if (!skipping) {
+                    handle_text_command(buffer + done, firmware_type,
+                            firmware_filename);
+                }
+                skipping = 0;
+                done = nl + 1 - buffer;
+            }
+            if (skipping) done = used;
+        }
+        used -= done;
+        memmove(buffer, buffer + done, used);
     }
-    free(filename);
 
-    return INSTALL_SUCCESS;
+    // A last command might not have had its newline
+    if (framed == 0 && used > 0 && !skipping) {
+        buffer[used] = '\0';
+        handle_text_command(buffer, firmware_type, firmware_filename);
+    }
+    free(buffer);
 }
 
 // If the package contains an update binary, extract it and run it.
@@ -183,18 +531,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
         return INSTALL_CORRUPT;
     }
 
-    char* binary = "/tmp/update_binary";
-    unlink(binary);
-    int fd = creat(binary, 0755);
-    if (fd < 0) {
-        LOGE("Can't make %s\n", binary);
-        return 1;
-    }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
-    close(fd);
-
-    if (!ok) {
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
+    StatsTimer timer;
+    stats_start(&timer, "binary");
+    char binary[PATH_MAX];
+    int ret = prepare_update_binary(zip, binary_entry, binary, sizeof(binary));
+    stats_stop(&timer, mzGetZipEntryUncompLen(binary_entry), 1);
+    if (ret) {
         return 1;
     }
 
@@ -231,6 +573,19 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //
     //   - the name of the package zip file.
     //
+    // and, where it can, recovery also sets these in the environment
+    // (updaters that don't know them carry on as before):
+    //
+    //   UPDATE_PACKAGE_FD    an fd open on the package
+    //   UPDATE_INDEX_FD      an fd holding the index recovery parsed
+    //                        from it, for mzOpenZipArchiveFd()
+    //
+    //   UPDATE_PROTOCOL      "1": the commands above may come as frames
+    //                        instead of text (see updater/protocol.h)
+    //
+    //   UPDATE_THREADS       how many threads to extract files and set
+    //                        their permissions on; 1 for none at all
+    //
 
     char** args = malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -240,6 +595,24 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    // Set in our own environment for the child to inherit: there's no
+    // safe setenv() between fork() and exec() with other threads about
+    setenv(UPDATER_PROTOCOL_ENV, "1", 1);
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", gThreads);
+    setenv("UPDATE_THREADS", threads, 1);
+    int index_fd = write_package_index(zip);
+    if (index_fd >= 0) {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", zip->fd);
+        setenv("UPDATE_PACKAGE_FD", value, 1);
+        snprintf(value, sizeof(value), "%d", index_fd);
+        setenv("UPDATE_INDEX_FD", value, 1);
+    }
+
+    // The updater's own mounts, extraction and flashing, as far as its
+    // CPU time and I/O show them.
+    stats_start(&timer, "updater");
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
@@ -248,58 +621,23 @@ try_update_binary(const char *path, ZipArchive *zip) {
         _exit(-1);
     }
     close(pipefd[1]);
+    unsetenv(UPDATER_PROTOCOL_ENV);
+    unsetenv("UPDATE_THREADS");
+    if (index_fd >= 0) {
+        unsetenv("UPDATE_PACKAGE_FD");
+        unsetenv("UPDATE_INDEX_FD");
+        close(index_fd);
+    }
 
     char* firmware_type = NULL;
     char* firmware_filename = NULL;
-
-    char buffer[81];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        LOGI("read: %s", buffer);
-
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print(str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("unknown command [%s]\n", command);
-        }
-    }
-    fclose(from_child);
+    read_updater_commands(pipefd[0], &firmware_type, &firmware_filename);
+    close(pipefd[0]);
 
     int status;
     waitpid(pid, &status, 0);
+    stats_stop(&timer, 0, 0);
+    invalidate_mounted_volumes();  // the script mounts what it likes
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
@@ -312,29 +650,33 @@ try_update_binary(const char *path, ZipArchive *zip) {
     }
 }
 
-static int
-handle_update_package(const char *path, ZipArchive *zip)
+// Uncompressed size of everything in the package.
+static long long
+package_bytes(const ZipArchive *zip)
 {
-    // Give verification half the progress bar...
-    ui_print("Verifying update package...\n");
-    ui_show_progress(
-            VERIFICATION_PROGRESS_FRACTION,
-            VERIFICATION_PROGRESS_TIME);
-
-/*
-    if (!verify_jar_signature(zip, keys, numKeys)) {
-        LOGE("Verification failed\n");
-        return INSTALL_CORRUPT;
+    long long total = 0;
+    unsigned int i;
+    for (i = 0; i < mzZipEntryCount(zip); ++i) {
+        total += mzGetZipEntryUncompLen(mzGetZipEntryAt(zip, i));
     }
-*/
+    return total;
+}
 
+// Install a package that's been verified as far as it's going to be:
+// run its update binary, or else its update script.
+static int
+install_update(const char *path, ZipArchive *zip, bool pipelined)
+{
     // Update should take the rest of the progress bar.
     ui_print("Installing update...\n");
 
-    int result = try_update_binary(path, zip);
-    if (result == INSTALL_SUCCESS || result == INSTALL_ERROR) {
-        register_package_root(NULL, NULL);  // Unregister package root
-        return result;
+    int result;
+    if (!pipelined) {
+        result = try_update_binary(path, zip);
+        if (result == INSTALL_SUCCESS || result == INSTALL_ERROR) {
+            register_package_root(NULL, NULL);  // Unregister package root
+            return result;
+        }
     }
 
     // if INSTALL_CORRUPT is returned, this package doesn't have an
@@ -345,108 +687,110 @@ handle_update_package(const char *path, ZipArchive *zip)
     script_entry = find_update_script(zip);
     if (script_entry == NULL) {
         LOGE("Can't find update script\n");
+        verify_pipelined_end();
         return INSTALL_CORRUPT;
     }
 
     if (register_package_root(zip, path) < 0) {
         LOGE("Can't register package root\n");
+        verify_pipelined_end();
         return INSTALL_ERROR;
     }
 
-    int ret = handle_update_script(zip, script_entry);
+    StatsTimer timer;
+    stats_start(&timer, "script");
+    result = handle_update_script(zip, script_entry);
+    stats_stop(&timer, 0, 0);
     register_package_root(NULL, NULL);  // Unregister package root
-    return ret;
+    verify_pipelined_end();
+    return result;
 }
 
-// Reads a file containing one or more public keys as produced by
-// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
-// as a C source literal, eg:
-//
-//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
-//
-// (Note that the braces and commas in this example are actual
-// characters the parser expects to find in the file; the ellipses
-// indicate more numbers omitted from this example.)
-//
-// The file may contain multiple keys in this format, separated by
-// commas.  The last key must not be followed by a comma.
-//
-// Returns NULL if the file failed to parse, or if it contain zero keys.
-static RSAPublicKey*
-load_keys(const char* filename, int* numKeys) {
-    RSAPublicKey* out = NULL;
-    *numKeys = 0;
-
-    FILE* f = fopen(filename, "r");
-    if (f == NULL) {
-        LOGE("opening %s: %s\n", filename, strerror(errno));
-        goto exit;
-    }
-
-    int i;
-    bool done = false;
-    while (!done) {
-        ++*numKeys;
-        out = realloc(out, *numKeys * sizeof(RSAPublicKey));
-        RSAPublicKey* key = out + (*numKeys - 1);
-        if (fscanf(f, " { %i , %i , { %i",
-                   &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
-            goto exit;
-        }
-        if (key->len != RSANUMWORDS) {
-            LOGE("key length (%d) does not match expected size\n", key->len);
-            goto exit;
-        }
-        for (i = 1; i < key->len; ++i) {
-            if (fscanf(f, " , %i", &(key->n[i])) != 1) goto exit;
+static int
+handle_update_package(const char *path, ZipArchive *zip,
+                      const KeyStore *keys)
+{
+    // Amend scripts run in this process, so in pipelined mode their
+    // files can be checked as they're extracted.  An update binary
+    // reads the package itself, so it's verified in full first.
+    bool pipelined = keys != NULL &&
+            gVerifyMode == INSTALL_VERIFY_PIPELINED &&
+            mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME) == NULL;
+
+    if (pipelined) {
+        // Only the signature chain is checked up front: that's quick.
+        ui_print("Checking signature...\n");
+        StatsTimer timer;
+        stats_start(&timer, "verify");
+        bool ok = verify_pipelined_begin(zip, keys);
+        stats_stop(&timer, 0, 0);
+        if (!ok) {
+            LOGE("Verification failed\n");
+            return INSTALL_CORRUPT;
         }
-        if (fscanf(f, " } , { %i", &(key->rr[0])) != 1) goto exit;
-        for (i = 1; i < key->len; ++i) {
-            if (fscanf(f, " , %i", &(key->rr[i])) != 1) goto exit;
+        ui_show_progress(VERIFICATION_PROGRESS_FRACTION, 0);
+        ui_set_progress(1.0);
+    } else {
+        // Give verification half the progress bar...
+        ui_print("Verifying update package...\n");
+        ui_show_progress(
+                VERIFICATION_PROGRESS_FRACTION,
+                VERIFICATION_PROGRESS_TIME);
+
+        if (keys != NULL) {
+            StatsTimer timer;
+            stats_start(&timer, "verify");
+            bool ok = verify_jar_signature(zip, keys);
+            stats_stop(&timer, package_bytes(zip), mzZipEntryCount(zip));
+            if (!ok) {
+                LOGE("Verification failed\n");
+                return INSTALL_CORRUPT;
+            }
         }
-        fscanf(f, " } } ");
+    }
 
-        // if the line ends in a comma, this file has more keys.
-        switch (fgetc(f)) {
-            case ',':
-                // more keys to come.
-                break;
+    return install_update(path, zip, pipelined);
+}
 
-            case EOF:
-                done = true;
-                break;
+// Load the keys to check packages against, if verification is on;
+// otherwise leave "keys" empty.
+static int
+load_package_keys(KeyStore *keys)
+{
+    memset(keys, 0, sizeof(*keys));
+    if (gVerifyMode == INSTALL_VERIFY_NONE) return INSTALL_SUCCESS;
 
-            default:
-                LOGE("unexpected character between keys\n");
-                goto exit;
-        }
+    StatsTimer timer;
+    stats_start(&timer, "keys");
+    int ret = keystore_load(PUBLIC_KEYS_FILE, keys);
+    stats_stop(&timer, 0, keys->count);
+    if (ret != 0) {
+        LOGE("Failed to load keys\n");
+        return INSTALL_CORRUPT;
     }
-
-    fclose(f);
-    return out;
-
-exit:
-    if (f) fclose(f);
-    free(out);
-    *numKeys = 0;
-    return NULL;
+    LOGI("%d key(s) loaded from %s\n", keys->count, PUBLIC_KEYS_FILE);
+    return INSTALL_SUCCESS;
 }
 
-int
-install_package(const char *root_path)
+// Mount, find and open the package at "root_path", and load the keys
+// to check it against unless "keys" is NULL.  Returns INSTALL_SUCCESS
+// or INSTALL_CORRUPT; on success, "zip" and "keys" must be released.
+static int
+open_package(const char *root_path, char *path, size_t path_size,
+             ZipArchive *zip, KeyStore *keys)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_print("Finding update package...\n");
-    ui_show_indeterminate_progress();
     LOGI("Update location: %s\n", root_path);
 
-    if (ensure_root_path_mounted(root_path) != 0) {
+    StatsTimer timer;
+    stats_start(&timer, "mount");
+    int ret = ensure_root_path_mounted(root_path);
+    stats_stop(&timer, 0, 0);
+    if (ret != 0) {
         LOGE("Can't mount %s\n", root_path);
         return INSTALL_CORRUPT;
     }
 
-    char path[PATH_MAX] = "";
-    if (translate_root_path(root_path, path, sizeof(path)) == NULL) {
+    if (translate_root_path(root_path, path, path_size) == NULL) {
         LOGE("Bad path %s\n", root_path);
         return INSTALL_CORRUPT;
     }
@@ -454,30 +798,199 @@ install_package(const char *root_path)
     ui_print("Opening update package...\n");
     LOGI("Update file path: %s\n", path);
 
-/*
-    int numKeys;
-    RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
-    if (loadedKeys == NULL) {
-        LOGE("Failed to load keys\n");
+    if (keys != NULL && load_package_keys(keys) != INSTALL_SUCCESS) {
         return INSTALL_CORRUPT;
     }
-    LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
-*/
 
     /* Try to open the package.
      */
-    ZipArchive zip;
-    int err = mzOpenZipArchive(path, &zip);
+    stats_start(&timer, "open");
+    int err = mzOpenZipArchive(path, zip);
+    stats_stop(&timer, 0, err == 0 ? mzZipEntryCount(zip) : 0);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        if (keys != NULL) keystore_free(keys);
         return INSTALL_CORRUPT;
     }
+    return INSTALL_SUCCESS;
+}
+
+int
+install_package(const char *root_path)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding update package...\n");
+    ui_show_indeterminate_progress();
+    stats_reset();
+
+    StatsTimer timer;
+    stats_start(&timer, "total");
+
+    char path[PATH_MAX] = "";
+    ZipArchive zip;
+    KeyStore keys;
+    int status = open_package(root_path, path, sizeof(path), &zip, &keys);
+    if (status == INSTALL_SUCCESS) {
+        /* Verify and install the contents of the package.
+         */
+        status = handle_update_package(path, &zip,
+                keys.count > 0 ? &keys : NULL);
+        mzCloseZipArchive(&zip);
+        keystore_free(&keys);
+    }
+
+    stats_stop(&timer, 0, 0);
+    return status;
+}
+
+int
+install_packages(const char *const *root_paths, int count)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    stats_reset();
+
+    StatsTimer timer;
+    stats_start(&timer, "total");
+
+    char (*paths)[PATH_MAX] = malloc(count * sizeof(*paths));
+    ZipArchive *zips = malloc(count * sizeof(*zips));
+    const ZipArchive **archives = malloc(count * sizeof(*archives));
+    KeyStore keys;
+    memset(&keys, 0, sizeof(keys));
+    int status = INSTALL_ERROR;
+    if (paths != NULL && zips != NULL && archives != NULL) {
+        status = load_package_keys(&keys);
+    }
+
+    // Open them all first, so a missing one stops the queue before
+    // anything is installed.
+    int opened = 0;
+    while (status == INSTALL_SUCCESS && opened < count) {
+        ui_print("Finding %s...\n", root_paths[opened]);
+        status = open_package(root_paths[opened], paths[opened], PATH_MAX,
+                &zips[opened], NULL);
+        if (status == INSTALL_SUCCESS) {
+            archives[opened] = &zips[opened];
+            ++opened;
+        }
+    }
+
+    int i;
+    if (status == INSTALL_SUCCESS && keys.count > 0) {
+        ui_print("Verifying %d packages...\n", count);
+        ui_show_progress(1.0, 0);
+
+        long long bytes = 0, files = 0;
+        for (i = 0; i < count; ++i) {
+            bytes += package_bytes(&zips[i]);
+            files += mzZipEntryCount(&zips[i]);
+        }
+        StatsTimer verify;
+        stats_start(&verify, "verify");
+        int bad = verify_jar_signatures(archives, count, &keys);
+        stats_stop(&verify, bytes, files);
+        if (bad >= 0) {
+            LOGE("Verification failed:\n  %s\n", root_paths[bad]);
+            status = INSTALL_CORRUPT;
+        }
+    }
+
+    for (i = 0; i < count && status == INSTALL_SUCCESS; ++i) {
+        ui_print("\nInstalling %s (%d of %d)...\n",
+                root_paths[i], i + 1, count);
+
+        // Each package's bar starts with its verification already done.
+        ui_reset_progress();
+        ui_show_progress(VERIFICATION_PROGRESS_FRACTION, 0);
+        ui_set_progress(1.0);
+        status = install_update(paths[i], &zips[i], false);
+        if (status != INSTALL_SUCCESS) {
+            LOGE("Can't install %s\n", root_paths[i]);
+        }
+    }
+
+    for (i = 0; i < opened; ++i) {
+        mzCloseZipArchive(&zips[i]);
+    }
+    keystore_free(&keys);
+    free(archives);
+    free(zips);
+    free(paths);
+
+    // One sync for the lot, rather than one per package.
+    StatsTimer flush;
+    stats_start(&flush, "sync");
+    sync();
+    stats_stop(&flush, 0, 0);
+
+    stats_stop(&timer, 0, 0);
+    return status;
+}
+
+// mzProcessZipEntryContents callback that throws the data away.
+static bool
+discard_data(const unsigned char *data, int data_len, void *cookie)
+{
+    *(long long *) cookie += data_len;
+    return true;
+}
+
+int
+install_benchmark(const char *root_path)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Benchmarking %s...\n", root_path);
+    ui_show_indeterminate_progress();
+    stats_reset();
+
+    StatsTimer timer;
+    stats_start(&timer, "total");
+
+    char path[PATH_MAX] = "";
+    ZipArchive zip;
+    KeyStore keys;
+    int status = open_package(root_path, path, sizeof(path), &zip, &keys);
+    if (status != INSTALL_SUCCESS) {
+        stats_stop(&timer, 0, 0);
+        return status;
+    }
+
+    // Verify as an install would...
+    if (keys.count > 0) {
+        StatsTimer verify;
+        stats_start(&verify, "verify");
+        bool ok = verify_jar_signature(&zip, &keys);
+        stats_stop(&verify, package_bytes(&zip), mzZipEntryCount(&zip));
+        if (!ok) {
+            LOGE("Verification failed\n");
+            status = INSTALL_CORRUPT;
+        }
+    }
+
+    // ...then inflate every file, but write nothing anywhere.
+    if (status == INSTALL_SUCCESS) {
+        StatsTimer extract;
+        long long bytes = 0;
+        int files = 0;
+        unsigned int i;
+        stats_start(&extract, "extract");
+        for (i = 0; i < mzZipEntryCount(&zip); ++i) {
+            const ZipEntry *entry = mzGetZipEntryAt(&zip, i);
+            if (!mzProcessZipEntryContents(&zip, entry, discard_data, &bytes)) {
+                UnterminatedString fn = mzGetZipEntryFileName(entry);
+                LOGE("Can't read %.*s\n", fn.len, fn.str);
+                status = INSTALL_CORRUPT;
+                break;
+            }
+            ++files;
+        }
+        stats_stop(&extract, bytes, files);
+    }
 
-    /* Verify and install the contents of the package.
-     */
-    // int status = handle_update_package(path, &zip, loadedKeys, numKeys);
-    int status = handle_update_package(path, &zip);
     mzCloseZipArchive(&zip);
-    // free(loadedKeys);
+    keystore_free(&keys);
+    stats_stop(&timer, 0, 0);
+    stats_show();
     return status;
 }
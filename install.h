@@ -22,4 +22,28 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 int install_package(const char *root_path);
 
+// Install several packages in one go.  All are opened and verified
+// (together, if verification is on) before the first is installed,
+// then they're installed in order, stopping at the first failure.
+int install_packages(const char *const *root_paths, int count);
+
+// Go through the motions of installing "root_path" without writing
+// anything: open and verify it, and inflate every file.  The time each
+// step takes is recorded as for an install (see stats.h).
+int install_benchmark(const char *root_path);
+
+// How install_package() checks a package's signature.  NONE, the
+// default, doesn't; FULL verifies the whole package before installing
+// any of it; PIPELINED checks the signature chain first and each file
+// as it's installed, holding back anything that can't be redone until
+// the rest has been checked.
+enum { INSTALL_VERIFY_NONE, INSTALL_VERIFY_FULL, INSTALL_VERIFY_PIPELINED };
+void install_set_verify_mode(int mode);
+
+// How many threads extract a package's files and set their permissions,
+// in recovery and in the update binary (which gets it in the
+// environment as UPDATE_THREADS).  One does everything serially.
+void install_set_threads(int threads);
+int install_threads();
+
 #endif  // RECOVERY_INSTALL_H_
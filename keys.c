@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "keys.h"
+
+void keystore_key_id(const RSAPublicKey *key, uint8_t id[KEY_ID_SIZE]) {
+    int i;
+    for (i = 0; i < KEY_ID_SIZE; ++i) {
+        uint32_t word = key->n[RSANUMWORDS - 1 - i / 4];
+        id[i] = word >> (24 - 8 * (i % 4));
+    }
+}
+
+static size_t store_length(int count) {
+    return sizeof(KeyStoreHeader) +
+            count * (KEY_ID_SIZE + sizeof(RSAPublicKey));
+}
+
+// Point ks->ids and ks->keys into a store laid out at ks->data.
+static void set_pointers(KeyStore *ks, int count) {
+    const char *p = (const char *) ks->data + sizeof(KeyStoreHeader);
+    ks->count = count;
+    ks->ids = (const uint8_t (*)[KEY_ID_SIZE]) p;
+    ks->keys = (const RSAPublicKey *) (p + count * KEY_ID_SIZE);
+}
+
+static int check_store(const char *path, const KeyStore *ks) {
+    const KeyStoreHeader *h = (const KeyStoreHeader *) ks->data;
+    if (ks->length < sizeof(*h) || memcmp(h->magic, KEY_STORE_MAGIC, 4)) {
+        LOGE("%s isn't a key store\n", path);
+        return -1;
+    }
+    if (h->key_size != sizeof(RSAPublicKey)) {
+        LOGE("%s has %u-byte keys (expected %d)\n",
+                path, h->key_size, (int) sizeof(RSAPublicKey));
+        return -1;
+    }
+    if (h->count == 0 || h->count > (ks->length - sizeof(*h)) /
+            (KEY_ID_SIZE + sizeof(RSAPublicKey)) ||
+            ks->length != store_length(h->count)) {
+        LOGE("%s is the wrong size for %u keys\n", path, h->count);
+        return -1;
+    }
+
+    KeyStore view = *ks;
+    set_pointers(&view, h->count);
+    int i;
+    for (i = 0; i < view.count; ++i) {
+        uint8_t id[KEY_ID_SIZE];
+        keystore_key_id(&view.keys[i], id);
+        if (view.keys[i].len != RSANUMWORDS ||
+                memcmp(id, view.ids[i], KEY_ID_SIZE)) {
+            LOGE("Bad key %d in %s\n", i + 1, path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int map_store(const char *path, int fd, KeyStore *ks) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("Can't stat %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+    ks->length = st.st_size;
+    ks->data = mmap(NULL, ks->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ks->data == MAP_FAILED) {
+        LOGE("Can't map %s\n(%s)\n", path, strerror(errno));
+        ks->data = NULL;
+        return -1;
+    }
+    ks->mapped = true;
+    if (check_store(path, ks) != 0) return -1;
+    set_pointers(ks, ((const KeyStoreHeader *) ks->data)->count);
+    return 0;
+}
+
+// Reads a file containing one or more public keys as produced by
+// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
+// as a C source literal, eg:
+//
+//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
+//
+// (Note that the braces and commas in this example are actual
+// characters the parser expects to find in the file; the ellipses
+// indicate more numbers omitted from this example.)
+//
+// The file may contain multiple keys in this format, separated by
+// commas.  The last key must not be followed by a comma.
+static int parse_text(const char *path, FILE *f, KeyStore *ks) {
+    RSAPublicKey *keys = NULL;
+    int count = 0, allocd = 0;
+
+    int i;
+    bool done = false;
+    while (!done) {
+        if (count == allocd) {
+            allocd = allocd ? allocd * 2 : 4;
+            RSAPublicKey *grown = realloc(keys, allocd * sizeof(*keys));
+            if (grown == NULL) {
+                LOGE("Can't allocate %d keys\n", allocd);
+                goto exit;
+            }
+            keys = grown;
+        }
+        RSAPublicKey* key = &keys[count++];
+        if (fscanf(f, " { %i , %i , { %i",
+                   &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
+            goto bad;
+        }
+        if (key->len != RSANUMWORDS) {
+            LOGE("key length (%d) does not match expected size\n", key->len);
+            goto exit;
+        }
+        for (i = 1; i < key->len; ++i) {
+            if (fscanf(f, " , %i", &(key->n[i])) != 1) goto bad;
+        }
+        if (fscanf(f, " } , { %i", &(key->rr[0])) != 1) goto bad;
+        for (i = 1; i < key->len; ++i) {
+            if (fscanf(f, " , %i", &(key->rr[i])) != 1) goto bad;
+        }
+        fscanf(f, " } } ");
+
+        // if the line ends in a comma, this file has more keys.
+        switch (fgetc(f)) {
+            case ',':
+                // more keys to come.
+                break;
+
+            case EOF:
+                done = true;
+                break;
+
+            default:
+                LOGE("unexpected character between keys\n");
+                goto exit;
+        }
+    }
+
+    // Lay the keys out as the binary store would be.
+    ks->length = store_length(count);
+    ks->data = calloc(1, ks->length);
+    if (ks->data == NULL) {
+        LOGE("Can't allocate %d keys\n", count);
+        goto exit;
+    }
+    ks->mapped = false;
+    set_pointers(ks, count);
+    memcpy((void *) ks->keys, keys, count * sizeof(*keys));
+    for (i = 0; i < count; ++i) {
+        keystore_key_id(&keys[i], (uint8_t *) ks->ids[i]);
+    }
+    free(keys);
+    return 0;
+
+bad:
+    LOGE("Can't parse key %d in %s\n", count, path);
+exit:
+    free(keys);
+    return -1;
+}
+
+int keystore_load(const char *path, KeyStore *ks) {
+    memset(ks, 0, sizeof(*ks));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char magic[4];
+    int ret;
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+            !memcmp(magic, KEY_STORE_MAGIC, sizeof(magic))) {
+        ret = map_store(path, fd, ks);
+        close(fd);
+    } else {
+        FILE *f = fdopen(fd, "r");
+        if (f == NULL) {
+            close(fd);
+            return -1;
+        }
+        ret = parse_text(path, f, ks);
+        fclose(f);
+    }
+
+    if (ret != 0) keystore_free(ks);
+    return ret;
+}
+
+void keystore_free(KeyStore *ks) {
+    if (ks->data != NULL) {
+        if (ks->mapped) {
+            munmap(ks->data, ks->length);
+        } else {
+            free(ks->data);
+        }
+    }
+    memset(ks, 0, sizeof(*ks));
+}
+
+int keystore_write(FILE *f, const KeyStore *ks) {
+    KeyStoreHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KEY_STORE_MAGIC, sizeof(h.magic));
+    h.count = ks->count;
+    h.key_size = sizeof(RSAPublicKey);
+    if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(ks->ids, KEY_ID_SIZE, ks->count, f) != (size_t) ks->count ||
+            fwrite(ks->keys, sizeof(RSAPublicKey), ks->count, f) !=
+                    (size_t) ks->count) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_KEYS_H
+#define _RECOVERY_KEYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mincrypt/rsa.h"
+
+/* The public keys packages may be signed with.
+ *
+ * A key file is either the text DumpPublicKey writes, or the binary
+ * store make-key-store builds from it:
+ *
+ *     KeyStoreHeader
+ *     uint8_t ids[count][KEY_ID_SIZE]
+ *     RSAPublicKey keys[count]
+ *
+ * in the device's byte order.  The binary store is mapped and used in
+ * place, after one check of its size and contents.
+ *
+ * A key's id is the top KEY_ID_SIZE bytes of its modulus, most
+ * significant first.  The certificate in a package's .RSA file carries
+ * the modulus in that order, so the id finds the key that signed it.
+ */
+
+#define KEY_ID_SIZE         16
+#define KEY_STORE_MAGIC     "RKS1"
+
+typedef struct {
+    char magic[4];              // KEY_STORE_MAGIC
+    uint32_t count;
+    uint32_t key_size;          // sizeof(RSAPublicKey) where it was built
+    uint32_t reserved;
+} KeyStoreHeader;
+
+typedef struct {
+    int count;
+    const uint8_t (*ids)[KEY_ID_SIZE];  // ids[i] is keys[i]'s
+    const RSAPublicKey *keys;
+
+    void *data;                 // where ids and keys live
+    size_t length;
+    bool mapped;                // else malloc()ed
+} KeyStore;
+
+/* Load the keys in "path", in either format.  Returns 0, or -1 (having
+ * logged why) if it can't be read or holds no valid keys.
+ */
+int keystore_load(const char *path, KeyStore *ks);
+void keystore_free(KeyStore *ks);
+
+// Write "ks" to "f" in the binary format.  Returns 0, or -1 on error.
+int keystore_write(FILE *f, const KeyStore *ks);
+
+void keystore_key_id(const RSAPublicKey *key, uint8_t id[KEY_ID_SIZE]);
+
+#endif  /* _RECOVERY_KEYS_H */
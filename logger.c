@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// How much of the log is kept in memory for the next save; anything
+// older is read back from the temporary log.
+#define LOGGER_RING_SIZE (256 * 1024)
+
+#define LOGGER_READ_SIZE (16 * 1024)
+
+static pthread_mutex_t gLogMutex = PTHREAD_MUTEX_INITIALIZER;
+static int gPipe = -1;          // the read end; stdout and stderr are the other
+static int gTmpFd = -1;         // the temporary log
+
+// Offsets in the temporary log.  The ring holds the bytes from
+// max(gRingStart, gLogged - LOGGER_RING_SIZE) up to gLogged, each at
+// its offset modulo the ring's size.
+static char gRing[LOGGER_RING_SIZE];
+static long long gRingStart;    // the size of the log when we started
+static long long gLogged;
+static long long gSaved;
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Move whatever is waiting in the pipe to the temporary log and the
+// ring.  Should only be called with gLogMutex locked.
+static void drain_locked(void)
+{
+    char buf[LOGGER_READ_SIZE];
+    ssize_t n;
+    while ((n = read(gPipe, buf, sizeof(buf))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+        if (n < 0) continue;
+        write_all(gTmpFd, buf, n);  // there's nowhere to report this
+
+        size_t pos = gLogged % LOGGER_RING_SIZE;
+        size_t first = LOGGER_RING_SIZE - pos;
+        if (first > (size_t) n) first = n;
+        memcpy(gRing + pos, buf, first);
+        memcpy(gRing, buf + first, n - first);
+        gLogged += n;
+    }
+}
+
+static void *logger_thread(void *cookie)
+{
+    struct pollfd pfd;
+    pfd.fd = gPipe;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (poll(&pfd, 1, -1) <= 0) continue;
+        pthread_mutex_lock(&gLogMutex);
+        drain_locked();
+        pthread_mutex_unlock(&gLogMutex);
+    }
+    return NULL;
+}
+
+int logger_init(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) return -1;
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Only the writing end is for children.
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    struct stat st;
+    gTmpFd = fd;
+    gPipe = pipefd[0];
+    gRingStart = gLogged = fstat(fd, &st) == 0 ? st.st_size : 0;
+    gSaved = 0;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, logger_thread, NULL) != 0) {
+        pthread_attr_destroy(&attr);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(fd);
+        gPipe = gTmpFd = -1;
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    close(pipefd[1]);
+    return 0;
+}
+
+int logger_save(const char *path)
+{
+    if (gTmpFd < 0) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) return -1;
+
+    int result = 0;
+    pthread_mutex_lock(&gLogMutex);
+    drain_locked();
+
+    long long ring_from = gLogged - LOGGER_RING_SIZE;
+    if (ring_from < gRingStart) ring_from = gRingStart;
+
+    // What never was, or no longer is, in the ring.
+    char buf[LOGGER_READ_SIZE];
+    while (result == 0 && gSaved < ring_from) {
+        size_t want = sizeof(buf);
+        if ((long long) want > ring_from - gSaved) want = ring_from - gSaved;
+        ssize_t n = pread(gTmpFd, buf, want, gSaved);
+        if (n <= 0) {
+            gSaved = ring_from;     // lost; don't keep trying
+        } else if (write_all(fd, buf, n) != 0) {
+            result = -1;
+        } else {
+            gSaved += n;
+        }
+    }
+
+    // The rest, in at most two writes.
+    while (result == 0 && gSaved < gLogged) {
+        size_t pos = gSaved % LOGGER_RING_SIZE;
+        size_t len = LOGGER_RING_SIZE - pos;
+        if ((long long) len > gLogged - gSaved) len = gLogged - gSaved;
+        if (write_all(fd, gRing + pos, len) != 0) {
+            result = -1;
+        } else {
+            gSaved += len;
+        }
+    }
+    pthread_mutex_unlock(&gLogMutex);
+
+    if (fsync(fd) != 0) result = -1;
+    if (close(fd) != 0) result = -1;
+    return result;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_LOGGER_H
+#define _RECOVERY_LOGGER_H
+
+/* The recovery log.
+ *
+ * stdout and stderr (ours, and the update binary's and any other
+ * child's) go into a pipe.  A thread drains it in large reads into the
+ * temporary log file and into a ring buffer in memory of everything
+ * not yet saved.  logger_save() then appends that to the log on cache
+ * straight from memory, as one write, and fsyncs just that file.
+ */
+
+// Start logging to "path" (appending to anything already there).
+// Returns 0, or -1 with stdout and stderr left alone.
+int logger_init(const char *path);
+
+// Append everything logged since the last save (or, the first time,
+// all of the temporary log) to "path", and fsync it.  Returns 0 or -1.
+int logger_save(const char *path);
+
+#endif  // _RECOVERY_LOGGER_H
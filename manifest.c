@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "gzblock.h"
+#include "manifest.h"
+
+#define MANIFEST_MAGIC      "manifest 1\n"
+#define MANIFEST_LINE_MAX   (PATH_MAX * 2 + 128)
+
+#define VERIFY_MAX_THREADS  4
+#define VERIFY_BUFFER_SIZE  (64 * 1024)
+
+static void put_escaped(FILE *f, const char *s) {
+    for (; *s != '\0'; ++s) {
+        switch (*s) {
+            case '\\': fputs("\\\\", f); break;
+            case '\t': fputs("\\t", f); break;
+            case '\n': fputs("\\n", f); break;
+            default: putc(*s, f); break;
+        }
+    }
+}
+
+static void unescape(char *s) {
+    char *out = s;
+    for (; *s != '\0'; ++s) {
+        if (*s == '\\' && s[1] != '\0') {
+            ++s;
+            *out++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int manifest_put_header(FILE *f) {
+    fputs(MANIFEST_MAGIC, f);
+    return ferror(f) ? -1 : 0;
+}
+
+int manifest_put_entry(FILE *f, const ManifestEntry *e) {
+    fprintf(f, "%lld\t%c\t%lld\t", e->offset, e->type, e->size);
+    if (e->type == '0') {
+        int i;
+        for (i = 0; i < SHA_DIGEST_SIZE; ++i) fprintf(f, "%02x", e->digest[i]);
+    } else {
+        putc('-', f);
+    }
+    putc('\t', f);
+    put_escaped(f, e->name);
+    putc('\n', f);
+    return ferror(f) ? -1 : 0;
+}
+
+// Parse one line (without its '\n') into "e"; the name is strdup()ed.
+static int parse_entry(char *line, ManifestEntry *e) {
+    memset(e, 0, sizeof(*e));
+    char *fields[5];
+    int i;
+    for (i = 0; i < 5; ++i) {
+        fields[i] = line;
+        if (i < 4) {
+            line = strchr(line, '\t');
+            if (line == NULL) return -1;
+            *line++ = '\0';
+        }
+    }
+    char *end;
+    e->offset = strtoll(fields[0], &end, 10);
+    if (*end != '\0' || e->offset < 0 || fields[1][0] == '\0') return -1;
+    e->type = fields[1][0];
+    e->size = strtoll(fields[2], &end, 10);
+    if (*end != '\0' || e->size < 0) return -1;
+    if (e->type == '0') {
+        if (strlen(fields[3]) != SHA_DIGEST_SIZE * 2) return -1;
+        for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+            int hi = hex_value(fields[3][i * 2]);
+            int lo = hex_value(fields[3][i * 2 + 1]);
+            if (hi < 0 || lo < 0) return -1;
+            e->digest[i] = hi << 4 | lo;
+        }
+    }
+    unescape(fields[4]);
+    e->name = strdup(fields[4]);
+    return e->name != NULL ? 0 : -1;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    long long x = ((const ManifestEntry *) a)->offset;
+    long long y = ((const ManifestEntry *) b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+int manifest_load(const char *archive_path, Manifest *m) {
+    memset(m, 0, sizeof(*m));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", archive_path, MANIFEST_SUFFIX);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char *line = malloc(MANIFEST_LINE_MAX);
+    int alloc = 0;
+    int ret = 0;
+    if (line == NULL || fgets(line, MANIFEST_LINE_MAX, f) == NULL ||
+            strcmp(line, MANIFEST_MAGIC) != 0) {
+        LOGE("%s isn't a backup manifest\n", path);
+        ret = -1;
+    }
+    while (ret == 0 && fgets(line, MANIFEST_LINE_MAX, f) != NULL) {
+        char *nl = strchr(line, '\n');
+        if (nl == NULL) {
+            LOGE("Line too long in %s\n", path);
+            ret = -1;
+            break;
+        }
+        *nl = '\0';
+        if (m->count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            ManifestEntry *more = realloc(m->entries, alloc * sizeof(*more));
+            if (more == NULL) {
+                ret = -1;
+                break;
+            }
+            m->entries = more;
+        }
+        if (parse_entry(line, &m->entries[m->count])) {
+            LOGE("Bad line in %s\n", path);
+            ret = -1;
+            break;
+        }
+        ++m->count;
+    }
+    if (ret == 0 && ferror(f)) ret = -1;
+    fclose(f);
+    free(line);
+    if (ret != 0) {
+        manifest_free(m);
+        return -1;
+    }
+
+    // Streams written side by side (tar_create_multi) can list an entry
+    // only once it has ended; put them back in archive order.
+    qsort(m->entries, m->count, sizeof(*m->entries), compare_offsets);
+    return 0;
+}
+
+void manifest_free(Manifest *m) {
+    int i;
+    for (i = 0; i < m->count; ++i) free(m->entries[i].name);
+    free(m->entries);
+    m->entries = NULL;
+    m->count = 0;
+}
+
+// Whether "name" (from a TarEntry) is "want", give or take trailing '/'s.
+static int same_name(const char *name, const char *want) {
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') --len;
+    return strlen(want) == len && strncmp(name, want, len) == 0;
+}
+
+typedef struct {
+    const char *archive_path;
+    const Manifest *m;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // "running" went down
+    int running;
+    int failed;
+    TarProgress progress;
+} VerifyJob;
+
+typedef struct {
+    VerifyJob *job;
+    int first, last;            // entries [first, last)
+    int fd;
+    GzBlockReader *gz;          // NULL for a plain tar
+    pthread_t thread;
+} VerifyRange;
+
+static ssize_t read_range(void *cookie, void *data, size_t len) {
+    VerifyRange *v = (VerifyRange *) cookie;
+    if (v->gz != NULL) return gzblock_read(v->gz, data, len);
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(v->fd, (char *) data + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+static int seek_range(VerifyRange *v, long long offset) {
+    if (v->gz != NULL) return gzblock_seek(v->gz, offset);
+    return lseek(v->fd, offset, SEEK_SET) == (off_t) offset ? 0 : -1;
+}
+
+// Hash the contents of the entry "tar" is at; -1 if they can't be read.
+static int hash_entry(VerifyRange *v, TarReader *tar, char *buffer,
+        uint8_t *digest) {
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t n;
+    while ((n = tar_read_data(tar, buffer, VERIFY_BUFFER_SIZE)) > 0) {
+        SHA_update(&ctx, buffer, n);
+        pthread_mutex_lock(&v->job->lock);
+        v->job->progress.bytes += n;
+        pthread_mutex_unlock(&v->job->lock);
+    }
+    if (n < 0) return -1;
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+static int verify_entries(VerifyRange *v, TarReader *tar, char *buffer) {
+    const Manifest *m = v->job->m;
+    int i;
+    for (i = v->first; i < v->last; ++i) {
+        const ManifestEntry *e = &m->entries[i];
+        if (e->type != '0') continue;
+        pthread_mutex_lock(&v->job->lock);
+        int failed = v->job->failed;    // elsewhere; no point going on
+        pthread_mutex_unlock(&v->job->lock);
+        if (failed) return 0;
+
+        // Neighbouring files needn't seek: the reader is already there
+        if (i == v->first || tar_reader_offset(tar) != e->offset) {
+            if (seek_range(v, e->offset)) {
+                LOGE("Can't seek to %s in backup\n", e->name);
+                return -1;
+            }
+            tar_reader_reset(tar, e->offset);
+        }
+
+        TarEntry entry;
+        uint8_t digest[SHA_DIGEST_SIZE];
+        if (tar_next_entry(tar, &entry) <= 0 || entry.type != '0' ||
+                !same_name(entry.name, e->name) || entry.size != e->size) {
+            LOGE("%s isn't where its manifest says\n", e->name);
+            return -1;
+        }
+        if (hash_entry(v, tar, buffer, digest)) {
+            LOGE("Can't read %s from backup\n", e->name);
+            return -1;
+        }
+        if (memcmp(digest, e->digest, SHA_DIGEST_SIZE) != 0) {
+            LOGE("%s is corrupt in backup\n", e->name);
+            return -1;
+        }
+        pthread_mutex_lock(&v->job->lock);
+        ++v->job->progress.files;
+        pthread_mutex_unlock(&v->job->lock);
+    }
+    return 0;
+}
+
+static void *verify_thread(void *cookie) {
+    VerifyRange *v = (VerifyRange *) cookie;
+    VerifyJob *job = v->job;
+    int ret = -1;
+    char *buffer = malloc(VERIFY_BUFFER_SIZE);
+    TarReader *tar = NULL;
+
+    // Each range has its own reader, with a single inflater; there's
+    // already a range per core.
+    v->fd = open(job->archive_path, O_RDONLY);
+    if (v->fd >= 0 && gzblock_is_gzip(v->fd)) {
+        v->gz = gzblock_open_reader(v->fd, 1);
+        if (v->gz == NULL) {
+            close(v->fd);
+            v->fd = -1;
+        }
+    }
+    if (v->fd < 0) {
+        LOGE("Can't open %s\n", job->archive_path);
+    } else if (buffer != NULL &&
+            (tar = tar_open_reader(read_range, v)) != NULL) {
+        ret = verify_entries(v, tar, buffer);
+    }
+
+    if (tar != NULL) tar_close_reader(tar);
+    if (v->gz != NULL) gzblock_close_reader(v->gz);
+    if (v->fd >= 0) close(v->fd);
+    free(buffer);
+
+    pthread_mutex_lock(&job->lock);
+    if (ret != 0) job->failed = 1;
+    --job->running;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+int manifest_verify(const char *archive_path, TarProgressFunction progress,
+        void *cookie) {
+    Manifest m;
+    if (manifest_load(archive_path, &m)) {
+        LOGE("No manifest for %s\n", archive_path);
+        return -1;
+    }
+
+    VerifyJob job;
+    memset(&job, 0, sizeof(job));
+    job.archive_path = archive_path;
+    job.m = &m;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    int i;
+    for (i = 0; i < m.count; ++i) {
+        if (m.entries[i].type != '0') continue;
+        ++job.progress.total_files;
+        job.progress.total_bytes += m.entries[i].size;
+    }
+
+    // Cut the entries into runs of about the same number of bytes
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nranges = cpus < 1 ? 1 : cpus > VERIFY_MAX_THREADS ?
+            VERIFY_MAX_THREADS : (int) cpus;
+    VerifyRange ranges[VERIFY_MAX_THREADS];
+    memset(ranges, 0, sizeof(ranges));
+    long long per_range = job.progress.total_bytes / nranges + 1;
+    long long bytes = 0;
+    int n = 0;
+    ranges[0].first = 0;
+    for (i = 0; i < m.count; ++i) {
+        if (m.entries[i].type == '0') bytes += m.entries[i].size;
+        if (bytes >= per_range * (n + 1) && n + 1 < nranges) {
+            ranges[n++].last = i + 1;
+            ranges[n].first = i + 1;
+        }
+    }
+    ranges[n++].last = m.count;
+
+    pthread_mutex_lock(&job.lock);
+    for (i = 0; i < n; ++i) {
+        ranges[i].job = &job;
+        ranges[i].fd = -1;
+        if (pthread_create(&ranges[i].thread, NULL, verify_thread,
+                &ranges[i])) {
+            LOGE("Can't start verification threads\n");
+            job.failed = 1;
+            break;
+        }
+        ++job.running;
+    }
+    int started = i;
+
+    // Report progress from here, a few times a second
+    while (job.running > 0) {
+        struct timeval now;
+        struct timespec until;
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec + (now.tv_usec >= 750000);
+        until.tv_nsec = (now.tv_usec + 250000) % 1000000 * 1000;
+        pthread_cond_timedwait(&job.cond, &job.lock, &until);
+
+        TarProgress done = job.progress;
+        pthread_mutex_unlock(&job.lock);
+        if (progress != NULL) progress(&done, cookie);
+        pthread_mutex_lock(&job.lock);
+    }
+    int ret = job.failed ? -1 : 0;
+    LOGI("verified %d files, %lld bytes of %s\n", job.progress.files,
+            job.progress.bytes, archive_path);
+    pthread_mutex_unlock(&job.lock);
+
+    for (i = 0; i < started; ++i) pthread_join(ranges[i].thread, NULL);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    manifest_free(&m);
+    return ret;
+}
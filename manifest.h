@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_MANIFEST_H
+#define _RECOVERY_MANIFEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mincrypt/sha.h"
+#include "tar.h"
+
+/* Manifests of tar backups.
+ *
+ * Next to "archive.tar.gz", tar_create() with TAR_MANIFEST writes
+ * "archive.tar.gz.manifest": a text file with a line for every entry,
+ * giving where its first header starts in the (uncompressed) tar
+ * stream, its type and size, the SHA-1 of a plain file's contents, and
+ * its name.  With gzblock's index that's enough to go straight to any
+ * entry, or to check the backup on several threads at once.
+ */
+
+#define MANIFEST_SUFFIX ".manifest"
+
+typedef struct {
+    long long offset;           // of the entry's first header block
+    long long size;             // contents of a plain file, otherwise 0
+    char type;                  // ustar typeflag, as in TarEntry
+    uint8_t digest[SHA_DIGEST_SIZE];    // plain files only
+    char *name;                 // as in TarEntry, without a trailing '/'
+} ManifestEntry;
+
+typedef struct {
+    int count;
+    ManifestEntry *entries;     // in order of offset
+} Manifest;
+
+// Write "e" as a manifest line.  Returns 0, or -1 if "f" has an error.
+int manifest_put_entry(FILE *f, const ManifestEntry *e);
+
+// The header line every manifest starts with.
+int manifest_put_header(FILE *f);
+
+/* Load the manifest of the archive at "archive_path".  Returns 0 on
+ * success, -1 if there's none or it can't be read.
+ */
+int manifest_load(const char *archive_path, Manifest *m);
+void manifest_free(Manifest *m);
+
+/* Check every plain file in the archive at "archive_path" against its
+ * manifest, on one thread per core.  Returns 0 if they all match, -1
+ * (having logged what's wrong) if not or there's no manifest.
+ */
+int manifest_verify(const char *archive_path, TarProgressFunction progress,
+        void *cookie);
+
+#endif  /* _RECOVERY_MANIFEST_H */
@@ -1,7 +1,7 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := graphics.c events.c resources.c
+LOCAL_SRC_FILES := graphics.c blend565.c events.c resources.c
 
 LOCAL_C_INCLUDES +=\
     external/libpng\
@@ -10,3 +10,18 @@ LOCAL_C_INCLUDES +=\
 LOCAL_MODULE := libminui
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Decodes recovery's images at build time (see mkimages.c).
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mkimages.c
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_MODULE := minui_mkimages
+
+include $(BUILD_HOST_EXECUTABLE)
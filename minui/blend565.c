@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLEND565_NEON 1
+#endif
+
+#include "blend565.h"
+
+/* Blending is done on the 5/6/5-bit channels with an alpha scaled to
+ * 0..256, so that out = (src * a + dst * (256 - a)) >> 8 never needs
+ * more than 16 bits and is exact at both ends.
+ */
+static inline unsigned scale_alpha(unsigned alpha)
+{
+    return alpha + (alpha >> 7);
+}
+
+static inline uint16_t blend_pixel(uint16_t d,
+        unsigned r5, unsigned g6, unsigned b5, unsigned a)
+{
+    unsigned dr = d >> 11, dg = (d >> 5) & 0x3f, db = d & 0x1f;
+    dr = (r5 * a + dr * (256 - a)) >> 8;
+    dg = (g6 * a + dg * (256 - a)) >> 8;
+    db = (b5 * a + db * (256 - a)) >> 8;
+    return (dr << 11) | (dg << 5) | db;
+}
+
+#ifdef BLEND565_NEON
+/* The same as blend_pixel(), for 8 pixels with an alpha each. */
+static inline uint16x8_t blend_8(uint16x8_t d, uint16x8_t r5,
+        uint16x8_t g6, uint16x8_t b5, uint16x8_t a)
+{
+    uint16x8_t inv = vsubq_u16(vdupq_n_u16(256), a);
+    uint16x8_t dr = vshrq_n_u16(d, 11);
+    uint16x8_t dg = vandq_u16(vshrq_n_u16(d, 5), vdupq_n_u16(0x3f));
+    uint16x8_t db = vandq_u16(d, vdupq_n_u16(0x1f));
+    dr = vshrq_n_u16(vmlaq_u16(vmulq_u16(r5, a), dr, inv), 8);
+    dg = vshrq_n_u16(vmlaq_u16(vmulq_u16(g6, a), dg, inv), 8);
+    db = vshrq_n_u16(vmlaq_u16(vmulq_u16(b5, a), db, inv), 8);
+    return vorrq_u16(vorrq_u16(vshlq_n_u16(dr, 11), vshlq_n_u16(dg, 5)), db);
+}
+
+static inline uint16x8_t scale_alpha_8(uint8x8_t alpha)
+{
+    uint16x8_t a = vmovl_u8(alpha);
+    return vaddq_u16(a, vshrq_n_u16(a, 7));
+}
+#endif
+
+void blend565_fill(uint16_t *dst, int count, uint16_t color)
+{
+#ifdef BLEND565_NEON
+    uint16x8_t c = vdupq_n_u16(color);
+    for (; count >= 8; count -= 8, dst += 8) {
+        vst1q_u16(dst, c);
+    }
+#endif
+    while (count-- > 0) {
+        *dst++ = color;
+    }
+}
+
+void blend565_fill_alpha(uint16_t *dst, int count,
+        unsigned r, unsigned g, unsigned b, unsigned alpha)
+{
+    unsigned a = scale_alpha(alpha);
+    if (a == 256) {
+        blend565_fill(dst, count, blend565_pack(r, g, b));
+        return;
+    }
+    if (a == 0) return;
+#ifdef BLEND565_NEON
+    uint16x8_t va = vdupq_n_u16(a);
+    uint16x8_t vr = vdupq_n_u16(r >> 3);
+    uint16x8_t vg = vdupq_n_u16(g >> 2);
+    uint16x8_t vb = vdupq_n_u16(b >> 3);
+    for (; count >= 8; count -= 8, dst += 8) {
+        vst1q_u16(dst, blend_8(vld1q_u16(dst), vr, vg, vb, va));
+    }
+#endif
+    while (count-- > 0) {
+        *dst = blend_pixel(*dst, r >> 3, g >> 2, b >> 3, a);
+        ++dst;
+    }
+}
+
+void blend565_mask(uint16_t *dst, const uint8_t *mask, int count,
+        unsigned r, unsigned g, unsigned b)
+{
+#ifdef BLEND565_NEON
+    uint16x8_t vr = vdupq_n_u16(r >> 3);
+    uint16x8_t vg = vdupq_n_u16(g >> 2);
+    uint16x8_t vb = vdupq_n_u16(b >> 3);
+    for (; count >= 8; count -= 8, dst += 8, mask += 8) {
+        uint16x8_t a = scale_alpha_8(vld1_u8(mask));
+        vst1q_u16(dst, blend_8(vld1q_u16(dst), vr, vg, vb, a));
+    }
+#endif
+    while (count-- > 0) {
+        unsigned a = *mask++;
+        // text is mostly all on or all off
+        if (a == 255) {
+            *dst = blend565_pack(r, g, b);
+        } else if (a != 0) {
+            *dst = blend_pixel(*dst, r >> 3, g >> 2, b >> 3, scale_alpha(a));
+        }
+        ++dst;
+    }
+}
+
+void blend565_copy_rgbx(uint16_t *dst, const uint8_t *src, int count)
+{
+#ifdef BLEND565_NEON
+    for (; count >= 8; count -= 8, dst += 8, src += 32) {
+        uint8x8x4_t p = vld4_u8(src);
+        uint16x8_t r = vandq_u16(vshll_n_u8(p.val[0], 8), vdupq_n_u16(0xf800));
+        uint16x8_t g = vandq_u16(vshll_n_u8(p.val[1], 3), vdupq_n_u16(0x07e0));
+        uint16x8_t b = vmovl_u8(vshr_n_u8(p.val[2], 3));
+        vst1q_u16(dst, vorrq_u16(vorrq_u16(r, g), b));
+    }
+#endif
+    for (; count > 0; --count, ++dst, src += 4) {
+        *dst = blend565_pack(src[0], src[1], src[2]);
+    }
+}
+
+void blend565_blend_rgba(uint16_t *dst, const uint8_t *src, int count)
+{
+#ifdef BLEND565_NEON
+    for (; count >= 8; count -= 8, dst += 8, src += 32) {
+        uint8x8x4_t p = vld4_u8(src);
+        uint16x8_t r = vmovl_u8(vshr_n_u8(p.val[0], 3));
+        uint16x8_t g = vmovl_u8(vshr_n_u8(p.val[1], 2));
+        uint16x8_t b = vmovl_u8(vshr_n_u8(p.val[2], 3));
+        uint16x8_t a = scale_alpha_8(p.val[3]);
+        vst1q_u16(dst, blend_8(vld1q_u16(dst), r, g, b, a));
+    }
+#endif
+    for (; count > 0; --count, ++dst, src += 4) {
+        unsigned a = src[3];
+        if (a == 255) {
+            *dst = blend565_pack(src[0], src[1], src[2]);
+        } else if (a != 0) {
+            *dst = blend_pixel(*dst, src[0] >> 3, src[1] >> 2, src[2] >> 3,
+                               scale_alpha(a));
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLEND565_H
+#define _MINUI_BLEND565_H
+
+#include <stdint.h>
+
+/* Span routines for drawing into an RGB565 surface, for what minui
+ * draws most: solid and translucent fills, and blits of its own
+ * images.  They use NEON where the compiler has it.
+ *
+ * Blending is source-over with non-premultiplied alpha, the same as
+ * GGL_SRC_ALPHA / GGL_ONE_MINUS_SRC_ALPHA; an alpha of 255 gives the
+ * source exactly, and 0 leaves the destination alone.  Colors are
+ * 8 bits per channel.
+ */
+
+static inline uint16_t blend565_pack(unsigned r, unsigned g, unsigned b)
+{
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+/* Set "count" pixels to "color". */
+void blend565_fill(uint16_t *dst, int count, uint16_t color);
+
+/* Blend (r, g, b) over "count" pixels with the same alpha for all. */
+void blend565_fill_alpha(uint16_t *dst, int count,
+        unsigned r, unsigned g, unsigned b, unsigned alpha);
+
+/* Blend (r, g, b) over "count" pixels, each with its own alpha from
+ * "mask" (an A_8 row, such as text).
+ */
+void blend565_mask(uint16_t *dst, const uint8_t *mask, int count,
+        unsigned r, unsigned g, unsigned b);
+
+/* Copy, or blend by their alpha, "count" RGBX_8888 / RGBA_8888 pixels. */
+void blend565_copy_rgbx(uint16_t *dst, const uint8_t *src, int count);
+void blend565_blend_rgba(uint16_t *dst, const uint8_t *src, int count);
+
+#endif  /* _MINUI_BLEND565_H */
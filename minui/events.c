@@ -16,8 +16,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/poll.h>
 
 #include <linux/input.h>
@@ -60,23 +63,58 @@ void ev_exit(void)
     }
 }
 
-int ev_get(struct input_event *ev, unsigned dont_wait)
+/* Events are read from the kernel as many as fit at once, and handed
+ * out of this buffer one at a time.  A trackball's motion, or a key
+ * and its SYN, then costs one poll() and read() instead of several.
+ */
+#define EV_BATCH 64
+
+static struct input_event ev_buf[EV_BATCH];
+static unsigned ev_buf_pos = 0, ev_buf_len = 0;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void ev_fill(void)
 {
-    int r;
     unsigned n;
+    ev_buf_pos = ev_buf_len = 0;
+    for(n = 0; n < ev_count && ev_buf_len < EV_BATCH; n++) {
+        if(ev_fds[n].revents & POLLIN) {
+            ssize_t r = read(ev_fds[n].fd, ev_buf + ev_buf_len,
+                             (EV_BATCH - ev_buf_len) * sizeof(ev_buf[0]));
+            if(r > 0) ev_buf_len += r / sizeof(ev_buf[0]);
+        }
+    }
+}
 
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+int ev_wait(struct input_event *ev, int timeout_ms)
+{
+    long long deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
 
+    while(ev_buf_pos == ev_buf_len) {
+        int wait = timeout_ms;
+        if(timeout_ms > 0) {
+            long long left = deadline - now_ms();
+            wait = left > 0 ? (int) left : 0;
+        }
+        int r = poll(ev_fds, ev_count, wait);
         if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
-            }
+            ev_fill();
+        } else if(r == 0 || wait == 0) {
+            return -1;
         }
-    } while(dont_wait == 0);
+    }
 
-    return -1;
+    *ev = ev_buf[ev_buf_pos++];
+    return 0;
+}
+
+int ev_get(struct input_event *ev, unsigned dont_wait)
+{
+    return ev_wait(ev, dont_wait ? 0 : -1);
 }
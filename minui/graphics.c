@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -29,6 +30,7 @@
 
 #include <pixelflinger/pixelflinger.h>
 
+#include "blend565.h"
 #include "font_10x18.h"
 #include "minui.h"
 
@@ -46,11 +48,76 @@ static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
 
+static unsigned char gr_current_color[4];   /* r, g, b, a of gr_color() */
+
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
 static struct fb_var_screeninfo vi;
 
+/* What's been drawn since each framebuffer was last brought up to date
+ * with the memory surface, as a few rectangles (x2, y2 exclusive).
+ * Rectangles that touch are merged, and if there get to be too many
+ * they all become one; either way only some parts of the screen may be
+ * copied twice, never missed.
+ */
+#define GR_MAX_DIRTY 4
+
+typedef struct {
+    int x1, y1, x2, y2;
+} GRRect;
+
+typedef struct {
+    GRRect rects[GR_MAX_DIRTY];
+    int count;
+} GRDamage;
+
+static GRDamage gr_damage[2];
+
+static void rect_union(GRRect *a, const GRRect *b)
+{
+    if (b->x1 < a->x1) a->x1 = b->x1;
+    if (b->y1 < a->y1) a->y1 = b->y1;
+    if (b->x2 > a->x2) a->x2 = b->x2;
+    if (b->y2 > a->y2) a->y2 = b->y2;
+}
+
+static void damage_add(GRDamage *d, const GRRect *r)
+{
+    int i;
+    for (i = 0; i < d->count; ++i) {
+        GRRect *t = &d->rects[i];
+        if (r->x1 <= t->x2 && t->x1 <= r->x2 &&
+                r->y1 <= t->y2 && t->y1 <= r->y2) {
+            rect_union(t, r);
+            return;
+        }
+    }
+    if (d->count < GR_MAX_DIRTY) {
+        d->rects[d->count++] = *r;
+        return;
+    }
+    for (i = 1; i < d->count; ++i) {
+        rect_union(&d->rects[0], &d->rects[i]);
+    }
+    rect_union(&d->rects[0], r);
+    d->count = 1;
+}
+
+void gr_dirty(int x1, int y1, int x2, int y2)
+{
+    GRRect r;
+    r.x1 = x1 < 0 ? 0 : x1;
+    r.y1 = y1 < 0 ? 0 : y1;
+    r.x2 = x2 > (int) vi.xres ? (int) vi.xres : x2;
+    r.y2 = y2 > (int) vi.yres ? (int) vi.yres : y2;
+    if (r.x1 >= r.x2 || r.y1 >= r.y2) return;
+
+    /* Neither buffer has it yet. */
+    damage_add(&gr_damage[0], &r);
+    damage_add(&gr_damage[1], &r);
+}
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
@@ -127,10 +194,25 @@ void gr_flip(void)
     /* swap front and back buffers */
     gr_active_fb = (gr_active_fb + 1) & 1;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+    /* copy what's changed since this buffer was last shown from the
+     * in-memory surface to it, before we make it active. */
+    GRDamage *d = &gr_damage[gr_active_fb];
+    unsigned short *fb = (unsigned short *) gr_framebuffer[gr_active_fb].data;
+    unsigned short *mem = (unsigned short *) gr_mem_surface.data;
+    int i, y;
+    for (i = 0; i < d->count; ++i) {
+        const GRRect *r = &d->rects[i];
+        if (r->x1 == 0 && r->x2 == (int) vi.xres) {
+            memcpy(fb + r->y1 * vi.xres, mem + r->y1 * vi.xres,
+                   (r->y2 - r->y1) * vi.xres * 2);
+            continue;
+        }
+        for (y = r->y1; y < r->y2; ++y) {
+            memcpy(fb + y * vi.xres + r->x1, mem + y * vi.xres + r->x1,
+                   (r->x2 - r->x1) * 2);
+        }
+    }
+    d->count = 0;
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
@@ -145,6 +227,83 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_current_color[0] = r;
+    gr_current_color[1] = g;
+    gr_current_color[2] = b;
+    gr_current_color[3] = a;
+}
+
+/* Fills and blits that are plain enough are drawn straight into the
+ * memory surface with the blend565 routines instead of pixelflinger's
+ * general scanline code; the results are the same, with REPLACE
+ * texturing and SRC_ALPHA / ONE_MINUS_SRC_ALPHA blending as set up by
+ * gr_init().  Each returns 0 if it drew, or -1 if the caller should
+ * fall back to pixelflinger.
+ */
+static int fast_fill(int x1, int y1, int x2, int y2)
+{
+    const unsigned char *c = gr_current_color;
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > (int) vi.xres) x2 = vi.xres;
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+
+    uint16_t *row = (uint16_t *) gr_mem_surface.data + y1 * vi.xres + x1;
+    uint16_t color = blend565_pack(c[0], c[1], c[2]);
+    for (; y1 < y2; ++y1, row += vi.xres) {
+        if (c[3] == 255) {
+            blend565_fill(row, x2 - x1, color);
+        } else {
+            blend565_fill_alpha(row, x2 - x1, c[0], c[1], c[2], c[3]);
+        }
+    }
+    return 0;
+}
+
+static int fast_blit(const GGLSurface *src, int sx, int sy, int w, int h,
+                     int dx, int dy)
+{
+    /* pixelflinger would wrap a source rectangle that isn't inside */
+    if (sx < 0 || sy < 0 || sx + w > (int) src->width ||
+            sy + h > (int) src->height) {
+        return -1;
+    }
+    int bpp;
+    switch (src->format) {
+        case GGL_PIXEL_FORMAT_RGB_565:   bpp = 2; break;
+        case GGL_PIXEL_FORMAT_RGBX_8888:
+        case GGL_PIXEL_FORMAT_RGBA_8888: bpp = 4; break;
+        case GGL_PIXEL_FORMAT_A_8:       bpp = 1; break;
+        default:                         return -1;
+    }
+
+    if (dx < 0) { sx -= dx; w += dx; dx = 0; }
+    if (dy < 0) { sy -= dy; h += dy; dy = 0; }
+    if (dx + w > (int) vi.xres) w = vi.xres - dx;
+    if (dy + h > (int) vi.yres) h = vi.yres - dy;
+
+    const unsigned char *c = gr_current_color;
+    const uint8_t *in = (const uint8_t *) src->data +
+            (sy * src->stride + sx) * bpp;
+    uint16_t *out = (uint16_t *) gr_mem_surface.data + dy * vi.xres + dx;
+    for (; h > 0; --h, in += src->stride * bpp, out += vi.xres) {
+        if (w <= 0) break;
+        switch (src->format) {
+            case GGL_PIXEL_FORMAT_RGB_565:
+                memcpy(out, in, w * 2);
+                break;
+            case GGL_PIXEL_FORMAT_RGBX_8888:
+                blend565_copy_rgbx(out, in, w);
+                break;
+            case GGL_PIXEL_FORMAT_RGBA_8888:
+                blend565_blend_rgba(out, in, w);
+                break;
+            case GGL_PIXEL_FORMAT_A_8:
+                blend565_mask(out, in, w, c[0], c[1], c[2]);
+                break;
+        }
+    }
+    return 0;
 }
 
 int gr_measure(const char *s)
@@ -157,6 +316,7 @@ int gr_text(int x, int y, const char *s)
     GGLContext *gl = gr_context;
     GRFont *font = gr_font;
     unsigned off;
+    int x0 = x;
 
     y -= font->ascent;
 
@@ -168,21 +328,91 @@ int gr_text(int x, int y, const char *s)
 
     while((off = *s++)) {
         off -= 32;
-        if (off < 96) {
+        if (off < 96 && fast_blit(&font->texture, off * font->cwidth, 0,
+                    font->cwidth, font->cheight, x, y) != 0) {
             gl->texCoord2i(gl, (off * font->cwidth) - x, 0 - y);
             gl->recti(gl, x, y, x + font->cwidth, y + font->cheight);
         }
         x += font->cwidth;
     }
+    gr_dirty(x0, y, x, y + font->cheight);
 
     return x;
 }
 
+gr_surface gr_render_text(const char *s, gr_surface reuse)
+{
+    GRFont *font = gr_font;
+    GGLSurface *ftex = &font->texture;
+    int len = strlen(s);
+    int width = len * font->cwidth;
+    GGLSurface *surface = (GGLSurface *) reuse;
+
+    if (surface == NULL || surface->stride < width) {
+        /* one allocation, so res_free_surface() frees it */
+        int stride = width > 0 ? width : 1;
+        surface = realloc(surface,
+                sizeof(GGLSurface) + stride * font->cheight);
+        if (surface == NULL) return NULL;   /* "reuse" is still good */
+        surface->version = sizeof(GGLSurface);
+        surface->height = font->cheight;
+        surface->stride = stride;
+        surface->format = GGL_PIXEL_FORMAT_A_8;
+    }
+    surface->data = (unsigned char *) (surface + 1);
+    surface->width = width;
+
+    /* copy each glyph's columns out of the font */
+    unsigned char *bits = (unsigned char *) surface->data;
+    const unsigned char *glyphs = (const unsigned char *) ftex->data;
+    unsigned row;
+    int i;
+    for (row = 0; row < font->cheight; ++row) {
+        unsigned char *out = bits + row * surface->stride;
+        for (i = 0; i < len; ++i, out += font->cwidth) {
+            unsigned off = (unsigned char) s[i] - 32;
+            if (off < 96) {
+                memcpy(out, glyphs + row * ftex->stride + off * font->cwidth,
+                       font->cwidth);
+            } else {
+                memset(out, 0, font->cwidth);
+            }
+        }
+    }
+    return surface;
+}
+
+int gr_text_blit(gr_surface text, int x, int y)
+{
+    int width = gr_get_width(text);
+    gr_blit(text, 0, 0, width, gr_get_height(text), x, y - gr_font->ascent);
+    return x + width;
+}
+
+gr_surface gr_copy_screen(gr_surface reuse)
+{
+    GGLSurface *surface = (GGLSurface *) reuse;
+    size_t size = vi.xres * vi.yres * 2;
+    if (surface == NULL) {
+        surface = malloc(sizeof(GGLSurface) + size);
+        if (surface == NULL) return NULL;
+        surface->version = sizeof(GGLSurface);
+        surface->width = vi.xres;
+        surface->height = vi.yres;
+        surface->stride = vi.xres;
+        surface->data = (unsigned char *) (surface + 1);
+        surface->format = GGL_PIXEL_FORMAT_RGB_565;
+    }
+    memcpy(surface->data, gr_mem_surface.data, size);
+    return surface;
+}
+
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
-    gl->recti(gl, x, y, w, h);
+    if (fast_fill(x, y, w, h) != 0) gl->recti(gl, x, y, w, h);
+    gr_dirty(x, y, w, h);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -196,8 +426,11 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, sx - dx, sy - dy);
-    gl->recti(gl, dx, dy, dx + w, dy + h);
+    if (fast_blit((GGLSurface*) source, sx, sy, w, h, dx, dy) != 0) {
+        gl->texCoord2i(gl, sx - dx, sy - dy);
+        gl->recti(gl, dx, dy, dx + w, dy + h);
+    }
+    gr_dirty(dx, dy, dx + w, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -268,6 +501,9 @@ int gr_init(void)
 
     get_memory_surface(&gr_mem_surface);
 
+    /* the first flip of each buffer copies the whole screen */
+    gr_dirty(0, 0, vi.xres, vi.yres);
+
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
@@ -26,6 +26,11 @@ void gr_exit(void);
 int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
+
+// gr_fill(), gr_text() and gr_blit() remember what they draw over, and
+// gr_flip() copies only that to the screen.  Anything drawn straight
+// into gr_fb_data() must be passed to gr_dirty() (x2, y2 exclusive).
+void gr_dirty(int x1, int y1, int x2, int y2);
 void gr_flip(void);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -37,6 +42,15 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
 
+// Text drawn again and again can be rendered once with gr_render_text()
+// (which reuses "reuse" if it's big enough, else reallocates it), then
+// drawn in the current color with gr_text_blit(), which puts it where
+// gr_text() would.  gr_copy_screen() keeps what's been drawn so far, to
+// gr_blit() back later.  Free either with res_free_surface().
+gr_surface gr_render_text(const char *s, gr_surface reuse);
+int gr_text_blit(gr_surface text, int x, int y);
+gr_surface gr_copy_screen(gr_surface reuse);
+
 // input event structure, include <linux/input.h> for the definition.
 // see http://www.mjmwired.net/kernel/Documentation/input/ for info.
 struct input_event;
@@ -68,10 +82,27 @@ int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, unsigned dont_wait);
 
+// Like ev_get(), but waits at most "timeout_ms" (forever if negative);
+// returns -1 if no event came in time.
+int ev_wait(struct input_event *ev, int timeout_ms);
+
 // Resources
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 
+// Images decoded at build time (by mkimages), used in place of the
+// PNG of the same name: res_create_surface() then just points a
+// surface at the pixels, which stay where they are.
+typedef struct {
+    const char* name;
+    int width;
+    int height;
+    int has_alpha;          // RGBA_8888 pixels if set, else RGB565
+    const void* pixels;
+} ResImage;
+
+void res_set_images(const ResImage* images, int count);
+
 #endif
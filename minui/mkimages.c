@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decode recovery's PNGs when it's built, into a C table of ResImages
+ * (see minui.h), so the device never runs libpng to show its first
+ * frame.  Opaque images become RGB565, exactly as minui would draw
+ * them; images with any transparency stay RGBA_8888.
+ *
+ *     mkimages <out.c> <image.png> ...
+ */
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char name[64];
+    unsigned width;
+    unsigned height;
+    int has_alpha;
+} Image;
+
+// Decode "path" into RGBA rows; returns the pixels, or NULL.
+static unsigned char *decode(const char *path, Image *image) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    unsigned char *pixels = NULL;
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+            NULL, NULL, NULL);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+    if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "%s: can't decode\n", path);
+        pixels = NULL;      // we're about to exit anyway
+        goto done;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+    image->width = png_get_image_width(png_ptr, info_ptr);
+    image->height = png_get_image_height(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    if (png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+        (color_type != PNG_COLOR_TYPE_RGB &&
+         color_type != PNG_COLOR_TYPE_RGBA)) {
+        // the same limits as res_create_surface()
+        fprintf(stderr, "%s: not 8-bit RGB or RGBA\n", path);
+        goto done;
+    }
+    if (color_type == PNG_COLOR_TYPE_RGB) {
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    }
+
+    size_t stride = image->width * 4;
+    pixels = malloc(stride * image->height);
+    if (pixels == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        goto done;
+    }
+    unsigned y;
+    for (y = 0; y < image->height; ++y) {
+        png_read_row(png_ptr, pixels + y * stride, NULL);
+    }
+
+    image->has_alpha = 0;
+    size_t i;
+    for (i = 3; i < stride * image->height; i += 4) {
+        if (pixels[i] != 0xff) {
+            image->has_alpha = 1;
+            break;
+        }
+    }
+
+done:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return pixels;
+}
+
+static void write_pixels(FILE *out, int index, const Image *image,
+                         const unsigned char *pixels) {
+    size_t count = (size_t) image->width * image->height;
+    size_t i;
+    if (image->has_alpha) {
+        fprintf(out, "static const unsigned char image%d[] "
+                "__attribute__((aligned(4))) = {", index);
+        for (i = 0; i < count * 4; ++i) {
+            fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n    ", pixels[i]);
+        }
+    } else {
+        fprintf(out, "static const unsigned short image%d[] = {", index);
+        for (i = 0; i < count; ++i) {
+            const unsigned char *p = pixels + i * 4;
+            unsigned rgb = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) |
+                    (p[2] >> 3);
+            fprintf(out, "%s0x%04x,", i % 8 ? " " : "\n    ", rgb);
+        }
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <out.c> <image.png> ...\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2;
+    Image *images = calloc(count > 0 ? count : 1, sizeof(Image));
+    FILE *out = fopen(argv[1], "w");
+    if (images == NULL || out == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by mkimages; do not edit. */\n\n"
+            "#include \"minui/minui.h\"\n\n");
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char *path = argv[i + 2];
+        const char *base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        size_t len = strlen(base);
+        if (len > 4 && strcmp(base + len - 4, ".png") == 0) len -= 4;
+        if (len >= sizeof(images[i].name)) {
+            fprintf(stderr, "%s: name too long\n", path);
+            return 1;
+        }
+        memcpy(images[i].name, base, len);
+
+        unsigned char *pixels = decode(path, &images[i]);
+        if (pixels == NULL) return 1;
+        write_pixels(out, i, &images[i], pixels);
+        free(pixels);
+    }
+
+    fprintf(out, "const ResImage recovery_images[] = {\n");
+    for (i = 0; i < count; ++i) {
+        fprintf(out, "    { \"%s\", %u, %u, %d, image%d },\n",
+                images[i].name, images[i].width, images[i].height,
+                images[i].has_alpha, i);
+    }
+    if (count == 0) fprintf(out, "    { 0 },\n");
+    fprintf(out, "};\n\nconst int recovery_image_count = %d;\n", count);
+
+    if (fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    free(images);
+    return 0;
+}
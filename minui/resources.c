@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -41,7 +42,38 @@ double pow(double x, double y) {
     return x;
 }
 
+static const ResImage* gImages = NULL;
+static int gImageCount = 0;
+
+void res_set_images(const ResImage* images, int count) {
+    gImages = images;
+    gImageCount = count;
+}
+
+static int find_image(const char* name, gr_surface* pSurface) {
+    int i;
+    for (i = 0; i < gImageCount; ++i) {
+        const ResImage* image = &gImages[i];
+        if (strcmp(image->name, name) != 0) continue;
+
+        GGLSurface* surface = malloc(sizeof(GGLSurface));
+        if (surface == NULL) return -8;
+        surface->version = sizeof(GGLSurface);
+        surface->width = image->width;
+        surface->height = image->height;
+        surface->stride = image->width;
+        surface->data = (void*) image->pixels;
+        surface->format = image->has_alpha ?
+                GGL_PIXEL_FORMAT_RGBA_8888 : GGL_PIXEL_FORMAT_RGB_565;
+        *pSurface = (gr_surface) surface;
+        return 0;
+    }
+    return -1;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
+    if (find_image(name, pSurface) == 0) return 0;
+
     char resPath[256];
     GGLSurface* surface = NULL;
     int result = 0;
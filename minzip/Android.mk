@@ -6,6 +6,7 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
+	Inflate.c \
 	Zip.c
 
 LOCAL_C_INCLUDES += \
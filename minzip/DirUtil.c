@@ -22,7 +22,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include "DirUtil.h"
 
@@ -165,13 +168,180 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+static int unlinkEntryAt(int dfd, const char *name, unsigned char type);
+
+/* Remove everything in the directory open on "dfd", which is closed.
+ * Everything is relative to directory fds, so no paths are built and
+ * the stack only holds a DIR per level.
+ */
+static int
+unlinkContentsAt(int dfd)
+{
+    DIR *dir = fdopendir(dfd);
+    if (dir == NULL) {
+        int save = errno;
+        close(dfd);
+        errno = save;
+        return -1;
+    }
+
+    struct dirent *de;
+    int fail = 0;
+    errno = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        if (unlinkEntryAt(dirfd(dir), de->d_name, de->d_type) < 0) {
+            fail = 1;
+            break;
+        }
+        errno = 0;
+    }
+    /* in case readdir or unlinkEntryAt failed */
+    if (fail || errno != 0) {
+        int save = errno;
+        closedir(dir);
+        errno = save;
+        return -1;
+    }
+    return closedir(dir);
+}
+
+/* rm -rf of "name" in the directory open on "dfd".  "type" is the
+ * d_type from readdir(), which saves a stat() when the filesystem
+ * fills it in.
+ */
+static int
+unlinkEntryAt(int dfd, const char *name, unsigned char type)
+{
+    if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return -1;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    }
+    if (type != DT_DIR) {
+        return unlinkat(dfd, name, 0);
+    }
+
+    int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0 || unlinkContentsAt(fd) < 0) {
+        return -1;
+    }
+    return unlinkat(dfd, name, AT_REMOVEDIR);
+}
+
+/* Call "fn" on every entry of "dir" (but "." and ".."), sharing them
+ * out among "numThreads" threads, and close "dir".  Each call handles
+ * a whole entry, and everything under it.  Returns 0, or -1 (setting
+ * errno) once any call fails, after which no more are made.
+ */
+#define CHILD_THREADS 4
+
+typedef int (*ChildFunction)(int dfd, const char *name, unsigned char type,
+        ino_t ino, const void *arg);
+
+typedef struct {
+    pthread_mutex_t lock;
+    DIR *dir;
+    ChildFunction fn;
+    const void *arg;
+    int err;                    // first failure, or 0
+} ChildPool;
+
+static void *
+childThread(void *cookie)
+{
+    ChildPool *pool = (ChildPool *) cookie;
+    for (;;) {
+        char name[NAME_MAX + 1];
+        unsigned char type;
+        ino_t ino;
+        struct dirent *de;
+
+        pthread_mutex_lock(&pool->lock);
+        do {
+            errno = 0;
+            de = pool->err == 0 ? readdir(pool->dir) : NULL;
+            if (de == NULL && errno != 0 && pool->err == 0) pool->err = errno;
+        } while (de != NULL &&
+                (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")));
+        if (de != NULL) {
+            strcpy(name, de->d_name);  // d_name is at most NAME_MAX
+            type = de->d_type;
+            ino = de->d_ino;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (de == NULL) break;
+
+        if (pool->fn(dirfd(pool->dir), name, type, ino, pool->arg) < 0) {
+            pthread_mutex_lock(&pool->lock);
+            if (pool->err == 0) pool->err = errno != 0 ? errno : EIO;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+static int
+forEachChild(DIR *dir, ChildFunction fn, const void *arg, int numThreads)
+{
+    ChildPool pool;
+    pool.dir = dir;
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.err = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (numThreads > 1) {
+        threads = (pthread_t *) malloc((numThreads - 1) * sizeof(pthread_t));
+    }
+    while (threads != NULL && started < numThreads - 1 &&
+            pthread_create(&threads[started], NULL, childThread, &pool) == 0) {
+        ++started;
+    }
+    childThread(&pool);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    free(threads);
+
+    pthread_mutex_destroy(&pool.lock);
+    if (closedir(pool.dir) < 0 && pool.err == 0) {
+        pool.err = errno;
+    }
+    if (pool.err != 0) {
+        errno = pool.err;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+unlinkChild(int dfd, const char *name, unsigned char type, ino_t ino,
+        const void *arg)
+{
+    return unlinkEntryAt(dfd, name, type);
+}
+
+int
+dirUnlinkChildren(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    return forEachChild(dir, unlinkChild, NULL, CHILD_THREADS);
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
     struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
 
     /* is it a file or directory? */
     if (lstat(path, &st) < 0) {
@@ -183,48 +353,268 @@ dirUnlinkHierarchy(const char *path)
         return unlink(path);
     }
 
-    /* a directory, so open handle */
-    dir = opendir(path);
+    /* a directory, so empty it and delete it */
+    if (dirUnlinkChildren(path) < 0) {
+        return -1;
+    }
+    return rmdir(path);
+}
+
+/* Remembered owners and modes, in a table open-addressed by inode
+ * number.  An inode of 0 marks an empty slot.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+} StatMemory;
+
+static pthread_mutex_t gStatLock = PTHREAD_MUTEX_INITIALIZER;
+static bool gStatsEnabled = false;
+static StatMemory *gStats = NULL;
+static size_t gStatsSize = 0;       // slots; a power of two, or 0
+static size_t gStatsCount = 0;
+
+static StatMemory *
+findStatSlot(dev_t dev, ino_t ino)
+{
+    size_t mask = gStatsSize - 1;
+    size_t slot = (size_t) ino & mask;
+    while (gStats[slot].ino != 0 &&
+            (gStats[slot].ino != ino || gStats[slot].dev != dev)) {
+        slot = (slot + 1) & mask;
+    }
+    return &gStats[slot];
+}
+
+void
+dirEnableStatMemory(void)
+{
+    gStatsEnabled = true;
+}
+
+static void
+rememberStat(const struct stat *st)
+{
+    if (!gStatsEnabled || st->st_ino == 0) {
+        return;
+    }
+    pthread_mutex_lock(&gStatLock);
+    if ((gStatsCount + 1) * 4 > gStatsSize * 3) {
+        /* Grow to keep it at most 3/4 full.  If that fails, the table
+         * is left as it is: nothing is forgotten, just not remembered.
+         */
+        size_t newSize = gStatsSize ? gStatsSize * 2 : 1024;
+        StatMemory *old = gStats;
+        size_t oldSize = gStatsSize, i;
+        gStats = (StatMemory *) calloc(newSize, sizeof(StatMemory));
+        if (gStats == NULL) {
+            gStats = old;
+            pthread_mutex_unlock(&gStatLock);
+            return;
+        }
+        gStatsSize = newSize;
+        for (i = 0; i < oldSize; ++i) {
+            if (old[i].ino != 0) {
+                *findStatSlot(old[i].dev, old[i].ino) = old[i];
+            }
+        }
+        free(old);
+    }
+    StatMemory *m = findStatSlot(st->st_dev, st->st_ino);
+    if (m->ino == 0) {
+        ++gStatsCount;
+    }
+    m->dev = st->st_dev;
+    m->ino = st->st_ino;
+    m->uid = st->st_uid;
+    m->gid = st->st_gid;
+    m->mode = st->st_mode;
+    pthread_mutex_unlock(&gStatLock);
+}
+
+void
+dirRememberFile(int fd)
+{
+    struct stat st;
+    if (gStatsEnabled && fstat(fd, &st) == 0) {
+        rememberStat(&st);
+    }
+}
+
+void
+dirForgetStats(void)
+{
+    pthread_mutex_lock(&gStatLock);
+    free(gStats);
+    gStats = NULL;
+    gStatsSize = 0;
+    gStatsCount = 0;
+    pthread_mutex_unlock(&gStatLock);
+}
+
+/* Fill in the owner and mode of inode "ino" on "dev" in "st", if they
+ * were remembered.  Returns true if they were.
+ */
+static bool
+recallStat(dev_t dev, ino_t ino, struct stat *st)
+{
+    bool found = false;
+    if (!gStatsEnabled || ino == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&gStatLock);
+    if (gStatsCount > 0) {
+        const StatMemory *m = findStatSlot(dev, ino);
+        if (m->ino != 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = dev;
+            st->st_ino = ino;
+            st->st_uid = m->uid;
+            st->st_gid = m->gid;
+            st->st_mode = m->mode;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&gStatLock);
+    return found;
+}
+
+typedef struct {
+    int uid, gid;
+    int dirMode, fileMode;
+} PermSpec;
+
+/* What setPermsEntryAt() is given for each child of a directory: the
+ * permissions to set, and the device the directory is on, to look up
+ * remembered inodes with.
+ */
+typedef struct {
+    const PermSpec *spec;
+    dev_t dev;
+} PermWalk;
+
+/* Give "name" in the directory open on "dfd" (described by "st") the
+ * owner and mode in "spec", unless it has them already: on flash every
+ * chown and chmod is a metadata write.
+ */
+static int
+setPermsAt(int dfd, const char *name, const struct stat *st,
+        const PermSpec *spec)
+{
+    int mode = S_ISDIR(st->st_mode) ? spec->dirMode : spec->fileMode;
+    int chowned = 0;
+    if (st->st_uid != (uid_t) spec->uid || st->st_gid != (gid_t) spec->gid) {
+        if (fchownat(dfd, name, spec->uid, spec->gid, AT_SYMLINK_NOFOLLOW)) {
+            return -1;
+        }
+        chowned = 1;            // which may have cleared setuid bits
+    }
+    if (!chowned && (st->st_mode & 07777) == (mode & 07777)) {
+        return 0;
+    }
+    if (fchmodat(dfd, name, mode, 0)) {
+        return -1;
+    }
+
+    /* Keep what a later walk would recall up to date.
+     */
+    if (!S_ISDIR(st->st_mode)) {
+        struct stat now = *st;
+        now.st_uid = spec->uid;
+        now.st_gid = spec->gid;
+        now.st_mode = (st->st_mode & ~07777) | (mode & 07777);
+        rememberStat(&now);
+    }
+    return 0;
+}
+
+static int setPermsEntryAt(int dfd, const char *name, unsigned char type,
+        ino_t ino, const void *arg);
+
+/* Set the permissions of everything in the directory open on "dfd"
+ * (which is on "walk->dev"), and close it.  Like unlinkContentsAt(), it
+ * works relative to directory fds, so no paths are built or looked up
+ * again.
+ */
+static int
+setPermsContentsAt(int dfd, const PermWalk *walk)
+{
+    DIR *dir = fdopendir(dfd);
     if (dir == NULL) {
+        int save = errno;
+        close(dfd);
+        errno = save;
         return -1;
     }
 
-    /* recurse over components */
+    struct dirent *de;
+    int fail = 0;
     errno = 0;
     while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
         if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
+        if (setPermsEntryAt(dirfd(dir), de->d_name, de->d_type, de->d_ino,
+                walk) < 0) {
             fail = 1;
             break;
         }
         errno = 0;
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
+    if (fail || errno != 0) {
         int save = errno;
         closedir(dir);
         errno = save;
         return -1;
     }
+    return closedir(dir);
+}
+
+static int
+setPermsEntryAt(int dfd, const char *name, unsigned char type, ino_t ino,
+        const void *arg)
+{
+    const PermWalk *walk = (const PermWalk *) arg;
+    struct stat st;
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    /* ignore symlinks */
+    if (type == DT_LNK) {
+        return 0;
+    }
+    /* Only files are remembered; a directory is always looked at, and
+     * tells its children which device they're on.
+     */
+    if (type == DT_DIR || !recallStat(walk->dev, ino, &st)) {
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return -1;
+        }
+    }
+    if (S_ISLNK(st.st_mode)) {
+        return 0;
+    }
+    if (setPermsAt(dfd, name, &st, walk->spec) < 0) {
         return -1;
     }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
+    }
 
-    /* delete target directory */
-    return rmdir(path);
+    int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        return -1;
+    }
+    PermWalk inner = { walk->spec, st.st_dev };
+    return setPermsContentsAt(fd, &inner);
 }
 
 int
 dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+        int uid, int gid, int dirMode, int fileMode, int numThreads)
 {
+    PermSpec spec = { uid, gid, dirMode, fileMode };
     struct stat st;
     if (lstat(path, &st)) {
         return -1;
@@ -234,47 +624,18 @@ dirSetHierarchyPermissions(const char *path,
     if (S_ISLNK(st.st_mode)) {
         return 0;
     }
-
-    /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (setPermsAt(AT_FDCWD, path, &st, &spec) < 0) {
         return -1;
     }
-
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
-        }
-
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
-            }
-
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
-        }
-
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
-        }
-
-        if (closedir(dir)) {
-            return -1;
-        }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
     }
 
-    return 0;
+    /* the top's subtrees may be done on several threads at once */
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    PermWalk walk = { &spec, st.st_dev };
+    return forEachChild(dir, setPermsEntryAt, &walk, numThreads);
 }
@@ -40,12 +40,36 @@ int dirCreateHierarchy(const char *path, int mode,
  */
 int dirUnlinkHierarchy(const char *path);
 
+/* Empty <path> (like rm -rf of everything in it), leaving <path> itself.
+ * The entries are removed on a few threads at once.  Returns 0 on
+ * success; returns -1 (and sets errno) if anything couldn't be removed.
+ */
+int dirUnlinkChildren(const char *path);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
- * Sets directories to <dirMode> and files to <fileMode>.  Skips symlinks.
+ * Sets directories to <dirMode> and files to <fileMode>.  Skips symlinks,
+ * and leaves alone anything that already has the right owner and mode.
+ * The subtrees of <path> are shared out among <numThreads> threads; with
+ * one (or fewer), everything is done on the calling thread.  Files whose
+ * owner and mode were remembered with dirRememberFile() aren't stat()ed
+ * again.
  */
 int dirSetHierarchyPermissions(const char *path,
-         int uid, int gid, int dirMode, int fileMode);
+         int uid, int gid, int dirMode, int fileMode, int numThreads);
+
+/* The owner and mode of files just written (by mzExtractRecursive()),
+ * remembered by inode so that dirSetHierarchyPermissions() can skip
+ * stat()ing them.  dirRememberFile() takes the regular file open on
+ * "fd"; it does nothing until dirEnableStatMemory() has been called.
+ * Anything that changes files behind the remembered ones' back
+ * (deleting them, chmod()ing them by path, running a program) must call
+ * dirForgetStats() first, much like invalidate_mounted_volumes().
+ * All of these may be called from any thread.
+ */
+void dirEnableStatMemory(void);
+void dirRememberFile(int fd);
+void dirForgetStats(void);
 
 #endif  // MINZIP_DIRUTIL_H_
@@ -2,8 +2,11 @@
  * Copyright 2006 The Android Open Source Project
  *
  * Hash table.  The dominant calls are add and lookup, with removals
- * happening very infrequently.  We use probing, and don't worry much
- * about tombstone removal.
+ * happening very infrequently.  We use Robin Hood probing: an entry being
+ * added takes the slot of any entry closer to its own ideal slot than the
+ * new one is, and that entry moves along instead.  Probe lengths stay
+ * short and even, a failed lookup can stop early, and a removal just
+ * shifts the following entries back, so there are no tombstones.
  */
 #include <stdlib.h>
 #include <assert.h>
@@ -59,10 +62,10 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
         return NULL;
 
     pHashTable->tableSize = roundUpPower2(initialSize);
-    pHashTable->numEntries = pHashTable->numDeadEntries = 0;
+    pHashTable->numEntries = 0;
     pHashTable->freeFunc = freeFunc;
     pHashTable->pEntries =
-        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashTable));
+        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashEntry));
     if (pHashTable->pEntries == NULL) {
         free(pHashTable);
         return NULL;
@@ -81,10 +84,7 @@ void mzHashTableClear(HashTable* pHashTable)
 
     pEnt = pHashTable->pEntries;
     for (i = 0; i < pHashTable->tableSize; i++, pEnt++) {
-        if (pEnt->data == HASH_TOMBSTONE) {
-            // nuke entry
-            pEnt->data = NULL;
-        } else if (pEnt->data != NULL) {
+        if (pEnt->data != NULL) {
             // call free func then nuke entry
             if (pHashTable->freeFunc != NULL)
                 (*pHashTable->freeFunc)(pEnt->data);
@@ -93,7 +93,6 @@ void mzHashTableClear(HashTable* pHashTable)
     }
 
     pHashTable->numEntries = 0;
-    pHashTable->numDeadEntries = 0;
 }
 
 /*
@@ -108,21 +107,46 @@ void mzHashTableFree(HashTable* pHashTable)
     free(pHashTable);
 }
 
-#ifndef NDEBUG
 /*
- * Count up the number of tombstone entries in the hash table.
+ * How far slot "idx" is from where an entry with "hashValue" would
+ * ideally go.
  */
-static int countTombStones(HashTable* pHashTable)
+static inline int probeDistance(const HashTable* pHashTable,
+    unsigned int hashValue, int idx)
 {
-    int i, count;
+    return (idx - hashValue) & (pHashTable->tableSize-1);
+}
 
-    for (count = i = 0; i < pHashTable->tableSize; i++) {
-        if (pHashTable->pEntries[i].data == HASH_TOMBSTONE)
-            count++;
+/*
+ * Put an entry that isn't in the table yet into it, displacing entries
+ * that are closer to home.  Returns the slot "data" ended up in.
+ */
+static HashEntry* insertEntry(HashTable* pHashTable, unsigned int hashValue,
+    void* data, int idx, int dist)
+{
+    HashEntry* pResult = NULL;
+    int mask = pHashTable->tableSize-1;
+
+    while (pHashTable->pEntries[idx].data != NULL) {
+        HashEntry* pEntry = &pHashTable->pEntries[idx];
+        int entryDist = probeDistance(pHashTable, pEntry->hashValue, idx);
+        if (entryDist < dist) {
+            HashEntry displaced = *pEntry;
+            pEntry->hashValue = hashValue;
+            pEntry->data = data;
+            if (pResult == NULL)
+                pResult = pEntry;
+            hashValue = displaced.hashValue;
+            data = displaced.data;
+            dist = entryDist;
+        }
+        idx = (idx + 1) & mask;
+        dist++;
     }
-    return count;
+    pHashTable->pEntries[idx].hashValue = hashValue;
+    pHashTable->pEntries[idx].data = data;
+    return pResult != NULL ? pResult : &pHashTable->pEntries[idx];
 }
-#endif
 
 /*
  * Resize a hash table.  We do this when adding an entry increased the
@@ -136,115 +160,101 @@ static int countTombStones(HashTable* pHashTable)
  */
 static bool resizeHash(HashTable* pHashTable, int newSize)
 {
-    HashEntry* pNewEntries;
+    HashEntry* pOldEntries = pHashTable->pEntries;
+    int oldSize = pHashTable->tableSize;
     int i;
 
-    assert(countTombStones(pHashTable) == pHashTable->numDeadEntries);
-    //LOGI("before: dead=%d\n", pHashTable->numDeadEntries);
-
-    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashTable));
-    if (pNewEntries == NULL)
+    pHashTable->pEntries = (HashEntry*) calloc(newSize, sizeof(HashEntry));
+    if (pHashTable->pEntries == NULL) {
+        pHashTable->pEntries = pOldEntries;
         return false;
+    }
+    pHashTable->tableSize = newSize;
 
-    for (i = 0; i < pHashTable->tableSize; i++) {
-        void* data = pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE) {
-            int hashValue = pHashTable->pEntries[i].hashValue;
-            int newIdx;
-
-            /* probe for new spot, wrapping around */
-            newIdx = hashValue & (newSize-1);
-            while (pNewEntries[newIdx].data != NULL)
-                newIdx = (newIdx + 1) & (newSize-1);
-
-            pNewEntries[newIdx].hashValue = hashValue;
-            pNewEntries[newIdx].data = data;
+    for (i = 0; i < oldSize; i++) {
+        if (pOldEntries[i].data != NULL) {
+            unsigned int hashValue = pOldEntries[i].hashValue;
+            insertEntry(pHashTable, hashValue, pOldEntries[i].data,
+                hashValue & (newSize-1), 0);
         }
     }
 
-    free(pHashTable->pEntries);
-    pHashTable->pEntries = pNewEntries;
-    pHashTable->tableSize = newSize;
-    pHashTable->numDeadEntries = 0;
-
-    assert(countTombStones(pHashTable) == 0);
+    free(pOldEntries);
     return true;
 }
 
+/*
+ * Find the slot holding "item", or NULL.  If "pIdx" isn't NULL, it's set
+ * to the slot the search stopped at and "pDist" to the probe distance
+ * there, which is where "item" would be inserted.
+ */
+static HashEntry* findEntry(HashTable* pHashTable, unsigned int itemHash,
+    const void* item, HashCompareFunc cmpFunc, int* pIdx, int* pDist)
+{
+    int mask = pHashTable->tableSize-1;
+    int idx = itemHash & mask;
+    int dist;
+
+    for (dist = 0; ; dist++) {
+        HashEntry* pEntry = &pHashTable->pEntries[idx];
+        if (pEntry->data == NULL ||
+            probeDistance(pHashTable, pEntry->hashValue, idx) < dist)
+        {
+            break;
+        }
+        if (pEntry->hashValue == itemHash &&
+            (*cmpFunc)(pEntry->data, item) == 0)
+        {
+            /* match */
+            return pEntry;
+        }
+        idx = (idx + 1) & mask;
+    }
+
+    if (pIdx != NULL) {
+        *pIdx = idx;
+        *pDist = dist;
+    }
+    return NULL;
+}
+
 /*
  * Look up an entry.
- *
- * We probe on collisions, wrapping around the table.
  */
 void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item,
     HashCompareFunc cmpFunc, bool doAdd)
 {
     HashEntry* pEntry;
-    HashEntry* pEnd;
-    void* result = NULL;
+    int idx, dist;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            //LOGD("+++ match on entry %d\n", pEntry - pHashTable->pEntries);
-            break;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
+    pEntry = findEntry(pHashTable, itemHash, item, cmpFunc, &idx, &dist);
+    if (pEntry != NULL)
+        return pEntry->data;
+    if (!doAdd)
+        return NULL;
 
-        //LOGI("+++ look probing %d...\n", pEntry - pHashTable->pEntries);
-    }
+    insertEntry(pHashTable, itemHash, item, idx, dist);
+    pHashTable->numEntries++;
 
-    if (pEntry->data == NULL) {
-        if (doAdd) {
-            pEntry->hashValue = itemHash;
-            pEntry->data = item;
-            pHashTable->numEntries++;
-
-            /*
-             * We've added an entry.  See if this brings us too close to full.
-             */
-            if ((pHashTable->numEntries+pHashTable->numDeadEntries) * LOAD_DENOM
-                > pHashTable->tableSize * LOAD_NUMER)
-            {
-                if (!resizeHash(pHashTable, pHashTable->tableSize * 2)) {
-                    /* don't really have a way to indicate failure */
-                    LOGE("Dalvik hash resize failure\n");
-                    abort();
-                }
-                /* note "pEntry" is now invalid */
-            } else {
-                //LOGW("okay %d/%d/%d\n",
-                //    pHashTable->numEntries, pHashTable->tableSize,
-                //    (pHashTable->tableSize * LOAD_NUMER) / LOAD_DENOM);
-            }
-
-            /* full table is bad -- search for nonexistent never halts */
-            assert(pHashTable->numEntries < pHashTable->tableSize);
-            result = item;
-        } else {
-            assert(result == NULL);
+    /*
+     * We've added an entry.  See if this brings us too close to full.
+     */
+    if (pHashTable->numEntries * LOAD_DENOM
+        > pHashTable->tableSize * LOAD_NUMER)
+    {
+        if (!resizeHash(pHashTable, pHashTable->tableSize * 2)) {
+            /* don't really have a way to indicate failure */
+            LOGE("Dalvik hash resize failure\n");
+            abort();
         }
-    } else {
-        result = pEntry->data;
     }
 
-    return result;
+    /* full table is bad -- search for nonexistent never halts */
+    assert(pHashTable->numEntries < pHashTable->tableSize);
+    return item;
 }
 
 /*
@@ -254,34 +264,41 @@ void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item
  */
 bool mzHashTableRemove(HashTable* pHashTable, unsigned int itemHash, void* item)
 {
-    HashEntry* pEntry;
-    HashEntry* pEnd;
+    int mask = pHashTable->tableSize-1;
+    int idx = itemHash & mask;
+    int dist;
 
     assert(pHashTable->tableSize > 0);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data == item) {
-            //LOGI("+++ stepping on entry %d\n", pEntry - pHashTable->pEntries);
-            pEntry->data = HASH_TOMBSTONE;
-            pHashTable->numEntries--;
-            pHashTable->numDeadEntries++;
-            return true;
+    for (dist = 0; ; dist++) {
+        HashEntry* pEntry = &pHashTable->pEntries[idx];
+        if (pEntry->data == NULL ||
+            probeDistance(pHashTable, pEntry->hashValue, idx) < dist)
+        {
+            return false;
         }
+        if (pEntry->data == item)
+            break;
+        idx = (idx + 1) & mask;
+    }
 
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
+    /* Shift the entries after it back one, until one that is already
+     * in its ideal slot (or an empty one).
+     */
+    for (;;) {
+        int next = (idx + 1) & mask;
+        HashEntry* pNext = &pHashTable->pEntries[next];
+        if (pNext->data == NULL ||
+            probeDistance(pHashTable, pNext->hashValue, next) == 0)
+        {
+            break;
         }
-
-        //LOGI("+++ del probing %d...\n", pEntry - pHashTable->pEntries);
+        pHashTable->pEntries[idx] = *pNext;
+        idx = next;
     }
-
-    return false;
+    pHashTable->pEntries[idx].data = NULL;
+    pHashTable->numEntries--;
+    return true;
 }
 
 /*
@@ -296,7 +313,7 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
     for (i = 0; i < pHashTable->tableSize; i++) {
         HashEntry* pEnt = &pHashTable->pEntries[i];
 
-        if (pEnt->data != NULL && pEnt->data != HASH_TOMBSTONE) {
+        if (pEnt->data != NULL) {
             val = (*func)(pEnt->data, arg);
             if (val != 0)
                 return val;
@@ -316,53 +333,36 @@ int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
     HashCompareFunc cmpFunc)
 {
     HashEntry* pEntry;
-    HashEntry* pEnd;
-    int count = 0;
 
     assert(pHashTable->tableSize > 0);
-    assert(item != HASH_TOMBSTONE);
     assert(item != NULL);
 
-    /* jump to the first entry and probe for a match */
-    pEntry = &pHashTable->pEntries[itemHash & (pHashTable->tableSize-1)];
-    pEnd = &pHashTable->pEntries[pHashTable->tableSize];
-    while (pEntry->data != NULL) {
-        if (pEntry->data != HASH_TOMBSTONE &&
-            pEntry->hashValue == itemHash &&
-            (*cmpFunc)(pEntry->data, item) == 0)
-        {
-            /* match */
-            break;
-        }
-
-        pEntry++;
-        if (pEntry == pEnd) {     /* wrap around to start */
-            if (pHashTable->tableSize == 1)
-                break;      /* edge case - single-entry table */
-            pEntry = pHashTable->pEntries;
-        }
-
-        count++;
-    }
-    if (pEntry->data == NULL)
+    pEntry = findEntry(pHashTable, itemHash, item, cmpFunc, NULL, NULL);
+    if (pEntry == NULL)
         return -1;
 
-    return count;
+    return probeDistance(pHashTable, itemHash, pEntry - pHashTable->pEntries);
 }
 
 /*
  * Evaluate the amount of probing required for the specified hash table.
  *
  * We do this by running through all entries in the hash table, computing
- * the hash value and then doing a lookup.
+ * the hash value and then doing a lookup.  Besides the average, the
+ * distribution matters: "0:" counts entries found in their ideal slot,
+ * "1:" one slot along, and so on.  "miss" is the average number of slots
+ * a lookup of something not in the table looks at.
  *
  * The caller should lock the table before calling here.
  */
 void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     HashCompareFunc cmpFunc)
 {
-    int numEntries, minProbe, maxProbe, totalProbe;
+    int numEntries, minProbe, maxProbe, totalProbe, totalMiss;
+    int hist[5] = { 0, 0, 0, 0, 0 };    /* 0, 1, 2, 3, 4+ */
+    int mask = pHashTable->tableSize-1;
     HashIter iter;
+    int i;
 
     numEntries = maxProbe = totalProbe = 0;
     minProbe = 65536*32767;
@@ -372,7 +372,7 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     {
         const void* data = (const void*)mzHashIterData(&iter);
         int count;
-            
+
         count = countProbes(pHashTable, (*calcFunc)(data), data, cmpFunc);
 
         numEntries++;
@@ -382,9 +382,29 @@ void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
         if (count > maxProbe)
             maxProbe = count;
         totalProbe += count;
+        hist[count < 4 ? count : 4]++;
+    }
+
+    /* A miss that starts at slot i stops at the first slot that is empty
+     * or holds an entry closer to home than the miss would be.
+     */
+    totalMiss = 0;
+    for (i = 0; i < pHashTable->tableSize; i++) {
+        int idx = i, dist = 0;
+        while (pHashTable->pEntries[idx].data != NULL &&
+            probeDistance(pHashTable, pHashTable->pEntries[idx].hashValue,
+                idx) >= dist)
+        {
+            idx = (idx + 1) & mask;
+            dist++;
+        }
+        totalMiss += dist + 1;
     }
 
-    LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f\n",
+    LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f, "
+        "miss=%.3f; 0:%d 1:%d 2:%d 3:%d 4+:%d\n",
         minProbe, maxProbe, totalProbe, numEntries, pHashTable->tableSize,
-        (float) totalProbe / (float) numEntries);
+        (float) totalProbe / (float) numEntries,
+        (float) totalMiss / (float) pHashTable->tableSize,
+        hist[0], hist[1], hist[2], hist[3], hist[4]);
 }
@@ -39,10 +39,9 @@ typedef int (*HashForeachFunc)(void* data, void* arg);
 /*
  * One entry in the hash table.  "data" values are expected to be (or have
  * the same characteristics as) valid pointers.  In particular, a NULL
- * value for "data" indicates an empty slot, and HASH_TOMBSTONE indicates
- * a no-longer-used slot that must be stepped over during probing.
+ * value for "data" indicates an empty slot.
  *
- * Attempting to add a NULL or tombstone value is an error.
+ * Attempting to add a NULL value is an error.
  *
  * When an entry is released, we will call (HashFreeFunc)(entry->data).
  */
@@ -51,8 +50,6 @@ typedef struct HashEntry {
     void* data;
 } HashEntry;
 
-#define HASH_TOMBSTONE ((void*) 0xcbcacccd)     // invalid ptr value
-
 /*
  * Expandable hash table.
  *
@@ -60,8 +57,7 @@ typedef struct HashEntry {
  */
 typedef struct HashTable {
     int         tableSize;          /* must be power of 2 */
-    int         numEntries;         /* current #of "live" entries */
-    int         numDeadEntries;     /* current #of tombstone entries */
+    int         numEntries;         /* current #of entries */
     HashEntry*  pEntries;           /* array on heap */
     HashFreeFunc freeFunc;
 } HashTable;
@@ -122,7 +118,9 @@ void* mzHashTableLookup(HashTable* pHashTable, unsigned int itemHash, void* item
 
 /*
  * Remove an item from the hash table, given its "data" pointer.  Does not
- * invoke the "free" function; just detaches it from the table.
+ * invoke the "free" function; just detaches it from the table.  Entries
+ * after it may move, so don't remove anything during mzHashForeach() or
+ * an iteration.
  */
 bool mzHashTableRemove(HashTable* pHashTable, unsigned int hash, void* item);
 
@@ -154,7 +152,7 @@ INLINE void mzHashIterNext(HashIter* pIter) {
     int lim = pIter->pHashTable->tableSize;
     for ( ; i < lim; i++) {
         void* data = pIter->pHashTable->pEntries[i].data;
-        if (data != NULL && data != HASH_TOMBSTONE)
+        if (data != NULL)
             break;
     }
     pIter->idx = i;
@@ -175,7 +173,7 @@ INLINE void* mzHashIterData(HashIter* pIter) {
 
 /*
  * Evaluate hash table performance by examining the number of times we
- * have to probe for an entry.
+ * have to probe for an entry, and for something that isn't there.
  *
  * The caller should lock the table beforehand.
  */
@@ -0,0 +1,576 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Whole-buffer inflate.  When the entire compressed stream and the
+ * entire destination are in memory, most of what makes a general
+ * inflater slow goes away: there's no sliding window to copy into, since
+ * back-references point straight into the output, and no need to stop
+ * and resume when either buffer runs dry.  Bits are taken from a 64-bit
+ * buffer that is topped up a word at a time, so one refill covers a
+ * whole length/distance pair, and Huffman codes are decoded with one
+ * table lookup for all but the rarest (longest) codes.
+ */
+#include "zlib.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Inflate.h"
+
+static int gInflateBackend = MZ_INFLATE_FAST;
+
+int mzSetInflateBackend(int backend)
+{
+    switch (backend) {
+    case MZ_INFLATE_AUTO:
+        gInflateBackend = MZ_INFLATE_FAST;
+        return 0;
+    case MZ_INFLATE_ZLIB:
+    case MZ_INFLATE_FAST:
+        gInflateBackend = backend;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int mzGetInflateBackend(void)
+{
+    return gInflateBackend;
+}
+
+/*
+ * zlib, given everything in one call.
+ */
+static bool inflateZlib(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    z_stream zstream;
+    int zerr;
+    bool ret;
+
+    memset(&zstream, 0, sizeof(zstream));
+    /* No zlib header; see processDeflatedEntry(). */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    zstream.next_in = (Bytef*) in;
+    zstream.avail_in = inLen;
+    zstream.next_out = (Bytef*) out;
+    zstream.avail_out = outLen;
+    zerr = inflate(&zstream, Z_FINISH);
+    ret = zerr == Z_STREAM_END && zstream.total_out == outLen;
+    if (!ret) {
+        LOGD("zlib inflate call failed (zerr=%d, %lu of %zu bytes)\n",
+                zerr, zstream.total_out, outLen);
+    }
+    inflateEnd(&zstream);
+    return ret;
+}
+
+/*
+ * Codes up to this long are decoded with a single lookup in "fast";
+ * longer ones fall back to a search by length.
+ */
+#define FAST_BITS 10
+#define FAST_MASK ((1 << FAST_BITS) - 1)
+
+#define MAX_CODES 288
+
+/*
+ * A canonical Huffman code.  fast[] is indexed by the next FAST_BITS
+ * bits of input and holds (code length << 9) | symbol, or 0 if the code
+ * there is longer than FAST_BITS.  The rest describes the code a length
+ * at a time: codes of length n run from firstCode[n] up to (but not
+ * including) maxCode[n] >> (16 - n), and stand for the symbols
+ * value[firstSymbol[n]...] in order.
+ */
+typedef struct {
+    uint16_t fast[1 << FAST_BITS];
+    uint16_t firstCode[16];
+    uint32_t maxCode[17];
+    uint16_t firstSymbol[16];
+    uint8_t size[MAX_CODES];
+    uint16_t value[MAX_CODES];
+} Huffman;
+
+static unsigned int reverseBits(unsigned int v, int n)
+{
+    v = ((v & 0xaaaa) >> 1) | ((v & 0x5555) << 1);
+    v = ((v & 0xcccc) >> 2) | ((v & 0x3333) << 2);
+    v = ((v & 0xf0f0) >> 4) | ((v & 0x0f0f) << 4);
+    v = ((v & 0xff00) >> 8) | ((v & 0x00ff) << 8);
+    return v >> (16 - n);
+}
+
+/*
+ * Build the code for "num" symbols with the given code lengths (0 for
+ * symbols that aren't used).  Fails if the lengths are over-subscribed
+ * or, as in zlib, incomplete: a stream with holes in its code is corrupt,
+ * and nothing checks the CRC of what comes out of mzInflateBuffer().
+ * The exceptions are also zlib's: no codes at all, and when "lone" is
+ * set, a single code of length 1 (a block with only one distance).
+ */
+static bool buildHuffman(Huffman *h, const uint8_t *lengths, int num,
+        bool lone)
+{
+    int counts[16];
+    int next[16];
+    int code = 0;
+    int symbol = 0;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    memset(h->fast, 0, sizeof(h->fast));
+    memset(h->size, 0, sizeof(h->size));
+    for (i = 0; i < num; i++) {
+        counts[lengths[i]]++;
+    }
+    counts[0] = 0;
+    for (i = 1; i < 16; i++) {
+        next[i] = code;
+        h->firstCode[i] = code;
+        h->firstSymbol[i] = symbol;
+        code += counts[i];
+        if (counts[i] != 0 && code > (1 << i)) {
+            return false;
+        }
+        h->maxCode[i] = code << (16 - i);
+        code <<= 1;
+        symbol += counts[i];
+    }
+    h->maxCode[16] = 0x10000;
+    if (code != (1 << 16) && symbol != 0 &&
+            !(lone && symbol == 1 && counts[1] == 1)) {
+        return false;
+    }
+
+    for (i = 0; i < num; i++) {
+        int len = lengths[i];
+        int slot;
+
+        if (len == 0) {
+            continue;
+        }
+        slot = next[len] - h->firstCode[len] + h->firstSymbol[len];
+        h->size[slot] = len;
+        h->value[slot] = i;
+        if (len <= FAST_BITS) {
+            int j;
+            for (j = reverseBits(next[len], len); j < (1 << FAST_BITS);
+                    j += 1 << len) {
+                h->fast[j] = (len << 9) | i;
+            }
+        }
+        next[len]++;
+    }
+    return true;
+}
+
+/*
+ * Where we are in the input and output.  "bits" holds "count" bits of
+ * input not yet used, lowest first; the bits above them are the bytes
+ * that follow, or zero.  Past the end of the input "overrun" zero bytes
+ * are made up, so decoding never has to check for the end; whether any
+ * of them were really used is checked once at the end.
+ */
+typedef struct {
+    const unsigned char *in;
+    const unsigned char *inEnd;
+    uint64_t bits;
+    unsigned int count;
+    unsigned int overrun;
+    unsigned char *out;
+    unsigned char *outStart;
+    unsigned char *outEnd;
+} InflateState;
+
+static inline uint64_t load64(const unsigned char *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+#else
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+            (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 |
+            (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48 |
+            (uint64_t) p[7] << 56;
+#endif
+}
+
+/*
+ * Top "bits" up to at least 56 bits.  Away from the end of the input
+ * this is one unaligned load: the bytes above "count" are ORed in again
+ * unchanged, and the pointer only moves past the whole bytes that fit.
+ */
+static inline void refill(InflateState *s)
+{
+    if (s->inEnd - s->in >= 8) {
+        s->bits |= load64(s->in) << s->count;
+        s->in += (63 - s->count) >> 3;
+        s->count |= 56;
+    } else {
+        while (s->count < 56) {
+            if (s->in < s->inEnd) {
+                s->bits |= (uint64_t) *s->in++ << s->count;
+            } else {
+                s->overrun++;
+            }
+            s->count += 8;
+        }
+    }
+}
+
+static inline unsigned int getBits(InflateState *s, int n)
+{
+    unsigned int v = s->bits & ((1u << n) - 1);
+    s->bits >>= n;
+    s->count -= n;
+    return v;
+}
+
+static int decodeSlow(const Huffman *h, uint64_t bits, unsigned int *pLen)
+{
+    unsigned int k = reverseBits(bits & 0xffff, 16);
+    unsigned int slot;
+    int len;
+
+    for (len = FAST_BITS + 1; k >= h->maxCode[len]; len++)
+        ;
+    if (len >= 16) {
+        return -1;
+    }
+    slot = (k >> (16 - len)) - h->firstCode[len] + h->firstSymbol[len];
+    if (slot >= MAX_CODES || h->size[slot] != len) {
+        return -1;
+    }
+    *pLen = len;
+    return h->value[slot];
+}
+
+/*
+ * Decode one symbol; needs 15 bits in the buffer.  Returns -1 for a code
+ * that isn't in h.
+ */
+static inline int decodeSymbol(InflateState *s, const Huffman *h)
+{
+    unsigned int entry = h->fast[s->bits & FAST_MASK];
+    unsigned int len;
+    int symbol;
+
+    if (entry != 0) {
+        len = entry >> 9;
+        symbol = entry & 511;
+    } else {
+        symbol = decodeSlow(h, s->bits, &len);
+        if (symbol < 0) {
+            return -1;
+        }
+    }
+    s->bits >>= len;
+    s->count -= len;
+    return symbol;
+}
+
+static const uint16_t kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t kDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const uint8_t kDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/*
+ * Copy a match of len bytes from dist bytes back.  When the source is at
+ * least a word behind and there's room past the end, copy whole words
+ * and let the last one run over; the bytes past the match haven't been
+ * produced yet, so nothing is lost.
+ */
+static inline void copyMatch(unsigned char *out, size_t dist,
+        unsigned int len, const unsigned char *outEnd)
+{
+    const unsigned char *src = out - dist;
+
+    if (dist >= 8 && (size_t)(outEnd - out) >= len + 8) {
+        unsigned char *end = out + len;
+        do {
+            memcpy(out, src, 8);
+            out += 8;
+            src += 8;
+        } while (out < end);
+    } else if (dist == 1) {
+        memset(out, *src, len);
+    } else {
+        while (len-- > 0) {
+            *out++ = *src++;
+        }
+    }
+}
+
+/*
+ * Decode one block of Huffman-coded data.  A refill leaves at least 56
+ * bits, enough for a length code and its extra bits (20) plus a distance
+ * code and its extra bits (28), so each symbol costs one refill; after a
+ * literal there are always bits for another code, which is taken at once
+ * if it's a literal too.
+ */
+static bool inflateCodes(InflateState *ps, const Huffman *litLen,
+        const Huffman *dist)
+{
+    InflateState s = *ps;
+    bool ret = false;
+
+    for (;;) {
+        unsigned int len;
+        size_t distance;
+        int symbol;
+
+        refill(&s);
+        symbol = decodeSymbol(&s, litLen);
+        if (symbol < 256) {
+            unsigned int entry;
+
+            if (symbol < 0 || s.out == s.outEnd) {
+                break;
+            }
+            *s.out++ = symbol;
+            entry = litLen->fast[s.bits & FAST_MASK];
+            if (entry != 0 && (entry & 511) < 256 && s.out != s.outEnd) {
+                s.bits >>= entry >> 9;
+                s.count -= entry >> 9;
+                *s.out++ = entry & 511;
+            }
+            continue;
+        }
+        if (symbol == 256) {
+            ret = true;
+            break;
+        }
+        symbol -= 257;
+        if (symbol >= 29) {
+            break;
+        }
+        len = kLengthBase[symbol] + getBits(&s, kLengthExtra[symbol]);
+        symbol = decodeSymbol(&s, dist);
+        if (symbol < 0 || symbol >= 30) {
+            break;
+        }
+        distance = kDistBase[symbol] + getBits(&s, kDistExtra[symbol]);
+        if (distance > (size_t)(s.out - s.outStart) ||
+            len > (size_t)(s.outEnd - s.out))
+        {
+            break;
+        }
+        copyMatch(s.out, distance, len, s.outEnd);
+        s.out += len;
+    }
+    *ps = s;
+    return ret;
+}
+
+static bool inflateStored(InflateState *s)
+{
+    unsigned int buffered;
+    unsigned int len;
+
+    /* Drop to a byte boundary and hand back the whole bytes still
+     * buffered; the data are then copied straight from the input.
+     */
+    getBits(s, s->count & 7);
+    buffered = s->count >> 3;
+    if (buffered < s->overrun) {
+        return false;
+    }
+    s->in -= buffered - s->overrun;
+    s->bits = 0;
+    s->count = 0;
+    s->overrun = 0;
+
+    if (s->inEnd - s->in < 4) {
+        return false;
+    }
+    len = s->in[0] | s->in[1] << 8;
+    if ((len ^ (s->in[2] | s->in[3] << 8)) != 0xffff) {
+        return false;
+    }
+    s->in += 4;
+    if ((size_t)(s->inEnd - s->in) < len ||
+        (size_t)(s->outEnd - s->out) < len)
+    {
+        return false;
+    }
+    memcpy(s->out, s->in, len);
+    s->in += len;
+    s->out += len;
+    return true;
+}
+
+static bool readDynamicCodes(InflateState *s, Huffman *litLen, Huffman *dist)
+{
+    static const uint8_t kOrder[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    uint8_t lengths[MAX_CODES + 32];
+    uint8_t codeLengths[19];
+    Huffman lengthCode;
+    int numLitLen, numDist, numCodeLengths, total;
+    int i;
+
+    refill(s);
+    numLitLen = getBits(s, 5) + 257;
+    numDist = getBits(s, 5) + 1;
+    numCodeLengths = getBits(s, 4) + 4;
+    if (numLitLen > 286 || numDist > 30) {
+        return false;
+    }
+    memset(codeLengths, 0, sizeof(codeLengths));
+    for (i = 0; i < numCodeLengths; i++) {
+        if (s->count < 3) {
+            refill(s);
+        }
+        codeLengths[kOrder[i]] = getBits(s, 3);
+    }
+    if (!buildHuffman(&lengthCode, codeLengths, 19, false)) {
+        return false;
+    }
+
+    total = numLitLen + numDist;
+    i = 0;
+    while (i < total) {
+        int symbol, repeat;
+        uint8_t value = 0;
+
+        refill(s);
+        symbol = decodeSymbol(s, &lengthCode);
+        if (symbol < 0) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+        if (symbol == 16) {
+            if (i == 0) {
+                return false;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + getBits(s, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + getBits(s, 3);
+        } else {
+            repeat = 11 + getBits(s, 7);
+        }
+        if (repeat > total - i) {
+            return false;
+        }
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if (lengths[256] == 0) {
+        return false;       // no end-of-block code
+    }
+    return buildHuffman(litLen, lengths, numLitLen, true) &&
+            buildHuffman(dist, lengths + numLitLen, numDist, true);
+}
+
+static Huffman gFixedLitLen;
+static Huffman gFixedDist;
+static pthread_once_t gFixedOnce = PTHREAD_ONCE_INIT;
+
+static void buildFixedCodes(void)
+{
+    uint8_t lengths[MAX_CODES];
+
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 256 - 144);
+    memset(lengths + 256, 7, 280 - 256);
+    memset(lengths + 280, 8, MAX_CODES - 280);
+    buildHuffman(&gFixedLitLen, lengths, MAX_CODES, false);
+    /* 32 to make the code complete; inflateCodes() refuses 30 and 31. */
+    memset(lengths, 5, 32);
+    buildHuffman(&gFixedDist, lengths, 32, false);
+}
+
+static bool inflateFast(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    InflateState s;
+    Huffman litLen, dist;
+    unsigned int final;
+
+    s.in = in;
+    s.inEnd = in + inLen;
+    s.bits = 0;
+    s.count = 0;
+    s.overrun = 0;
+    s.out = s.outStart = out;
+    s.outEnd = out + outLen;
+
+    do {
+        bool ok;
+
+        if (s.overrun > 8) {
+            return false;
+        }
+        refill(&s);
+        final = getBits(&s, 1);
+        switch (getBits(&s, 2)) {
+        case 0:
+            ok = inflateStored(&s);
+            break;
+        case 1:
+            pthread_once(&gFixedOnce, buildFixedCodes);
+            ok = inflateCodes(&s, &gFixedLitLen, &gFixedDist);
+            break;
+        case 2:
+            ok = readDynamicCodes(&s, &litLen, &dist) &&
+                    inflateCodes(&s, &litLen, &dist);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok) {
+            LOGD("Bad deflate data at input offset %ld\n",
+                    (long)(s.in - in));
+            return false;
+        }
+    } while (!final);
+
+    /* The made-up bytes must all still be in the buffer, unused. */
+    if (s.overrun * 8 > s.count) {
+        LOGD("Deflate data run past the end of the input\n");
+        return false;
+    }
+    if (s.out != s.outEnd) {
+        LOGD("Deflate data came out short (%zu of %zu bytes)\n",
+                (size_t)(s.out - out), outLen);
+        return false;
+    }
+    return true;
+}
+
+bool mzInflateBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    if (gInflateBackend == MZ_INFLATE_ZLIB) {
+        return inflateZlib(in, inLen, out, outLen);
+    }
+    return inflateFast(in, inLen, out, outLen);
+}
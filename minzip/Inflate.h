@@ -0,0 +1,36 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Whole-buffer inflate of raw deflate data.
+ */
+#ifndef _MINZIP_INFLATE
+#define _MINZIP_INFLATE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Which decoder mzInflateBuffer() uses.  MZ_INFLATE_ZLIB is a single
+ * call to zlib's inflate(); MZ_INFLATE_FAST is minzip's own decoder,
+ * which only handles the case where all the input and all the output
+ * are in memory, and is the default.  Streaming through zlib is still
+ * used for entries that are too big to decode at once.
+ */
+enum { MZ_INFLATE_AUTO, MZ_INFLATE_ZLIB, MZ_INFLATE_FAST };
+
+/*
+ * Use a particular decoder from now on (MZ_INFLATE_AUTO for the default).
+ * Returns 0, or -1 if there's no such decoder.
+ */
+int mzSetInflateBackend(int backend);
+int mzGetInflateBackend(void);
+
+/*
+ * Inflate the raw deflate stream in[0..inLen) into out, which must come
+ * out to exactly outLen bytes.  Returns false if the data are corrupt or
+ * the wrong size.
+ */
+bool mzInflateBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen);
+
+#endif /*_MINZIP_INFLATE*/
@@ -11,6 +11,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
 
 #define LOG_TAG "minzip"
 #include "Log.h"
@@ -150,17 +151,36 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap)
 {
     off_t dummy;
-    size_t fileLength, actualLength;
-    off_t actualStart;
-    int adjust;
-    void* memPtr;
+    size_t fileLength;
 
     assert(pMap != NULL);
 
     if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
         return -1;
 
-    if (start + length > (long)fileLength) {
+    return sysMapFileSegment(fd, start, length, fileLength, pMap);
+}
+
+/*
+ * Map part of a file whose length the caller already knows.  fd's file
+ * position is neither used nor changed, so threads sharing an fd may map
+ * segments of it at the same time.
+ *
+ * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
+ * value and does not disturb "pMap".
+ */
+int sysMapFileSegment(int fd, off_t start, long length, size_t fileLength,
+    MemMapping* pMap)
+{
+    size_t actualLength;
+    off_t actualStart;
+    int adjust;
+    void* memPtr;
+
+    assert(pMap != NULL);
+
+    if (start < 0 || length <= 0 ||
+        (uint64_t)start + length > (uint64_t)fileLength) {
         LOGW("bad segment: st=%d len=%ld flen=%d\n",
             (int) start, length, (int) fileLength);
         return -1;
@@ -192,6 +212,24 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Advise sequential access over part of a mapping.
+ */
+void sysAdviseSequential(const void* addr, size_t length)
+{
+    uintptr_t start, end;
+
+    if (addr == NULL || length == 0)
+        return;
+
+    start = (uintptr_t) addr & ~((uintptr_t) DEFAULT_PAGE_SIZE - 1);
+    end = (uintptr_t) addr + length;
+    if (madvise((void*) start, end - start, MADV_SEQUENTIAL) < 0) {
+        LOGV("madvise(%p, %d, SEQUENTIAL) failed: %s\n",
+            (void*) start, (int) (end - start), strerror(errno));
+    }
+}
+
 /*
  * Release a memory mapping.
  */
@@ -51,6 +51,21 @@ int sysMapFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
 
+/*
+ * Like sysMapFileSegmentInShmem, but given the file's length, so fd's
+ * file position is never touched; safe on an fd shared between threads.
+ */
+int sysMapFileSegment(int fd, off_t start, long length, size_t fileLength,
+    MemMapping* pMap);
+
+/*
+ * Tell the kernel that [addr, addr+length) of a mapped segment is about to
+ * be read from start to finish, so it can read ahead aggressively and drop
+ * pages behind us.  "addr" need not be page-aligned.  This is only a hint;
+ * failures are ignored.
+ */
+void sysAdviseSequential(const void* addr, size_t length);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
@@ -9,7 +9,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>     // for offsetof()
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
@@ -17,14 +20,13 @@
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Inflate.h"
 #include "Log.h"
 #include "DirUtil.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -91,42 +93,11 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   off=%u comp=%u uncomp=%u how=%d\n", pEntry->offset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
- */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
-{
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
-}
-
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
- */
-static int hashcmpZipName(const void* ventry, const void* vname)
-{
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
-}
-
 /*
  * Compute the hash code for a ZipEntry filename.
  *
@@ -143,18 +114,67 @@ static unsigned int computeHash(const char* name, int nameLen)
     return hash;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * How far "slot" is from the slot an item with hash "hash" would
+ * ideally be in.
+ */
+static inline unsigned int probeDistance(unsigned int hash, unsigned int slot,
+    unsigned int mask)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    return (slot - hash) & mask;
+}
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+/*
+ * Add pArchive->pEntries[index] to the name lookup table, keeping the
+ * first of any entries with the same name.
+ *
+ * The table is Robin Hood hashed: an item being inserted takes the slot
+ * of any item nearer its own ideal slot than the new one is, and that
+ * item moves on instead.  That keeps the longest probe short, and lets
+ * a lookup stop as soon as it passes a slot whose item is nearer home
+ * than the name it's looking for would be.  The table is allocated for
+ * the final entry count up front and never shrinks, so there's no
+ * resizing and no deletion to worry about.
+ */
+static void addEntryToHashTable(ZipArchive* pArchive, unsigned int index)
+{
+    const ZipEntry* pEntry = &pArchive->pEntries[index];
+    unsigned int mask = pArchive->hashSize - 1;
+    ZipHashSlot item;
+    unsigned int slot, dist;
+    bool displaced = false;
+
+    item.hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+    item.entry = index + 1;
+    slot = item.hash & mask;
+    for (dist = 0; pArchive->pHash[slot].entry != 0; dist++) {
+        ZipHashSlot* pSlot = &pArchive->pHash[slot];
+        unsigned int slotDist = probeDistance(pSlot->hash, slot, mask);
+
+        /* A duplicate can only be before the first displacement.
+         */
+        if (!displaced && pSlot->hash == item.hash) {
+            const ZipEntry* found = &pArchive->pEntries[pSlot->entry - 1];
+            if (found->fileNameLen == pEntry->fileNameLen &&
+                memcmp(found->fileName, pEntry->fileName,
+                        pEntry->fileNameLen) == 0)
+            {
+                LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                    found->fileNameLen, found->fileName);
+                /* keep going */
+                return;
+            }
+        }
+        if (slotDist < dist) {
+            ZipHashSlot tmp = *pSlot;
+            *pSlot = item;
+            item = tmp;
+            dist = slotDist;
+            displaced = true;
+        }
+        slot = (slot + 1) & mask;
     }
+    pArchive->pHash[slot] = item;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,6 +197,96 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/* Order entries by name, bytewise, with a name sorting before any
+ * longer name it is a prefix of.  Duplicate names keep the order of
+ * their local headers.
+ */
+static int compareEntries(const void *a, const void *b)
+{
+    const ZipEntry *pA = (const ZipEntry *)a;
+    const ZipEntry *pB = (const ZipEntry *)b;
+    unsigned int len;
+    int diff;
+
+    len = pA->fileNameLen < pB->fileNameLen ?
+            pA->fileNameLen : pB->fileNameLen;
+    diff = strncmp(pA->fileName, pB->fileName, len);
+    if (diff == 0) {
+        diff = (int)pA->fileNameLen - (int)pB->fileNameLen;
+    }
+    if (diff == 0) {
+        diff = (pA->offset > pB->offset) - (pA->offset < pB->offset);
+    }
+    return diff;
+}
+
+static int compareEntryPointers(const void *a, const void *b)
+{
+    return compareEntries(*(const ZipEntry *const *)a,
+            *(const ZipEntry *const *)b);
+}
+
+/*
+ * Fill in pArchive->pSorted, the indexes of its entries in
+ * compareEntries() order.  The entries themselves stay in central
+ * directory order, which is the order their data is laid out in.
+ */
+static bool sortEntries(ZipArchive* pArchive)
+{
+    unsigned int numEntries = pArchive->numEntries;
+    const ZipEntry** byName;
+    unsigned int i;
+
+    pArchive->pSorted = (uint32_t*) malloc(numEntries * sizeof(uint32_t));
+    byName = (const ZipEntry**) malloc(numEntries * sizeof(ZipEntry*));
+    if (pArchive->pSorted == NULL || byName == NULL) {
+        free(byName);
+        return false;
+    }
+    for (i = 0; i < numEntries; i++)
+        byName[i] = &pArchive->pEntries[i];
+    qsort(byName, numEntries, sizeof(ZipEntry*), compareEntryPointers);
+    for (i = 0; i < numEntries; i++)
+        pArchive->pSorted[i] = byName[i] - pArchive->pEntries;
+    free(byName);
+    return true;
+}
+
+/*
+ * Find the EOCD.  We'll find it immediately unless they have a file
+ * comment.  Returns NULL if there isn't one.
+ */
+static const unsigned char* findEndOfCentralDir(const MemMapping* pMap)
+{
+    const unsigned char* ptr = pMap->addr + pMap->length - ENDHDR;
+
+    while (ptr >= (const unsigned char*) pMap->addr) {
+        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+            return ptr;
+        ptr--;
+    }
+    return NULL;
+}
+
+/*
+ * Return a pointer to len bytes of the archive at file offset "offset":
+ * straight out of the mapping if they're in it, otherwise read into
+ * scratch.  Returns NULL if they can't be read.
+ */
+static const unsigned char* archiveBytes(const ZipArchive* pArchive,
+    const MemMapping* pMap, off_t offset, size_t len, unsigned char* scratch)
+{
+    if (offset >= pArchive->mapOffset &&
+        offset + len <= pArchive->mapOffset + pMap->length)
+    {
+        return (const unsigned char*) pMap->addr +
+                (offset - pArchive->mapOffset);
+    }
+    if (pread(pArchive->fd, scratch, len, offset) != (ssize_t) len)
+        return NULL;
+    return scratch;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -188,6 +298,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 {
     bool result = false;
     const unsigned char* ptr;
+    unsigned char scratch[LOCHDR];
     unsigned int i, numEntries, cdOffset;
     unsigned int val;
 
@@ -196,7 +307,12 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    ptr = archiveBytes(pArchive, pMap, 0, 4, scratch);
+    if (ptr == NULL) {
+        LOGV("Can't read Zip header\n");
+        goto bail;
+    }
+    val = get4LE(ptr);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -205,18 +321,8 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         goto bail;
     }
 
-    /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
-     */
-    ptr = pMap->addr + pMap->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    ptr = findEndOfCentralDir(pMap);
+    if (ptr == NULL) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
@@ -230,9 +336,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     cdOffset = get4LE(ptr + ENDOFF);
 
     LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
+    if (numEntries == 0 || cdOffset < pArchive->mapOffset ||
+        cdOffset >= pArchive->mapOffset + pMap->length)
+    {
         LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+            numEntries, cdOffset, pArchive->fileLength);
         goto bail;
     }
 
@@ -241,11 +349,15 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
+    pArchive->hashSize = 1;
+    while (pArchive->hashSize < mzHashSize(numEntries))
+        pArchive->hashSize <<= 1;
+    pArchive->pHash = (ZipHashSlot*) calloc(pArchive->hashSize,
+            sizeof(ZipHashSlot));
     if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = pMap->addr + (cdOffset - pArchive->mapOffset);
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
         unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
@@ -275,58 +387,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -352,16 +413,14 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        if ((uint64_t)localHdrOffset + LOCHDR > pArchive->fileLength) {
+            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        localHdr = archiveBytes(pArchive, pMap, localHdrOffset, LOCHDR,
+                scratch);
+        if (localHdr == NULL) {
+            LOGW("Can't read local header (at %d)\n", i);
             goto bail;
         }
         if (get4LE(localHdr) != LOCSIG) {
@@ -374,47 +433,395 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             LOGW("Integer overflow adding in parseZipArchive\n");
             goto bail;
         }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if ((uint64_t)pEntry->offset + pEntry->compLen > pArchive->fileLength) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort the entries by name, for mzFindZipEntriesWithPrefix().
      */
+    if (!sortEntries(pArchive))
+        goto bail;
+
     for (i = 0; i < numEntries; i++) {
         /* Add to hash table; no need to lock here.
          */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+        addEntryToHashTable(pArchive, i);
     }
-#endif
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
+        free(pArchive->pHash);
+        free(pArchive->pSorted);
         pArchive->pHash = NULL;
+        pArchive->pSorted = NULL;
+        pArchive->hashSize = 0;
     }
     return result;
 }
 
 /*
- * Open a Zip archive and scan out the contents.
+ * Parsed indexes are cached here, so that opening the same package again
+ * (e.g. from the updater child after recovery has verified it) can skip
+ * the central directory scan.  There's one cache file per package path,
+ * replaced whenever that path is parsed again, so they can't pile up.
+ */
+#define INDEX_CACHE_DIR "/tmp"
+#define INDEX_CACHE_MAGIC 0x33697a6d    // "mzi3": separate sorted view
+
+/*
+ * Smaller archives are parsed again rather than cached; scanning their
+ * central directory costs less than the file in /tmp.
+ */
+#define INDEX_CACHE_MIN_ENTRIES 64
+
+/*
+ * Header of an index cache file.  It's followed by numEntries ZipEntry
+ * structs, with fileName stored as a file offset, the numEntries
+ * uint32_t indexes of the sorted view, and then hashSize ZipHashSlot
+ * structs.  Everything up to numEntries is the key.
+ */
+typedef struct {
+    uint32_t    magic;
+    uint32_t    entrySize;      // sizeof(ZipEntry) of the writer
+    uint64_t    fileSize;
+    int64_t     mtime;
+    uint32_t    eocdHash;
+    uint32_t    numEntries;
+    uint32_t    hashSize;
+} IndexCacheHeader;
+
+/*
+ * Fill in the key fields of an index header for the archive open on fd.
+ */
+static bool indexKey(int fd, const MemMapping* pMap,
+    IndexCacheHeader* pHeader)
+{
+    struct stat st;
+    const unsigned char* eocd;
+
+    if (fstat(fd, &st) != 0)
+        return false;
+    eocd = findEndOfCentralDir(pMap);
+    if (eocd == NULL)
+        return false;
+
+    memset(pHeader, 0, sizeof(*pHeader));
+    pHeader->magic = INDEX_CACHE_MAGIC;
+    pHeader->entrySize = sizeof(ZipEntry);
+    pHeader->fileSize = st.st_size;
+    pHeader->mtime = st.st_mtime;
+    pHeader->eocdHash = computeHash((const char*) eocd, ENDHDR);
+    return true;
+}
+
+/*
+ * Fill in the key fields of an index cache header for the archive
+ * open on fd, and the name of its cache file, which comes from the
+ * archive's path.
+ */
+static bool indexCacheKey(int fd, const MemMapping* pMap,
+    IndexCacheHeader* pHeader, char* path, size_t pathLen)
+{
+    char link[32], target[PATH_MAX];
+    ssize_t len;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    len = readlink(link, target, sizeof(target));
+    if (len <= 0 || len >= (ssize_t) sizeof(target))
+        return false;
+    if (!indexKey(fd, pMap, pHeader))
+        return false;
+    snprintf(path, pathLen, "%s/minzip-%08x.idx", INDEX_CACHE_DIR,
+            computeHash(target, len));
+    return true;
+}
+
+static bool readFully(int fd, void* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        buf = (char*) buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        buf = (const char*) buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Try to fill in the entries and hash table of pArchive from an index
+ * written by writeIndex(), read from fd's current offset.  Its key must
+ * match "pKey", every name must lie inside the mapping and every data
+ * range inside the file, and each entry has to pass the same name and
+ * "version made by" checks as in parseZipArchive(), so a stale or
+ * forged index can't let through anything the archive itself wouldn't.
+ * The sorted view must also hold each entry once, in compareEntries()
+ * order, which the lookups by prefix rely on.
+ *
+ * Returns "true" on success.
+ */
+static bool readIndex(ZipArchive* pArchive, const MemMapping* pMap, int fd,
+    const IndexCacheHeader* pKey)
+{
+    IndexCacheHeader header;
+    unsigned char* seen = NULL;
+    unsigned int i;
+
+    if (!readFully(fd, &header, sizeof(header)) ||
+        memcmp(&header, pKey, offsetof(IndexCacheHeader, numEntries)) != 0 ||
+        header.numEntries == 0 || header.hashSize <= header.numEntries ||
+        (header.hashSize & (header.hashSize - 1)) != 0)
+    {
+        goto bail;
+    }
+
+    pArchive->pEntries = (ZipEntry*) malloc(
+            header.numEntries * sizeof(ZipEntry));
+    pArchive->pSorted = (uint32_t*) malloc(
+            header.numEntries * sizeof(uint32_t));
+    pArchive->pHash = (ZipHashSlot*) malloc(
+            header.hashSize * sizeof(ZipHashSlot));
+    seen = (unsigned char*) calloc(header.numEntries, 1);
+    if (pArchive->pEntries == NULL || pArchive->pSorted == NULL ||
+        pArchive->pHash == NULL || seen == NULL)
+    {
+        goto bail;
+    }
+    if (!readFully(fd, pArchive->pEntries,
+            header.numEntries * sizeof(ZipEntry)) ||
+        !readFully(fd, pArchive->pSorted,
+            header.numEntries * sizeof(uint32_t)) ||
+        !readFully(fd, pArchive->pHash,
+            header.hashSize * sizeof(ZipHashSlot)))
+    {
+        goto bail;
+    }
+
+    for (i = 0; i < header.numEntries; i++) {
+        ZipEntry* pEntry = &pArchive->pEntries[i];
+        uintptr_t nameOffset = (uintptr_t) pEntry->fileName;
+
+        if (nameOffset < (uintptr_t) pArchive->mapOffset ||
+            (uint64_t) nameOffset + pEntry->fileNameLen >
+                    pArchive->mapOffset + pMap->length ||
+            (uint64_t) pEntry->offset + pEntry->compLen > pArchive->fileLength)
+        {
+            goto bail;
+        }
+        pEntry->fileName = (const char*) pMap->addr +
+                (nameOffset - pArchive->mapOffset);
+        if (!validFilename(pEntry->fileName, pEntry->fileNameLen) ||
+            ((pEntry->versionMadeBy & 0xff00) != 0 &&
+             (pEntry->versionMadeBy & 0xff00) != CENVEM_UNIX))
+        {
+            goto bail;
+        }
+    }
+    for (i = 0; i < header.numEntries; i++) {
+        uint32_t index = pArchive->pSorted[i];
+
+        if (index >= header.numEntries || seen[index])
+            goto bail;
+        seen[index] = 1;
+        if (i > 0 && compareEntries(
+                &pArchive->pEntries[pArchive->pSorted[i - 1]],
+                &pArchive->pEntries[index]) > 0)
+        {
+            goto bail;
+        }
+    }
+    for (i = 0; i < header.hashSize; i++) {
+        if (pArchive->pHash[i].entry > header.numEntries)
+            goto bail;
+    }
+
+    free(seen);
+    pArchive->numEntries = header.numEntries;
+    pArchive->hashSize = header.hashSize;
+    return true;
+
+bail:
+    free(seen);
+    free(pArchive->pEntries);
+    free(pArchive->pSorted);
+    free(pArchive->pHash);
+    pArchive->pEntries = NULL;
+    pArchive->pSorted = NULL;
+    pArchive->pHash = NULL;
+    return false;
+}
+
+/*
+ * Try to fill in the entries and hash table of pArchive from a cached
+ * index.
+ *
+ * Returns "true" on a cache hit.
+ */
+static bool loadIndexCache(ZipArchive* pArchive, const MemMapping* pMap)
+{
+    IndexCacheHeader key;
+    char path[PATH_MAX];
+    bool ok;
+    int fd;
+
+    if (!indexCacheKey(pArchive->fd, pMap, &key, path, sizeof(path)))
+        return false;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    ok = readIndex(pArchive, pMap, fd, &key);
+    close(fd);
+    if (!ok) {
+        LOGI("Ignoring stale or damaged index cache %s\n", path);
+        unlink(path);
+        return false;
+    }
+    LOGV("Loaded index for %d entries from %s\n", pArchive->numEntries, path);
+    return true;
+}
+
+/*
+ * Write the index of pArchive (mapped at pMap) to fd, for readIndex().
+ */
+static bool writeIndex(const ZipArchive* pArchive, const MemMapping* pMap,
+    int fd)
+{
+    IndexCacheHeader header;
+    ZipEntry* entries = NULL;
+    unsigned int i;
+    bool ok;
+
+    if (!indexKey(pArchive->fd, pMap, &header))
+        return false;
+    header.numEntries = pArchive->numEntries;
+    header.hashSize = pArchive->hashSize;
+
+    entries = (ZipEntry*) malloc(pArchive->numEntries * sizeof(ZipEntry));
+    if (entries == NULL)
+        return false;
+    memcpy(entries, pArchive->pEntries,
+            pArchive->numEntries * sizeof(ZipEntry));
+    for (i = 0; i < pArchive->numEntries; i++) {
+        entries[i].fileName = (const char*) (uintptr_t)
+                (entries[i].fileName - (const char*) pMap->addr +
+                 pArchive->mapOffset);
+    }
+
+    ok = writeFully(fd, &header, sizeof(header)) &&
+        writeFully(fd, entries, pArchive->numEntries * sizeof(ZipEntry)) &&
+        writeFully(fd, pArchive->pSorted,
+            pArchive->numEntries * sizeof(uint32_t)) &&
+        writeFully(fd, pArchive->pHash,
+            pArchive->hashSize * sizeof(ZipHashSlot));
+    free(entries);
+    return ok;
+}
+
+/*
+ * Save the freshly parsed index of pArchive for loadIndexCache().
+ * Failures are harmless; the next open just parses the archive again.
+ */
+static void saveIndexCache(const ZipArchive* pArchive, const MemMapping* pMap)
+{
+    IndexCacheHeader header;
+    char path[PATH_MAX], tmpPath[PATH_MAX];
+    int fd;
+
+    if (pArchive->numEntries < INDEX_CACHE_MIN_ENTRIES)
+        return;
+    if (!indexCacheKey(pArchive->fd, pMap, &header, path, sizeof(path)))
+        return;
+
+    /* Write to a temporary name and rename, so that a concurrent open
+     * never sees a partial file.
+     */
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGV("Can't create index cache %s: %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    if (!writeIndex(pArchive, pMap, fd) ||
+        close(fd) != 0 ||
+        rename(tmpPath, path) != 0)
+    {
+        LOGV("Can't write index cache %s: %s\n", path, strerror(errno));
+        unlink(tmpPath);
+    }
+}
+
+/*
+ * Map just the central directory and EOCD (everything from the start of
+ * the central directory to the end of the file) for windowed mode.
+ */
+static bool mapCentralDir(ZipArchive* pArchive, MemMapping* pMap)
+{
+    MemMapping tail;
+    const unsigned char* eocd;
+    size_t tailLength;
+    off_t tailStart;
+    unsigned int cdOffset;
+
+    /* The EOCD is followed by at most a 64K comment.
+     */
+    tailLength = ENDHDR + 0xffff;
+    if (tailLength > pArchive->fileLength)
+        tailLength = pArchive->fileLength;
+    tailStart = pArchive->fileLength - tailLength;
+    if (sysMapFileSegmentInShmem(pArchive->fd, tailStart, tailLength,
+            &tail) != 0)
+    {
+        return false;
+    }
+    eocd = findEndOfCentralDir(&tail);
+    if (eocd == NULL) {
+        LOGI("Could not find end-of-central-directory in Zip\n");
+        sysReleaseShmem(&tail);
+        return false;
+    }
+    cdOffset = get4LE(eocd + ENDOFF);
+    sysReleaseShmem(&tail);
+
+    if (cdOffset >= pArchive->fileLength ||
+        sysMapFileSegmentInShmem(pArchive->fd, cdOffset,
+            pArchive->fileLength - cdOffset, pMap) != 0)
+    {
+        return false;
+    }
+    pArchive->mapOffset = cdOffset;
+    return true;
+}
+
+/*
+ * Map the archive open on pArchive->fd (taking ownership of it) and
+ * fill in its index: from indexFd if that holds a matching one, else
+ * from the cache, else by scanning the central directory.
  *
  * The easiest way to do this is to mmap() the whole thing and do the
  * traditional backward scan for central directory.  Since the EOCD is
@@ -424,44 +831,68 @@ bail:
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
  * flag?)
- *
- * On success, we fill out the contents of "pArchive".
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openArchive(int fd, int indexFd, const char* fileName,
+    ZipArchive* pArchive)
 {
     MemMapping map;
+    IndexCacheHeader key;
     int err;
 
-    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
-
     map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = fd;
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
+    struct stat st;
+    if (fstat(pArchive->fd, &st) != 0) {
         err = errno ? errno : -1;
-        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        LOGV("Unable to stat '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
+    pArchive->fileLength = st.st_size;
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    if (pArchive->fileLength < ENDHDR) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%zd)\n", fileName,
+                pArchive->fileLength);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+    /* An inherited descriptor may have been left anywhere, and
+     * sysMapFileInShmem() maps from the current offset.
+     */
+    if (lseek(pArchive->fd, 0, SEEK_SET) != 0) {
+        err = errno ? errno : -1;
         goto bail;
     }
-
-    if (!parseZipArchive(pArchive, &map)) {
+    if (pArchive->fileLength <= MZ_WINDOWED_MIN_LENGTH &&
+        sysMapFileInShmem(pArchive->fd, &map) == 0)
+    {
+        pArchive->mapOffset = 0;
+    } else if (mapCentralDir(pArchive, &map)) {
+        LOGI("Opened '%s' in windowed mode\n", fileName);
+    } else {
         err = -1;
-        LOGV("Parsing '%s' failed\n", fileName);
+        LOGW("Map of '%s' failed\n", fileName);
         goto bail;
     }
 
+    if (indexFd >= 0 && (lseek(indexFd, 0, SEEK_SET) != 0 ||
+            !indexKey(pArchive->fd, &map, &key) ||
+            !readIndex(pArchive, &map, indexFd, &key)))
+    {
+        LOGI("Ignoring index passed for '%s'\n", fileName);
+        indexFd = -1;
+    }
+    if (indexFd < 0 && !loadIndexCache(pArchive, &map)) {
+        if (!parseZipArchive(pArchive, &map)) {
+            err = -1;
+            LOGV("Parsing '%s' failed\n", fileName);
+            goto bail;
+        }
+        saveIndexCache(pArchive, &map);
+    }
+
     err = 0;
     sysCopyMap(&pArchive->map, &map);
     map.addr = NULL;
@@ -474,6 +905,40 @@ bail:
     return err;
 }
 
+/*
+ * Open a Zip archive and scan out the contents.
+ *
+ * On success, we fill out the contents of "pArchive".
+ */
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    int fd;
+    int err;
+
+    LOGV("Opening archive '%s' %p\n", fileName, pArchive);
+
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
+        err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        memset(pArchive, 0, sizeof(*pArchive));
+        pArchive->fd = -1;
+        return err;
+    }
+    return openArchive(fd, -1, fileName, pArchive);
+}
+
+int mzOpenZipArchiveFd(int fd, int indexFd, ZipArchive* pArchive)
+{
+    LOGV("Opening archive on fd %d %p\n", fd, pArchive);
+    return openArchive(fd, indexFd, "(inherited)", pArchive);
+}
+
+bool mzWriteZipArchiveIndex(const ZipArchive* pArchive, int fd)
+{
+    return writeIndex(pArchive, &pArchive->map, fd);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -489,12 +954,16 @@ void mzCloseZipArchive(ZipArchive* pArchive)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
+    free(pArchive->pSorted);
 
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pHash);
 
     pArchive->fd = -1;
     pArchive->pHash = NULL;
+    pArchive->hashSize = 0;
     pArchive->pEntries = NULL;
+    pArchive->pSorted = NULL;
+    pArchive->pObserver = NULL;
 }
 
 /*
@@ -505,10 +974,113 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    size_t nameLen = strlen(entryName);
+    unsigned int itemHash = computeHash(entryName, nameLen);
+    unsigned int mask, slot, dist;
+
+    if (pArchive->pHash == NULL)
+        return NULL;
+
+    mask = pArchive->hashSize - 1;
+    slot = itemHash & mask;
+    for (dist = 0; ; dist++) {
+        const ZipHashSlot* pSlot = &pArchive->pHash[slot];
+        if (pSlot->entry == 0 || probeDistance(pSlot->hash, slot, mask) < dist)
+            return NULL;
+        if (pSlot->hash == itemHash) {
+            const ZipEntry* pEntry = &pArchive->pEntries[pSlot->entry - 1];
+            if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0)
+            {
+                return pEntry;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/*
+ * Log how many slots past its ideal one each entry's name is found in,
+ * which is how many slots a successful mzFindZipEntry() looks at, less
+ * one.
+ */
+void mzZipProbeCount(const ZipArchive* pArchive)
+{
+    unsigned int hist[5] = { 0, 0, 0, 0, 0 };   // 0, 1, 2, 3, 4+
+    unsigned int minProbe = ~0U, maxProbe = 0, numEntries = 0;
+    unsigned long long totalProbe = 0;
+    unsigned int mask = pArchive->hashSize - 1;
+    unsigned int slot;
+
+    for (slot = 0; slot < pArchive->hashSize; slot++) {
+        const ZipHashSlot* pSlot = &pArchive->pHash[slot];
+        unsigned int count;
+        if (pSlot->entry == 0)
+            continue;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+        count = probeDistance(pSlot->hash, slot, mask);
+        numEntries++;
+        if (count < minProbe)
+            minProbe = count;
+        if (count > maxProbe)
+            maxProbe = count;
+        totalProbe += count;
+        hist[count < 4 ? count : 4]++;
+    }
+    if (numEntries == 0)
+        minProbe = 0;
+
+    LOGI("Probe: min=%u max=%u, total=%llu in %u (%u), avg=%.3f; "
+        "0:%u 1:%u 2:%u 3:%u 4+:%u\n", minProbe, maxProbe, totalProbe,
+        numEntries, pArchive->hashSize,
+        numEntries ? (double) totalProbe / numEntries : 0.0,
+        hist[0], hist[1], hist[2], hist[3], hist[4]);
+}
+
+/*
+ * Find the entries whose names start with prefix.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst)
+{
+    size_t prefixLen = strlen(prefix);
+    unsigned int low, high, first;
+
+    /* Find the first entry that doesn't sort before prefix...
+     */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + ((high - low) / 2);
+        const ZipEntry *pEntry = &pArchive->pEntries[pArchive->pSorted[mid]];
+        size_t len = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        int diff = strncmp(pEntry->fileName, prefix, len);
+        if (diff < 0 || (diff == 0 && pEntry->fileNameLen < prefixLen)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    first = low;
+
+    /* ...and then the first one after it that doesn't match.
+     */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + ((high - low) / 2);
+        const ZipEntry *pEntry = &pArchive->pEntries[pArchive->pSorted[mid]];
+        if (pEntry->fileNameLen >= prefixLen &&
+                strncmp(pEntry->fileName, prefix, prefixLen) == 0)
+        {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    *pFirst = first;
+    return low - first;
 }
 
 /*
@@ -522,35 +1094,267 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Return true if the entry's data is stored as is, uncompressed.
+ */
+bool mzIsZipEntryStored(const ZipEntry* pEntry)
+{
+    return pEntry->compression == STORED;
+}
+
+/*
+ * Return true if the entry is STORED with its data page-aligned.
+ */
+bool mzIsZipEntryAligned(const ZipEntry* pEntry)
+{
+    return pEntry->compression == STORED &&
+            pEntry->offset % MZ_ENTRY_ALIGNMENT == 0;
+}
+
+/*
+ * Entry data is handed out in windows of at most this size.  Window
+ * boundaries fall on multiples of this size in the file, so all but the
+ * first window of an entry start on a page boundary.
+ */
+#define MAPPED_WINDOW_SIZE (1024 * 1024)
+
+/*
+ * In windowed mode, runs shorter than this are read with pread() rather
+ * than mapped; an mmap() per small file costs more than the copy.
+ */
+#define MIN_MAPPED_WINDOW (64 * 1024)
+
+/* Return a pointer to the compressed data of this entry in the archive's
+ * mapping, or NULL if the data isn't mapped.
+ */
+static const unsigned char *mappedEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pArchive->map.addr == NULL || pEntry->offset < pArchive->mapOffset ||
+        (uint64_t)pEntry->offset + pEntry->compLen >
+                pArchive->mapOffset + pArchive->map.length)
+    {
+        return NULL;
+    }
+    return (const unsigned char *)pArchive->map.addr +
+            (pEntry->offset - pArchive->mapOffset);
+}
+
+/*
+ * Sequential reader for the compressed bytes of one entry.  The bytes
+ * come from the archive mapping when it covers the entry, otherwise from
+ * a window mapped just for the current stretch of the entry, and failing
+ * that from pread() into buf.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const unsigned char *mapped;    // entry data in a mapping, or NULL
+    off_t pos;
+    size_t remaining;
+    MemMapping entryMap;            // the whole of an aligned entry
+    MemMapping window;              // addr is NULL when nothing is mapped
+    unsigned char buf[32 * 1024];
+} EntryInput;
+
+/*
+ * The largest aligned entry mapped whole, so a huge image can't use up
+ * the address space; bigger ones are read a window at a time.
+ */
+#define MAX_ENTRY_MAPPING (64 * 1024 * 1024)
+
+static void openEntryInput(EntryInput *pInput, const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    pInput->pArchive = pArchive;
+    pInput->mapped = mappedEntryData(pArchive, pEntry);
+    pInput->pos = pEntry->offset;
+    pInput->remaining = pEntry->compLen;
+    pInput->entryMap.addr = NULL;
+    pInput->window.addr = NULL;
+
+    /* An aligned STORED entry maps as it is, with no window to slide
+     * and nothing to copy.
+     */
+    if (pInput->mapped == NULL && mzIsZipEntryAligned(pEntry) &&
+        pEntry->compLen >= MIN_MAPPED_WINDOW &&
+        pEntry->compLen <= MAX_ENTRY_MAPPING &&
+        sysMapFileSegment(pArchive->fd, pEntry->offset, pEntry->compLen,
+            pArchive->fileLength, &pInput->entryMap) == 0)
+    {
+        pInput->mapped = pInput->entryMap.addr;
+    }
+    if (pInput->mapped != NULL) {
+        sysAdviseSequential(pInput->mapped, pInput->remaining);
+    }
+}
+
+static void releaseEntryWindow(EntryInput *pInput)
+{
+    if (pInput->window.addr != NULL) {
+        sysReleaseShmem(&pInput->window);
+        pInput->window.addr = NULL;
+    }
+}
+
+static void closeEntryInput(EntryInput *pInput)
+{
+    releaseEntryWindow(pInput);
+    if (pInput->entryMap.addr != NULL) {
+        sysReleaseShmem(&pInput->entryMap);
+        pInput->entryMap.addr = NULL;
+    }
+}
+
+/* Point *pData at the next run of compressed bytes and return its
+ * length.  Returns 0 when the entry is used up and -1 on a read error.
+ * The data stay valid until the next call.
+ */
+static long nextEntryInput(EntryInput *pInput, const unsigned char **pData)
+{
+    size_t count;
+
+    releaseEntryWindow(pInput);
+    if (pInput->remaining == 0) {
+        return 0;
+    }
+
+    count = MAPPED_WINDOW_SIZE - (pInput->pos % MAPPED_WINDOW_SIZE);
+    if (count > pInput->remaining) {
+        count = pInput->remaining;
+    }
+
+    if (pInput->mapped != NULL) {
+        *pData = pInput->mapped;
+        pInput->mapped += count;
+    } else if (count >= MIN_MAPPED_WINDOW &&
+        sysMapFileSegment(pInput->pArchive->fd, pInput->pos, count,
+            pInput->pArchive->fileLength, &pInput->window) == 0)
+    {
+        sysAdviseSequential(pInput->window.addr, count);
+        *pData = pInput->window.addr;
+    } else {
+        ssize_t n;
+
+        pInput->window.addr = NULL;
+        if (count > sizeof(pInput->buf)) {
+            count = sizeof(pInput->buf);
+        }
+        n = pread(pInput->pArchive->fd, pInput->buf, count, pInput->pos);
+        if (n < 0 || (size_t)n != count) {
+            LOGE("Can't read %zu bytes from zip file: %ld\n", count, (long)n);
+            return -1;
+        }
+        *pData = pInput->buf;
+    }
+    pInput->pos += count;
+    pInput->remaining -= count;
+    return count;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
+    EntryInput input;
+    const unsigned char *data;
+    long count;
+    bool ret = true;
+
+    openEntryInput(&input, pArchive, pEntry);
+    while (ret && (count = nextEntryInput(&input, &data)) != 0) {
+        ret = count > 0 && processFunction(data, count, cookie);
+    }
+    closeEntryInput(&input);
+    return ret;
+}
+
+/*
+ * Deflated entries that inflate to no more than this are decoded in one
+ * go into a buffer of their full size, by mzInflateBuffer(), rather than
+ * streamed through zlib 32K at a time.  Bigger ones are streamed unless
+ * the caller has a buffer for all of it, as in mzReadZipEntry().  An
+ * entry that isn't in the archive mapping is read whole first, so its
+ * compressed size is held to the same limit.
+ */
+#define WHOLE_INFLATE_MAX (1024 * 1024)
+
+/* Whether the compressed data of this entry can be had all at once.
+ */
+static bool canInflateWhole(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    return pEntry->compression == DEFLATED &&
+            (pEntry->compLen <= WHOLE_INFLATE_MAX ||
+             mappedEntryData(pArchive, pEntry) != NULL);
+}
+
+static bool inflatesWhole(const ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    return pEntry->uncompLen <= WHOLE_INFLATE_MAX &&
+            canInflateWhole(pArchive, pEntry);
+}
+
+/* Inflate all of a deflated entry into buf, which holds uncompLen bytes.
+ */
+static bool inflateEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buf)
+{
+    const unsigned char *data = mappedEntryData(pArchive, pEntry);
+    unsigned char *readBuf = NULL;
+    bool ret;
+
+    if (data == NULL) {
         ssize_t n;
-        size_t count;
-        bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+        readBuf = (unsigned char *)malloc(pEntry->compLen + 1);
+        if (readBuf == NULL) {
+            LOGE("Can't allocate %u bytes for '%.*s'\n", pEntry->compLen,
+                    pEntry->fileNameLen, pEntry->fileName);
             return false;
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        n = pread(pArchive->fd, readBuf, pEntry->compLen, pEntry->offset);
+        if (n < 0 || (size_t)n != pEntry->compLen) {
+            LOGE("Can't read %u bytes from zip file: %ld\n",
+                    pEntry->compLen, (long)n);
+            free(readBuf);
             return false;
         }
-        bytesLeft -= count;
+        data = readBuf;
     }
-    return true;
+    ret = mzInflateBuffer(data, pEntry->compLen, buf, pEntry->uncompLen);
+    if (!ret) {
+        LOGW("Can't inflate '%.*s'\n", pEntry->fileNameLen, pEntry->fileName);
+    }
+    free(readBuf);
+    return ret;
+}
+
+/* Call processFunction once on all the uncompressed data of a small
+ * deflated entry.
+ */
+static bool processDeflatedEntryWhole(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    unsigned char *buf = (unsigned char *)malloc(pEntry->uncompLen + 1);
+    bool ret;
+
+    if (buf == NULL) {
+        LOGE("Can't allocate %u bytes for '%.*s'\n", pEntry->uncompLen,
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    ret = inflateEntryToBuffer(pArchive, pEntry, buf);
+    if (ret && pEntry->uncompLen > 0 &&
+        !processFunction(buf, pEntry->uncompLen, cookie))
+    {
+        LOGW("Process function elected to fail (in inflate)\n");
+        ret = false;
+    }
+    free(buf);
+    return ret;
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
@@ -558,13 +1362,17 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
+    EntryInput input;
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
 
-    compRemaining = pEntry->compLen;
+    if (inflatesWhole(pArchive, pEntry)) {
+        return processDeflatedEntryWhole(pArchive, pEntry, processFunction,
+                cookie);
+    }
+
+    openEntryInput(&input, pArchive, pEntry);
 
     /*
      * Initialize the zlib stream.
@@ -598,22 +1406,18 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+        /* get the next run of input */
+        if (zstream.avail_in == 0 && input.remaining > 0) {
+            const unsigned char *data;
+            long getSize = nextEntryInput(&input, &data);
+            LOGVV("+++ reading %ld bytes (%zu left)\n",
+                getSize, input.remaining);
+            if (getSize < 0) {
+                LOGW("inflate read failed\n");
                 goto z_bail;
             }
 
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
+            zstream.next_in = (Bytef*) data;
             zstream.avail_in = getSize;
         }
 
@@ -650,54 +1454,244 @@ z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
+    closeEntryInput(&input);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
             LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+                result, (long)pEntry->uncompLen);
         return false;
     }
-    return true;
+    return true;
+}
+
+/*
+ * Stream the uncompressed data through the supplied function,
+ * passing cookie to it each time it gets called.  processFunction
+ * may be called more than once.
+ *
+ * If processFunction returns false, the operation is abandoned and
+ * mzProcessZipEntryContents() immediately returns false.
+ *
+ * This is useful for calculating the hash of an entry's uncompressed contents.
+ */
+bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    bool ret = false;
+
+    /* The entry data is read with pread() at explicit offsets, so the
+     * shared fd's file position is never touched and several threads
+     * may process different entries of the same archive at once.
+     */
+    switch (pEntry->compression) {
+    case STORED:
+        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+        break;
+    case DEFLATED:
+        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
+        break;
+    default:
+        LOGE("Unsupported compression type %d for entry '%s'\n",
+                pEntry->compression, pEntry->fileName);
+        break;
+    }
+
+    return ret;
+}
+
+/*
+ * Per-reader state for pulling an entry's uncompressed data a piece at a
+ * time.  Each reader has its own file offset, so readers on different
+ * threads don't interfere with each other or with the archive's fd.
+ */
+struct ZipEntryReader {
+    const ZipArchive *pArchive;
+    const ZipEntry *pEntry;
+    off_t pos;                  // file offset of the next compressed byte
+    long compRemaining;         // compressed bytes not yet read from file
+    long uncompRemaining;       // uncompressed bytes not yet returned
+    unsigned long crc;
+    bool zinit;
+    z_stream zstream;
+    unsigned char readBuf[32 * 1024];
+};
+
+ZipEntryReader *mzOpenZipEntryReader(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    ZipEntryReader *pReader;
+    int zerr;
+
+    if (pEntry->compression != STORED && pEntry->compression != DEFLATED) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return NULL;
+    }
+
+    pReader = (ZipEntryReader *)malloc(sizeof(*pReader));
+    if (pReader == NULL) {
+        return NULL;
+    }
+    pReader->pArchive = pArchive;
+    pReader->pEntry = pEntry;
+    pReader->pos = pEntry->offset;
+    pReader->compRemaining = pEntry->compLen;
+    pReader->uncompRemaining = pEntry->uncompLen;
+    pReader->crc = crc32(0L, Z_NULL, 0);
+    pReader->zinit = false;
+
+    if (mappedEntryData(pArchive, pEntry) != NULL) {
+        sysAdviseSequential(mappedEntryData(pArchive, pEntry), pEntry->compLen);
+    }
+
+    if (pEntry->compression == DEFLATED) {
+        memset(&pReader->zstream, 0, sizeof(pReader->zstream));
+        pReader->zstream.zalloc = Z_NULL;
+        pReader->zstream.zfree = Z_NULL;
+        pReader->zstream.opaque = Z_NULL;
+        pReader->zstream.data_type = Z_UNKNOWN;
+
+        /* No zlib header; see processDeflatedEntry().
+         */
+        zerr = inflateInit2(&pReader->zstream, -MAX_WBITS);
+        if (zerr != Z_OK) {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+            free(pReader);
+            return NULL;
+        }
+        pReader->zinit = true;
+
+        /* As in processDeflatedEntry(), inflate straight from the mapping
+         * when we can.
+         */
+        const unsigned char *mapped = mappedEntryData(pArchive, pEntry);
+        if (mapped != NULL) {
+            pReader->zstream.next_in = (Bytef *)mapped;
+            pReader->zstream.avail_in = pEntry->compLen;
+            pReader->pos += pEntry->compLen;
+            pReader->compRemaining = 0;
+        }
+    }
+    return pReader;
+}
+
+/* Fill "buf" from a STORED entry. */
+static ssize_t readStored(ZipEntryReader *pReader, unsigned char *buf,
+    size_t len)
+{
+    const unsigned char *mapped;
+    ssize_t n;
+
+    if ((long)len > pReader->compRemaining) {
+        len = pReader->compRemaining;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    mapped = mappedEntryData(pReader->pArchive, pReader->pEntry);
+    if (mapped != NULL) {
+        memcpy(buf, mapped + (pReader->pos - pReader->pEntry->offset), len);
+        pReader->pos += len;
+        pReader->compRemaining -= len;
+        return len;
+    }
+    n = pread(pReader->pArchive->fd, buf, len, pReader->pos);
+    if (n < 0 || (size_t)n != len) {
+        LOGE("Can't read %zu bytes from zip file: %ld\n", len, (long)n);
+        return -1;
+    }
+    pReader->pos += n;
+    pReader->compRemaining -= n;
+    return n;
+}
+
+/* Fill "buf" from a DEFLATED entry, reading more input as needed. */
+static ssize_t readDeflated(ZipEntryReader *pReader, unsigned char *buf,
+    size_t len)
+{
+    z_stream *zs = &pReader->zstream;
+    int zerr = Z_OK;
+
+    zs->next_out = (Bytef *)buf;
+    zs->avail_out = len;
+    while (zs->avail_out > 0 && zerr != Z_STREAM_END) {
+        if (zs->avail_in == 0 && pReader->compRemaining > 0) {
+            long getSize = pReader->compRemaining > (long)sizeof(pReader->readBuf)
+                    ? (long)sizeof(pReader->readBuf) : pReader->compRemaining;
+            ssize_t cc = pread(pReader->pArchive->fd, pReader->readBuf,
+                    getSize, pReader->pos);
+            if (cc != getSize) {
+                LOGW("inflate read failed (%ld vs %ld)\n", (long)cc, getSize);
+                return -1;
+            }
+            pReader->pos += getSize;
+            pReader->compRemaining -= getSize;
+            zs->next_in = pReader->readBuf;
+            zs->avail_in = getSize;
+        }
+
+        zerr = inflate(zs, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            return -1;
+        }
+        if (zerr == Z_OK && zs->avail_in == 0 && pReader->compRemaining == 0
+                && zs->avail_out > 0) {
+            LOGW("Truncated deflate stream in '%.*s'\n",
+                    pReader->pEntry->fileNameLen, pReader->pEntry->fileName);
+            return -1;
+        }
+    }
+    return len - zs->avail_out;
 }
 
-/*
- * Stream the uncompressed data through the supplied function,
- * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
- *
- * If processFunction returns false, the operation is abandoned and
- * mzProcessZipEntryContents() immediately returns false.
- *
- * This is useful for calculating the hash of an entry's uncompressed contents.
- */
-bool mzProcessZipEntryContents(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+ssize_t mzReadZipEntryReader(ZipEntryReader *pReader, void *buf, size_t len)
 {
-    bool ret = false;
-    off_t oldOff;
+    const ZipEntry *pEntry = pReader->pEntry;
+    ssize_t n;
 
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+    if (pReader->uncompRemaining == 0 || len == 0) {
+        return 0;
+    }
+    if ((long)len > pReader->uncompRemaining) {
+        len = pReader->uncompRemaining;
+    }
 
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+    if (pEntry->compression == STORED) {
+        n = readStored(pReader, (unsigned char *)buf, len);
+    } else {
+        n = readDeflated(pReader, (unsigned char *)buf, len);
+    }
+    if (n <= 0) {
+        if (n == 0) {
+            LOGW("Size mismatch on inflated file (%ld short)\n",
+                    pReader->uncompRemaining);
+        }
+        return -1;
+    }
 
-    switch (pEntry->compression) {
-    case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
-        break;
+    pReader->crc = crc32(pReader->crc, (const unsigned char *)buf, n);
+    pReader->uncompRemaining -= n;
+    if (pReader->uncompRemaining == 0 &&
+            pReader->crc != (unsigned long)pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, pReader->crc,
+                (unsigned long)pEntry->crc32);
+        return -1;
     }
+    return n;
+}
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
-    return ret;
+void mzCloseZipEntryReader(ZipEntryReader *pReader)
+{
+    if (pReader == NULL) {
+        return;
+    }
+    if (pReader->zinit) {
+        inflateEnd(&pReader->zstream);
+    }
+    free(pReader);
 }
 
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
@@ -707,6 +1701,51 @@ static bool crcProcessFunction(const unsigned char *data, int dataLen,
     return true;
 }
 
+typedef struct {
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+    unsigned long crc;
+} CrcProcessArgs;
+
+static bool crcChainProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    CrcProcessArgs *args = (CrcProcessArgs *)cookie;
+    args->crc = crc32(args->crc, data, dataLen);
+    return args->processFunction(data, dataLen, args->cookie);
+}
+
+/*
+ * Stream the uncompressed data through processFunction, checking the
+ * CRC on the way past.  This is equivalent to calling mzIsZipEntryIntact()
+ * followed by mzProcessZipEntryContents(), but only inflates the entry once.
+ */
+bool mzProcessZipEntryContentsCheckCrc(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie, bool *pCrcOk)
+{
+    CrcProcessArgs args;
+    bool ret;
+
+    args.processFunction = processFunction;
+    args.cookie = cookie;
+    args.crc = crc32(0L, Z_NULL, 0);
+    *pCrcOk = false;
+    ret = mzProcessZipEntryContents(pArchive, pEntry, crcChainProcessFunction,
+            (void *)&args);
+    if (!ret) {
+        return false;
+    }
+    if (args.crc != (unsigned long)pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, args.crc,
+                (unsigned long)pEntry->crc32);
+    } else {
+        *pCrcOk = true;
+    }
+    return true;
+}
+
 /*
  * Check the CRC on this entry; return true if it is correct.
  * May do other internal checks as well.
@@ -725,7 +1764,8 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     }
     if (crc != (unsigned long)pEntry->crc32) {
         LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+                pEntry->fileNameLen, pEntry->fileName, crc,
+                (unsigned long)pEntry->crc32);
         return false;
     }
     return true;
@@ -758,6 +1798,17 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    /* Inflate straight into the caller's buffer when we can. */
+    if (bufLen >= 0 && pEntry->uncompLen <= (unsigned int)bufLen &&
+        canInflateWhole(pArchive, pEntry))
+    {
+        ret = inflateEntryToBuffer(pArchive, pEntry, (unsigned char *)buf);
+        if (!ret) {
+            LOGE("Can't extract entry to buffer.\n");
+        }
+        return ret;
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -769,30 +1820,113 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     return true;
 }
 
+/*
+ * Extracted data is gathered into writes of this size, so a file is
+ * written in a few big, aligned chunks rather than one write() per
+ * inflate buffer.
+ */
+#define SINK_BUFFER_SIZE (128 * 1024)
+
+/* Buffered destination for mzExtractZipEntryToFile().
+ */
+typedef struct {
+    int fd;
+    unsigned char *buf;     // may be NULL; then every chunk is written as-is
+    size_t bufLen;
+    size_t used;
+    const ZipExtractObserver *observer;
+    void *state;            // observer's, or NULL if it isn't watching
+} FileSink;
+
+static bool flushFileSink(FileSink *sink)
+{
+    if (sink->used > 0) {
+        if (!writeFully(sink->fd, sink->buf, sink->used)) {
+            LOGE("Error writing %zu bytes from zip file: %s\n",
+                 sink->used, strerror(errno));
+            return false;
+        }
+        sink->used = 0;
+    }
+    return true;
+}
+
 static bool writeProcessFunction(const unsigned char *data, int dataLen,
                                  void *cookie)
 {
-    int fd = (int)cookie;
+    FileSink *sink = (FileSink *)cookie;
+    size_t len = dataLen;
 
-    ssize_t soFar = 0;
-    while (true) {
-        ssize_t n = write(fd, data+soFar, dataLen-soFar);
-        if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
-                 dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
-                return false;
-            }
+    if (sink->state != NULL) {
+        sink->observer->update(sink->state, data, dataLen);
+    }
+
+    /* Big chunks (e.g. STORED data straight from the mapping) skip the
+     * buffer, in whole multiples of its size to keep writes aligned.
+     */
+    if (sink->buf == NULL || (sink->used == 0 && len >= sink->bufLen)) {
+        size_t direct = len;
+        if (sink->buf != NULL) {
+            direct -= len % sink->bufLen;
+        }
+        if (!writeFully(sink->fd, data, direct)) {
+            LOGE("Error writing %zu bytes from zip file from %p: %s\n",
+                 direct, data, strerror(errno));
+            return false;
+        }
+        data += direct;
+        len -= direct;
+    }
+
+    while (len > 0) {
+        size_t count = sink->bufLen - sink->used;
+        if (count > len) {
+            count = len;
+        }
+        memcpy(sink->buf + sink->used, data, count);
+        sink->used += count;
+        data += count;
+        len -= count;
+        if (sink->used == sink->bufLen && !flushFileSink(sink)) {
+            return false;
         }
     }
+    return true;
+}
+
+/*
+ * If fd is an empty regular file positioned at its start, reserve its
+ * blocks up front, so a big file is allocated in a few extents instead
+ * of a write at a time.  This uses fallocate() with FALLOC_FL_KEEP_SIZE,
+ * which reserves space without writing anything or changing the file's
+ * size; where that isn't available (or the filesystem doesn't support
+ * it) nothing is done.  ftruncate() is no substitute: on vfat it
+ * zero-fills the whole file, so every byte would be written twice, and
+ * elsewhere it only makes a sparse file.
+ *
+ * Returns true if space was reserved, so the caller knows the file
+ * started out empty and can truncate it again if extraction fails.
+ */
+static bool preallocateFile(int fd, long length)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    struct stat st;
+
+    if (length <= 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size != 0 || lseek(fd, 0, SEEK_CUR) != 0)
+    {
+        return false;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length) != 0) {
+        LOGV("Can't preallocate %ld bytes: %s\n", length, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void) fd;
+    (void) length;
+    return false;
+#endif
 }
 
 /*
@@ -801,15 +1935,48 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
+    FileSink sink;
+    bool preallocated;
+    bool ret;
+
+    preallocated = preallocateFile(fd, pEntry->uncompLen);
+
+    sink.fd = fd;
+    sink.used = 0;
+    sink.bufLen = pEntry->uncompLen < SINK_BUFFER_SIZE ?
+            pEntry->uncompLen : SINK_BUFFER_SIZE;
+    /* An entry inflated whole arrives in one piece, to write as it is. */
+    sink.buf = sink.bufLen > 0 && !inflatesWhole(pArchive, pEntry) ?
+            (unsigned char *)malloc(sink.bufLen) : NULL;
+    sink.observer = pArchive->pObserver;
+    sink.state = NULL;
+    if (sink.observer != NULL) {
+        sink.state = sink.observer->begin(pEntry, sink.observer->cookie);
+    }
+
+    ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
+                                    &sink) && flushFileSink(&sink);
+    free(sink.buf);
+    if (sink.state != NULL && !sink.observer->end(sink.state, ret)) {
+        ret = false;
+    }
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
+        /* Don't leave a partial file holding all the reserved space. */
+        if (preallocated && ftruncate(fd, 0) != 0) {
+            LOGW("Can't truncate partial file: %s\n", strerror(errno));
+        }
         return false;
     }
     return true;
 }
 
+void mzSetExtractObserver(ZipArchive *pArchive,
+    const ZipExtractObserver *pObserver)
+{
+    pArchive->pObserver = pObserver;
+}
+
 /* Helper state to make path translation easier and less malloc-happy.
  */
 typedef struct {
@@ -870,6 +2037,201 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * With MZ_EXTRACT_SYNC, extracted files are kept open here and fsync()ed
+ * a batch at a time, so the filesystem can write back many files at
+ * once instead of stalling on each one.
+ */
+#define SYNC_BATCH_SIZE 32
+
+typedef struct {
+    int fds[SYNC_BATCH_SIZE];
+    int count;
+} MzSyncBatch;
+
+/* fsync() and close every file in the batch.
+ */
+static bool flushSyncBatch(MzSyncBatch *batch)
+{
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        if (fsync(batch->fds[i]) != 0) {
+            LOGE("Error syncing extracted file: %s\n", strerror(errno));
+            ok = false;
+        }
+        close(batch->fds[i]);
+    }
+    batch->count = 0;
+    return ok;
+}
+
+/* Create targetFile and write the contents of the regular file
+ * entry pEntry to it.  If batch is non-NULL, the file is left open in
+ * it to be synced later.
+ */
+static bool extractRegularFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *targetFile,
+    const struct utimbuf *timestamp, MzSyncBatch *batch)
+{
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    if (ok) {
+        dirRememberFile(fd);    // for a set_perm_recursive over it
+    }
+    if (!ok || batch == NULL) {
+        close(fd);
+    } else {
+        batch->fds[batch->count++] = fd;
+        if (batch->count == SYNC_BATCH_SIZE && !flushSyncBatch(batch)) {
+            return false;
+        }
+    }
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+static int compareIndexes(const void *a, const void *b)
+{
+    uint32_t indexA = *(const uint32_t *)a;
+    uint32_t indexB = *(const uint32_t *)b;
+    return (indexA > indexB) - (indexA < indexB);
+}
+
+/* Regular files queued up by mzExtractRecursiveParallel(), and the
+ * state shared by the threads extracting them.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const char *targetDir;
+    const char *zipDir;
+    const struct utimbuf *timestamp;
+    bool sync;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+
+    ZipEntry **jobs;
+    unsigned int numJobs;
+
+    pthread_mutex_t lock;
+    unsigned int nextJob;       // protected by lock
+    bool failed;                // protected by lock
+} MzExtractWork;
+
+/* Pull queued files off the work list and extract them until the list
+ * is empty or any thread has failed.  The callback is invoked with the
+ * lock held, so it never runs concurrently with itself.
+ */
+static void *extractWorker(void *arg)
+{
+    MzExtractWork *work = (MzExtractWork *)arg;
+    MzPathHelper helper;
+    MzSyncBatch batch;
+
+    batch.count = 0;
+
+    helper.targetDir = work->targetDir;
+    helper.targetDirLen = strlen(work->targetDir);
+    helper.zipDir = work->zipDir;
+    helper.zipDirLen = strlen(work->zipDir);
+    helper.buf = NULL;
+    helper.bufLen = 0;
+
+    for (;;) {
+        ZipEntry *pEntry;
+
+        pthread_mutex_lock(&work->lock);
+        if (work->failed || work->nextJob >= work->numJobs) {
+            pthread_mutex_unlock(&work->lock);
+            break;
+        }
+        pEntry = work->jobs[work->nextJob++];
+        pthread_mutex_unlock(&work->lock);
+
+        const char *targetFile = targetEntryPath(&helper, pEntry);
+        bool ok = targetFile != NULL;
+        if (!ok) {
+            LOGE("Can't assemble target path for \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+        } else {
+            ok = extractRegularFile(work->pArchive, pEntry, targetFile,
+                    work->timestamp, work->sync ? &batch : NULL);
+        }
+
+        pthread_mutex_lock(&work->lock);
+        if (!ok) {
+            work->failed = true;
+        } else if (work->callback != NULL) {
+            work->callback(targetFile, work->cookie);
+        }
+        pthread_mutex_unlock(&work->lock);
+    }
+
+    if (!flushSyncBatch(&batch)) {
+        pthread_mutex_lock(&work->lock);
+        work->failed = true;
+        pthread_mutex_unlock(&work->lock);
+    }
+    free(helper.buf);
+    return NULL;
+}
+
+/* Extract the queued files on numThreads threads, one of which is the
+ * calling thread.  Returns true if every file was extracted.
+ */
+static bool runExtractWork(MzExtractWork *work, int numThreads)
+{
+    pthread_t *threads = NULL;
+    int started = 0;
+    int i;
+
+    if ((unsigned int)numThreads > work->numJobs) {
+        numThreads = work->numJobs;
+    }
+    if (numThreads > 1) {
+        threads = (pthread_t *)malloc(sizeof(pthread_t) * (numThreads - 1));
+    }
+    if (threads != NULL) {
+        for (i = 0; i < numThreads - 1; i++) {
+            int err = pthread_create(&threads[i], NULL, extractWorker, work);
+            if (err != 0) {
+                LOGW("Can't start extraction thread: %s\n", strerror(err));
+                break;
+            }
+            started++;
+        }
+    }
+
+    extractWorker(work);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    return !work->failed;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -894,6 +2256,23 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                         const char *zipDir, const char *targetDir,
                         int flags, const struct utimbuf *timestamp,
                         void (*callback)(const char *fn, void *), void *cookie)
+{
+    return mzExtractRecursiveParallel(pArchive, zipDir, targetDir, flags,
+            timestamp, callback, cookie, 1);
+}
+
+/*
+ * Like mzExtractRecursive(), but with numThreads > 1 the regular files
+ * are written by a pool of numThreads threads.  Directories, parent
+ * directories and symlinks are all created up front on the calling
+ * thread, so the workers only ever creat() into directories that
+ * already exist.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie,
+                        int numThreads)
 {
     if (zipDir[0] == '/') {
         LOGE("mzExtractRecursive(): zipDir must be a relative path.\n");
@@ -939,50 +2318,51 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+    /* Walk through the entries whose path begins with zpath and
+     * extract them.
      */
-    unsigned int i;
-    bool seenMatch = false;
+    unsigned int i, first, count;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+
+    /* The matches are found in name order, but are extracted in central
+     * directory order, which is the order their data is laid out in.
+     */
+    count = mzFindZipEntriesWithPrefix(pArchive, zpath, &first);
+    uint32_t *order = NULL;
+    if (count > 0) {
+        order = (uint32_t *)malloc(sizeof(uint32_t) * count);
+        if (order == NULL) {
+            LOGE("Can't allocate %u entry indexes\n", count);
+            free(zpath);
+            return false;
+        }
+        memcpy(order, pArchive->pSorted + first, sizeof(uint32_t) * count);
+        qsort(order, count, sizeof(uint32_t), compareIndexes);
+    }
+
+    /* In parallel mode, regular files are queued here during the walk
+     * and extracted afterwards.
+     */
+    MzExtractWork work;
+    memset(&work, 0, sizeof(work));
+
+    /* Files extracted on this thread with MZ_EXTRACT_SYNC.
+     */
+    MzSyncBatch batch;
+    batch.count = 0;
+    if (numThreads > 1 && !(flags & MZ_EXTRACT_DRY_RUN) && count > 0) {
+        work.jobs = (ZipEntry **)malloc(sizeof(ZipEntry *) * count);
+        if (work.jobs == NULL) {
+            LOGW("Can't allocate extraction queue; extracting serially\n");
+        }
+    }
+
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+    for (i = 0; i < count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + order[i];
 
         /* Find the target location of the entry.
          */
@@ -1003,8 +2383,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1072,39 +2450,44 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
+            } else if (work.jobs != NULL) {
+                /* The entry is a regular file; leave it for the
+                 * worker threads.  The callback runs when it's done.
+                 */
+                work.jobs[work.numJobs++] = pEntry;
+                continue;
             } else {
                 /* The entry is a regular file.
-                 * Open the target for writing.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
+                if (!extractRegularFile(pArchive, pEntry, targetFile,
+                        timestamp, (flags & MZ_EXTRACT_SYNC) ? &batch : NULL)) {
                     ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && work.numJobs > 0) {
+        work.pArchive = pArchive;
+        work.targetDir = targetDir;
+        work.zipDir = zpath;
+        work.timestamp = timestamp;
+        work.sync = (flags & MZ_EXTRACT_SYNC) != 0;
+        work.callback = callback;
+        work.cookie = cookie;
+        pthread_mutex_init(&work.lock, NULL);
+        ok = runExtractWork(&work, numThreads);
+        pthread_mutex_destroy(&work.lock);
+    }
+
+    if (!flushSyncBatch(&batch)) {
+        ok = false;
+    }
+    free(work.jobs);
+    free(order);
     free(helper.buf);
     free(zpath);
 
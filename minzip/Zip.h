@@ -8,6 +8,7 @@
 
 #include "inline_magic.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <utime.h>
 
@@ -17,33 +18,51 @@
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
  *
- * TODO: we're now keeping the pages mapped so we don't have to copy the
- * filename.  We can change the accessors to retrieve the various pieces
- * directly from the source file instead of copying them out, for a very
- * slight speed hit and a modest reduction in memory usage.
+ * The pages stay mapped, so the filename isn't copied.  Every field is
+ * sized to what the (non-Zip64) format can hold, which keeps the entry
+ * table small for big packages.
  */
 typedef struct ZipEntry {
-    unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
-    int          compression;
-    long         modTime;
-    long         crc32;
-    int          versionMadeBy;
-    long         externalFileAttributes;
+    uint32_t     offset;
+    uint32_t     compLen;
+    uint32_t     uncompLen;
+    uint32_t     modTime;
+    uint32_t     crc32;
+    uint32_t     externalFileAttributes;
+    uint16_t     fileNameLen;
+    uint16_t     compression;
+    uint16_t     versionMadeBy;
 } ZipEntry;
 
+/*
+ * One slot of the name lookup table, which is Robin Hood hashed.  The
+ * name hash is kept inline so most mismatches are rejected without
+ * touching the entry itself, and so each slot's distance from its ideal
+ * slot can be worked out.  "entry" is the index into pEntries plus one;
+ * zero marks an empty slot.
+ */
+typedef struct ZipHashSlot {
+    uint32_t     hash;
+    uint32_t     entry;
+} ZipHashSlot;
+
+struct ZipExtractObserver;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    ZipEntry*   pEntries;       // in central directory order
+    uint32_t*   pSorted;        // indexes into pEntries, by name
+    ZipHashSlot* pHash;         // maps file name to ZipEntry
+    unsigned int hashSize;      // always a power of 2
     MemMapping  map;
+    off_t       mapOffset;      // file offset of map.addr
+    size_t      fileLength;
+    const struct ZipExtractObserver* pObserver;   // see mzSetExtractObserver()
 } ZipArchive;
 
 /*
@@ -58,11 +77,33 @@ typedef struct {
 /*
  * Open a Zip archive.
  *
+ * Archives of up to MZ_WINDOWED_MIN_LENGTH bytes are mapped whole.
+ * Larger ones (or ones that can't be mapped whole) are opened in
+ * windowed mode: only the central directory stays mapped, and entry
+ * data is mapped a window at a time while it's being read.
+ *
  * On success, returns 0 and populates "pArchive".  Returns nonzero errno
  * value on failure.
  */
+#ifndef MZ_WINDOWED_MIN_LENGTH
+#define MZ_WINDOWED_MIN_LENGTH (128 * 1024 * 1024)
+#endif
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Like mzOpenZipArchive(), but for an archive that's already open on
+ * "fd" (which the ZipArchive takes over).  If "indexFd" isn't -1 it
+ * should hold an index written by mzWriteZipArchiveIndex(); when it
+ * matches the archive it's used instead of the central directory, so a
+ * child process can pick up where its parent left off.
+ */
+int mzOpenZipArchiveFd(int fd, int indexFd, ZipArchive* pArchive);
+
+/*
+ * Write the parsed index of "pArchive" to "fd", for mzOpenZipArchiveFd().
+ */
+bool mzWriteZipArchiveIndex(const ZipArchive* pArchive, int fd);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -78,6 +119,22 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Log how far lookups in the archive's name table have to probe, to
+ * evaluate it on real packages.
+ */
+void mzZipProbeCount(const ZipArchive* pArchive);
+
+/*
+ * Find all entries whose names begin with "prefix".  A view of the
+ * entries sorted by name is kept, so the matches are contiguous in it:
+ * on return they are mzGetSortedZipEntry(pArchive, *pFirst) onward, and
+ * the return value is how many there are.  An empty prefix matches
+ * every entry.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -86,7 +143,8 @@ INLINE unsigned int mzZipEntryCount(const ZipArchive* pArchive) {
 }
 
 /*
- * Get an entry by index.  Returns NULL if the index is out-of-bounds.
+ * Get an entry by index, in central directory order.  Returns NULL if
+ * the index is out-of-bounds.
  */
 INLINE const ZipEntry*
 mzGetZipEntryAt(const ZipArchive* pArchive, unsigned int index)
@@ -97,6 +155,19 @@ mzGetZipEntryAt(const ZipArchive* pArchive, unsigned int index)
     return NULL;
 }
 
+/*
+ * Get an entry by its position in name order.  Returns NULL if the
+ * position is out-of-bounds.
+ */
+INLINE const ZipEntry*
+mzGetSortedZipEntry(const ZipArchive* pArchive, unsigned int position)
+{
+    if (position < pArchive->numEntries) {
+        return pArchive->pEntries + pArchive->pSorted[position];
+    }
+    return NULL;
+}
+
 /*
  * Get the index number of an entry in the archive.
  */
@@ -127,6 +198,15 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
     return pEntry->crc32;
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
+bool mzIsZipEntryStored(const ZipEntry* pEntry);
+
+/*
+ * STORED entries whose data start on a multiple of this (as
+ * align-update-package lays them out) are mapped whole, straight from
+ * the archive, when their contents are processed in windowed mode.
+ */
+#define MZ_ENTRY_ALIGNMENT 4096
+bool mzIsZipEntryAligned(const ZipEntry* pEntry);
 
 
 /*
@@ -139,17 +219,66 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
 /*
  * Stream the uncompressed data through the supplied function,
  * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
+ * may be called more than once, though small deflated entries are
+ * inflated whole and passed to it in a single call.
  *
  * If processFunction returns false, the operation is abandoned and
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The archive's file position is not used or changed, so different threads
+ * may process entries of the same (open, unchanging) archive concurrently.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Like mzProcessZipEntryContents(), but also computes the CRC of the
+ * uncompressed data in the same pass.  *pCrcOk is set to true iff the
+ * CRC matches the one recorded in the central directory.
+ *
+ * Returns false if the data couldn't be streamed; a CRC mismatch alone
+ * only clears *pCrcOk.  Callers that are about to hash an entry should
+ * use this instead of mzIsZipEntryIntact(), which inflates it again.
+ */
+bool mzProcessZipEntryContentsCheckCrc(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie, bool *pCrcOk);
+
+/*
+ * A cursor for pulling an entry's uncompressed data in caller-sized
+ * pieces, for consumers that can't be driven by a callback.  Treat as
+ * opaque.
+ *
+ * Readers use positional reads and keep their own offset and inflate
+ * state, so any number of them may be open at once, on any threads, on
+ * the same archive.  A single reader must only be used by one thread at
+ * a time.
+ */
+typedef struct ZipEntryReader ZipEntryReader;
+
+/*
+ * Start reading "pEntry" from the beginning.  Returns NULL on failure
+ * (including an unsupported compression method).
+ */
+ZipEntryReader *mzOpenZipEntryReader(const ZipArchive *pArchive,
+    const ZipEntry *pEntry);
+
+/*
+ * Copy up to "len" bytes of uncompressed data into "buf".  Returns the
+ * number of bytes copied, 0 once the whole entry has been returned, or
+ * -1 on a read or inflate error.  The CRC is checked as the last byte is
+ * returned; a mismatch is reported as an error on that call.
+ */
+ssize_t mzReadZipEntryReader(ZipEntryReader *pReader, void *buf, size_t len);
+
+/*
+ * Release a reader.  NULL is ignored.
+ */
+void mzCloseZipEntryReader(ZipEntryReader *pReader);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
@@ -164,10 +293,41 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
  * Inflate and write an entry to a file.
+ *
+ * Output is coalesced into large writes.  If fd is an empty regular file
+ * at offset 0, space for the entry's uncompressed size is reserved first
+ * with fallocate(FALLOC_FL_KEEP_SIZE), so the filesystem can allocate it
+ * in one piece; the file's size is left alone.  Where fallocate() isn't
+ * available (bionic) or the filesystem refuses, nothing is reserved and
+ * the file just grows as it's written.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
+/*
+ * Hooks on the data mzExtractZipEntryToFile() writes, so a caller can
+ * check entries in the same pass that extracts them.
+ *
+ * begin() is called before an entry is written, and returns state for
+ * it, or NULL to leave that entry alone.  update() then sees the data
+ * in order, and end() is told whether the write succeeded; if it
+ * returns false, the extraction fails.  Different entries may be
+ * extracted on different threads at once.
+ */
+typedef struct ZipExtractObserver {
+    void* (*begin)(const ZipEntry* pEntry, void* cookie);
+    void (*update)(void* state, const unsigned char* data, int dataLen);
+    bool (*end)(void* state, bool ok);
+    void* cookie;
+} ZipExtractObserver;
+
+/*
+ * Set (or, with NULL, clear) the observer of "pArchive"'s extractions.
+ * It must stay valid until it's cleared or the archive is closed.
+ */
+void mzSetExtractObserver(ZipArchive* pArchive,
+    const ZipExtractObserver* pObserver);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -190,6 +350,8 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_SYNC - fsync() every extracted file before returning,
+ *                       in batches, so callers don't need a global sync()
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -197,10 +359,28 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2, MZ_EXTRACT_SYNC = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
         void (*callback)(const char *fn, void*), void *cookie);
 
+/*
+ * Same as mzExtractRecursive(), but regular files are extracted by
+ * numThreads threads working in parallel.  All directories are created
+ * before any file is written.  The callback is still invoked once per
+ * unpacked file and never concurrently, but files are not necessarily
+ * reported in archive order.  numThreads <= 1 is the same as calling
+ * mzExtractRecursive().
+ *
+ * Extraction to flash is dominated by per-file latency rather than CPU,
+ * so MZ_EXTRACT_THREADS is a reasonable default even on one core.
+ */
+#define MZ_EXTRACT_THREADS 4
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void*), void *cookie,
+        int numThreads);
+
 #endif /*_MINZIP_ZIP*/
@@ -22,6 +22,7 @@
 #include <unistd.h>
 
 #include "cutils/log.h"
+#include "minzip/Zip.h"
 #include "mtdutils.h"
 
 #define LOG_TAG "flash_image"
@@ -47,17 +48,81 @@ void die(const char *msg, ...) {
 }
 
 void printUsage(char *programName) {
-	fprintf(stderr, "usage: %s [-d] partition file.img\n", programName);
+	fprintf(stderr, "usage: %s [-d] partition source\n", programName);
+	fprintf(stderr, "source is one of:\n");
+	fprintf(stderr, "		file.img\n");
+	fprintf(stderr, "		-		standard input\n");
+	fprintf(stderr, "		zip:package.zip:entry	an entry in a zip package\n");
 	fprintf(stderr, "options:\n");
     fprintf(stderr, "		-d		delete the image file after a successful flash\n");
 }
 
-/* Read an image file and write it to a flash partition. */
+/* Where the image comes from: a file or pipe, or a zip entry that is
+ * inflated as it's read, so nothing has to be staged anywhere first.
+ */
+typedef struct {
+    int fd;
+    ZipArchive zip;
+    ZipEntryReader *reader;
+} ImageSource;
+
+static int open_source(ImageSource *src, const char *name) {
+    src->fd = -1;
+    src->reader = NULL;
+    if (!strcmp(name, "-")) {
+        src->fd = STDIN_FILENO;
+        return 0;
+    }
+    if (strncmp(name, "zip:", 4)) {
+        src->fd = open(name, O_RDONLY);
+        return src->fd < 0 ? -1 : 0;
+    }
+
+    const char *entryName = strchr(name + 4, ':');
+    if (entryName == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *package = strndup(name + 4, entryName - (name + 4));
+    if (package == NULL) return -1;
+    int err = mzOpenZipArchive(package, &src->zip);
+    free(package);
+    if (err != 0) {
+        errno = err > 0 ? err : EINVAL;
+        return -1;
+    }
+
+    const ZipEntry *entry = mzFindZipEntry(&src->zip, entryName + 1);
+    if (entry == NULL) {
+        mzCloseZipArchive(&src->zip);
+        errno = ENOENT;
+        return -1;
+    }
+    src->reader = mzOpenZipEntryReader(&src->zip, entry);
+    if (src->reader == NULL) {
+        mzCloseZipArchive(&src->zip);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill buf unless the source ends first; pipes return short reads. */
+static ssize_t read_source(ImageSource *src, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = src->reader != NULL ?
+                mzReadZipEntryReader(src->reader, buf + got, len - got) :
+                read(src->fd, buf + got, len - got);
+        if (r < 0 && errno == EINTR && src->reader == NULL) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+/* Read an image and write it to a flash partition. */
 int main(int argc, char **argv) {
-    const MtdPartition *ptn;
-    MtdWriteContext *write;
-    void *data;
-    unsigned sz;
     int i;
     char *partitionName = NULL, *imageFile = NULL;
     int deleteImage = 0;
@@ -81,20 +146,31 @@ int main(int argc, char **argv) {
 		return 2;
 	}
 
-
+	// Only a plain file can be deleted afterwards
+	if (!strcmp(imageFile, "-") || !strncmp(imageFile, "zip:", 4))
+		deleteImage = 0;
 
     if (mtd_scan_partitions() <= 0) die("error scanning partitions");
     const MtdPartition *partition = mtd_find_partition_by_name(partitionName);
     if (partition == NULL) die("can't find %s partition", partitionName);
 
-    // If the first part of the file matches the partition, skip writing
+    size_t block_size;
+    if (mtd_partition_info(partition, NULL, &block_size, NULL))
+        die("error getting %s block size", partitionName);
+
+    ImageSource src;
+    if (open_source(&src, imageFile)) die("error opening %s", imageFile);
 
-    int fd = open(imageFile, O_RDONLY);
-    if (fd < 0) die("error opening %s", imageFile);
+    // The first block is written last, so that a partial flash never
+    // looks valid.  Keep all of it, since the source may not be seekable.
+    char *first = malloc(block_size);
+    char *buf = malloc(block_size);
+    if (first == NULL || buf == NULL) die("out of memory");
+    ssize_t firstlen = read_source(&src, first, block_size);
+    if (firstlen <= 0) die("error reading %s header", imageFile);
+    int headerlen = firstlen < HEADER_SIZE ? firstlen : HEADER_SIZE;
 
-    char header[HEADER_SIZE];
-    int headerlen = read(fd, header, sizeof(header));
-    if (headerlen <= 0) die("error reading %s header", imageFile);
+    // If the first part of the image matches the partition, skip writing
 
     MtdReadContext *in = mtd_read_partition(partition);
     if (in == NULL) {
@@ -106,8 +182,8 @@ int main(int argc, char **argv) {
         if (checklen <= 0) {
             LOGW("error reading %s: %s\n", partitionName, strerror(errno));
             // just assume it needs re-writing
-        } else if (checklen == headerlen && !memcmp(header, check, headerlen)) {
-            LOGI("header is the same, not flashing %s\n", argv[1]);
+        } else if (checklen == headerlen && !memcmp(first, check, headerlen)) {
+            LOGI("header is the same, not flashing %s\n", partitionName);
             if (deleteImage)
 				unlink(imageFile);
             return 0;
@@ -115,51 +191,37 @@ int main(int argc, char **argv) {
         mtd_read_close(in);
     }
 
-    // Skip the header (we'll come back to it), write everything else
+    // Blank out the first block (we'll come back to it), write everything
+    // else.  The async writer programs each block while we read the next.
     LOGI("flashing %s from %s\n", partitionName, imageFile);
 
-    MtdWriteContext *out = mtd_write_partition(partition);
+    MtdWriteContext *out = mtd_write_partition_async(partition, 0);
     if (out == NULL) die("error writing %s", partitionName);
+    mtd_write_set_skip_unchanged(out, 1);
 
-    char buf[HEADER_SIZE];
-    memset(buf, 0, headerlen);
-    int wrote = mtd_write_data(out, buf, headerlen);
-    if (wrote != headerlen) die("error writing %s", partitionName);
+    memset(buf, 0, firstlen);
+    ssize_t wrote = mtd_write_data(out, buf, firstlen);
+    if (wrote != firstlen) die("error writing %s", partitionName);
 
-    int len;
-    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    ssize_t len;
+    while ((len = read_source(&src, buf, block_size)) > 0) {
         wrote = mtd_write_data(out, buf, len);
         if (wrote != len) die("error writing %s", partitionName);
     }
     if (len < 0) die("error reading %s", imageFile);
 
+    if (mtd_erase_blocks(out, 0) == (off_t) -1)
+        die("error writing %s", partitionName);
+    LOGI("%d unchanged blocks left alone\n", mtd_write_skipped_blocks(out));
     if (mtd_write_close(out)) die("error closing %s", partitionName);
 
-    // Now come back and write the header last
+    // Now come back and write the first block last
 
     out = mtd_write_partition(partition);
     if (out == NULL) die("error re-opening %s", partitionName);
 
-    wrote = mtd_write_data(out, header, headerlen);
-    if (wrote != headerlen) die("error re-writing %s", partitionName);
-
-    // Need to write a complete block, so write the rest of the first block
-    size_t block_size;
-    if (mtd_partition_info(partition, NULL, &block_size, NULL))
-        die("error getting %s block size", partitionName);
-
-    if (lseek(fd, headerlen, SEEK_SET) != headerlen)
-        die("error rewinding %s", imageFile);
-
-    int left = block_size - headerlen;
-    while (left < 0) left += block_size;
-    while (left > 0) {
-        len = read(fd, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
-        if (len <= 0) die("error reading %s", imageFile);
-        if (mtd_write_data(out, buf, len) != len)
-            die("error writing %s", partitionName);
-        left -= len;
-    }
+    wrote = mtd_write_data(out, first, firstlen);
+    if (wrote != firstlen) die("error re-writing %s", partitionName);
 
     if (mtd_write_close(out)) die("error closing %s", partitionName);
 
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/mount.h>
@@ -34,12 +35,16 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    unsigned int generation;    // bumped by invalidate_mounted_volumes()
+    unsigned int scanned;       // generation "volumes" was read at
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    1,      // generation
+    0       // scanned
 };
 
 static inline void
@@ -56,14 +61,67 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
+/* Read all of a /proc file, which can't be stat()ed for its size.
+ * Returns a malloc()ed, NUL-terminated buffer, or NULL.
+ */
+static char *
+read_proc_file(const char *path, ssize_t *len)
+{
+    size_t allocd = 2048;
+    ssize_t nbytes = 0;
+    char *buf = malloc(allocd);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || buf == NULL) {
+        goto bail;
+    }
+    for (;;) {
+        if (nbytes + 1 >= (ssize_t) allocd) {
+            char *bigger = realloc(buf, allocd * 2);
+            if (bigger == NULL) {
+                goto bail;
+            }
+            buf = bigger;
+            allocd *= 2;
+        }
+        ssize_t n = read(fd, buf + nbytes, allocd - 1 - nbytes);
+        if (n < 0) {
+            goto bail;
+        } else if (n == 0) {
+            break;
+        }
+        nbytes += n;
+    }
+    close(fd);
+    buf[nbytes] = '\0';
+    *len = nbytes;
+    return buf;
+
+bail:
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+void
+invalidate_mounted_volumes()
+{
+    g_mounts_state.generation++;
+}
+
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
+    char *buf;
     const char *bufp;
-    int fd;
     ssize_t nbytes;
 
+    if (g_mounts_state.volumes != NULL &&
+            g_mounts_state.scanned == g_mounts_state.generation) {
+        /* Nothing we know of has been mounted since the last scan.
+         */
+        return 0;
+    }
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -86,16 +144,10 @@ scan_mounted_volumes()
 
     /* Open and read the file contents.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
+    buf = read_proc_file(PROC_MOUNTS_FILENAME, &nbytes);
+    if (buf == NULL) {
         goto bail;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -124,6 +176,21 @@ scan_mounted_volumes()
         matches = sscanf(bufp, "%63s %63s %63s %127s",
                 device, mount_point, filesystem, flags);
 
+        if (matches == 4 &&
+                g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+            const int numv = g_mounts_state.volumes_allocd * 2;
+            MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                    numv * sizeof(*volumes));
+            if (volumes == NULL) {
+                free(buf);
+                errno = ENOMEM;
+                goto bail;
+            }
+            memset(volumes + g_mounts_state.volumes_allocd, 0,
+                    (numv - g_mounts_state.volumes_allocd) * sizeof(*volumes));
+            g_mounts_state.volumes = volumes;
+            g_mounts_state.volumes_allocd = numv;
+        }
         if (matches == 4) {
             device[sizeof(device)-1] = '\0';
             mount_point[sizeof(mount_point)-1] = '\0';
@@ -151,7 +218,9 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
             nbytes--;
         }
     }
+    free(buf);
 
+    g_mounts_state.scanned = g_mounts_state.generation;
     return 0;
 
 bail:
@@ -19,7 +19,12 @@
 
 typedef struct MountedVolume MountedVolume;
 
+/* /proc/mounts is only read again after invalidate_mounted_volumes(),
+ * which anything that mounts a volume, or runs a program that might,
+ * should call.  unmount_mounted_volume() keeps the list current itself.
+ */
 int scan_mounted_volumes(void);
+void invalidate_mounted_volumes(void);
 
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTDUTILS_MTDDEVICE_H_
+#define MTDUTILS_MTDDEVICE_H_
+
+#include <sys/types.h>
+
+/* what mtdutils.c does all its flash I/O through: the kernel's /proc/mtd
+ * and /dev/mtd/mtd%d by default, or the simulator in mtdsim.c.  each call
+ * behaves like the system call it's named after, including setting errno;
+ * ioctl() need only handle MEMGETINFO, MEMERASE, MEMGETBADBLOCK and
+ * ECCGETSTATS.
+ */
+typedef struct {
+    ssize_t (*read_table)(char *buf, size_t size);  // /proc/mtd's contents
+    int (*open)(int index, int flags);              // of partition mtd<index>
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void *data, size_t size);
+    ssize_t (*write)(int fd, const void *data, size_t size);
+    off_t (*lseek)(int fd, off_t offset, int whence);
+    int (*ioctl)(int fd, int request, void *arg);
+} MtdDevice;
+
+/* switch devices; the partitions are read again on the next
+ * mtd_scan_partitions().  only call this with nothing open.
+ */
+void mtd_set_device(const MtdDevice *device);
+
+#endif  // MTDUTILS_MTDDEVICE_H_
@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A simulated NAND flash, each partition an ordinary file, so the code in
+ * mtdutils.c can be run, timed and broken on purpose anywhere.  It acts
+ * like mtdchar on a NAND chip: programming can only clear bits, so a
+ * block has to be erased (back to all 0xff) before it's written again;
+ * erases must be whole, aligned blocks; and each operation takes as long
+ * as the config says.
+ *
+ * The config is a text file of lines like these ('#' starts a comment;
+ * sizes may end in k or M):
+ *
+ *     page 2048                   # the program/read unit; the default
+ *     latency 2000 300 50         # us per block erased, per page
+ *                                 #   programmed, per page read
+ *     partition system 64M 128k system.img
+ *                                 # created if it doesn't exist, and
+ *                                 #   padded out with 0xff if short
+ *     bad system 12               # factory-bad block 12: MEMGETBADBLOCK
+ *                                 #   says so, and erase and write fail
+ *     worn system 40              # a block that erases, but won't program
+ *     ecc system 41 1 0           # every read of block 41 adds 1
+ *                                 #   corrected and 0 failed ECC errors
+ *
+ * Partitions are numbered mtd0, mtd1, ... in the order they're listed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdutils.h"
+#include "mtddevice.h"
+
+#define SIM_MAX_PARTITIONS  32      // as many as mtd_scan_partitions() holds
+#define SIM_MAX_FDS         256
+
+#define SIM_BAD     0x01
+#define SIM_WORN    0x02
+
+typedef struct {
+    unsigned char flags;        // SIM_*
+    unsigned char corrected;    // ECC errors on every read
+    unsigned char failed;
+} SimBlock;
+
+typedef struct {
+    char *name;
+    char *image;
+    unsigned int size;
+    unsigned int erase_size;
+    SimBlock *blocks;
+    struct mtd_ecc_stats ecc;   // the device's counters, as ECCGETSTATS
+} SimPartition;
+
+static SimPartition g_sim_partitions[SIM_MAX_PARTITIONS];
+static int g_sim_partition_count;
+static unsigned int g_sim_page_size = 2048;
+static unsigned int g_sim_erase_us, g_sim_program_us, g_sim_read_us;
+
+// Which partition each open fd is on, plus one; 0 for none.
+static unsigned char g_sim_fds[SIM_MAX_FDS];
+static pthread_mutex_t g_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SimPartition *sim_partition(int fd)
+{
+    if (fd < 0 || fd >= SIM_MAX_FDS || g_sim_fds[fd] == 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &g_sim_partitions[g_sim_fds[fd] - 1];
+}
+
+static void sim_delay(unsigned int us, unsigned int count)
+{
+    unsigned long long total = (unsigned long long) us * count;
+    if (total == 0) return;
+    struct timespec ts;
+    ts.tv_sec = total / 1000000;
+    ts.tv_nsec = (total % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+static unsigned int sim_pages(size_t size)
+{
+    return (size + g_sim_page_size - 1) / g_sim_page_size;
+}
+
+static ssize_t sim_read_table(char *buf, size_t size)
+{
+    size_t len = snprintf(buf, size, "dev:    size   erasesize  name\n");
+    int i;
+    for (i = 0; i < g_sim_partition_count && len < size; ++i) {
+        const SimPartition *p = &g_sim_partitions[i];
+        len += snprintf(buf + len, size - len, "mtd%d: %08x %08x \"%s\"\n",
+                i, p->size, p->erase_size, p->name);
+    }
+    if (len >= size) len = size - 1;
+    return len;
+}
+
+static int sim_open(int index, int flags)
+{
+    if (index < 0 || index >= g_sim_partition_count) {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = open(g_sim_partitions[index].image, flags);
+    if (fd < 0) return -1;
+    if (fd >= SIM_MAX_FDS) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim_fds[fd] = index + 1;
+    pthread_mutex_unlock(&g_sim_lock);
+    return fd;
+}
+
+static int sim_close(int fd)
+{
+    if (sim_partition(fd) == NULL) return -1;
+    pthread_mutex_lock(&g_sim_lock);
+    g_sim_fds[fd] = 0;
+    pthread_mutex_unlock(&g_sim_lock);
+    return close(fd);
+}
+
+static ssize_t sim_read(int fd, void *data, size_t size)
+{
+    SimPartition *p = sim_partition(fd);
+    if (p == NULL) return -1;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) return -1;
+    if (pos >= (off_t) p->size) return 0;
+    if (size > p->size - pos) size = p->size - pos;
+
+    ssize_t r = read(fd, data, size);
+    if (r <= 0) return r;
+    sim_delay(g_sim_read_us, sim_pages(r));
+
+    unsigned int first = pos / p->erase_size;
+    unsigned int last = (pos + r - 1) / p->erase_size;
+    pthread_mutex_lock(&g_sim_lock);
+    for (; first <= last; ++first) {
+        p->ecc.corrected += p->blocks[first].corrected;
+        p->ecc.failed += p->blocks[first].failed;
+    }
+    pthread_mutex_unlock(&g_sim_lock);
+    return r;
+}
+
+static ssize_t sim_write(int fd, const void *data, size_t size)
+{
+    SimPartition *p = sim_partition(fd);
+    if (p == NULL) return -1;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) return -1;
+    if (size == 0) return 0;
+    if (pos + size > p->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    unsigned int block;
+    for (block = pos / p->erase_size;
+         block <= (pos + size - 1) / p->erase_size; ++block) {
+        if (p->blocks[block].flags & (SIM_BAD | SIM_WORN)) {
+            sim_delay(g_sim_program_us, 1);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    // Programming only turns 1s into 0s
+    unsigned char *cells = malloc(size);
+    if (cells == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t r = pread(fd, cells, size, pos);
+    if (r == (ssize_t) size) {
+        size_t i;
+        for (i = 0; i < size; ++i) cells[i] &= ((const unsigned char *) data)[i];
+        r = pwrite(fd, cells, size, pos);
+    } else if (r >= 0) {
+        errno = EIO;
+        r = -1;
+    }
+    free(cells);
+    if (r != (ssize_t) size) return -1;
+
+    sim_delay(g_sim_program_us, sim_pages(size));
+    if (lseek(fd, pos + size, SEEK_SET) < 0) return -1;
+    return size;
+}
+
+static int sim_erase(int fd, SimPartition *p, const struct erase_info_user *e)
+{
+    if (e->length == 0 || e->start % p->erase_size != 0 ||
+        e->length % p->erase_size != 0 || e->start + e->length > p->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char *ones = malloc(p->erase_size);
+    if (ones == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(ones, 0xff, p->erase_size);
+
+    // Block by block, stopping at the first failure, like the driver
+    int r = 0;
+    unsigned int pos;
+    for (pos = e->start; pos < e->start + e->length; pos += p->erase_size) {
+        sim_delay(g_sim_erase_us, 1);
+        if (p->blocks[pos / p->erase_size].flags & SIM_BAD) {
+            errno = EIO;
+            r = -1;
+            break;
+        }
+        if (pwrite(fd, ones, p->erase_size, pos) != (ssize_t) p->erase_size) {
+            r = -1;
+            break;
+        }
+    }
+    free(ones);
+    return r;
+}
+
+static int sim_ioctl(int fd, int request, void *arg)
+{
+    SimPartition *p = sim_partition(fd);
+    if (p == NULL) return -1;
+
+    switch (request) {
+        case MEMGETINFO: {
+            struct mtd_info_user *info = (struct mtd_info_user *) arg;
+            memset(info, 0, sizeof(*info));
+            info->type = MTD_NANDFLASH;
+            info->flags = MTD_CAP_NANDFLASH;
+            info->size = p->size;
+            info->erasesize = p->erase_size;
+            info->writesize = g_sim_page_size;
+            info->oobsize = g_sim_page_size / 32;
+            return 0;
+        }
+
+        case MEMERASE:
+            return sim_erase(fd, p, (const struct erase_info_user *) arg);
+
+        case MEMGETBADBLOCK: {
+            loff_t pos = *(loff_t *) arg;
+            if (pos < 0 || pos >= p->size) {
+                errno = EINVAL;
+                return -1;
+            }
+            return (p->blocks[pos / p->erase_size].flags & SIM_BAD) != 0;
+        }
+
+        case ECCGETSTATS:
+            pthread_mutex_lock(&g_sim_lock);
+            memcpy(arg, &p->ecc, sizeof(p->ecc));
+            pthread_mutex_unlock(&g_sim_lock);
+            return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static const MtdDevice g_sim_device = {
+    sim_read_table,
+    sim_open,
+    sim_close,
+    sim_read,
+    sim_write,
+    lseek,
+    sim_ioctl,
+};
+
+static void sim_reset(void)
+{
+    int i;
+    for (i = 0; i < g_sim_partition_count; ++i) {
+        free(g_sim_partitions[i].name);
+        free(g_sim_partitions[i].image);
+        free(g_sim_partitions[i].blocks);
+    }
+    memset(g_sim_partitions, 0, sizeof(g_sim_partitions));
+    g_sim_partition_count = 0;
+    g_sim_page_size = 2048;
+    g_sim_erase_us = g_sim_program_us = g_sim_read_us = 0;
+}
+
+static int parse_size(const char *s, unsigned int *value)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 0);
+    if (*end == 'k' || *end == 'K') {
+        n *= 1024;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        n *= 1024 * 1024;
+        ++end;
+    }
+    if (end == s || *end != '\0') return -1;
+    *value = n;
+    return 0;
+}
+
+// Make sure the image is there and at least the partition's size,
+// filling anything new with 0xff, as if freshly erased.
+static int sim_create_image(const SimPartition *p)
+{
+    int fd = open(p->image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    off_t end = lseek(fd, 0, SEEK_END);
+    char ones[4096];
+    memset(ones, 0xff, sizeof(ones));
+    while (end >= 0 && end < (off_t) p->size) {
+        size_t n = p->size - end < sizeof(ones) ? p->size - end : sizeof(ones);
+        if (write(fd, ones, n) != (ssize_t) n) {
+            end = -1;
+            break;
+        }
+        end += n;
+    }
+    if (close(fd) != 0 || end < 0) return -1;
+    return 0;
+}
+
+static SimPartition *find_partition(const char *name)
+{
+    int i;
+    for (i = 0; i < g_sim_partition_count; ++i) {
+        if (strcmp(g_sim_partitions[i].name, name) == 0) {
+            return &g_sim_partitions[i];
+        }
+    }
+    return NULL;
+}
+
+// One config line, split into words.  Returns 0, or -1 if it's bad.
+static int parse_line(char **word, int count)
+{
+    if (strcmp(word[0], "page") == 0 && count == 2) {
+        return parse_size(word[1], &g_sim_page_size) == 0 &&
+                g_sim_page_size > 0 ? 0 : -1;
+    }
+
+    if (strcmp(word[0], "latency") == 0 && count == 4) {
+        return parse_size(word[1], &g_sim_erase_us) == 0 &&
+                parse_size(word[2], &g_sim_program_us) == 0 &&
+                parse_size(word[3], &g_sim_read_us) == 0 ? 0 : -1;
+    }
+
+    if (strcmp(word[0], "partition") == 0 && count == 5) {
+        if (g_sim_partition_count == SIM_MAX_PARTITIONS ||
+            find_partition(word[1]) != NULL) {
+            return -1;
+        }
+        SimPartition *p = &g_sim_partitions[g_sim_partition_count];
+        if (parse_size(word[2], &p->size) != 0 ||
+            parse_size(word[3], &p->erase_size) != 0 ||
+            p->erase_size == 0 || p->size == 0 ||
+            p->size % p->erase_size != 0) {
+            return -1;
+        }
+        p->name = strdup(word[1]);
+        p->image = strdup(word[4]);
+        p->blocks = calloc(p->size / p->erase_size, sizeof(SimBlock));
+        ++g_sim_partition_count;  // so sim_reset() frees it either way
+        if (p->name == NULL || p->image == NULL || p->blocks == NULL) {
+            return -1;
+        }
+        if (sim_create_image(p) != 0) {
+            fprintf(stderr, "mtdsim: can't create %s (%s)\n",
+                    p->image, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    SimPartition *p = count >= 3 ? find_partition(word[1]) : NULL;
+    unsigned int block;
+    if (p == NULL || parse_size(word[2], &block) != 0 ||
+        block >= p->size / p->erase_size) {
+        return -1;
+    }
+    if (strcmp(word[0], "bad") == 0 && count == 3) {
+        p->blocks[block].flags |= SIM_BAD;
+        return 0;
+    }
+    if (strcmp(word[0], "worn") == 0 && count == 3) {
+        p->blocks[block].flags |= SIM_WORN;
+        return 0;
+    }
+    if (strcmp(word[0], "ecc") == 0 && count == 5) {
+        unsigned int corrected, failed;
+        if (parse_size(word[3], &corrected) != 0 ||
+            parse_size(word[4], &failed) != 0 ||
+            corrected > 255 || failed > 255) {
+            return -1;
+        }
+        p->blocks[block].corrected = corrected;
+        p->blocks[block].failed = failed;
+        return 0;
+    }
+    return -1;
+}
+
+int mtd_sim_init(const char *config)
+{
+    FILE *f = fopen(config, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mtdsim: can't open %s (%s)\n",
+                config, strerror(errno));
+        return -1;
+    }
+
+    sim_reset();
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char *word[6];
+        int count = 0;
+        char *save;
+        char *w = strtok_r(line, " \t\r\n", &save);
+        while (w != NULL && count < 6) {
+            word[count++] = w;
+            w = strtok_r(NULL, " \t\r\n", &save);
+        }
+        if (count == 0) continue;
+
+        if (w != NULL || parse_line(word, count) != 0) {
+            fprintf(stderr, "mtdsim: %s:%d: bad line\n", config, lineno);
+            fclose(f);
+            sim_reset();
+            return -1;
+        }
+    }
+    fclose(f);
+
+    mtd_set_device(&g_sim_device);
+    return 0;
+}
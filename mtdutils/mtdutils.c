@@ -20,26 +20,42 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <time.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "mtddevice.h"
+#include "mounts.h"
 
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    unsigned char *blocks;  // BLOCK_* state of each eraseblock, or NULL
 };
 
+// Factory-bad blocks don't change while we're running, so the answer to
+// MEMGETBADBLOCK is remembered per partition rather than asked again on
+// every erase and write.  Blocks we fail to program are treated the same.
+#define BLOCK_UNKNOWN   0
+#define BLOCK_GOOD      1
+#define BLOCK_BAD       2
+
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
     size_t consumed;
+    size_t avail;       // bytes of good data in buffer
+    int readahead;      // erase blocks per read(); buffer holds that many
     int fd;
+    MtdStats stats;
+    unsigned long long opened;  // now_us() at open, for throughput
 };
 
 struct MtdWriteContext {
@@ -47,8 +63,150 @@ struct MtdWriteContext {
     char *buffer;
     size_t stored;
     int fd;
+
+    int verify;         // MTD_VERIFY_*
+    char *verify_buf;   // read-back buffer for MTD_VERIFY_FULL and
+                        //   skip_unchanged
+    int skip_unchanged;
+    int skip_erased;
+    int skipped;        // blocks that already held the right data
+    unsigned int crc;   // MTD_VERIFY_DEFERRED: crc32 of the blocks written,
+    off_t *written;     //   and where they went
+    int written_count;
+
+    // Asynchronous mode only (ring != NULL).  buffer is the ring slot
+    // being filled; the writer thread programs the 'queued' slots that
+    // start at ring[next].
+    char **ring;
+    int ring_size;
+    int next;
+    int queued;
+    int error;          // errno of the first failed block, sticky
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Updated by whichever thread does the I/O; only looked at once the
+    // writer has been drained.
+    MtdStats stats;
+    unsigned long long opened;
 };
 
+#define MTD_PROC_FILENAME   "/proc/mtd"
+
+static ssize_t kernel_read_table(char *buf, size_t size)
+{
+    int fd = open(MTD_PROC_FILENAME, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t nbytes = read(fd, buf, size);
+    close(fd);
+    return nbytes;
+}
+
+static int kernel_open(int index, int flags)
+{
+    char mtddevname[32];
+    sprintf(mtddevname, "/dev/mtd/mtd%d", index);
+    return open(mtddevname, flags);
+}
+
+static int kernel_ioctl(int fd, int request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static const MtdDevice g_kernel_device = {
+    kernel_read_table,
+    kernel_open,
+    close,
+    read,
+    write,
+    lseek,
+    kernel_ioctl,
+};
+
+static const MtdDevice *g_mtd_device = &g_kernel_device;
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Account for one operation that began at 'start'.
+static void add_latency(MtdLatency *l, unsigned long long start)
+{
+    unsigned long long us = now_us() - start;
+    int bucket = 0;
+    while (bucket < MTD_STATS_BUCKETS - 1 && (us >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    ++l->count;
+    l->total_us += us;
+    if (us > l->max_us) l->max_us = us;
+    ++l->buckets[bucket];
+}
+
+static int timed_erase(MtdStats *stats, int fd, struct erase_info_user *erase)
+{
+    unsigned long long start = now_us();
+    int r = g_mtd_device->ioctl(fd, MEMERASE, erase);
+    add_latency(&stats->erase, start);
+    return r;
+}
+
+static ssize_t timed_write(MtdStats *stats, int fd, const char *data,
+        size_t size)
+{
+    unsigned long long start = now_us();
+    ssize_t r = g_mtd_device->write(fd, data, size);
+    add_latency(&stats->program, start);
+    if (r > 0) stats->bytes_written += r;
+    return r;
+}
+
+static ssize_t timed_read(MtdStats *stats, int fd, char *data, size_t size)
+{
+    unsigned long long start = now_us();
+    ssize_t r = g_mtd_device->read(fd, data, size);
+    add_latency(&stats->read, start);
+    if (r > 0) stats->bytes_read += r;
+    return r;
+}
+
+static void dump_latency(const char *what, const MtdLatency *l)
+{
+    if (l->count == 0) return;
+    char hist[MTD_STATS_BUCKETS * 11 + 1];
+    int i, len = 0;
+    for (i = 0; i < MTD_STATS_BUCKETS; ++i) {
+        len += snprintf(hist + len, sizeof(hist) - len, " %u", l->buckets[i]);
+    }
+    fprintf(stderr, "mtd:   %s: %u ops, avg %llu us, max %u us;"
+            " log2(us) histogram%s\n", what, l->count,
+            l->total_us / l->count, l->max_us, hist);
+}
+
+// Log what a context did, so slow flashes can be told apart in the field.
+static void dump_stats(const char *verb, const MtdPartition *partition,
+        const MtdStats *stats, unsigned long long opened)
+{
+    unsigned long long ms = (now_us() - opened) / 1000;
+    long long bytes = stats->bytes_written > 0 ?
+            stats->bytes_written : stats->bytes_read;
+    fprintf(stderr, "mtd: %s %s: %lld bytes in %llu ms (%llu KB/s); "
+            "%d retries, %d bad blocks, ECC %d corrected, %d failed\n",
+            verb, partition->name, bytes, ms,
+            ms > 0 ? (unsigned long long) bytes / ms * 1000 / 1024 : 0,
+            stats->retries, stats->bad_blocks,
+            stats->ecc_corrected, stats->ecc_failed);
+    dump_latency("erase", &stats->erase);
+    dump_latency("program", &stats->program);
+    dump_latency("read", &stats->read);
+}
+
 typedef struct {
     MtdPartition *partitions;
     int partitions_allocd;
@@ -61,17 +219,45 @@ static MtdState g_mtd_state = {
     -1      // partition_count
 };
 
-#define MTD_PROC_FILENAME   "/proc/mtd"
+/* Held across a scan, so that a caller on another thread (parallel()
+ * in an updater script) can't see the table while it's half filled in.
+ */
+static pthread_mutex_t g_mtd_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void mtd_set_device(const MtdDevice *device)
+{
+    pthread_mutex_lock(&g_mtd_scan_lock);
+    g_mtd_device = device != NULL ? device : &g_kernel_device;
+    g_mtd_state.partition_count = -1;
+    pthread_mutex_unlock(&g_mtd_scan_lock);
+}
+
+static int scan_partitions_locked();
 
 int
 mtd_scan_partitions()
+{
+    pthread_mutex_lock(&g_mtd_scan_lock);
+    int count = scan_partitions_locked();
+    pthread_mutex_unlock(&g_mtd_scan_lock);
+    return count;
+}
+
+static int
+scan_partitions_locked()
 {
     char buf[2048];
     const char *bufp;
-    int fd;
     int i;
     ssize_t nbytes;
 
+    /* The partition table can't change under us, so once it has been
+     * read, later calls (and the pointers they hand out) stay valid.
+     */
+    if (g_mtd_state.partition_count >= 0) {
+        return g_mtd_state.partition_count;
+    }
+
     if (g_mtd_state.partitions == NULL) {
         const int nump = 32;
         MtdPartition *partitions = malloc(nump * sizeof(*partitions));
@@ -95,17 +281,14 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        free(p->blocks);
+        p->blocks = NULL;
         p->device_index = -1;
     }
 
-    /* Open and read the file contents.
+    /* Read the file contents.
      */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    nbytes = g_mtd_device->read_table(buf, sizeof(buf) - 1);
     if (nbytes < 0) {
         goto bail;
     }
@@ -145,6 +328,10 @@ mtd_scan_partitions()
                 errno = ENOMEM;
                 goto bail;
             }
+            if (mtderasesize > 0) {
+                // Without the map we just ask the driver every time
+                p->blocks = calloc(mtdsize / mtderasesize, 1);
+            }
             g_mtd_state.partition_count++;
         }
 
@@ -193,7 +380,15 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
     char devname[64];
     int rv = -1;
 
+    if (g_mtd_device != &g_kernel_device) {
+        // There's no block device behind a simulated partition
+        printf("Can't mount simulated %s on %s\n", partition->name, mount_point);
+        errno = ENODEV;
+        return -1;
+    }
+
     sprintf(devname, "/dev/block/mtdblock%d", partition->device_index);
+    invalidate_mounted_volumes();
     if (!read_only) {
         rv = mount(devname, mount_point, filesystem, flags, NULL);
     }
@@ -234,14 +429,12 @@ int
 mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size)
 {
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    int fd = open(mtddevname, O_RDONLY);
+    int fd = g_mtd_device->open(partition->device_index, O_RDONLY);
     if (fd < 0) return -1;
 
     struct mtd_info_user mtd_info;
-    int ret = ioctl(fd, MEMGETINFO, &mtd_info);
-    close(fd);
+    int ret = g_mtd_device->ioctl(fd, MEMGETINFO, &mtd_info);
+    g_mtd_device->close(fd);
     if (ret < 0) return -1;
 
     if (total_size != NULL) *total_size = mtd_info.size;
@@ -261,53 +454,132 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDONLY);
+    ctx->fd = g_mtd_device->open(partition->device_index, O_RDONLY);
     if (ctx->fd < 0) {
-        free(ctx);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->opened = now_us();
+    ctx->consumed = 0;
+    ctx->avail = 0;
+    ctx->readahead = 1;
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+int mtd_read_set_readahead(MtdReadContext *ctx, int blocks)
+{
+    if (blocks < 1) blocks = 1;
+    char *buffer = malloc((size_t) blocks * ctx->partition->erase_size);
+    if (buffer == NULL) return -1;
+
+    // Keep anything already read but not yet consumed
+    memcpy(buffer, ctx->buffer + ctx->consumed, ctx->avail - ctx->consumed);
+    ctx->avail -= ctx->consumed;
+    ctx->consumed = 0;
+    free(ctx->buffer);
+    ctx->buffer = buffer;
+    ctx->readahead = blocks;
+    return 0;
+}
+
+// True if all 'size' bytes of data are 'c'.  Once the head is known to
+// match, comparing the data against itself shifted lets memcmp() go a
+// word (or vector) at a time.
+static int block_filled(const char *data, ssize_t size, int c)
+{
+    ssize_t i, head = size < 16 ? size : 16;
+    for (i = 0; i < head; ++i) {
+        if ((unsigned char) data[i] != (unsigned char) c) return 0;
+    }
+    return memcmp(data, data + head, size - head) == 0;
+}
+
+// Read the block at pos, checking the ECC counters.  Returns 0 if the
+// data is good, 1 if it couldn't be read cleanly, -1 if the ECC stats
+// aren't available at all.
+static int read_checked(MtdStats *stats, int fd, off_t pos, char *data,
+        ssize_t size)
 {
     struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    if (g_mtd_device->ioctl(fd, ECCGETSTATS, &before)) {
         fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (g_mtd_device->lseek(fd, pos, SEEK_SET) != pos ||
+        timed_read(stats, fd, data, size) != size) {
+        fprintf(stderr, "mtd: read error at 0x%08lx (%s)\n",
+                pos, strerror(errno));
+        return 1;
+    }
+    if (g_mtd_device->ioctl(fd, ECCGETSTATS, &after)) {
+        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    stats->ecc_corrected += after.corrected - before.corrected;
+    stats->ecc_failed += after.failed - before.failed;
+    if (after.failed != before.failed) {
+        fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08lx\n",
+                after.corrected - before.corrected,
+                after.failed - before.failed, pos);
+        return 1;
+    }
+    return 0;
+}
+
+// Read up to 'count' erase blocks at the current position with one
+// read(), dropping unreadable and all-zero blocks.  If the ECC counters
+// move during the read, each block is read again by itself so only the
+// ones at fault are dropped.  Returns the number of good bytes stored
+// in data (at least one block), or -1 at the end of the partition.
+static ssize_t read_blocks(MtdReadContext *ctx, char *data, int count)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    off_t pos = g_mtd_device->lseek(fd, 0, SEEK_CUR);
+    if (pos == (off_t) -1) return -1;
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        if (lseek(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            fprintf(stderr, "mtd: read error at 0x%08lx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-            return -1;
-        } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08lx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-        } else {
-            int i;
-            for (i = 0; i < size; ++i) {
-                if (data[i] != 0) {
-                    return 0;  // Success!
+        int n = (partition->size - pos) / size;
+        if (n > count) n = count;
+
+        int r = read_checked(&ctx->stats, fd, pos, data, n * size);
+        if (r < 0) return -1;
+
+        ssize_t good = 0;
+        int i;
+        for (i = 0; i < n; ++i) {
+            off_t bpos = pos + i * size;
+            char *block = data + i * size;
+            if (r > 0 && n > 1) {
+                int br = read_checked(&ctx->stats, fd, bpos, block, size);
+                if (br < 0) return -1;
+                if (br > 0) {
+                    ++ctx->stats.bad_blocks;
+                    continue;
                 }
+            } else if (r > 0) {
+                ++ctx->stats.bad_blocks;
+                continue;
+            }
+
+            if (block_filled(block, size, 0)) {
+                fprintf(stderr, "mtd: read all-zero block at 0x%08lx; "
+                        "skipping\n", bpos);
+                ++ctx->stats.bad_blocks;
+                continue;
             }
-            fprintf(stderr, "mtd: read all-zero block at 0x%08lx; skipping\n",
-                    pos);
+            if (block != data + good) memmove(data + good, block, size);
+            good += size;
         }
 
-        pos += partition->erase_size;
+        pos += n * size;
+        if (g_mtd_device->lseek(fd, pos, SEEK_SET) != pos) return -1;
+        if (good > 0) return good;  // Success!
     }
 
     errno = ENOSPC;
@@ -316,10 +588,11 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
 
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    const size_t size = ctx->partition->erase_size;
     ssize_t read = 0;
     while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->avail) {
+            size_t avail = ctx->avail - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
@@ -327,29 +600,39 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        while (ctx->consumed == ctx->avail && len - read >= size) {
+            size_t blocks = (len - read) / size;
+            if (blocks > (size_t) ctx->readahead) blocks = ctx->readahead;
+            ssize_t got = read_blocks(ctx, data + read, blocks);
+            if (got < 0) return -1;
+            read += got;
         }
 
         if (read >= len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        // Read the next blocks into the buffer
+        if (ctx->consumed == ctx->avail && read < (int) len) {
+            ssize_t got = read_blocks(ctx, ctx->buffer, ctx->readahead);
+            if (got < 0) return -1;
             ctx->consumed = 0;
+            ctx->avail = got;
         }
     }
 
     return read;
 }
 
+const MtdStats *mtd_read_stats(const MtdReadContext *ctx)
+{
+    return &ctx->stats;
+}
+
 void mtd_read_close(MtdReadContext *ctx)
 {
-    close(ctx->fd);
+    dump_stats("read", ctx->partition, &ctx->stats, ctx->opened);
+    g_mtd_device->close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
 }
@@ -365,9 +648,7 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
         return NULL;
     }
 
-    char mtddevname[32];
-    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDWR);
+    ctx->fd = g_mtd_device->open(partition->device_index, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
         free(ctx);
@@ -375,52 +656,251 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     }
 
     ctx->partition = partition;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->opened = now_us();
     ctx->stored = 0;
+    ctx->verify = MTD_VERIFY_FULL;
+    ctx->verify_buf = NULL;
+    ctx->skip_unchanged = 0;
+    ctx->skip_erased = 0;
+    ctx->skipped = 0;
+    ctx->crc = 0;
+    ctx->written = NULL;
+    ctx->written_count = 0;
+    ctx->ring = NULL;
     return ctx;
 }
 
-static int write_block(const MtdPartition *partition, int fd, const char *data)
+int mtd_write_set_verify(MtdWriteContext *ctx, int mode)
+{
+    if (mode != MTD_VERIFY_FULL && mode != MTD_VERIFY_ECC &&
+        mode != MTD_VERIFY_DEFERRED) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->verify = mode;
+    return 0;
+}
+
+void mtd_write_set_skip_unchanged(MtdWriteContext *ctx, int enable)
+{
+    ctx->skip_unchanged = enable;
+}
+
+void mtd_write_set_skip_erased(MtdWriteContext *ctx, int enable)
+{
+    ctx->skip_erased = enable;
+}
+
+int mtd_write_skipped_blocks(const MtdWriteContext *ctx)
+{
+    return ctx->skipped;
+}
+
+const MtdStats *mtd_write_stats(const MtdWriteContext *ctx)
+{
+    return &ctx->stats;
+}
+
+static char *get_verify_buf(MtdWriteContext *ctx)
+{
+    if (ctx->verify_buf == NULL) {
+        ctx->verify_buf = malloc(ctx->partition->erase_size);
+    }
+    return ctx->verify_buf;
+}
+
+// Plain table-driven CRC-32 (the zlib polynomial), for deferred verification.
+static unsigned int crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
 {
-    off_t pos = lseek(fd, 0, SEEK_CUR);
+    unsigned int i, j;
+    for (i = 0; i < 256; ++i) {
+        unsigned int c = i;
+        for (j = 0; j < 8; ++j) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc32_table[i] = c;
+    }
+}
+
+static unsigned int crc32_update(unsigned int crc, const char *data, size_t len)
+{
+    const unsigned int *table = crc32_table;
+    pthread_once(&crc32_once, crc32_init);
+
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = table[(crc ^ (unsigned char) *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Check a block just written at pos according to the context's policy.
+// Returns 0 if it's good.
+static int verify_block(MtdWriteContext *ctx, off_t pos, const char *data,
+        const struct mtd_ecc_stats *before)
+{
+    ssize_t size = ctx->partition->erase_size;
+    int fd = ctx->fd;
+
+    if (ctx->verify == MTD_VERIFY_FULL) {
+        if (get_verify_buf(ctx) == NULL) return -1;
+        if (g_mtd_device->lseek(fd, pos, SEEK_SET) != pos ||
+            timed_read(&ctx->stats, fd, ctx->verify_buf, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        if (memcmp(data, ctx->verify_buf, size) != 0) {
+            fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    // No read-back: trust the driver's program status (the write() result)
+    // plus the ECC counters, which some drivers bump on program failures.
+    struct mtd_ecc_stats after;
+    if (before != NULL && g_mtd_device->ioctl(fd, ECCGETSTATS, &after) == 0 &&
+        (after.failed != before->failed ||
+         after.badblocks != before->badblocks)) {
+        fprintf(stderr, "mtd: ECC failure writing 0x%08lx\n", pos);
+        return -1;
+    }
+    return 0;
+}
+
+// Remember a good block for the deferred check in mtd_write_close().
+static int record_block(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    if (ctx->verify != MTD_VERIFY_DEFERRED) return 0;
+
+    if (ctx->written == NULL) {
+        int max = ctx->partition->size / ctx->partition->erase_size;
+        ctx->written = (off_t *) malloc(max * sizeof(off_t));
+        if (ctx->written == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    ctx->written[ctx->written_count++] = pos;
+    ctx->crc = crc32_update(ctx->crc, data, ctx->partition->erase_size);
+    return 0;
+}
+
+// Read back every block written and compare against the running crc.
+static int verify_deferred(MtdWriteContext *ctx)
+{
+    if (ctx->verify != MTD_VERIFY_DEFERRED || ctx->written_count == 0) {
+        return 0;
+    }
+
+    ssize_t size = ctx->partition->erase_size;
+    char *buf = malloc(size);
+    if (buf == NULL) return -1;
+
+    unsigned int crc = 0;
+    int i;
+    for (i = 0; i < ctx->written_count; ++i) {
+        off_t pos = ctx->written[i];
+        if (g_mtd_device->lseek(ctx->fd, pos, SEEK_SET) != pos ||
+            timed_read(&ctx->stats, ctx->fd, buf, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            free(buf);
+            return -1;
+        }
+        crc = crc32_update(crc, buf, size);
+    }
+    free(buf);
+
+    if (crc != ctx->crc) {
+        fprintf(stderr, "mtd: verification error: crc 0x%08x, wrote 0x%08x\n",
+                crc, ctx->crc);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int block_is_bad(const MtdPartition *partition, int fd, off_t pos)
+{
+    unsigned char *state = NULL;
+    if (partition->blocks != NULL && partition->erase_size > 0) {
+        state = &partition->blocks[pos / partition->erase_size];
+        if (*state != BLOCK_UNKNOWN) return *state == BLOCK_BAD;
+    }
+
+    loff_t bpos = pos;
+    int bad = g_mtd_device->ioctl(fd, MEMGETBADBLOCK, &bpos) > 0;
+    if (state != NULL) *state = bad ? BLOCK_BAD : BLOCK_GOOD;
+    return bad;
+}
+
+static void mark_block_bad(const MtdPartition *partition, off_t pos)
+{
+    if (partition->blocks != NULL && partition->erase_size > 0) {
+        partition->blocks[pos / partition->erase_size] = BLOCK_BAD;
+    }
+}
+
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    off_t pos = g_mtd_device->lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    // Erasing leaves a block reading all 0xff, so such a block (padding in
+    // most images) needs the erase alone; programming it changes nothing.
+    const int blank = block_filled(data, size, 0xff);
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (block_is_bad(partition, fd, pos)) {
             fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
+            ++ctx->stats.bad_blocks;
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        // If the block already holds exactly this data, leave it alone
+        if (ctx->skip_unchanged && get_verify_buf(ctx) != NULL &&
+            read_checked(&ctx->stats, fd, pos, ctx->verify_buf, size) == 0 &&
+            memcmp(data, ctx->verify_buf, size) == 0) {
+            if (record_block(ctx, pos, data)) return -1;
+            ++ctx->skipped;
+            return 0;  // fd is left at pos + size by the read
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            if (retry > 0) ++ctx->stats.retries;
+            if (timed_erase(&ctx->stats, fd, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            struct mtd_ecc_stats before;
+            int have_stats = ctx->verify != MTD_VERIFY_FULL &&
+                    g_mtd_device->ioctl(fd, ECCGETSTATS, &before) == 0;
+            if (blank) {
+                if (g_mtd_device->lseek(fd, pos + size, SEEK_SET) != pos + size) continue;
+            } else if (g_mtd_device->lseek(fd, pos, SEEK_SET) != pos ||
+                timed_write(&ctx->stats, fd, data, size) != size) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+                if (ctx->verify != MTD_VERIFY_FULL) continue;
             }
 
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+            if (verify_block(ctx, pos, data, have_stats ? &before : NULL)) {
                 continue;
             }
+            if (record_block(ctx, pos, data)) return -1;
 
             if (retry > 0) {
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
@@ -430,7 +910,9 @@ static int write_block(const MtdPartition *partition, int fd, const char *data)
 
         // Try to erase it once more as we give up on this block
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
+        timed_erase(&ctx->stats, fd, &erase_info);
+        mark_block_bad(partition, pos);
+        ++ctx->stats.bad_blocks;
         pos += partition->erase_size;
     }
 
@@ -439,8 +921,143 @@ static int write_block(const MtdPartition *partition, int fd, const char *data)
     return -1;
 }
 
+static void *write_thread(void *arg)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) arg;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->queued == 0 && !ctx->stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->queued == 0) break;
+
+        const char *data = ctx->ring[ctx->next];
+        int failed = ctx->error;
+        pthread_mutex_unlock(&ctx->lock);
+
+        // After a failure, just drain the queue; the error is reported
+        // to the producer on its next call.
+        int err = 0;
+        if (!failed && write_block(ctx, data)) {
+            err = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (err && !ctx->error) ctx->error = err;
+        ctx->next = (ctx->next + 1) % ctx->ring_size;
+        --ctx->queued;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+MtdWriteContext *mtd_write_partition_async(const MtdPartition *partition,
+        int buffers)
+{
+    if (buffers <= 0) buffers = 4;
+    if (buffers < 2) buffers = 2;
+
+    MtdWriteContext *ctx = mtd_write_partition(partition);
+    if (ctx == NULL) return NULL;
+
+    ctx->ring = (char **) calloc(buffers, sizeof(char *));
+    if (ctx->ring == NULL) goto fail;
+    ctx->ring_size = buffers;
+    ctx->ring[0] = ctx->buffer;
+    int i;
+    for (i = 1; i < buffers; ++i) {
+        ctx->ring[i] = malloc(partition->erase_size);
+        if (ctx->ring[i] == NULL) goto fail;
+    }
+    ctx->next = 0;
+    ctx->queued = 0;
+    ctx->error = 0;
+    ctx->stop = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    if (pthread_create(&ctx->thread, NULL, write_thread, ctx)) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        goto fail;
+    }
+    return ctx;
+
+fail:
+    if (ctx->ring != NULL) {
+        for (i = 1; i < ctx->ring_size; ++i) free(ctx->ring[i]);
+        free(ctx->ring);
+        ctx->ring = NULL;
+    }
+    mtd_write_close(ctx);
+    return NULL;
+}
+
+// Hand the full block in ctx->buffer to the writer thread, and make
+// ctx->buffer the next free slot, waiting for one if the ring is full.
+static int queue_block(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ++ctx->queued;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->queued == ctx->ring_size && !ctx->error) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int err = ctx->error;
+    if (!err) {
+        ctx->buffer = ctx->ring[(ctx->next + ctx->queued) % ctx->ring_size];
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait until every queued block has been written.
+static int drain_blocks(MtdWriteContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queued > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    int err = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t mtd_write_data_async(MtdWriteContext *ctx,
+        const char *data, size_t len)
+{
+    size_t wrote = 0;
+    while (wrote < len) {
+        size_t avail = ctx->partition->erase_size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
+
+        if (ctx->stored == ctx->partition->erase_size) {
+            if (queue_block(ctx)) return -1;
+            ctx->stored = 0;
+        }
+    }
+
+    return wrote;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    if (ctx->ring != NULL) return mtd_write_data_async(ctx, data, len);
+
     size_t wrote = 0;
     while (wrote < len) {
         // Coalesce partial writes into complete blocks
@@ -454,13 +1071,13 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
         // If a complete block was accumulated, write it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+            if (write_block(ctx, ctx->buffer)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
         while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx->partition, ctx->fd, data + wrote)) return -1;
+            if (write_block(ctx, data + wrote)) return -1;
             wrote += ctx->partition->erase_size;
         }
     }
@@ -468,17 +1085,58 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
     return wrote;
 }
 
+static int block_is_erased(MtdWriteContext *ctx, off_t pos)
+{
+    const ssize_t size = ctx->partition->erase_size;
+    if (get_verify_buf(ctx) == NULL ||
+        read_checked(&ctx->stats, ctx->fd, pos, ctx->verify_buf, size) != 0) {
+        return 0;
+    }
+    return block_filled(ctx->verify_buf, size, 0xff);
+}
+
+static void erase_range(MtdWriteContext *ctx, off_t start, off_t length)
+{
+    const off_t size = ctx->partition->erase_size;
+    struct erase_info_user erase_info;
+    if (length <= 0) return;
+
+    // One request for the whole run; the driver may refuse multi-block
+    // erases, in which case fall back to a block at a time.
+    erase_info.start = start;
+    erase_info.length = length;
+    if (length > size && timed_erase(&ctx->stats, ctx->fd, &erase_info) == 0) {
+        return;
+    }
+
+    off_t pos;
+    for (pos = start; pos < start + length; pos += size) {
+        erase_info.start = pos;
+        erase_info.length = size;
+        if (timed_erase(&ctx->stats, ctx->fd, &erase_info) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        }
+    }
+}
+
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        if (ctx->ring != NULL) {
+            if (queue_block(ctx)) return -1;
+        } else {
+            if (write_block(ctx, ctx->buffer)) return -1;
+        }
         ctx->stored = 0;
     }
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
+    // Everything queued has to be on flash before we can use the fd here
+    if (ctx->ring != NULL && drain_blocks(ctx)) return -1;
+
+    off_t pos = g_mtd_device->lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
 
     const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
@@ -488,24 +1146,29 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         return -1;
     }
 
-    // Erase the specified number of blocks
+    // Erase the specified number of blocks, one run of good blocks at a time
+    const ssize_t size = ctx->partition->erase_size;
+    off_t run = pos;
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        int skip = 0;
+        if (block_is_bad(ctx->partition, ctx->fd, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
+            ++ctx->stats.bad_blocks;
+            skip = 1;  // Don't try to erase known factory-bad blocks.
+        } else if (ctx->skip_erased && block_is_erased(ctx, pos)) {
+            ++ctx->skipped;
+            skip = 1;
         }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        if (skip) {
+            erase_range(ctx, run, pos - run);
+            run = pos + size;
         }
-        pos += ctx->partition->erase_size;
+        pos += size;
     }
+    erase_range(ctx, run, pos - run);
 
+    // Leave the fd where the next write should go
+    if (g_mtd_device->lseek(ctx->fd, pos, SEEK_SET) != pos) return -1;
     return pos;
 }
 
@@ -514,8 +1177,31 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
-    if (close(ctx->fd)) r = -1;
+    if (r == 0 && verify_deferred(ctx)) r = -1;
+
+    if (ctx->ring != NULL) {
+        // Stop the writer; after an error there may still be blocks queued
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = 1;
+        if (!ctx->error) ctx->error = EIO;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->thread, NULL);
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+
+        int i;
+        for (i = 0; i < ctx->ring_size; ++i) free(ctx->ring[i]);
+        free(ctx->ring);
+        ctx->buffer = NULL;
+    }
+
+    dump_stats(ctx->stats.bytes_written > 0 ? "wrote" : "erased",
+            ctx->partition, &ctx->stats, ctx->opened);
+    if (g_mtd_device->close(ctx->fd)) r = -1;
     free(ctx->buffer);
+    free(ctx->verify_buf);
+    free(ctx->written);
     free(ctx);
     return r;
 }
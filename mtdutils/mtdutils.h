@@ -21,10 +21,21 @@
 
 typedef struct MtdPartition MtdPartition;
 
+/* reads /proc/mtd the first time; later calls return the same count and
+ * partitions.  returns the number of partitions, or -1.
+ */
 int mtd_scan_partitions(void);
 
 const MtdPartition *mtd_find_partition_by_name(const char *name);
 
+/* use simulated flash, a file per partition, instead of /proc/mtd and
+ * /dev/mtd, e.g. to run or time flashing on a workstation.  the config
+ * file lists the partitions and any bad blocks, ECC errors and latency
+ * to simulate; see mtdsim.c.  call it before mtd_scan_partitions().
+ * returns 0, or -1 if the config can't be used.
+ */
+int mtd_sim_init(const char *config);
+
 /* mount_point is like "/system"
  * filesystem is like "yaffs2"
  */
@@ -46,9 +57,80 @@ MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
 
+/* read up to 'blocks' erase blocks per read() instead of one, for big
+ * sequential reads.  ECC errors are still tracked per block.  returns 0,
+ * or -1 if the bigger buffer can't be allocated.
+ */
+int mtd_read_set_readahead(MtdReadContext *, int blocks);
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 int mtd_write_close(MtdWriteContext *);
 
+/* how mtd_write_data() checks each erase block it writes:
+ *   MTD_VERIFY_FULL     - read it back and compare (the default)
+ *   MTD_VERIFY_ECC      - no read-back; trust the write result and the
+ *                         ECCGETSTATS counters
+ *   MTD_VERIFY_DEFERRED - like MTD_VERIFY_ECC, but mtd_write_close() reads
+ *                         back everything written and checks its crc32
+ * set it before writing any data.  returns 0, or -1 for a bad mode.
+ */
+enum { MTD_VERIFY_FULL, MTD_VERIFY_ECC, MTD_VERIFY_DEFERRED };
+int mtd_write_set_verify(MtdWriteContext *, int mode);
+
+/* with skip_unchanged set, each block is read first (with the same ECC
+ * checks as mtd_read_data()) and is neither erased nor programmed if it
+ * already holds the data being written.  mtd_write_skipped_blocks() says
+ * how many blocks that saved; for an async context, call it after
+ * mtd_erase_blocks(), which waits for the writer.
+ */
+void mtd_write_set_skip_unchanged(MtdWriteContext *, int enable);
+int mtd_write_skipped_blocks(const MtdWriteContext *);
+
+/* with skip_erased set, mtd_erase_blocks() reads each block first and
+ * doesn't erase it if it already reads back as all 0xff; those count as
+ * skipped blocks too.  only the data area is looked at, so don't use this
+ * where the filesystem keeps anything in the OOB area (e.g. yaffs2).
+ */
+void mtd_write_set_skip_erased(MtdWriteContext *, int enable);
+
+/* like mtd_write_partition(), but blocks are erased and written by a
+ * background thread from a ring of 'buffers' erase-block buffers (0 for
+ * the default), so the caller can produce the next block meanwhile.
+ * mtd_write_data() only queues data; a write failure is reported by a
+ * later mtd_write_data(), or by mtd_erase_blocks() or mtd_write_close(),
+ * which both wait for everything queued to reach the flash.
+ */
+MtdWriteContext *mtd_write_partition_async(const MtdPartition *, int buffers);
+
+/* what a context has done so far; also logged when it's closed.
+ * latency histogram bucket i counts operations that took
+ * [2^i, 2^(i+1)) microseconds; the last bucket holds anything longer.
+ * for an async write context, read it after mtd_erase_blocks().
+ */
+#define MTD_STATS_BUCKETS 20
+
+typedef struct {
+    unsigned int count;
+    unsigned long long total_us;
+    unsigned int max_us;
+    unsigned int buckets[MTD_STATS_BUCKETS];
+} MtdLatency;
+
+typedef struct {
+    MtdLatency erase;       // MEMERASE calls
+    MtdLatency program;     // write() calls
+    MtdLatency read;        // read() calls, including read-back checks
+    long long bytes_read;
+    long long bytes_written;
+    int retries;            // extra erase/program attempts
+    int bad_blocks;         // blocks stepped over as bad or unreadable
+    int ecc_corrected;      // soft ECC errors seen while reading
+    int ecc_failed;         // hard ECC errors seen while reading
+} MtdStats;
+
+const MtdStats *mtd_read_stats(const MtdReadContext *);
+const MtdStats *mtd_write_stats(const MtdWriteContext *);
+
 #endif  // MTDUTILS_H_
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "progress.h"
+
+// The time left is worked out from the rate over about the last
+// PROGRESS_SMOOTHING samples, taken once a second.
+#define PROGRESS_SMOOTHING 3
+
+static ProgressMeter *gCurrent = NULL;
+
+static double seconds_since(const struct timeval *then) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - then->tv_sec) + (now.tv_usec - then->tv_usec) / 1e6;
+}
+
+static void format_amount(char *buf, size_t size, const ProgressMeter *m,
+        long long n) {
+    if (m->bytes) {
+        snprintf(buf, size, "%lld MB", n >> 20);
+    } else {
+        snprintf(buf, size, "%lld files", n);
+    }
+}
+
+static void show_text(ProgressMeter *m) {
+    char text[64], done[24], total[24];
+    int elapsed = (int) seconds_since(&m->start);
+
+    format_amount(done, sizeof(done), m, m->done);
+    if (m->total <= 0) {
+        snprintf(text, sizeof(text), "%s%s%d:%02d elapsed",
+                m->done > 0 ? done : "", m->done > 0 ? ", " : "",
+                elapsed / 60, elapsed % 60);
+    } else {
+        format_amount(total, sizeof(total), m, m->total);
+        char *space = strchr(done, ' ');
+        if (space != NULL) *space = '\0';       // "12 of 34 MB"
+        int n = snprintf(text, sizeof(text), "%s of %s", done, total);
+        if (m->rate > 0 && m->bytes && n < (int) sizeof(text)) {
+            n += snprintf(text + n, sizeof(text) - n, ", %.1f MB/s",
+                    m->rate / (1024 * 1024));
+        }
+        if (m->rate > 0 && m->done < m->total && n < (int) sizeof(text)) {
+            int left = (int) ((m->total - m->done) / m->rate + 0.5);
+            snprintf(text + n, sizeof(text) - n, ", %d:%02d left",
+                    left / 60, left % 60);
+        }
+    }
+    ui_set_progress_text(text);
+}
+
+void progress_begin(ProgressMeter *m, const char *what, int bytes,
+        long long total) {
+    memset(m, 0, sizeof(*m));
+    m->what = what;
+    m->bytes = bytes;
+    m->total = total;
+    gettimeofday(&m->start, NULL);
+    m->sample = m->start;
+    gCurrent = m;
+
+    if (total > 0) {
+        ui_show_progress(1.0, 0);
+    } else {
+        ui_show_indeterminate_progress();
+    }
+    show_text(m);
+}
+
+void progress_update(ProgressMeter *m, long long done, long long total) {
+    if (total > 0 && m->total <= 0) ui_show_progress(1.0, 0);
+    m->done = done;
+    m->total = total;
+    if (total > 0) ui_set_progress((float) done / total);
+
+    double dt = seconds_since(&m->sample);
+    if (dt < 1.0) return;
+    double rate = (done - m->sample_done) / dt;
+    if (m->rate <= 0) {
+        m->rate = rate;
+    } else {
+        m->rate += (rate - m->rate) / PROGRESS_SMOOTHING;
+    }
+    gettimeofday(&m->sample, NULL);
+    m->sample_done = done;
+    show_text(m);
+}
+
+void progress_end(ProgressMeter *m) {
+    double seconds = seconds_since(&m->start);
+    if (m->done == 0) {
+        LOGI("%s: %.1f s\n", m->what, seconds);
+    } else if (m->bytes) {
+        LOGI("%s: %lld bytes in %.1f s (%.1f MB/s)\n", m->what, m->done,
+                seconds, seconds > 0 ? m->done / seconds / (1024 * 1024) : 0);
+    } else {
+        LOGI("%s: %lld files in %.1f s\n", m->what, m->done, seconds);
+    }
+    if (gCurrent == m) gCurrent = NULL;
+    ui_reset_progress();
+}
+
+int progress_spawn(const char *path, char *const argv[], pid_t *pid) {
+    // The child keeps the write end open across exec; the read end sees
+    // end of file as soon as it (and anything it started) is gone.
+    int pipefd[2];
+    if (pipe(pipefd)) return -1;
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+
+    *pid = fork();
+    if (*pid == 0) {
+        close(pipefd[0]);
+        execv(path, argv);
+        fprintf(stderr, "E:Can't run %s (%s)\n", path, strerror(errno));
+        _exit(-1);
+    }
+    int saved_errno = errno;
+    close(pipefd[1]);
+    if (*pid < 0) {
+        close(pipefd[0]);
+        errno = saved_errno;
+        return -1;
+    }
+    return pipefd[0];
+}
+
+int progress_wait(pid_t pid, int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        int n = poll(&pfd, 1, 1000);
+        if (n < 0 && errno != EINTR) break;     // fall back on waitpid()
+        if (n > 0) {
+            char c;
+            if (read(fd, &c, 1) <= 0) break;    // the child has exited
+        }
+        if (gCurrent != NULL) {
+            progress_update(gCurrent, gCurrent->done, gCurrent->total);
+        }
+    }
+    close(fd);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return status;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_PROGRESS_H
+#define _RECOVERY_PROGRESS_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+/* Progress of one long operation, shown on the ui.c progress bar with
+ * the amount done, the rate and the time left underneath.  Only one
+ * meter is shown at a time, between progress_begin() and progress_end().
+ */
+typedef struct {
+    const char *what;           // for the log, e.g. "backup"
+    int bytes;                  // units are bytes (otherwise, files)
+    long long total;            // 0 if unknown: the bar is indeterminate
+    long long done;
+    double rate;                // units per second, smoothed
+    struct timeval start;
+    struct timeval sample;      // when "rate" was last updated
+    long long sample_done;
+} ProgressMeter;
+
+// Show the progress bar for a new operation of "total" units.
+void progress_begin(ProgressMeter *m, const char *what, int bytes,
+        long long total);
+
+/* Record that "done" of "total" units are finished; the total may
+ * change as the operation learns more.  Cheap to call often.
+ */
+void progress_update(ProgressMeter *m, long long done, long long total);
+
+// Hide the progress bar and log how long it all took.
+void progress_end(ProgressMeter *m);
+
+/* Run "path" with "argv" in a child process.  Returns an fd that becomes
+ * readable (at end of file) the moment the child exits, or -1 with errno
+ * set; "*pid" is the child.
+ */
+int progress_spawn(const char *path, char *const argv[], pid_t *pid);
+
+/* Wait for the child started by progress_spawn(), keeping the elapsed
+ * time of the meter being shown (if any) up to date meanwhile.  Closes
+ * "fd".  Returns the child's exit status as from waitpid(), or -1.
+ */
+int progress_wait(pid_t pid, int fd);
+
+#endif  /* _RECOVERY_PROGRESS_H */
@@ -20,6 +20,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <stdlib.h>
@@ -36,25 +37,44 @@
 #include "common.h"
 #include "cutils/properties.h"
 #include "firmware.h"
+#include "image.h"
 #include "install.h"
+#include "logger.h"
+#include "manifest.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
+#include "progress.h"
+#include "restore.h"
 #include "roots.h"
+#include "sdindex.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "tar.h"
+#include "trace.h"
+#include "verifier.h"
 
 static const struct option OPTIONS[] = {
   { "send_intent", required_argument, NULL, 's' },
   { "update_package", required_argument, NULL, 'u' },
   { "wipe_data", no_argument, NULL, 'w' },
   { "wipe_cache", no_argument, NULL, 'c' },
+  { "verify_package", required_argument, NULL, 'v' },
+  { "benchmark", required_argument, NULL, 'b' },
+  { "verify_threads", required_argument, NULL, 't' },
+  { "threads", required_argument, NULL, 'j' },
+  { NULL, 0, NULL, 0 },
 };
 
 static const char *COMMAND_FILE = "CACHE:recovery/command";
 static const char *INTENT_FILE = "CACHE:recovery/intent";
 static const char *LOG_FILE = "CACHE:recovery/log";
+static const char *LAST_INSTALL_STATS_FILE = "CACHE:recovery/last_install_stats";
 static const char *SDCARD_PACKAGE_FILE = "SDCARD:update.zip";
 static const char *SDCARD_PATH = "SDCARD:";
 #define SDCARD_PATH_LENGTH 7
 static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
+static const char *BOOT_TRACE_FILE = "CACHE:recovery/last_boot_trace";
+static const char *SNAPSHOT_STORE = "/sdcard/backup_chunks";
 
 /*
  * The recovery tool communicates with the main system through /cache files.
@@ -64,7 +84,16 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  *
  * The arguments which may be supplied in the recovery.command file:
  *   --send_intent=anystring - write the text out to recovery.intent
- *   --update_package=root:path - verify install an OTA package file
+ *   --update_package=root:path - verify install an OTA package file;
+ *       given more than once, all are verified first, then installed in order
+ *   --verify_package=full|pipelined - check package signatures; pipelined
+ *       checks files as they're installed, reading the package only once
+ *   --benchmark=root:path - open, verify and inflate a package, but
+ *       install nothing; report the time taken in LAST_INSTALL_STATS_FILE
+ *   --verify_threads=N - check package digests on N threads; 1 checks
+ *       them serially, and the default is one thread per online CPU
+ *   --threads=N - extract package files and set their permissions on N
+ *       threads; 1 does it serially
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
  *
@@ -148,6 +177,18 @@ check_and_fclose(FILE *fp, const char *name) {
     fclose(fp);
 }
 
+// record where the time went in the last install (or benchmark)
+static void
+save_install_stats(const char *package, int status, int benchmark) {
+    FILE *fp = fopen_root_path(LAST_INSTALL_STATS_FILE, "w");
+    if (fp == NULL) {
+        LOGE("Can't open %s\n", LAST_INSTALL_STATS_FILE);
+        return;
+    }
+    stats_write(fp, package, status, benchmark);
+    check_and_fclose(fp, LAST_INSTALL_STATS_FILE);
+}
+
 // command line args come from, in decreasing precedence:
 //   - the actual command line
 //   - the bootloader control block (one per line, after "recovery")
@@ -204,10 +245,12 @@ get_args(int *argc, char ***argv) {
 
     // --> write the arguments we have back into the bootloader control block
     // always boot into recovery after this (until finish_recovery() is called)
+    // a benchmark changes nothing, so there's no need to repeat it
     strlcpy(boot.command, "boot-recovery", sizeof(boot.command));
     strlcpy(boot.recovery, "recovery\n", sizeof(boot.recovery));
     int i;
     for (i = 1; i < *argc; ++i) {
+        if (!strncmp((*argv)[i], "--benchmark", 11)) continue;
         strlcat(boot.recovery, (*argv)[i], sizeof(boot.recovery));
         strlcat(boot.recovery, "\n", sizeof(boot.recovery));
     }
@@ -234,22 +277,13 @@ finish_recovery(const char *send_intent)
     }
 
     // Copy logs to cache so the system can find out what happened.
-    FILE *log = fopen_root_path(LOG_FILE, "a");
-    if (log == NULL) {
-        LOGE("Can't open %s\n", LOG_FILE);
+    char path[PATH_MAX] = "";
+    if (ensure_root_path_mounted(LOG_FILE) != 0 ||
+        translate_root_path(LOG_FILE, path, sizeof(path)) == NULL) {
+        LOGE("Can't mount %s\n", LOG_FILE);
     } else {
-        FILE *tmplog = fopen(TEMPORARY_LOG_FILE, "r");
-        if (tmplog == NULL) {
-            LOGE("Can't open %s\n", TEMPORARY_LOG_FILE);
-        } else {
-            static long tmplog_offset = 0;
-            fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
-            tmplog_offset = ftell(tmplog);
-            check_and_fclose(tmplog, TEMPORARY_LOG_FILE);
-        }
-        check_and_fclose(log, LOG_FILE);
+        dirCreateHierarchy(path, 0777, NULL, 1);
+        if (logger_save(path) != 0) LOGE("Can't write %s\n", LOG_FILE);
     }
 
     // Reset the bootloader message to revert to a normal main system boot.
@@ -258,14 +292,21 @@ finish_recovery(const char *send_intent)
     set_bootloader_message(&boot);
 
     // Remove the command file, so recovery won't repeat indefinitely.
-    char path[PATH_MAX] = "";
+    // The log is already on disk, and the BCB is written straight to
+    // flash; only the unlink remains to be made to stick.
     if (ensure_root_path_mounted(COMMAND_FILE) != 0 ||
         translate_root_path(COMMAND_FILE, path, sizeof(path)) == NULL ||
         (unlink(path) && errno != ENOENT)) {
         LOGW("Can't unlink %s\n", COMMAND_FILE);
+    } else {
+        char *slash = strrchr(path, '/');
+        if (slash != NULL) *slash = '\0';
+        int dir = open(path, O_RDONLY);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
     }
-
-    sync();  // For good measure.
 }
 
 #define TEST_AMEND 0
@@ -288,30 +329,121 @@ test_amend()
 static int
 erase_root(const char *root)
 {
+    ProgressMeter meter;
     ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
+    progress_begin(&meter, "format", 0, 0);
     ui_print("Formatting %s..", root);
-    return format_root_device(root);
+    int ret = format_root_device(root);
+    progress_end(&meter);
+    return ret;
+}
+
+/* Run a program (argv[0] is looked up in /sbin) with an indeterminate
+ * progress bar and the elapsed time showing.  Returns 0 if it succeeded.
+ */
+static int
+run_with_progress(const char *what, char *const argv[])
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sbin/%s", argv[0]);
+	pid_t pid;
+	int fd = progress_spawn(path, argv, &pid);
+	if (fd < 0) {
+		LOGE("Can't run %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	ProgressMeter meter;
+	progress_begin(&meter, what, 0, 0);
+	int status = progress_wait(pid, fd);
+	progress_end(&meter);
+	return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// The meter shown by backup_progress() during backups and restores
+static ProgressMeter backup_meter;
+
+static void
+backup_progress(const TarProgress *progress, void *cookie)
+{
+	*(TarProgress *) cookie = *progress;
+	if (progress->total_bytes > 0 || progress->total_files <= 0) {
+		backup_meter.bytes = 1;
+		progress_update(&backup_meter, progress->bytes, progress->total_bytes);
+	} else {
+		backup_meter.bytes = 0;
+		progress_update(&backup_meter, progress->files, progress->total_files);
+	}
+}
+
+static int sdcard_shared = 0;	// exported to a USB host
+
+/* Mount the sdcard and keep it indexed while it's here; "path" gets
+ * where it's mounted.  Returns 0, or -1 (quietly) if it can't be.
+ */
+static int
+mount_sdcard(char *path, size_t size)
+{
+	if (ensure_root_path_mounted(SDCARD_PATH) != 0) {
+		return -1;
+	}
+	if (translate_root_path(SDCARD_PATH, path, size) == NULL) {
+		LOGE("Bad path %s\n", SDCARD_PATH);
+		return -1;
+	}
+	if (!sdcard_shared) sdindex_start(path);
+	return 0;
 }
 
+// Newest incremental backup of "partition"; the names sort by date.
+static int
+latest_snapshot(const char *partition, char *path, size_t size)
+{
+	char prefix[strlen(partition)+9];
+	strcpy(prefix, partition);
+	strcat(prefix, "_backup_");
+	char best[NAME_MAX+1] = "";
+
+	DIR *dir = opendir("/sdcard");
+	if (dir == NULL) return -1;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if (strncmp(de->d_name, prefix, strlen(prefix)) == 0 && len > 5 &&
+				strcmp(de->d_name + len - 5, ".snap") == 0 &&
+				strcmp(de->d_name, best) > 0) {
+			strcpy(best, de->d_name);
+		}
+	}
+	closedir(dir);
+	if (best[0] == '\0') return -1;
+	snprintf(path, size, "/sdcard/%s", best);
+	return 0;
+}
+
+#define BACKUP_TAR			0
+#define BACKUP_INCREMENTAL	1
+#define BACKUP_IMAGE		2
+
 static void
-backup_partition(char partition[])
+backup_partition(char partition[], int mode)
 {
 	ui_print("\n- This will BACKUP your %s!", partition);
 	ui_print("\n- Press HOME to confirm, or");
 	ui_print("\n- any other key to abort..");
 	int confirm_item = ui_wait_key();
 	if (confirm_item == KEY_DREAM_HOME) {
-		char path[strlen(partition)];
+		char path[strlen(partition)+3];
+		char sdcard[PATH_MAX];
 		if (strcmp(partition, "data") == 0) {
 			strcpy(path, "DATA:");
 		} else {
 			strcpy(path, "SYSTEM:");
 		}
 	
-		if (ensure_root_path_mounted(path) != 0) {
+		// Images are read from the device, which mustn't be mounted
+		if (mode != BACKUP_IMAGE && ensure_root_path_mounted(path) != 0) {
 			ui_print("Can't mount %s\n", partition);
-		} else if (ensure_root_path_mounted("SDCARD:") != 0) {
+		} else if (mount_sdcard(sdcard, sizeof(sdcard)) != 0) {
 			ui_print("Can't mount sdcard\n");
 		} else {
 		
@@ -320,39 +452,48 @@ backup_partition(char partition[])
 			//create filename
 			time_t rawtime;
 			struct tm * timeinfo;
-			char formattime[25];
+			char formattime[32];
 			time ( &rawtime );
 			timeinfo = localtime ( &rawtime );
-			strftime (formattime,25,"_backup_%y%m%d%H%M%S.tar",timeinfo);
-			char filename[strlen(partition)+37];
+			strftime (formattime,32,
+					mode == BACKUP_IMAGE ? "_backup_%y%m%d%H%M%S.img" :
+					mode == BACKUP_INCREMENTAL ? "_backup_%y%m%d%H%M%S.snap" :
+					"_backup_%y%m%d%H%M%S.tar.gz",timeinfo);
+			char filename[strlen(partition)+40];
 			strcpy(filename, "/sdcard/");
 			strcat(filename, partition);
 			strcat(filename, formattime);
 		
-			//create exclude command
-			char exclude[strlen(partition)+26];
-			strcpy(exclude, "--exclude='");
-			strcat(exclude, partition);
-			strcat(exclude, "/$RFS_LOG.LO$'");
-	
-			int error=0;
-			pid_t pid = fork();
-			if (pid == 0) {
-				error=execl("/sbin/busybox", "busybox", "tar", "-c", exclude, "-f", filename, partition, NULL);
-				_exit(-1);
-			}
-		
-			int status;
-		
-			while (waitpid(pid, &status, WNOHANG) == 0) {
-				ui_print(".");
-				sleep(1);
+			// busybox tar used to be run from / with this exclude pattern
+			char dir[strlen(partition)+2];
+			strcpy(dir, "/");
+			strcat(dir, partition);
+			char exclude[strlen(partition)+14];
+			strcpy(exclude, partition);
+			strcat(exclude, "/$RFS_LOG.LO$");
+
+			progress_begin(&backup_meter, "backup", 1, 0);
+			TarProgress done;
+			int error;
+			if (mode == BACKUP_IMAGE) {
+				error = image_backup(path, filename, backup_progress, &done);
+			} else if (mode == BACKUP_INCREMENTAL) {
+				char previous[PATH_MAX];
+				error = snapshot_create(filename, dir, exclude, SNAPSHOT_STORE,
+						latest_snapshot(partition, previous, sizeof(previous)) == 0 ?
+						previous : NULL, backup_progress, &done);
+			} else {
+				error = tar_create(filename, dir, exclude,
+						TAR_GZIP | TAR_MANIFEST, backup_progress, &done);
 			}
+			progress_end(&backup_meter);
+			sdindex_invalidate();
 			ui_print("\n");
-		
+
 			if (error != 0) {
 				ui_print("Error creating backup. Backup not performed.\n\n");
 			} else {
+				LOGI("backed up %d files, %lld bytes\n", done.files, done.bytes);
 				ui_print("Backup %s complete!\n", partition);
 			}
 		}
@@ -361,6 +502,94 @@ backup_partition(char partition[])
 	}
 }
 
+/* Back up system and data together into one archive.  They're on
+ * separate devices, so each is read on its own thread while this one
+ * writes to the sdcard.
+ */
+static void
+backup_all(void)
+{
+	ui_print("\n- This will BACKUP your system and data!");
+	ui_print("\n- Press HOME to confirm, or");
+	ui_print("\n- any other key to abort..");
+	int confirm_item = ui_wait_key();
+	if (confirm_item != KEY_DREAM_HOME) {
+		ui_print("\nBackup aborted.\n");
+		return;
+	}
+	if (ensure_root_path_mounted("SYSTEM:") != 0) {
+		ui_print("Can't mount system\n");
+		return;
+	}
+	if (ensure_root_path_mounted("DATA:") != 0) {
+		ui_print("Can't mount data\n");
+		return;
+	}
+	char sdcard[PATH_MAX];
+	if (mount_sdcard(sdcard, sizeof(sdcard)) != 0) {
+		ui_print("Can't mount sdcard\n");
+		return;
+	}
+
+	ui_print("\nPerforming backup");
+	time_t rawtime;
+	char filename[64];
+	time(&rawtime);
+	strftime(filename, sizeof(filename),
+			"/sdcard/all_backup_%y%m%d%H%M%S.tar.gz", localtime(&rawtime));
+	static const char *const dirs[] = { "/system", "/data" };
+	static const char *const excludes[] = { "system/$RFS_LOG.LO$",
+			"data/$RFS_LOG.LO$" };
+
+	TarProgress done;
+	memset(&done, 0, sizeof(done));
+	progress_begin(&backup_meter, "backup", 1, 0);
+	int error = tar_create_multi(filename, dirs, excludes, 2,
+			TAR_GZIP | TAR_MANIFEST, backup_progress, &done);
+	progress_end(&backup_meter);
+	sdindex_invalidate();
+	ui_print("\n");
+
+	if (error != 0) {
+		ui_print("Error creating backup. Backup not performed.\n\n");
+	} else {
+		LOGI("backed up %d files, %lld bytes\n", done.files, done.bytes);
+		ui_print("Backup of system and data complete!\n");
+	}
+}
+
+// Whether "name" in /sdcard is a backup to list for restoring
+static int
+backup_listed(const char *name, const char *prefix)
+{
+	size_t len = strlen(name);
+	size_t suffix = strlen(MANIFEST_SUFFIX);
+	if (len > suffix && strcmp(name + len - suffix, MANIFEST_SUFFIX) == 0) {
+		return 0;  // goes with the backup of the same name
+	}
+	return strncmp(name, prefix, strlen(prefix)) == 0 ||
+			strncmp(name, "all_backup_", 11) == 0;
+}
+
+/* Check a tar backup against its manifest before anything is erased.
+ * Returns 0 if it's good or has no manifest (older backups).
+ */
+static int
+verify_backup(const char *filename)
+{
+	char manifest[PATH_MAX];
+	snprintf(manifest, sizeof(manifest), "%s%s", filename, MANIFEST_SUFFIX);
+	if (access(manifest, F_OK) != 0) return 0;
+
+	ui_print("Verifying backup\n");
+	TarProgress done;
+	memset(&done, 0, sizeof(done));
+	progress_begin(&backup_meter, "verify", 1, 0);
+	int error = manifest_verify(filename, backup_progress, &done);
+	progress_end(&backup_meter);
+	return error;
+}
+
 static void
 restore_partition(char partition[])
 {
@@ -375,25 +604,18 @@ restore_partition(char partition[])
     							NULL };
 
     char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
+    SdIndexEntry *entries;
     char **files;
     int total = 0;
-    int i;
+    int i, count;
 
-    if (ensure_root_path_mounted(SDCARD_PATH) != 0) {
+    if (mount_sdcard(path, sizeof(path)) != 0) {
         LOGE("Can't mount %s\n", SDCARD_PATH);
         return;
     }
 
-    if (translate_root_path(SDCARD_PATH, path, sizeof(path)) == NULL) {
-        LOGE("Bad path %s", path);
-        return;
-    }
-
-    dir = opendir(path);
-    if (dir == NULL) {
-        LOGE("Couldn't open directory %s", path);
+    count = sdindex_list(path, SDINDEX_BACKUP, &entries);
+    if (count < 0) {
         return;
     }
     
@@ -401,35 +623,17 @@ restore_partition(char partition[])
     strcpy(prefix, partition);
     strcat(prefix, "_backup_");
 
-    /* count how many files we're looking at */
-    while ((de = readdir(dir)) != NULL) {        
-        if (strncmp(de->d_name, prefix, strlen(prefix)) == 0){
-        	total++;
+    /* put the names in the array for the menu; backups of everything
+     * have the partition in them too */
+    files = (char **) malloc((count + 1) * sizeof(*files));
+    for (i = 0; i < count; i++) {
+        if (backup_listed(entries[i].name, prefix)) {
+            files[total++] = entries[i].name;
+            entries[i].name = NULL;
         }
     }
-
-    /* allocate the array for the file list menu */
-    files = (char **) malloc((total + 1) * sizeof(*files));
     files[total] = NULL;
-
-    /* set it up for the second pass */
-    rewinddir(dir);
-
-    /* put the names in the array for the menu */
-    i = 0;
-    while ((de = readdir(dir)) != NULL) {        
-        if (strncmp(de->d_name, prefix, strlen(prefix)) == 0){
-        	files[i] = (char *) malloc(strlen(de->d_name) + 1);
-            strcpy(files[i], de->d_name);
-            i++;
-        }
-    }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        LOGE("Failure closing directory %s", path);
-        goto out;
-    }
+    sdindex_free(entries, count);
 
     ui_start_menu(headers, files);
     int selected = 0;
@@ -469,29 +673,50 @@ restore_partition(char partition[])
                     	} else {
                     		strcpy(prefix, "SYSTEM:");
                     	}
+                        char filename[strlen(files[chosen_item]) + 9];
+                        strcpy(filename, "/sdcard/");
+                		strcat(filename, files[chosen_item]);
+                        size_t len = strlen(filename);
+
+                        // An image replaces the whole partition; no need to
+                        // format or mount it
+                        if (len > 4 && strcmp(filename + len - 4, ".img") == 0) {
+                            TarProgress done;
+                            ui_print("Performing restore\n");
+                            progress_begin(&backup_meter, "restore", 1, 0);
+                            int error = image_restore(filename, prefix, backup_progress, &done);
+                            progress_end(&backup_meter);
+                            if (error != 0) {
+                                ui_print("Error restoring %s.\n\n", partition);
+                            } else {
+                                ui_print("Restore %s complete!\n", partition);
+                            }
+                        } else {
+                        // Start reading the backup now; the first of it is
+                        // inflated and unpacked while the partition formats
+                        RestoreJob *job = NULL;
+                        int snapshot = len > 5 && strcmp(filename + len - 5, ".snap") == 0;
+                        if (!snapshot && verify_backup(filename) != 0) {
+                            ui_print("Backup is damaged. Restore not performed.\n\n");
+                        } else {
+                        if (!snapshot) job = restore_begin(filename, partition);
                     	erase_root(prefix);
                         ui_print("Performing restore");
                         if (ensure_root_path_mounted(prefix) != 0) {
             				ui_print("Can't mount %s\n", partition);
+                            if (job != NULL) restore_cancel(job);
             			} else {
                         
-                        char filename[strlen(files[chosen_item]) + 9];
-                        strcpy(filename, "/sdcard/");
-                		strcat(filename, files[chosen_item]);
-                        
                         int error=0;
-                        pid_t pid = fork();
-                        if (pid == 0) {
-                            error=execl("/sbin/busybox", "busybox", "tar", "-x", "-f", filename, NULL);
-                            _exit(-1);                           
-                        }
-
-                        int status;
-
-                        while (waitpid(pid, &status, WNOHANG) == 0) {
-                            ui_print(".");
-                            sleep(1);
+                        TarProgress done;
+                        progress_begin(&backup_meter, "restore", 1, 0);
+                        if (snapshot) {
+                            error = snapshot_restore(filename, SNAPSHOT_STORE,
+                                    backup_progress, &done);
+                        } else {
+                            error = job != NULL ? restore_finish(job, backup_progress, &done) : -1;
                         }
+                        progress_end(&backup_meter);
                         ui_print("\n");
 
                         //if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
@@ -501,6 +726,8 @@ restore_partition(char partition[])
                              ui_print("Restore %s complete!\n",partition);
                         }
                         }
+                        }
+                        }
                    
                     } else {
                         ui_print("\nRestore %s aborted.\n", partition);
@@ -511,8 +738,6 @@ restore_partition(char partition[])
         }
     }
 
-out:
-
     for (i = 0; i < total; i++) {
         free(files[i]);
     }
@@ -571,9 +796,10 @@ sdcard_options()
             ui_end_menu();
             
            int confirm_item;
+           char path[PATH_MAX];
             switch (chosen_item) {
                 case SDCARD_MOUNT:
-			if (ensure_root_path_mounted("SDCARD:") != 0) {
+			if (mount_sdcard(path, sizeof(path)) != 0) {
             			ui_print("\nCan't mount sdcard\n");
             		}
             		else {
@@ -582,8 +808,11 @@ sdcard_options()
 		break;
 				
 		case SDCARD_UNMOUNT:
+			// the indexer mustn't have files open on it
+			sdindex_stop();
 			if (ensure_root_path_unmounted("SDCARD:") != 0) {
             			ui_print("\nCan't unmount sdcard\n");
+            			mount_sdcard(path, sizeof(path));
             		}
             		else {
             			ui_print("\nSdcard unmounted from /sdcard\n");
@@ -597,12 +826,15 @@ sdcard_options()
                     		
                     		int error=0;
                     		//error = system("/sbin/busybox rm /data/dalvik-cache/*");
+                    		sdindex_stop();
                     		error = system("/sbin/busybox echo /dev/block/vold/179:0 > /sys/devices/platform/s3c6410-usbgadget/gadget/lun0/file");
                         	ui_print("\n");
 
                         	if (error != 0){
                              	ui_print("\nError mounting sdcard to USB.\n\n");
+                             	mount_sdcard(path, sizeof(path));
                         	} else {
+                             	sdcard_shared = 1;
                              	ui_print("\nSdcard mounted to USB\n");
                         	}
                         }
@@ -621,6 +853,9 @@ sdcard_options()
                         	if (error != 0){
                              	ui_print("\nError unmounting sdcard from USB\n");
                         	} else {
+                             	// the host may have changed anything
+                             	sdcard_shared = 0;
+                             	mount_sdcard(path, sizeof(path));
                              	ui_print("\nSdcard unmounted from USB\n");
                         	}
                         }
@@ -656,11 +891,13 @@ system_options()
                         		NULL };
 
 #define SYSTEM_BACKUP		0
-#define SYSTEM_RESTORE		1
-#define SYSTEM_MOUNT	 	2
-#define SYSTEM_UNMOUNT 		3
+#define SYSTEM_IMAGE		1
+#define SYSTEM_RESTORE		2
+#define SYSTEM_MOUNT	 	3
+#define SYSTEM_UNMOUNT 		4
 
     static char* items[] = { 	"Backup",
+								"Raw image backup",
 			     				"Restore",
 			     				"Mount",
 								"Unmount",
@@ -694,9 +931,13 @@ system_options()
             int confirm_item;
             switch (chosen_item) {
                 case SYSTEM_BACKUP:
-                	backup_partition("system");
+                	backup_partition("system", BACKUP_TAR);
                     break;
 
+				case SYSTEM_IMAGE:
+					backup_partition("system", BACKUP_IMAGE);
+					break;
+
 				case SYSTEM_RESTORE:
 					restore_partition("system");
 					break;
@@ -749,13 +990,17 @@ data_options()
                         		NULL };
 
 #define DATA_BACKUP			0
-#define DATA_RESTORE		1
-#define DATA_CLEAR_DALVIK	2
-#define DATA_WIPE	 		3
-#define DATA_MOUNT	 		4
-#define DATA_UNMOUNT 		5
+#define DATA_INCREMENTAL	1
+#define DATA_IMAGE			2
+#define DATA_RESTORE		3
+#define DATA_CLEAR_DALVIK	4
+#define DATA_WIPE	 		5
+#define DATA_MOUNT	 		6
+#define DATA_UNMOUNT 		7
 
     static char* items[] = { 	"Backup",
+								"Incremental backup",
+								"Raw image backup",
 			     				"Restore",
 			     				"Clear dalvik cache",
 								"Wipe/factory reset",
@@ -792,9 +1037,17 @@ data_options()
             int confirm_item;
             switch (chosen_item) {
                 case DATA_BACKUP:
-                	backup_partition("data");
+                	backup_partition("data", BACKUP_TAR);
                     break;
 
+				case DATA_INCREMENTAL:
+					backup_partition("data", BACKUP_INCREMENTAL);
+					break;
+
+				case DATA_IMAGE:
+					backup_partition("data", BACKUP_IMAGE);
+					break;
+
 				case DATA_RESTORE:
 					restore_partition("data");
 					break;
@@ -810,21 +1063,15 @@ data_options()
             			} else {
                     		ui_print("\nClearing dalvik cache");
                     		
-                    		int error=0;
-                    		error = system("/sbin/busybox rm /data/dalvik-cache/*");
+                    		// progress_end() logs how long the unlinking took
+                    		ProgressMeter meter;
+                    		progress_begin(&meter, "dalvik-cache", 0, 0);
+                    		int error = dirUnlinkChildren("/data/dalvik-cache");
+                    		if (error != 0) {
+                    			LOGW("Can't clear /data/dalvik-cache (%s)\n", strerror(errno));
+                    		}
+                    		progress_end(&meter);
                     		
-                        	//pid_t pid = fork();
-                        	//if (pid == 0) {
-                            	//error=execl("/bin/sh", "sh", "-c", "busybox", "rm", "/data/dalvik-cache/*", NULL);
-                            	//_exit(-1);
-                        	//}
-
-                        	//int status;
-
-                        	//while (waitpid(pid, &status, WNOHANG) == 0) {
-                            	//ui_print(".");
-                            	//sleep(1);
-                        	//}
                         	ui_print("\n");
 
                         	if (error != 0){
@@ -940,7 +1187,7 @@ flash_options()
                 
                   // old kernel flash command
                   //case FLASH_KERNEL:
-                	//backup_partition("data");
+                	//backup_partition("data", BACKUP_TAR);
                   //break;
                   
 
@@ -958,19 +1205,8 @@ flash_options()
             	     //	} else {
                        //	ui_print("\nClearing dalvik cache");
                        // }
-                    		int error=0;
-                        	pid_t pid = fork();
-                        	if (pid == 0) {
-                            	error=execl("/sbin/flash_image", "flash_image", "boot", "/sdcard/updates/zImage", NULL);
-                            	_exit(-1);
-                        	}
-
-                        	int status;
-
-                        	while (waitpid(pid, &status, WNOHANG) == 0) {
-                            	ui_print(".");
-                            	sleep(1);
-                        	}
+                    		char *args[] = { "flash_image", "boot", "/sdcard/updates/zImage", NULL };
+                    		int error = run_with_progress("flash_image", args);
                         	ui_print("\n");
 
                         	if (error != 0){
@@ -1000,19 +1236,8 @@ flash_options()
             	     //	} else {
                        //	ui_print("\nClearing dalvik cache");
                        // }
-                    		int error=0;
-                        	pid_t pid = fork();
-                        	if (pid == 0) {
-                            	error=execl("/sbin/flash_image", "flash_image", "boot3", "/sdcard/updates/logo.png", NULL);
-                            	_exit(-1);
-                        	}
-
-                        	int status;
-
-                        	while (waitpid(pid, &status, WNOHANG) == 0) {
-                            	ui_print(".");
-                            	sleep(1);
-                        	}
+                    		char *args[] = { "flash_image", "boot3", "/sdcard/updates/logo.png", NULL };
+                    		int error = run_with_progress("flash_image", args);
                         	ui_print("\n");
 
                         	if (error != 0){
@@ -1044,19 +1269,8 @@ flash_options()
                     	//	ui_print("\nClearing dalvik cache");
                         //}
                     		
-                    		int error=0;
-                        	pid_t pid = fork();
-                        	if (pid == 0) {
-                            	error=execl("/sbin/flash_image", "flash_image", "recovery", "/sdcard/updates/recovery.rfs", NULL);
-                            	_exit(-1);
-                        	}
-
-                        	int status;
-
-                        	while (waitpid(pid, &status, WNOHANG) == 0) {
-                            	ui_print(".");
-                            	sleep(1);
-                        	}
+                    		char *args[] = { "flash_image", "recovery", "/sdcard/updates/recovery.rfs", NULL };
+                    		int error = run_with_progress("flash_image", args);
                         	ui_print("\n");
 
                         	if (error != 0){
@@ -1088,6 +1302,35 @@ flash_options()
 }
 
 
+// list the .zip files at the top of the sdcard, for a menu; returns
+// how many there are, or -1
+static int
+list_update_files(SdIndexEntry **list)
+{
+    char path[PATH_MAX] = "";
+
+    if (mount_sdcard(path, sizeof(path)) != 0) {
+        LOGE("Can't mount %s\n", SDCARD_PATH);
+        return -1;
+    }
+    return sdindex_list(path, SDINDEX_ZIP, list);
+}
+
+// "name", or "name (damaged)" if the index found something wrong
+static char *
+update_file_label(const SdIndexEntry *e)
+{
+    const char *problem = sdindex_problem(e);
+    char *label = (char *) malloc(strlen(e->name) +
+            (problem != NULL ? strlen(problem) + 3 : 0) + 1);
+    if (problem != NULL) {
+        sprintf(label, "%s (%s)", e->name, problem);
+    } else {
+        strcpy(label, e->name);
+    }
+    return label;
+}
+
 static void
 choose_update_file()
 {
@@ -1101,66 +1344,18 @@ choose_update_file()
     							"",
                         		NULL };
 
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    char **files;
-    int total = 0;
+    SdIndexEntry *files;
     int i;
+    int total = list_update_files(&files);
+    if (total < 0) return;
 
-    if (ensure_root_path_mounted(SDCARD_PATH) != 0) {
-        LOGE("Can't mount %s\n", SDCARD_PATH);
-        return;
-    }
-
-    if (translate_root_path(SDCARD_PATH, path, sizeof(path)) == NULL) {
-        LOGE("Bad path %s", path);
-        return;
-    }
-
-    dir = opendir(path);
-    if (dir == NULL) {
-        LOGE("Couldn't open directory %s", path);
-        return;
-    }
-
-    /* count how many files we're looking at */
-    while ((de = readdir(dir)) != NULL) {
-        char *extension = strrchr(de->d_name, '.');
-        if (extension == NULL || de->d_name[0] == '.') {
-            continue;
-        } else if (!strcasecmp(extension, ".zip")) {
-            total++;
-        }
-    }
-
-    /* allocate the array for the file list menu */
-    files = (char **) malloc((total + 1) * sizeof(*files));
-    files[total] = NULL;
-
-    /* set it up for the second pass */
-    rewinddir(dir);
-
-    /* put the names in the array for the menu */
-    i = 0;
-    while ((de = readdir(dir)) != NULL) {
-        char *extension = strrchr(de->d_name, '.');
-        if (extension == NULL || de->d_name[0] == '.') {
-            continue;
-        } else if (!strcasecmp(extension, ".zip")) {
-            files[i] = (char *) malloc(SDCARD_PATH_LENGTH + strlen(de->d_name) + 1);
-            strcpy(files[i], de->d_name);
-            i++;
-        }
-    }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        LOGE("Failure closing directory %s", path);
-        goto out;
+    char **labels = (char **) malloc((total + 1) * sizeof(*labels));
+    for (i = 0; i < total; i++) {
+        labels[i] = update_file_label(&files[i]);
     }
+    labels[total] = NULL;
 
-    ui_start_menu(headers, files);
+    ui_start_menu(headers, labels);
     int selected = 0;
     int chosen_item = -1;
 
@@ -1188,15 +1383,20 @@ choose_update_file()
             ui_end_menu();
 
             ui_print("\n- Installing new image!");
+            const char *problem = sdindex_problem(&files[chosen_item]);
+            if (problem != NULL) {
+                ui_print("\n- Warning: this zip looks %s!", problem);
+            }
             ui_print("\n- Press HOME to confirm, or");
             ui_print("\n- any other key to abort..");
             int confirm_apply = ui_wait_key();
             if (confirm_apply == KEY_DREAM_HOME) {
                 ui_print("\nInstall from sdcard...\n");
-                char package_name[SDCARD_PATH_LENGTH + strlen(files[chosen_item]) + 1];
+                char package_name[SDCARD_PATH_LENGTH + strlen(files[chosen_item].name) + 1];
                 strcpy(package_name, SDCARD_PATH);
-                strcat(package_name, files[chosen_item]);
+                strcat(package_name, files[chosen_item].name);
                 int status = install_package(package_name);
+                save_install_stats(package_name, status, 0);
                 if (status != INSTALL_SUCCESS) {
                     ui_set_background(BACKGROUND_ICON_ERROR);
                     ui_print("Installation aborted.\n");
@@ -1218,12 +1418,157 @@ choose_update_file()
         }
     }
 
-out:
+    for (i = 0; i < total; i++) {
+        free(labels[i]);
+    }
+    free(labels);
+    sdindex_free(files, total);
+}
+
+#define MAX_QUEUED_PACKAGES 8
 
+// install several packages, recording one set of figures for the lot
+static int
+install_queue(const char *const *packages, int count)
+{
+    int status = install_packages(packages, count);
+
+    char names[PATH_MAX] = "";
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (i > 0) strlcat(names, ",", sizeof(names));
+        strlcat(names, packages[i], sizeof(names));
+    }
+    save_install_stats(names, status, 0);
+    return status;
+}
+
+static void
+queue_update_files()
+{
+    static char* headers[] = {  "",
+								"",
+    							"",
+    							"Queue update ZIP files",
+    							"",
+    							"OK adds or removes a file;",
+    							"installs run in queue order",
+                        		"Back returns to main menu",
+    							"",
+                        		NULL };
+
+    SdIndexEntry *files;
+    int i;
+    int total = list_update_files(&files);
+    if (total < 0) return;
+
+    // items[0] starts the install; items[i + 1] shows files[i] and
+    // where it is in the queue, if it's there
+    char **items = (char **) malloc((total + 2) * sizeof(*items));
+    char **labels = (char **) malloc((total + 1) * sizeof(*labels));
+    char *queue[MAX_QUEUED_PACKAGES];
+    int position[total + 1];        // files[i] is queue[position[i] - 1]
+    int queued = 0;
+    items[0] = strdup("Install queued zips");
     for (i = 0; i < total; i++) {
-        free(files[i]);
+        labels[i] = update_file_label(&files[i]);
+        items[i + 1] = (char *) malloc(strlen(labels[i]) + 8);
+        sprintf(items[i + 1], "    %s", labels[i]);
+        position[i] = 0;
     }
-    free(files);
+    items[total + 1] = NULL;
+
+    ui_start_menu(headers, items);
+    int selected = 0;
+
+    finish_recovery(NULL);
+    ui_reset_progress();
+    for (;;) {
+        int key = ui_wait_key();
+        int visible = ui_text_visible();
+
+        if (key == KEY_DREAM_BACK) {
+            break;
+        } else if ((key == KEY_DOWN || key == KEY_DREAM_VOLUMEDOWN) && visible) {
+            ++selected;
+            selected = ui_menu_select(selected);
+        } else if ((key == KEY_UP || key == KEY_DREAM_VOLUMEUP) && visible) {
+            --selected;
+            selected = ui_menu_select(selected);
+        } else if (key == KEY_I5700_CENTER && visible && selected > 0) {
+            int f = selected - 1;
+            if (position[f] > 0) {
+                // take it out, and move the ones behind it up
+                int j;
+                for (j = 0; j < total; j++) {
+                    if (position[j] > position[f]) position[j]--;
+                }
+                position[f] = 0;
+                queued--;
+            } else if (queued < MAX_QUEUED_PACKAGES) {
+                position[f] = ++queued;
+            }
+            for (i = 0; i < total; i++) {
+                if (position[i] > 0) {
+                    sprintf(items[i + 1], "[%d] %s", position[i], labels[i]);
+                } else {
+                    sprintf(items[i + 1], "    %s", labels[i]);
+                }
+            }
+            ui_start_menu(headers, items);
+            selected = ui_menu_select(selected);
+        } else if (key == KEY_I5700_CENTER && visible && queued > 0) {
+            ui_end_menu();
+
+            int damaged = 0;
+            for (i = 0; i < total; i++) {
+                if (position[i] == 0) continue;
+                queue[position[i] - 1] = (char *) malloc(
+                        SDCARD_PATH_LENGTH + strlen(files[i].name) + 1);
+                strcpy(queue[position[i] - 1], SDCARD_PATH);
+                strcat(queue[position[i] - 1], files[i].name);
+                if (sdindex_problem(&files[i]) != NULL) damaged++;
+            }
+
+            ui_print("\n- Installing %d zips in order!", queued);
+            if (damaged > 0) {
+                ui_print("\n- Warning: %d of them look damaged", damaged);
+                ui_print("\n  or unsigned!");
+            }
+            ui_print("\n- Press HOME to confirm, or");
+            ui_print("\n- any other key to abort..");
+            int confirm_apply = ui_wait_key();
+            if (confirm_apply == KEY_DREAM_HOME) {
+                ui_print("\nInstall from sdcard...\n");
+                int status = install_queue((const char *const *) queue, queued);
+                if (status != INSTALL_SUCCESS) {
+                    ui_set_background(BACKGROUND_ICON_ERROR);
+                    ui_print("Installation aborted.\n");
+                } else if (firmware_update_pending()) {
+                    ui_print("\nReboot via home+back or menu\n"
+                             "to complete installation.\n");
+                } else {
+                    ui_print("\nInstall from sdcard complete.\n");
+                }
+            } else {
+                ui_print("\nInstallation aborted.\n");
+            }
+            for (i = 0; i < queued; i++) {
+                free(queue[i]);
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < total + 1; i++) {
+        free(items[i]);
+    }
+    free(items);
+    for (i = 0; i < total; i++) {
+        free(labels[i]);
+    }
+    free(labels);
+    sdindex_free(files, total);
 }
 
 //32 character length
@@ -1244,21 +1589,29 @@ prompt_and_wait()
 // these constants correspond to elements of the items[] list.
 #define ITEM_REBOOT			0
 #define ITEM_APPLY_ZIP		1
-#define ITEM_DATA_OPTIONS	2
-#define ITEM_SYSTEM_OPTIONS	3
-#define ITEM_SDCARD_OPTIONS	4
-#define ITEM_FLASH_OPTIONS	5
-#define ITEM_CONSOLE       	6
+#define ITEM_QUEUE_ZIPS		2
+#define ITEM_DATA_OPTIONS	3
+#define ITEM_SYSTEM_OPTIONS	4
+#define ITEM_BACKUP_ALL		5
+#define ITEM_SDCARD_OPTIONS	6
+#define ITEM_FLASH_OPTIONS	7
+#define ITEM_CONSOLE       	8
 
 	static char* items[] = {"Reboot system now",
 							"Apply zip from Sdcard",
+							"Queue zips from Sdcard",
 							"Data options",
 							"System options",
+							"Backup system and data",
 							"Sdcard options",
 							"Flash options",
 							"Go to Console",
 							NULL };
 
+    // start indexing the sdcard while the user reads the menu
+    char sdcard[PATH_MAX];
+    mount_sdcard(sdcard, sizeof(sdcard));
+
     ui_start_menu(headers, items);
     int selected = 0;
     int chosen_item = -1;
@@ -1291,6 +1644,10 @@ prompt_and_wait()
                 case ITEM_APPLY_ZIP:
                     choose_update_file();
                     break;
+
+                case ITEM_QUEUE_ZIPS:
+                    queue_update_files();
+                    break;
                     
                 case ITEM_DATA_OPTIONS:
                 	data_options();
@@ -1299,6 +1656,10 @@ prompt_and_wait()
                 case ITEM_SYSTEM_OPTIONS:
                 	system_options();
                 	break;
+
+                case ITEM_BACKUP_ALL:
+                	backup_all();
+                	break;
                 	
                 case ITEM_SDCARD_OPTIONS:
                 	sdcard_options();
@@ -1311,6 +1672,7 @@ prompt_and_wait()
                 case ITEM_CONSOLE:
                     ui_print("\nGoing to the Console!\n");
 		    do_reboot = 0;
+		    sdindex_stop();	// leave the sdcard free to unmount
                     gr_exit();
                     break;
             }
@@ -1337,30 +1699,69 @@ print_property(const char *key, const char *name, void *cookie)
     fprintf(stderr, "%s=%s\n", key, name);
 }
 
+static void *
+ui_init_thread(void *cookie)
+{
+    ui_init();
+    trace_point("ui_init");
+    return NULL;
+}
+
+// the startup timeline, to the log and to cache
+static void
+save_boot_trace()
+{
+    fprintf(stderr, "Startup trace (seconds since boot, since previous):\n");
+    trace_write(stderr);
+    fprintf(stderr, "\n");
+
+    FILE *fp = fopen_root_path(BOOT_TRACE_FILE, "w");
+    if (fp == NULL) {
+        LOGW("Can't open %s\n", BOOT_TRACE_FILE);
+        return;
+    }
+    trace_write(fp);
+    check_and_fclose(fp, BOOT_TRACE_FILE);
+}
+
 int
 main(int argc, char **argv)
 {
+    trace_point("main");
     time_t start = time(NULL);
 
     // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    if (logger_init(TEMPORARY_LOG_FILE) != 0) {
+        freopen(TEMPORARY_LOG_FILE, "a", stdout);
+        freopen(TEMPORARY_LOG_FILE, "a", stderr);
+    }
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
     fprintf(stderr, "Starting recovery on %s", ctime(&start));
+    trace_point("logger_init");
 
     tcflow(STDIN_FILENO, TCOOFF);
     
 //    char prop_value[PROPERTY_VALUE_MAX];
 //    property_get("ro.build.display.id", &prop_value, "not set");
 
-    ui_init();
+    // The screen and input devices don't depend on the arguments, so
+    // bring them up while get_args() reads misc and mounts cache.
+    pthread_t ui_thread;
+    int ui_async = pthread_create(&ui_thread, NULL, ui_init_thread, NULL) == 0;
+    if (!ui_async) ui_init_thread(NULL);
 //    ui_print("Build: ");
 //    ui_print(prop_value);
 //    ui_print("\n    by LeshaK (forum.leshak.com)\n\n");
     get_args(&argc, &argv);
+    trace_point("get_args");
+    if (ui_async) pthread_join(ui_thread, NULL);
 
     int previous_runs = 0;
     const char *send_intent = NULL;
-    const char *update_package = NULL;
+    const char *update_packages[MAX_QUEUED_PACKAGES];
+    int num_update_packages = 0;
+    const char *benchmark_package = NULL;
     int wipe_data = 0, wipe_cache = 0;
 
     int arg;
@@ -1368,9 +1769,28 @@ main(int argc, char **argv)
         switch (arg) {
         case 'p': previous_runs = atoi(optarg); break;
         case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
+        case 'u':
+            // more than one makes a queue, installed in the order given
+            if (num_update_packages < MAX_QUEUED_PACKAGES) {
+                update_packages[num_update_packages++] = optarg;
+            } else {
+                LOGE("Too many packages; ignoring %s\n", optarg);
+            }
+            break;
         case 'w': wipe_data = wipe_cache = 1; break;
         case 'c': wipe_cache = 1; break;
+        case 'b': benchmark_package = optarg; break;
+        case 't': verify_set_threads(atoi(optarg)); break;
+        case 'j': install_set_threads(atoi(optarg)); break;
+        case 'v':
+            if (!strcmp(optarg, "full")) {
+                install_set_verify_mode(INSTALL_VERIFY_FULL);
+            } else if (!strcmp(optarg, "pipelined")) {
+                install_set_verify_mode(INSTALL_VERIFY_PIPELINED);
+            } else {
+                LOGE("Unknown verify mode \"%s\"\n", optarg);
+            }
+            break;
         case '?':
             LOGE("Invalid command argument\n");
             continue;
@@ -1394,11 +1814,21 @@ main(int argc, char **argv)
     if (register_update_commands(&ctx)) {
         LOGE("Can't install update commands\n");
     }
+    trace_point("ready");
+    save_boot_trace();
 
     int status = INSTALL_SUCCESS;
 
-    if (update_package != NULL) {
-        status = install_package(update_package);
+    if (benchmark_package != NULL) {
+        status = install_benchmark(benchmark_package);
+        save_install_stats(benchmark_package, status, 1);
+        if (status != INSTALL_SUCCESS) ui_print("Benchmark failed.\n");
+    } else if (num_update_packages == 1) {
+        status = install_package(update_packages[0]);
+        save_install_stats(update_packages[0], status, 0);
+        if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
+    } else if (num_update_packages > 1) {
+        status = install_queue(update_packages, num_update_packages);
         if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
     } else if (wipe_data || wipe_cache) {
         if (wipe_data && erase_root("DATA:")) status = INSTALL_ERROR;
@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>  // for makedev()
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "common.h"
+#include "gzblock.h"
+#include "manifest.h"
+#include "restore.h"
+
+// Unpacked data waiting for the writer is limited to this much, which is
+// also about how far the reading can get ahead while the target formats.
+#define RESTORE_QUEUE_BYTES (8 * 1024 * 1024)
+#define RESTORE_DATA_SIZE   (128 * 1024)
+
+enum { OP_ENTRY, OP_DATA, OP_END };
+
+typedef struct RestoreOp {
+    struct RestoreOp *next;
+    int type;
+    TarEntry entry;             // OP_ENTRY; the strings are in data[]
+    size_t len;
+    char data[];
+} RestoreOp;
+
+struct RestoreJob {
+    int fd;
+    GzBlockReader *gz;          // NULL for an uncompressed backup
+    TarReader *tar;
+    char *only;                 // restore just this directory, if not NULL
+    Manifest manifest;          // to go straight to "only"'s entries
+    int selective;              // ... if there is one and we can seek
+    pthread_t unpacker;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // anything below changed
+    RestoreOp *head;
+    RestoreOp *tail;
+    size_t queued;              // bytes of ops in the queue
+    int unpacked;               // the unpacker has queued everything
+    int ready;                  // the writer may start
+    int cancel;
+    int failed;
+    int written;                // the writer has stopped
+    TarProgress progress;       // what the writer has done
+};
+
+static ssize_t read_file(void *cookie, void *data, size_t len) {
+    RestoreJob *job = (RestoreJob *) cookie;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(job->fd, (char *) data + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            LOGE("Can't read backup (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+static ssize_t read_gz(void *cookie, void *data, size_t len) {
+    return gzblock_read(((RestoreJob *) cookie)->gz, data, len);
+}
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Refuse names that would land outside "/" of the partition's tree.
+static int name_ok(const char *name) {
+    const char *p = name;
+    if (*name == '\0') return 0;
+    while (*p != '\0') {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+        while (*p != '\0' && *p != '/') ++p;
+        while (*p == '/') ++p;
+    }
+    return 1;
+}
+
+// Whether "name" is "dir" or something under it.
+static int name_under(const char *name, const char *dir) {
+    size_t len = strlen(dir);
+    return strncmp(name, dir, len) == 0 &&
+            (name[len] == '\0' || name[len] == '/');
+}
+
+static RestoreOp *new_op(int type, size_t len) {
+    RestoreOp *op = malloc(sizeof(*op) + len);
+    if (op != NULL) {
+        memset(op, 0, sizeof(*op));
+        op->type = type;
+        op->len = len;
+    }
+    return op;
+}
+
+// Hand "op" to the writer, waiting while the queue is full.
+static int queue_op(RestoreJob *job, RestoreOp *op) {
+    pthread_mutex_lock(&job->lock);
+    while (!job->cancel && !job->failed && job->head != NULL &&
+            job->queued + op->len > RESTORE_QUEUE_BYTES) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    if (job->cancel || job->failed) {
+        pthread_mutex_unlock(&job->lock);
+        free(op);
+        return -1;
+    }
+    if (job->tail != NULL) {
+        job->tail->next = op;
+    } else {
+        job->head = op;
+    }
+    job->tail = op;
+    job->queued += op->len;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+static int queue_entry(RestoreJob *job, const TarEntry *entry) {
+    size_t name_len = strlen(entry->name);
+    size_t link_len = strlen(entry->link);
+    RestoreOp *op = new_op(OP_ENTRY, name_len + link_len + 2);
+    if (op == NULL) return -1;
+    op->entry = *entry;
+    memcpy(op->data, entry->name, name_len + 1);
+    memcpy(op->data + name_len + 1, entry->link, link_len + 1);
+    op->entry.name = op->data;
+    op->entry.link = op->data + name_len + 1;
+    return queue_op(job, op);
+}
+
+/* Queue the operations for "entry", which "tar" is at.  If "want" isn't
+ * NULL, it's the name the entry must have.  Returns 0 to go on, 1 if the
+ * job has stopped, or -1 on error.
+ */
+static int unpack_entry(RestoreJob *job, TarEntry *entry, const char *want) {
+    // Strip the trailing '/' of directories
+    size_t len = strlen(entry->name);
+    char name[PATH_MAX];
+    if (len >= sizeof(name)) {
+        LOGE("Name too long in backup\n");
+        return -1;
+    }
+    memcpy(name, entry->name, len + 1);
+    while (len > 1 && name[len - 1] == '/') name[--len] = '\0';
+    if (!name_ok(name)) {
+        LOGE("Bad name in backup: %s\n", name);
+        return -1;
+    }
+    if (want != NULL && strcmp(name, want) != 0) {
+        LOGE("%s isn't where its manifest says\n", want);
+        return -1;
+    }
+    if (job->only != NULL && !name_under(name, job->only)) return 0;
+    entry->name = name;
+    if (queue_entry(job, entry)) return 1;
+    if (entry->type != '0') return 0;
+
+    long long left = entry->size;
+    while (left > 0) {
+        size_t n = left < RESTORE_DATA_SIZE ? left : RESTORE_DATA_SIZE;
+        RestoreOp *op = new_op(OP_DATA, n);
+        if (op == NULL || tar_read_data(job->tar, op->data, n) !=
+                (ssize_t) n) {
+            free(op);
+            return -1;
+        }
+        left -= n;
+        if (queue_op(job, op)) return 1;
+    }
+    RestoreOp *op = new_op(OP_END, 0);
+    if (op == NULL) return -1;
+    return queue_op(job, op) ? 1 : 0;
+}
+
+// Visit just the manifest's entries under "only", skipping what's between.
+static int unpack_selected(RestoreJob *job) {
+    const Manifest *m = &job->manifest;
+    int i, ret = 0;
+    for (i = 0; ret == 0 && i < m->count; ++i) {
+        const ManifestEntry *e = &m->entries[i];
+        if (!name_under(e->name, job->only)) continue;
+        if (tar_reader_offset(job->tar) != e->offset) {
+            int bad = job->gz != NULL ? gzblock_seek(job->gz, e->offset) :
+                    lseek(job->fd, e->offset, SEEK_SET) != (off_t) e->offset;
+            if (bad) {
+                LOGE("Can't seek to %s in backup\n", e->name);
+                return -1;
+            }
+            tar_reader_reset(job->tar, e->offset);
+        }
+        TarEntry entry;
+        if (tar_next_entry(job->tar, &entry) <= 0) {
+            LOGE("%s isn't where its manifest says\n", e->name);
+            return -1;
+        }
+        ret = unpack_entry(job, &entry, e->name);
+    }
+    return ret;
+}
+
+static void *unpack_thread(void *cookie) {
+    RestoreJob *job = (RestoreJob *) cookie;
+    int ret = 0;
+    if (job->selective) {
+        ret = unpack_selected(job);
+    } else {
+        TarEntry entry;
+        while (ret == 0 && (ret = tar_next_entry(job->tar, &entry)) > 0) {
+            ret = unpack_entry(job, &entry, NULL);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (ret < 0) job->failed = 1;
+    job->unpacked = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static void set_owner_and_mode(const char *path, const TarEntry *e) {
+    if (chown(path, e->uid, e->gid) || chmod(path, e->mode)) {
+        LOGW("Can't set owner/mode of %s (%s)\n", path, strerror(errno));
+    }
+}
+
+// What the writer is in the middle of: a file, between OP_ENTRY and OP_END.
+typedef struct {
+    RestoreOp *entry;
+    char path[PATH_MAX];
+    int fd;
+} RestoreFile;
+
+static int apply_entry(RestoreFile *file, RestoreOp *op) {
+    const TarEntry *e = &op->entry;
+    char path[PATH_MAX];
+    int ret = 0;
+    snprintf(path, sizeof(path), "/%s", e->name);
+
+    switch (e->type) {
+        case '0':
+            unlink(path);
+            file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (file->fd < 0) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            file->entry = op;   // kept until OP_END
+            strcpy(file->path, path);
+            return 0;
+
+        case '5':
+            if (mkdir(path, 0700) && errno != EEXIST) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            set_owner_and_mode(path, e);
+            break;
+
+        case '2':
+            unlink(path);
+            if (symlink(e->link, path)) {
+                LOGE("Can't link %s (%s)\n", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            if (lchown(path, e->uid, e->gid)) {
+                LOGW("Can't set owner of %s (%s)\n", path, strerror(errno));
+            }
+            break;
+
+        case '1': {
+            char target[PATH_MAX];
+            snprintf(target, sizeof(target), "/%s", e->link);
+            unlink(path);
+            if (link(target, path)) {
+                LOGE("Can't link %s (%s)\n", path, strerror(errno));
+                ret = -1;
+            }
+            break;
+        }
+
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = e->type == '3' ? S_IFCHR :
+                    e->type == '4' ? S_IFBLK : S_IFIFO;
+            unlink(path);
+            if (mknod(path, type | e->mode,
+                    makedev(e->devmajor, e->devminor))) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            set_owner_and_mode(path, e);
+            break;
+        }
+
+        default:
+            LOGW("Skipping %s (type '%c')\n", path, e->type);
+            break;
+    }
+    free(op);
+    return ret;
+}
+
+static int finish_file(RestoreFile *file) {
+    const TarEntry *e = &file->entry->entry;
+    int ret = 0;
+    if (fchown(file->fd, e->uid, e->gid) || fchmod(file->fd, e->mode)) {
+        LOGW("Can't set owner/mode of %s (%s)\n", file->path, strerror(errno));
+    }
+    if (close(file->fd)) {
+        LOGE("Can't write %s (%s)\n", file->path, strerror(errno));
+        ret = -1;
+    }
+    struct utimbuf times = { e->mtime, e->mtime };
+    utime(file->path, &times);
+    free(file->entry);
+    file->entry = NULL;
+    file->fd = -1;
+    return ret;
+}
+
+static void *write_thread(void *cookie) {
+    RestoreJob *job = (RestoreJob *) cookie;
+    RestoreFile file;
+    file.entry = NULL;
+    file.fd = -1;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->ready && !job->cancel) pthread_cond_wait(&job->cond, &job->lock);
+    for (;;) {
+        while (job->head == NULL && !job->unpacked && !job->cancel &&
+                !job->failed) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if (job->cancel || job->failed || job->head == NULL) break;
+        RestoreOp *op = job->head;
+        job->head = op->next;
+        if (job->head == NULL) job->tail = NULL;
+        job->queued -= op->len;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+
+        int ret = 0;
+        int type = op->type;
+        size_t data_len = 0;
+        if (type == OP_ENTRY) {
+            ret = apply_entry(&file, op);
+        } else if (type == OP_DATA) {
+            data_len = op->len;
+            if (file.fd < 0 || write_fully(file.fd, op->data, op->len)) {
+                LOGE("Can't write %s (%s)\n", file.path, strerror(errno));
+                ret = -1;
+            }
+            free(op);
+        } else {
+            ret = file.fd >= 0 ? finish_file(&file) : -1;
+            free(op);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (ret) job->failed = 1;
+        job->progress.bytes += data_len;
+        if (type == OP_ENTRY) ++job->progress.files;
+    }
+    job->written = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    if (file.fd >= 0) close(file.fd);
+    free(file.entry);
+    return NULL;
+}
+
+RestoreJob *restore_begin(const char *archive_path, const char *only) {
+    RestoreJob *job = calloc(1, sizeof(*job));
+    if (job == NULL) return NULL;
+    if (only != NULL && (job->only = strdup(only)) == NULL) {
+        free(job);
+        return NULL;
+    }
+    job->fd = open(archive_path, O_RDONLY);
+    if (job->fd < 0) {
+        LOGE("Can't open %s (%s)\n", archive_path, strerror(errno));
+        free(job->only);
+        free(job);
+        return NULL;
+    }
+
+    int seekable = 1;
+    if (gzblock_is_gzip(job->fd)) {
+        GzBlockIndex index;
+        seekable = gzblock_read_index(job->fd, &index) == 0;
+        if (seekable) {
+            job->progress.total_bytes = (long long) index.count * index.block_size;
+            gzblock_free_index(&index);
+        }
+        job->gz = gzblock_open_reader(job->fd, 0);
+        if (job->gz != NULL) job->tar = tar_open_reader(read_gz, job);
+    } else {
+        struct stat st;
+        if (fstat(job->fd, &st) == 0) job->progress.total_bytes = st.st_size;
+        job->tar = tar_open_reader(read_file, job);
+    }
+    if (job->tar == NULL) {
+        LOGE("Can't read %s\n", archive_path);
+        if (job->gz != NULL) gzblock_close_reader(job->gz);
+        close(job->fd);
+        free(job->only);
+        free(job);
+        return NULL;
+    }
+
+    // With a manifest, part of a backup needn't be read through
+    if (job->only != NULL && seekable &&
+            manifest_load(archive_path, &job->manifest) == 0) {
+        job->selective = 1;
+        job->progress.total_bytes = 0;
+        int i;
+        for (i = 0; i < job->manifest.count; ++i) {
+            const ManifestEntry *e = &job->manifest.entries[i];
+            if (name_under(e->name, job->only)) {
+                job->progress.total_bytes += e->size;
+            }
+        }
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    int unpacker = pthread_create(&job->unpacker, NULL, unpack_thread, job);
+    int writer = pthread_create(&job->writer, NULL, write_thread, job);
+    if (unpacker == 0 && writer == 0) return job;
+
+    // Couldn't start; tidy up whichever thread did
+    LOGE("Can't start restore threads\n");
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    if (unpacker == 0) pthread_join(job->unpacker, NULL);
+    if (writer == 0) pthread_join(job->writer, NULL);
+    job->unpacker = job->writer = 0;
+    restore_cancel(job);
+    return NULL;
+}
+
+static void free_job(RestoreJob *job) {
+    pthread_mutex_lock(&job->lock);
+    if (!job->written) job->cancel = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    if (job->unpacker) pthread_join(job->unpacker, NULL);
+    if (job->writer) pthread_join(job->writer, NULL);
+
+    while (job->head != NULL) {
+        RestoreOp *op = job->head;
+        job->head = op->next;
+        free(op);
+    }
+    tar_close_reader(job->tar);
+    if (job->gz != NULL) gzblock_close_reader(job->gz);
+    close(job->fd);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    manifest_free(&job->manifest);
+    free(job->only);
+    free(job);
+}
+
+int restore_finish(RestoreJob *job, TarProgressFunction progress,
+        void *cookie) {
+    pthread_mutex_lock(&job->lock);
+    job->ready = 1;
+    pthread_cond_broadcast(&job->cond);
+    while (!job->written) {
+        struct timeval now;
+        struct timespec until;
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec + (now.tv_usec >= 750000);
+        until.tv_nsec = (now.tv_usec + 250000) % 1000000 * 1000;
+        pthread_cond_timedwait(&job->cond, &job->lock, &until);
+
+        TarProgress done = job->progress;
+        pthread_mutex_unlock(&job->lock);
+        if (progress != NULL) progress(&done, cookie);
+        pthread_mutex_lock(&job->lock);
+    }
+    int ret = job->failed ? -1 : 0;
+    LOGI("restored %d entries, %lld bytes\n", job->progress.files,
+            job->progress.bytes);
+    pthread_mutex_unlock(&job->lock);
+
+    free_job(job);
+    return ret;
+}
+
+void restore_cancel(RestoreJob *job) {
+    free_job(job);
+}
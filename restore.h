@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_RESTORE_H
+#define _RECOVERY_RESTORE_H
+
+#include "tar.h"
+
+/* Restoring a tar backup (plain, or compressed with gzblock) under "/".
+ *
+ * The work is split into stages joined by bounded queues: gzblock's
+ * read-ahead and inflater threads, a thread that unpacks the tar stream
+ * into file operations, and a thread that carries them out.  Nothing is
+ * written until restore_finish() is called, so the first stages can
+ * read and check the start of the backup while the target partition is
+ * still being formatted.
+ */
+
+typedef struct RestoreJob RestoreJob;
+
+/* Start reading "archive_path".  If "only" isn't NULL, just the entries
+ * under that top-level directory (e.g. "data") are restored; with a
+ * manifest (see manifest.h) the rest of the backup is skipped rather than
+ * read through.  Returns NULL if it can't be opened.
+ */
+RestoreJob *restore_begin(const char *archive_path, const char *only);
+
+/* Let the writer go, and wait for the whole backup to be restored.
+ * "progress" (if not NULL) is called a few times a second from this
+ * thread.  Frees "job".  Returns 0 on success, -1 on failure.
+ */
+int restore_finish(RestoreJob *job, TarProgressFunction progress,
+        void *cookie);
+
+// Stop without writing anything more, and free "job".
+void restore_cancel(RestoreJob *job);
+
+#endif  /* _RECOVERY_RESTORE_H */
@@ -15,7 +15,10 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,9 +28,22 @@
 #include "mtdutils/mtdutils.h"
 #include "mtdutils/mounts.h"
 #include "minzip/Zip.h"
+#include "progress.h"
 #include "roots.h"
 #include "common.h"
 
+// Older kernel headers don't have these; the kernel says EINVAL or
+// EOPNOTSUPP if it doesn't either.
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12,125)
+#endif
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t)
+#endif
+
 typedef struct {
     const char *name;
     const char *device;
@@ -230,7 +246,6 @@ ensure_root_path_mounted(const char *root_path)
         if (info->partition_name == NULL) {
             return -1;
         }
-//TODO: make the mtd stuff scan once when it needs to
         mtd_scan_partitions();
         const MtdPartition *partition;
         partition = mtd_find_partition_by_name(info->partition_name);
@@ -247,6 +262,7 @@ ensure_root_path_mounted(const char *root_path)
         info->filesystem == g_package_file) {
         return -1;
     }
+    invalidate_mounted_volumes();
 
     if (info->filesystem != NULL && strcmp(info->filesystem, "rfs")==0) {
     	// mkdir(info->mount_point, 0755);  // in case it doesn't already exist
@@ -324,6 +340,45 @@ get_root_mtd_partition(const char *root_path)
     return mtd_find_partition_by_name(info->partition_name);
 }
 
+const char *
+get_root_block_device(const char *root_path)
+{
+    const RootInfo *info = get_root_info_for_path(root_path);
+    if (info == NULL || info->device == NULL ||
+            info->device == g_mtd_device)
+    {
+        return NULL;
+    }
+    return info->device;
+}
+
+int
+discard_block_device(const char *device, int secure)
+{
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+        LOGW("discard: can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    unsigned long long range[2] = { 0, 0 };
+    if (ioctl(fd, BLKGETSIZE64, &range[1]) < 0 || range[1] == 0) {
+        LOGW("discard: can't size %s (%s)\n", device, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int ret = ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, range);
+    int err = errno;
+    close(fd);
+    if (ret < 0) {
+        LOGI("discard: %s doesn't support %sdiscard (%s)\n", device,
+                secure ? "secure " : "", strerror(err));
+        errno = err;
+        return 1;
+    }
+    LOGI("discard: %s (%llu bytes) discarded\n", device, range[1]);
+    return 0;
+}
+
 int
 format_root_device(const char *root)
 {
@@ -356,23 +411,23 @@ format_root_device(const char *root)
 
     if (info->filesystem != NULL && strcmp(info->filesystem, "rfs")==0) {
 	LOGW("format: %s\n", info->device);
-        pid_t pid = fork();
-        if (pid == 0) {
-	    char *args[] = {"/sbin/fformat", info->device, NULL};
-            execv("/sbin/fformat", args);
-            fprintf(stderr, "E:Can't run fformat [%s]\n", strerror(errno));
-            _exit(-1);
-        }
-
-        int status;
-
-        while (waitpid(pid, &status, WNOHANG) == 0) {
-            ui_print(".");
-            sleep(1);
+        /* Tell the flash that all the old data is garbage; fformat then
+         * only writes the filesystem metadata, and the translation layer
+         * never has to copy stale sectors around.
+         */
+        discard_block_device(info->device, 0);
+	char *args[] = {"/sbin/fformat", info->device, NULL};
+        pid_t pid;
+        int fd = progress_spawn("/sbin/fformat", args, &pid);
+        if (fd < 0) {
+            LOGE("Can't run fformat (%s)\n", strerror(errno));
+            return -1;
         }
+        int status = progress_wait(pid, fd);
         ui_print("\n");
+        invalidate_mounted_volumes();
 
-        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        if (status == -1 || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
             LOGW("format_root_device: can't erase \"%s\"\n", root);
 	    return -1;
             ui_print("Error running samdroid backup. Backup not performed.\n\n");
@@ -396,7 +451,11 @@ format_root_device(const char *root)
             if (write == NULL) {
                 LOGW("format_root_device: can't open \"%s\"\n", root);
                 return -1;
-            } else if (mtd_erase_blocks(write, -1) == (off_t) -1) {
+            }
+            // yaffs2 keeps its tags in the OOB area, so only raw
+            // partitions can trust an all-0xff read to mean erased.
+            mtd_write_set_skip_erased(write, info->filesystem == g_raw);
+            if (mtd_erase_blocks(write, -1) == (off_t) -1) {
                 LOGW("format_root_device: can't erase \"%s\"\n", root);
                 mtd_write_close(write);
                 return -1;
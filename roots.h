@@ -55,9 +55,21 @@ int ensure_root_path_unmounted(const char *root_path);
 
 const MtdPartition *get_root_mtd_partition(const char *root_path);
 
+/* Returns the block device (like "/dev/stl6") behind the root, or NULL
+ * if it's an MTD partition or has no device.
+ */
+const char *get_root_block_device(const char *root_path);
+
 /* "root" must be the exact name of the root; no relative path is permitted.
  * If the named root is mounted, this will attempt to unmount it first.
  */
 int format_root_device(const char *root);
 
+/* Discard (BLKDISCARD, or BLKSECDISCARD if "secure") all of the block
+ * device at "device", so the flash behind it can drop the old data
+ * without writing over it.  Returns 0 on success, 1 if the device or
+ * kernel doesn't support it, or -1 if the device can't be opened or sized.
+ */
+int discard_block_device(const char *device, int secure);
+
 #endif  // RECOVERY_ROOTS_H_
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "manifest.h"
+#include "sdindex.h"
+
+#define EOCD_SIGNATURE      0x06054b50
+#define EOCD_LENGTH         22
+#define CENTRAL_SIGNATURE   0x02014b50
+#define CENTRAL_LENGTH      46
+#define MAX_COMMENT_LENGTH  65535
+
+// Bigger central directories aren't read for the signature check.
+#define MAX_CENTRAL_LENGTH  (8 * 1024 * 1024)
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // wanted or running changed
+    bool started;
+    bool running;               // between sdindex_start() and _stop()
+    bool scanning;              // the thread may have files open
+    char dir[PATH_MAX];
+    unsigned wanted;            // generation asked for
+    unsigned built;             // generation "entries" is from
+    time_t dir_mtime;           // of "dir" when "entries" was read
+    SdIndexEntry *entries;
+    int count;
+} gIndex = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned get_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+static int classify(const char *name) {
+    if (name[0] == '.') return 0;
+    const char *extension = strrchr(name, '.');
+    if (extension != NULL && !strcasecmp(extension, ".zip")) {
+        return SDINDEX_ZIP;
+    }
+    size_t len = strlen(name);
+    size_t suffix = strlen(MANIFEST_SUFFIX);
+    if (len > suffix && !strcmp(name + len - suffix, MANIFEST_SUFFIX)) {
+        return 0;  // goes with the backup of the same name
+    }
+    return strstr(name, "_backup_") != NULL ? SDINDEX_BACKUP : 0;
+}
+
+static bool ends_with(const unsigned char *name, unsigned len,
+        const char *suffix) {
+    size_t n = strlen(suffix);
+    return len > n && !strncasecmp((const char *) name + len - n, suffix, n);
+}
+
+/* Look over the zip at "fd" without inflating anything: find its end
+ * record, check the central directory lies before it, and walk the
+ * directory for a signature.  Returns SDINDEX_CHECKED plus what's wrong.
+ */
+static int check_zip(int fd, long long size) {
+    int flags = SDINDEX_CHECKED;
+    if (size < EOCD_LENGTH) return flags | SDINDEX_DAMAGED;
+
+    size_t tail = size < MAX_COMMENT_LENGTH + EOCD_LENGTH ?
+            size : MAX_COMMENT_LENGTH + EOCD_LENGTH;
+    unsigned char *buf = malloc(tail);
+    if (buf == NULL) return 0;
+    if (pread(fd, buf, tail, size - tail) != (ssize_t) tail) {
+        free(buf);
+        return flags | SDINDEX_DAMAGED;
+    }
+
+    // The record is last, followed only by its comment.
+    const unsigned char *eocd = NULL;
+    size_t i;
+    for (i = tail - EOCD_LENGTH + 1; i-- > 0; ) {
+        if (get_le32(buf + i) == EOCD_SIGNATURE &&
+                i + EOCD_LENGTH + get_le16(buf + i + 20) <= tail) {
+            eocd = buf + i;
+            break;
+        }
+    }
+    if (eocd == NULL) {
+        free(buf);
+        return flags | SDINDEX_DAMAGED;
+    }
+    unsigned entries = get_le16(eocd + 10);
+    unsigned long cd_length = get_le32(eocd + 12);
+    unsigned long cd_offset = get_le32(eocd + 16);
+    long long eocd_offset = size - tail + (eocd - buf);
+    free(buf);
+    if ((long long) cd_offset + cd_length > eocd_offset) {
+        return flags | SDINDEX_DAMAGED;
+    }
+    if (cd_length > MAX_CENTRAL_LENGTH) return flags;
+
+    buf = malloc(cd_length ? cd_length : 1);
+    if (buf == NULL) return 0;
+    if (pread(fd, buf, cd_length, cd_offset) != (ssize_t) cd_length) {
+        free(buf);
+        return flags | SDINDEX_DAMAGED;
+    }
+
+    bool sf = false, rsa = false;
+    size_t off = 0;
+    for (i = 0; i < entries; ++i) {
+        const unsigned char *p = buf + off;
+        if (off + CENTRAL_LENGTH > cd_length ||
+                get_le32(p) != CENTRAL_SIGNATURE) {
+            flags |= SDINDEX_DAMAGED;
+            break;
+        }
+        unsigned name_len = get_le16(p + 28);
+        size_t next = off + CENTRAL_LENGTH + name_len +
+                get_le16(p + 30) + get_le16(p + 32);
+        if (next > cd_length) {
+            flags |= SDINDEX_DAMAGED;
+            break;
+        }
+        const unsigned char *name = p + CENTRAL_LENGTH;
+        if (name_len > 9 && !strncasecmp((const char *) name, "META-INF/", 9)) {
+            if (ends_with(name, name_len, ".SF")) sf = true;
+            if (ends_with(name, name_len, ".RSA")) rsa = true;
+        }
+        off = next;
+    }
+    free(buf);
+
+    if (!(flags & SDINDEX_DAMAGED) && !(sf && rsa)) flags |= SDINDEX_UNSIGNED;
+    return flags;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcasecmp(((const SdIndexEntry *) a)->name,
+            ((const SdIndexEntry *) b)->name);
+}
+
+// Whether the background scan of generation "gen" should give up.
+static bool scan_cancelled(unsigned gen) {
+    pthread_mutex_lock(&gIndex.lock);
+    bool cancelled = !gIndex.running || gIndex.wanted != gen;
+    pthread_mutex_unlock(&gIndex.lock);
+    return cancelled;
+}
+
+/* Read "dir" in one pass, into "*list" sorted by name.  "check" runs
+ * check_zip() on each zip, and makes the scan of generation "gen" give
+ * up if that's no longer wanted.  Returns the count, or -1.
+ */
+static int scan_dir(const char *dir, bool check, unsigned gen,
+        SdIndexEntry **list) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        if (!check) LOGE("Couldn't open directory %s\n", dir);
+        return -1;
+    }
+
+    SdIndexEntry *entries = NULL;
+    int count = 0, allocd = 0;
+    bool failed = false;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        int kind = classify(de->d_name);
+        if (kind == 0) continue;
+        if (check && scan_cancelled(gen)) {
+            failed = true;
+            break;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) close(fd);
+            continue;
+        }
+
+        if (count == allocd) {
+            allocd = allocd ? allocd * 2 : 16;
+            SdIndexEntry *grown = realloc(entries, allocd * sizeof(*entries));
+            if (grown == NULL) {
+                close(fd);
+                failed = true;
+                break;
+            }
+            entries = grown;
+        }
+        SdIndexEntry *e = &entries[count];
+        e->name = strdup(de->d_name);
+        if (e->name == NULL) {
+            close(fd);
+            failed = true;
+            break;
+        }
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        e->flags = kind;
+        if (check && kind == SDINDEX_ZIP) e->flags |= check_zip(fd, e->size);
+        close(fd);
+        ++count;
+    }
+    closedir(d);
+
+    if (failed) {
+        sdindex_free(entries, count);
+        return -1;
+    }
+    if (count > 0) qsort(entries, count, sizeof(*entries), compare_entries);
+    *list = entries;
+    return count;
+}
+
+static void *index_thread(void *cookie) {
+    pthread_mutex_lock(&gIndex.lock);
+    for (;;) {
+        while (!gIndex.running || gIndex.built == gIndex.wanted) {
+            pthread_cond_wait(&gIndex.cond, &gIndex.lock);
+        }
+        unsigned gen = gIndex.wanted;
+        char dir[PATH_MAX];
+        strcpy(dir, gIndex.dir);
+        gIndex.scanning = true;
+        pthread_mutex_unlock(&gIndex.lock);
+
+        // Changes made while the scan runs must make it stale.
+        struct stat st;
+        SdIndexEntry *list = NULL;
+        int count = -1;
+        if (stat(dir, &st) == 0) count = scan_dir(dir, true, gen, &list);
+
+        pthread_mutex_lock(&gIndex.lock);
+        gIndex.scanning = false;
+        if (count >= 0 && gIndex.running && gIndex.wanted == gen) {
+            sdindex_free(gIndex.entries, gIndex.count);
+            gIndex.entries = list;
+            gIndex.count = count;
+            gIndex.dir_mtime = st.st_mtime;
+            gIndex.built = gen;
+            LOGI("indexed %d files in %s\n", count, dir);
+        } else if (count >= 0) {
+            sdindex_free(list, count);
+        } else if (gIndex.wanted == gen) {
+            // unreadable; lists fall back to reading it themselves
+            sdindex_free(gIndex.entries, gIndex.count);
+            gIndex.entries = NULL;
+            gIndex.count = -1;
+            gIndex.built = gen;
+        }
+        pthread_cond_broadcast(&gIndex.cond);
+    }
+    return NULL;
+}
+
+int sdindex_start(const char *dir) {
+    int ret = 0;
+    pthread_mutex_lock(&gIndex.lock);
+    if (!gIndex.started) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, index_thread, NULL) != 0) {
+            LOGW("Can't start the sdcard indexer\n");
+            ret = -1;
+        } else {
+            gIndex.started = true;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (ret == 0) {
+        strlcpy(gIndex.dir, dir, sizeof(gIndex.dir));
+        gIndex.running = true;
+        gIndex.wanted++;
+        pthread_cond_broadcast(&gIndex.cond);
+    }
+    pthread_mutex_unlock(&gIndex.lock);
+    return ret;
+}
+
+void sdindex_stop(void) {
+    pthread_mutex_lock(&gIndex.lock);
+    gIndex.running = false;
+    gIndex.wanted++;
+    while (gIndex.scanning) pthread_cond_wait(&gIndex.cond, &gIndex.lock);
+    sdindex_free(gIndex.entries, gIndex.count);
+    gIndex.entries = NULL;
+    gIndex.count = 0;
+    pthread_mutex_unlock(&gIndex.lock);
+}
+
+void sdindex_invalidate(void) {
+    pthread_mutex_lock(&gIndex.lock);
+    gIndex.wanted++;
+    pthread_cond_broadcast(&gIndex.cond);
+    pthread_mutex_unlock(&gIndex.lock);
+}
+
+// Copy the entries of "src" with any of "kinds" into "*list".
+static int copy_entries(const SdIndexEntry *src, int count, int kinds,
+        SdIndexEntry **list) {
+    SdIndexEntry *dst = malloc((count > 0 ? count : 1) * sizeof(*dst));
+    if (dst == NULL) return -1;
+    int i, n = 0;
+    for (i = 0; i < count; ++i) {
+        if (!(src[i].flags & kinds)) continue;
+        dst[n] = src[i];
+        dst[n].name = strdup(src[i].name);
+        if (dst[n].name == NULL) {
+            sdindex_free(dst, n);
+            return -1;
+        }
+        ++n;
+    }
+    *list = dst;
+    return n;
+}
+
+int sdindex_list(const char *dir, int kinds, SdIndexEntry **list) {
+    pthread_mutex_lock(&gIndex.lock);
+    if (gIndex.running && gIndex.built == gIndex.wanted &&
+            gIndex.count >= 0 && !strcmp(gIndex.dir, dir)) {
+        // Files added or removed behind our back change the directory.
+        struct stat st;
+        if (stat(dir, &st) == 0 && st.st_mtime == gIndex.dir_mtime) {
+            int n = copy_entries(gIndex.entries, gIndex.count, kinds, list);
+            pthread_mutex_unlock(&gIndex.lock);
+            return n;
+        }
+        gIndex.wanted++;
+        pthread_cond_broadcast(&gIndex.cond);
+    }
+    pthread_mutex_unlock(&gIndex.lock);
+
+    SdIndexEntry *all;
+    int count = scan_dir(dir, false, 0, &all);
+    if (count < 0) return -1;
+    int n = copy_entries(all, count, kinds, list);
+    sdindex_free(all, count);
+    return n;
+}
+
+void sdindex_free(SdIndexEntry *list, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        free(list[i].name);
+    }
+    free(list);
+}
+
+const char *sdindex_problem(const SdIndexEntry *e) {
+    if (e->flags & SDINDEX_DAMAGED) return "damaged";
+    if (e->flags & SDINDEX_UNSIGNED) return "unsigned";
+    return NULL;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_SDINDEX_H
+#define _RECOVERY_SDINDEX_H
+
+#include <time.h>
+
+/* A list of the packages and backups at the top of the sdcard, kept
+ * by a thread in the background so the menus don't have to read the
+ * directory while the user waits.
+ *
+ * Each zip also gets a quick look: whether it has an end of central
+ * directory record and a central directory that fits in the file, and
+ * whether it carries a META-INF signature.  That's enough to point out
+ * a truncated download before anyone starts installing it.
+ *
+ * The thread only reads the card between sdindex_start() and
+ * sdindex_stop(); it must be stopped before the card is unmounted or
+ * handed to a USB host, and started again once it's back.
+ */
+
+#define SDINDEX_ZIP         0x01
+#define SDINDEX_BACKUP      0x02
+#define SDINDEX_CHECKED     0x04    // the zip checks below were run
+#define SDINDEX_DAMAGED     0x08    // no end record, or a bad directory
+#define SDINDEX_UNSIGNED    0x10    // no META-INF/*.SF and *.RSA
+
+typedef struct {
+    char *name;                 // within the directory
+    long long size;
+    time_t mtime;
+    int flags;
+} SdIndexEntry;
+
+/* Index "dir" (eg. "/sdcard"), which is mounted, in the background.
+ * Starts the thread the first time; afterwards, rescans.  Returns 0,
+ * or -1 if the thread can't be started.
+ */
+int sdindex_start(const char *dir);
+
+/* Stop reading the card.  Waits for a scan under way to close its
+ * files, and forgets the index until the next sdindex_start().
+ */
+void sdindex_stop(void);
+
+// Something on the card changed; scan it again.
+void sdindex_invalidate(void);
+
+/* The entries of "dir" with any of the "kinds" flags, sorted by name,
+ * in "*list" (free with sdindex_free()).  If the index isn't up to
+ * date, reads the directory now instead, without the zip checks.
+ * Returns the number of entries, or -1 if the directory can't be read.
+ */
+int sdindex_list(const char *dir, int kinds, SdIndexEntry **list);
+void sdindex_free(SdIndexEntry *list, int count);
+
+// What's wrong with the zip "e", for a menu, or NULL if nothing is known.
+const char *sdindex_problem(const SdIndexEntry *e);
+
+#endif  /* _RECOVERY_SDINDEX_H */
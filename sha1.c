@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sha1.h"
+
+static int gBackend = SHA1_AUTO;
+static pthread_once_t gBackendOnce = PTHREAD_ONCE_INIT;
+
+#ifdef SHA1_HAVE_LANES
+// Whether the CPU can run sha1_lanes.c.  Only ARM builds need to ask;
+// x86 has had SSE2 for as long as there have been hosts to build on.
+static int cpu_has_vectors(void)
+{
+#ifdef __arm__
+    // The kernel's HWCAP bits, from the auxiliary vector.
+    enum { AUX_HWCAP = 16, HWCAP_NEON = 1 << 12 };
+    unsigned long aux[2];
+    int has = 0;
+    int fd = open("/proc/self/auxv", O_RDONLY);
+    if (fd < 0) return 0;
+    while (read(fd, aux, sizeof(aux)) == sizeof(aux) && aux[0] != 0) {
+        if (aux[0] == AUX_HWCAP) {
+            has = (aux[1] & HWCAP_NEON) != 0;
+            break;
+        }
+    }
+    close(fd);
+    return has;
+#else
+    return 1;
+#endif
+}
+#endif
+
+static void choose_backend(void)
+{
+    if (gBackend != SHA1_AUTO) return;     // already set by hand
+    gBackend = SHA1_SCALAR;
+#ifdef SHA1_HAVE_LANES
+    if (cpu_has_vectors()) gBackend = SHA1_VECTOR;
+#endif
+}
+
+static int backend(void)
+{
+    pthread_once(&gBackendOnce, choose_backend);
+    return gBackend;
+}
+
+int sha1_set_backend(int which)
+{
+    pthread_once(&gBackendOnce, choose_backend);
+    if (which == SHA1_AUTO) {
+        gBackend = SHA1_AUTO;
+        choose_backend();
+        return 0;
+    }
+    if (which == SHA1_VECTOR) {
+#ifdef SHA1_HAVE_LANES
+        if (!cpu_has_vectors()) return -1;
+#else
+        return -1;
+#endif
+    } else if (which != SHA1_REFERENCE && which != SHA1_SCALAR) {
+        return -1;
+    }
+    gBackend = which;
+    return 0;
+}
+
+int sha1_get_backend(void)
+{
+    return backend();
+}
+
+const char *sha1_backend_name(void)
+{
+    switch (backend()) {
+        case SHA1_REFERENCE: return "reference";
+        case SHA1_VECTOR: return "vector";
+    }
+    return "scalar";
+}
+
+static const uint32_t kInitialState[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+#define ROL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Rounds t and on use a 16-word window of the message schedule.
+#define W(t) ((t) < 16 ? (w[(t)] = load_be32(data + (t) * 4)) :             \
+        (w[(t) & 15] = ROL(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^         \
+                           w[((t) - 14) & 15] ^ w[(t) & 15], 1)))
+
+// One round with a, b, c, d, e renamed rather than moved.
+#define R(a, b, c, d, e, f, k, t) do {                                  \
+        e += ROL(a, 5) + (f) + (k) + W(t);                              \
+        b = ROL(b, 30);                                                 \
+    } while (0)
+
+#define F1(b, c, d) (d ^ (b & (c ^ d)))
+#define F2(b, c, d) (b ^ c ^ d)
+#define F3(b, c, d) ((b & c) | (d & (b | c)))
+
+#define R1(a, b, c, d, e, t) R(a, b, c, d, e, F1(b, c, d), 0x5a827999, t)
+#define R2(a, b, c, d, e, t) R(a, b, c, d, e, F2(b, c, d), 0x6ed9eba1, t)
+#define R3(a, b, c, d, e, t) R(a, b, c, d, e, F3(b, c, d), 0x8f1bbcdc, t)
+#define R4(a, b, c, d, e, t) R(a, b, c, d, e, F2(b, c, d), 0xca62c1d6, t)
+
+// Five rounds, after which the variables are back in their places.
+#define FIVE(r, t) do {                                                 \
+        r(a, b, c, d, e, t);                                            \
+        r(e, a, b, c, d, t + 1);                                        \
+        r(d, e, a, b, c, t + 2);                                        \
+        r(c, d, e, a, b, t + 3);                                        \
+        r(b, c, d, e, a, t + 4);                                        \
+    } while (0)
+
+// Hash "blocks" 64-byte blocks of data into state.
+static void sha1_transform(uint32_t state[5], const uint8_t *data,
+        size_t blocks)
+{
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t w[16];
+        uint32_t a = state[0], b = state[1], c = state[2];
+        uint32_t d = state[3], e = state[4];
+
+        FIVE(R1, 0); FIVE(R1, 5); FIVE(R1, 10); FIVE(R1, 15);
+        FIVE(R2, 20); FIVE(R2, 25); FIVE(R2, 30); FIVE(R2, 35);
+        FIVE(R3, 40); FIVE(R3, 45); FIVE(R3, 50); FIVE(R3, 55);
+        FIVE(R4, 60); FIVE(R4, 65); FIVE(R4, 70); FIVE(R4, 75);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+// The final block or two of a message: whatever is left of it after
+// its whole blocks ("len" bytes of "rest"), then the padding and the
+// length in bits.  Returns the number of blocks.
+static int pad_message(uint8_t tail[128], const uint8_t *rest, size_t len,
+        uint64_t total)
+{
+    int blocks = len + 9 > 64 ? 2 : 1;
+    memcpy(tail, rest, len);
+    tail[len] = 0x80;
+    memset(tail + len + 1, 0, blocks * 64 - len - 1);
+    uint64_t bits = total * 8;
+    int i;
+    for (i = 0; i < 8; ++i) tail[blocks * 64 - 1 - i] = bits >> (i * 8);
+    return blocks;
+}
+
+static void store_digest(uint8_t digest[SHA_DIGEST_SIZE],
+        const uint32_t state[5])
+{
+    int i;
+    for (i = 0; i < 5; ++i) store_be32(digest + i * 4, state[i]);
+}
+
+void sha1_init(Sha1Context *ctx)
+{
+    ctx->backend = backend() == SHA1_REFERENCE ? SHA1_REFERENCE : SHA1_SCALAR;
+    if (ctx->backend == SHA1_REFERENCE) {
+        SHA_init(&ctx->ref);
+        return;
+    }
+    memcpy(ctx->state, kInitialState, sizeof(ctx->state));
+    ctx->count = 0;
+}
+
+void sha1_update(Sha1Context *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    if (ctx->backend == SHA1_REFERENCE) {
+        while (len > 0) {
+            int n = len > (1 << 30) ? (1 << 30) : (int) len;
+            SHA_update(&ctx->ref, p, n);
+            p += n;
+            len -= n;
+        }
+        return;
+    }
+
+    size_t used = ctx->count % 64;
+    ctx->count += len;
+    if (used > 0) {
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64) return;
+        sha1_transform(ctx->state, ctx->buf, 1);
+    }
+    sha1_transform(ctx->state, p, len / 64);
+    memcpy(ctx->buf, p + len / 64 * 64, len % 64);
+}
+
+void sha1_final(Sha1Context *ctx, uint8_t digest[SHA_DIGEST_SIZE])
+{
+    if (ctx->backend == SHA1_REFERENCE) {
+        memcpy(digest, SHA_final(&ctx->ref), SHA_DIGEST_SIZE);
+        return;
+    }
+    uint8_t tail[128];
+    int blocks = pad_message(tail, ctx->buf, ctx->count % 64, ctx->count);
+    sha1_transform(ctx->state, tail, blocks);
+    store_digest(digest, ctx->state);
+}
+
+#ifdef SHA1_HAVE_LANES
+// A message being hashed in one lane of sha1_multi().
+typedef struct {
+    int message;            // index into the caller's arrays; -1 if idle
+    const uint8_t *next;    // its next whole block
+    size_t whole;           // whole blocks left at "next"
+    int padded;             // blocks in "tail"
+    int tailUsed;
+    uint8_t tail[128];
+} Lane;
+
+static void start_lane(Lane *lane, int message, const void *data, size_t len)
+{
+    lane->message = message;
+    lane->next = (const uint8_t *) data;
+    lane->whole = len / 64;
+    lane->padded = pad_message(lane->tail, lane->next + lane->whole * 64,
+            len % 64, len);
+    lane->tailUsed = 0;
+}
+
+static const uint8_t *next_block(Lane *lane)
+{
+    if (lane->whole > 0) {
+        const uint8_t *block = lane->next;
+        lane->next += 64;
+        --lane->whole;
+        return block;
+    }
+    return lane->tail + 64 * lane->tailUsed++;
+}
+
+static int lane_done(const Lane *lane)
+{
+    return lane->whole == 0 && lane->tailUsed == lane->padded;
+}
+
+static void multi_vector(int count, const void *const *data, const size_t *len,
+        uint8_t (*digests)[SHA_DIGEST_SIZE])
+{
+    static const uint8_t idle[64];
+    Lane lanes[SHA1_LANES];
+    uint32_t state[5][SHA1_LANES];
+    int pending = 0, active = 0, i, l;
+
+    for (l = 0; l < SHA1_LANES; ++l) {
+        lanes[l].message = -1;
+        if (pending < count) {
+            start_lane(&lanes[l], pending, data[pending], len[pending]);
+            for (i = 0; i < 5; ++i) state[i][l] = kInitialState[i];
+            ++pending;
+            ++active;
+        }
+    }
+
+    while (active > 0) {
+        // A lone message left is quicker to finish one lane wide.
+        if (active == 1 && pending == count) {
+            for (l = 0; lanes[l].message < 0; ++l) ;
+            Lane *lane = &lanes[l];
+            uint32_t one[5];
+            for (i = 0; i < 5; ++i) one[i] = state[i][l];
+            sha1_transform(one, lane->next, lane->whole);
+            sha1_transform(one, lane->tail + 64 * lane->tailUsed,
+                    lane->padded - lane->tailUsed);
+            store_digest(digests[lane->message], one);
+            break;
+        }
+
+        const uint8_t *blocks[SHA1_LANES];
+        for (l = 0; l < SHA1_LANES; ++l) {
+            blocks[l] = lanes[l].message < 0 ? idle : next_block(&lanes[l]);
+        }
+        sha1_transform_lanes(state, blocks);
+
+        for (l = 0; l < SHA1_LANES; ++l) {
+            Lane *lane = &lanes[l];
+            if (lane->message < 0 || !lane_done(lane)) continue;
+
+            uint32_t one[5];
+            for (i = 0; i < 5; ++i) one[i] = state[i][l];
+            store_digest(digests[lane->message], one);
+            lane->message = -1;
+            --active;
+            if (pending < count) {
+                start_lane(lane, pending, data[pending], len[pending]);
+                for (i = 0; i < 5; ++i) state[i][l] = kInitialState[i];
+                ++pending;
+                ++active;
+            }
+        }
+    }
+}
+#endif
+
+void sha1_multi(int count, const void *const *data, const size_t *len,
+        uint8_t (*digests)[SHA_DIGEST_SIZE])
+{
+#ifdef SHA1_HAVE_LANES
+    if (count > 1 && backend() == SHA1_VECTOR) {
+        multi_vector(count, data, len, digests);
+        return;
+    }
+#endif
+    int i;
+    for (i = 0; i < count; ++i) {
+        Sha1Context ctx;
+        sha1_init(&ctx);
+        sha1_update(&ctx, data[i], len[i]);
+        sha1_final(&ctx, digests[i]);
+    }
+}
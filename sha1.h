@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_SHA1_H
+#define _RECOVERY_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/sha.h"
+
+/* SHA-1 for checking package digests.
+ *
+ * There are three implementations.  SHA1_REFERENCE is mincrypt's SHA_*(),
+ * which everything used before and which the others are checked against.
+ * SHA1_SCALAR is the same algorithm, unrolled, taking whole blocks
+ * straight from the caller's data.  SHA1_VECTOR hashes SHA1_LANES
+ * messages at once in the lanes of NEON (or SSE2, on the host) vectors;
+ * it only applies to sha1_multi(), and is only there if the build and
+ * the CPU have the instructions.  The best available is picked the
+ * first time any of these functions is called.
+ */
+
+enum { SHA1_AUTO, SHA1_REFERENCE, SHA1_SCALAR, SHA1_VECTOR };
+
+#define SHA1_LANES 4
+
+typedef struct {
+    int backend;
+    SHA_CTX ref;            // SHA1_REFERENCE
+    uint32_t state[5];      // the others
+    uint64_t count;
+    uint8_t buf[64];
+} Sha1Context;
+
+void sha1_init(Sha1Context *ctx);
+void sha1_update(Sha1Context *ctx, const void *data, size_t len);
+void sha1_final(Sha1Context *ctx, uint8_t digest[SHA_DIGEST_SIZE]);
+
+// Hash "count" whole messages, putting the digest of data[i] in digests[i].
+void sha1_multi(int count, const void *const *data, const size_t *len,
+        uint8_t (*digests)[SHA_DIGEST_SIZE]);
+
+// Use a particular implementation from now on (SHA1_AUTO for the best).
+// Returns 0, or -1 if this build or CPU doesn't have it.
+int sha1_set_backend(int backend);
+
+// What sha1_multi() is using: one of SHA1_REFERENCE, SHA1_SCALAR or
+// SHA1_VECTOR, or as a string for logs.
+int sha1_get_backend(void);
+const char *sha1_backend_name(void);
+
+// One block of each of SHA1_LANES messages; state[i][lane] is word i of
+// a lane's hash.  In sha1_lanes.c, for sha1_multi().
+void sha1_transform_lanes(uint32_t state[5][SHA1_LANES],
+        const uint8_t *const block[SHA1_LANES]);
+
+#endif  // _RECOVERY_SHA1_H
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The SHA-1 compression function on SHA1_LANES independent messages at
+ * once, written with GCC's generic vectors so it becomes NEON on ARM and
+ * SSE2 on x86.  This file is built with NEON enabled (as sha1_lanes.c.neon)
+ * and sha1.c only calls it once it has seen the CPU supports NEON; nothing
+ * else may go in here.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+typedef uint32_t v4u __attribute__((vector_size(16)));
+
+#define SPLAT(x)    ((v4u) { (x), (x), (x), (x) })
+#define ROL(x, n)   (((x) << SPLAT(n)) | ((x) >> SPLAT(32 - (n))))
+
+#define ROUND(f, k, t) do {                                             \
+        v4u tmp = ROL(a, 5) + (f) + e + SPLAT(k) + schedule(w, t);     \
+        e = d;                                                          \
+        d = c;                                                          \
+        c = ROL(b, 30);                                                 \
+        b = a;                                                          \
+        a = tmp;                                                        \
+    } while (0)
+
+static inline v4u schedule(v4u *w, int t)
+{
+    if (t < 16) return w[t];
+    v4u x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+    w[t & 15] = ROL(x, 1);
+    return w[t & 15];
+}
+
+void sha1_transform_lanes(uint32_t state[5][SHA1_LANES],
+        const uint8_t *const block[SHA1_LANES])
+{
+    v4u w[16];
+    int t, i;
+    for (t = 0; t < 16; ++t) {
+        uint32_t lane[SHA1_LANES];
+        for (i = 0; i < SHA1_LANES; ++i) {
+            const uint8_t *p = block[i] + t * 4;
+            lane[i] = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        }
+        memcpy(&w[t], lane, sizeof(lane));
+    }
+
+    v4u h[5], a, b, c, d, e;
+    memcpy(h, state, sizeof(h));
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+
+    for (t = 0; t < 20; ++t) ROUND(d ^ (b & (c ^ d)), 0x5a827999, t);
+    for (; t < 40; ++t) ROUND(b ^ c ^ d, 0x6ed9eba1, t);
+    for (; t < 60; ++t) ROUND((b & c) | (d & (b | c)), 0x8f1bbcdc, t);
+    for (; t < 80; ++t) ROUND(b ^ c ^ d, 0xca62c1d6, t);
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    memcpy(state, h, sizeof(h));
+}
@@ -0,0 +1,820 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "mincrypt/sha.h"
+#include "snapshot.h"
+
+/* A manifest is this line, then one line per entry, tab separated:
+ *
+ *    d  mode uid gid mtime path
+ *    f  mode uid gid mtime size path
+ *    l  mode uid gid mtime path target
+ *    n  mode uid gid mtime rdev path     (devices and fifos)
+ *
+ * with mode (st_mode, in octal) and path relative to "/".  Tabs,
+ * newlines and backslashes in names are backslash-escaped.  Each 'f'
+ * line is followed by a "c <sha1>" line for every chunk of the file.
+ *
+ * A chunk with digest "abcdef..." is stored zlib-compressed as
+ * <store>/ab/cdef....
+ */
+#define MANIFEST_MAGIC      "snapshot 1\n"
+#define MANIFEST_LINE_MAX   (4 * PATH_MAX + 128)
+#define CHUNK_HEX           (SHA_DIGEST_SIZE * 2)
+
+typedef uint8_t ChunkId[SHA_DIGEST_SIZE];
+
+typedef struct {
+    char type;                  // 'd', 'f', 'l' or 'n', as above
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long mtime;
+    long long size;             // 'f' only
+    unsigned long rdev;         // 'n' only
+    char *path;
+    char *target;               // 'l' only
+    int nchunks;                // 'f' only
+    ChunkId *chunks;
+} SnapshotEntry;
+
+typedef int (*SnapshotEntryFunction)(const SnapshotEntry *entry,
+        void *cookie);
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the number of bytes read, short only at end of file; -1 on error.
+static ssize_t read_fully(int fd, void *data, size_t len) {
+    char *p = (char *) data;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+static void put_escaped(FILE *f, const char *s) {
+    for (; *s != '\0'; ++s) {
+        switch (*s) {
+            case '\\': fputs("\\\\", f); break;
+            case '\t': fputs("\\t", f); break;
+            case '\n': fputs("\\n", f); break;
+            default: putc(*s, f); break;
+        }
+    }
+}
+
+static void unescape(char *s) {
+    char *out = s;
+    for (; *s != '\0'; ++s) {
+        if (*s == '\\' && s[1] != '\0') {
+            ++s;
+            *out++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+static void chunk_hex(const ChunkId id, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        hex[2 * i] = digits[id[i] >> 4];
+        hex[2 * i + 1] = digits[id[i] & 0xf];
+    }
+    hex[CHUNK_HEX] = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static int parse_chunk(const char *hex, ChunkId id) {
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_value(hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        id[i] = (hi << 4) | lo;
+    }
+    return hex[CHUNK_HEX] == '\0' || hex[CHUNK_HEX] == '\n' ? 0 : -1;
+}
+
+static void chunk_path(const char *store, const ChunkId id,
+        char *path, size_t size) {
+    char hex[CHUNK_HEX + 1];
+    chunk_hex(id, hex);
+    snprintf(path, size, "%s/%.2s/%s", store, hex, hex + 2);
+}
+
+static void put_entry(FILE *f, const SnapshotEntry *e) {
+    fprintf(f, "%c\t%o\t%u\t%u\t%ld\t", e->type, e->mode, e->uid, e->gid,
+            e->mtime);
+    if (e->type == 'f') fprintf(f, "%lld\t", e->size);
+    if (e->type == 'n') fprintf(f, "%lu\t", e->rdev);
+    put_escaped(f, e->path);
+    if (e->type == 'l') {
+        putc('\t', f);
+        put_escaped(f, e->target);
+    }
+    putc('\n', f);
+
+    char hex[CHUNK_HEX + 1];
+    int i;
+    for (i = 0; i < e->nchunks; ++i) {
+        chunk_hex(e->chunks[i], hex);
+        fprintf(f, "c\t%s\n", hex);
+    }
+}
+
+static int parse_entry(char *line, SnapshotEntry *e) {
+    char *field[8];
+    int n = 0;
+    char *p = line;
+    line[strcspn(line, "\n")] = '\0';
+    while (n < 8) {
+        field[n++] = p;
+        if ((p = strchr(p, '\t')) == NULL) break;
+        *p++ = '\0';
+    }
+
+    memset(e, 0, sizeof(*e));
+    if (n < 6 || strlen(field[0]) != 1) return -1;
+    e->type = field[0][0];
+    e->mode = strtoul(field[1], NULL, 8);
+    e->uid = strtoul(field[2], NULL, 10);
+    e->gid = strtoul(field[3], NULL, 10);
+    e->mtime = strtol(field[4], NULL, 10);
+    switch (e->type) {
+        case 'd':
+            if (n != 6) return -1;
+            e->path = field[5];
+            break;
+        case 'f':
+            if (n != 7) return -1;
+            e->size = strtoll(field[5], NULL, 10);
+            e->path = field[6];
+            break;
+        case 'n':
+            if (n != 7) return -1;
+            e->rdev = strtoul(field[5], NULL, 10);
+            e->path = field[6];
+            break;
+        case 'l':
+            if (n != 7) return -1;
+            e->path = field[5];
+            e->target = field[6];
+            unescape(e->target);
+            break;
+        default:
+            return -1;
+    }
+    unescape(e->path);
+    return 0;
+}
+
+// Call "fn" for every entry of the manifest at "path", in order.
+static int read_manifest(const char *path, SnapshotEntryFunction fn,
+        void *cookie) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    // An entry's line is kept in "entry_line" while its chunks are read
+    char *line = malloc(MANIFEST_LINE_MAX);
+    char *entry_line = malloc(MANIFEST_LINE_MAX);
+    ChunkId *chunks = NULL;
+    int chunks_alloc = 0;
+    SnapshotEntry e;
+    int have_entry = 0;
+    int ret = 0;
+
+    if (line == NULL || entry_line == NULL ||
+            fgets(line, MANIFEST_LINE_MAX, f) == NULL ||
+            strcmp(line, MANIFEST_MAGIC) != 0) {
+        LOGE("%s isn't a snapshot manifest\n", path);
+        ret = -1;
+    }
+    while (ret == 0) {
+        char *got = fgets(line, MANIFEST_LINE_MAX, f);
+        if (got != NULL && strchr(line, '\n') == NULL && !feof(f)) {
+            LOGE("Line too long in %s\n", path);
+            ret = -1;
+            break;
+        }
+        if (got != NULL && line[0] == 'c' && line[1] == '\t' &&
+                have_entry && e.type == 'f') {
+            if (e.nchunks == chunks_alloc) {
+                int alloc = chunks_alloc ? chunks_alloc * 2 : 64;
+                ChunkId *more = realloc(chunks, alloc * sizeof(*chunks));
+                if (more == NULL) {
+                    ret = -1;
+                    break;
+                }
+                chunks = more;
+                chunks_alloc = alloc;
+            }
+            if (parse_chunk(line + 2, chunks[e.nchunks]) != 0) {
+                LOGE("Bad chunk in %s: %s", path, line);
+                ret = -1;
+                break;
+            }
+            ++e.nchunks;
+            continue;
+        }
+
+        if (have_entry) {
+            e.chunks = chunks;
+            have_entry = 0;
+            if ((ret = fn(&e, cookie)) != 0) break;
+        }
+        if (got == NULL) {
+            if (ferror(f)) ret = -1;
+            break;
+        }
+
+        char *tmp = entry_line;
+        entry_line = line;
+        line = tmp;
+        if (parse_entry(entry_line, &e) != 0) {
+            LOGE("Bad entry in %s\n", path);
+            ret = -1;
+            break;
+        }
+        have_entry = 1;
+    }
+
+    fclose(f);
+    free(chunks);
+    free(entry_line);
+    free(line);
+    return ret;
+}
+
+typedef struct {
+    FILE *manifest;
+    const char *store;
+    const char *exclude;
+    SnapshotEntry *previous;    // files of the last snapshot, by path
+    int nprevious;
+    int previous_alloc;
+    unsigned char *data;        // a chunk as read from its file
+    unsigned char *packed;      // ...and compressed
+    ChunkId *chunks;            // chunks of the current file
+    int chunks_alloc;
+    int unchanged;              // files whose chunks were reused
+    int new_chunks;
+    long long new_bytes;        // compressed bytes added to the store
+    TarProgress progress;
+    TarProgressFunction callback;
+    void *cookie;
+} SnapshotWriter;
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const SnapshotEntry *) a)->path,
+            ((const SnapshotEntry *) b)->path);
+}
+
+static int keep_previous(const SnapshotEntry *e, void *cookie) {
+    SnapshotWriter *w = (SnapshotWriter *) cookie;
+    if (e->type != 'f') return 0;
+    if (w->nprevious == w->previous_alloc) {
+        int alloc = w->previous_alloc ? w->previous_alloc * 2 : 256;
+        SnapshotEntry *more = realloc(w->previous, alloc * sizeof(*more));
+        if (more == NULL) return -1;
+        w->previous = more;
+        w->previous_alloc = alloc;
+    }
+    SnapshotEntry *copy = &w->previous[w->nprevious];
+    *copy = *e;
+    copy->path = strdup(e->path);
+    copy->chunks = malloc(e->nchunks * sizeof(ChunkId) + 1);
+    if (copy->path == NULL || copy->chunks == NULL) {
+        free(copy->path);
+        free(copy->chunks);
+        return -1;
+    }
+    memcpy(copy->chunks, e->chunks, e->nchunks * sizeof(ChunkId));
+    ++w->nprevious;
+    return 0;
+}
+
+static void free_previous(SnapshotWriter *w) {
+    int i;
+    for (i = 0; i < w->nprevious; ++i) {
+        free(w->previous[i].path);
+        free(w->previous[i].chunks);
+    }
+    free(w->previous);
+    w->previous = NULL;
+    w->nprevious = 0;
+}
+
+// The previous snapshot's chunks for this file, if it hasn't changed.
+static const SnapshotEntry *unchanged_file(SnapshotWriter *w,
+        const SnapshotEntry *e) {
+    if (w->nprevious == 0) return NULL;
+    const SnapshotEntry *prev = bsearch(e, w->previous, w->nprevious,
+            sizeof(*e), compare_entries);
+    if (prev == NULL || prev->size != e->size || prev->mtime != e->mtime) {
+        return NULL;
+    }
+
+    // Someone may have tidied up the store since
+    char path[PATH_MAX];
+    int i;
+    for (i = 0; i < prev->nchunks; ++i) {
+        chunk_path(w->store, prev->chunks[i], path, sizeof(path));
+        if (access(path, F_OK) != 0) return NULL;
+    }
+    return prev;
+}
+
+// Add the "len" bytes in w->data to the store, unless they're there.
+static int store_chunk(SnapshotWriter *w, size_t len, ChunkId id) {
+    SHA(w->data, len, id);
+    char path[PATH_MAX];
+    chunk_path(w->store, id, path, sizeof(path));
+    if (access(path, F_OK) == 0) return 0;
+
+    uLongf packed_len = compressBound(SNAPSHOT_CHUNK_SIZE);
+    if (compress2(w->packed, &packed_len, w->data, len, Z_BEST_SPEED) != Z_OK) {
+        LOGE("Can't compress chunk\n");
+        errno = EIO;
+        return -1;
+    }
+
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    *slash = '/';
+
+    // Written aside, synced and renamed, so a chunk that exists is
+    // complete even after a power cut; later snapshots reuse it as is
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Can't create %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+    int ret = write_fully(fd, w->packed, packed_len);
+    if (ret == 0) ret = fsync(fd);
+    if (close(fd)) ret = -1;
+    if (ret == 0) ret = rename(tmp, path);
+    if (ret != 0) {
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    ++w->new_chunks;
+    w->new_bytes += packed_len;
+    return 0;
+}
+
+static int add_file(SnapshotWriter *w, const char *path, SnapshotEntry *e) {
+    const SnapshotEntry *prev = unchanged_file(w, e);
+    if (prev != NULL) {
+        e->nchunks = prev->nchunks;
+        e->chunks = prev->chunks;
+        ++w->unchanged;
+        w->progress.bytes += e->size;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    // As with tar, the size we stat()ed is the size we record
+    long long left = e->size;
+    e->nchunks = 0;
+    while (left > 0) {
+        size_t want = left < SNAPSHOT_CHUNK_SIZE ? left : SNAPSHOT_CHUNK_SIZE;
+        ssize_t got = read_fully(fd, w->data, want);
+        if (got < 0) {
+            LOGE("Can't read %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if ((size_t) got < want) {
+            LOGW("%s shrank while being backed up\n", path);
+            memset(w->data + got, 0, want - got);
+        }
+
+        if (e->nchunks == w->chunks_alloc) {
+            int alloc = w->chunks_alloc ? w->chunks_alloc * 2 : 64;
+            ChunkId *more = realloc(w->chunks, alloc * sizeof(*more));
+            if (more == NULL) {
+                close(fd);
+                return -1;
+            }
+            w->chunks = more;
+            w->chunks_alloc = alloc;
+        }
+        if (store_chunk(w, want, w->chunks[e->nchunks])) {
+            close(fd);
+            return -1;
+        }
+        ++e->nchunks;
+        left -= want;
+        w->progress.bytes += want;
+        if (w->callback != NULL) w->callback(&w->progress, w->cookie);
+    }
+    close(fd);
+    e->chunks = w->chunks;
+    return 0;
+}
+
+static int add_tree(SnapshotWriter *w, char *path, size_t len) {
+    struct stat st;
+    if (lstat(path, &st)) {
+        if (errno == ENOENT) return 0;  // removed since we read its directory
+        LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    SnapshotEntry e;
+    memset(&e, 0, sizeof(e));
+    e.path = path;
+    while (*e.path == '/') ++e.path;
+    if (w->exclude != NULL && strcmp(e.path, w->exclude) == 0) return 0;
+    e.mode = st.st_mode;
+    e.uid = st.st_uid;
+    e.gid = st.st_gid;
+    e.mtime = st.st_mtime;
+
+    char link[PATH_MAX];
+    if (S_ISREG(st.st_mode)) {
+        e.type = 'f';
+        e.size = st.st_size;
+        if (add_file(w, path, &e)) return -1;
+    } else if (S_ISLNK(st.st_mode)) {
+        ssize_t n = readlink(path, link, sizeof(link) - 1);
+        if (n < 0) {
+            LOGE("Can't read link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        link[n] = '\0';
+        e.type = 'l';
+        e.target = link;
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) ||
+            S_ISFIFO(st.st_mode)) {
+        e.type = 'n';
+        e.rdev = st.st_rdev;
+    } else if (S_ISDIR(st.st_mode)) {
+        e.type = 'd';
+    } else {
+        return 0;  // sockets
+    }
+    put_entry(w->manifest, &e);
+    ++w->progress.files;
+
+    if (e.type != 'd') return 0;
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *de;
+    while (ret == 0 && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        size_t name_len = strlen(de->d_name);
+        if (len + 1 + name_len + 1 >= PATH_MAX) {
+            LOGE("Path too long under %s\n", path);
+            ret = -1;
+            break;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, de->d_name, name_len + 1);
+        ret = add_tree(w, path, len + 1 + name_len);
+        path[len] = '\0';
+    }
+    closedir(d);
+    return ret;
+}
+
+// Sizing pass, so progress can be shown as a fraction.
+static void count_tree(SnapshotWriter *w, char *path, size_t len) {
+    struct stat st;
+    if (lstat(path, &st)) return;
+    const char *name = path;
+    while (*name == '/') ++name;
+    if (w->exclude != NULL && strcmp(name, w->exclude) == 0) return;
+    ++w->progress.total_files;
+    if (S_ISREG(st.st_mode)) {
+        w->progress.total_bytes += st.st_size;
+    } else if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (d == NULL) return;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                continue;
+            }
+            size_t name_len = strlen(de->d_name);
+            if (len + 1 + name_len + 1 >= PATH_MAX) continue;
+            path[len] = '/';
+            memcpy(path + len + 1, de->d_name, name_len + 1);
+            count_tree(w, path, len + 1 + name_len);
+            path[len] = '\0';
+        }
+        closedir(d);
+    }
+}
+
+int snapshot_create(const char *manifest_path, const char *dir,
+        const char *exclude, const char *store, const char *previous,
+        TarProgressFunction progress, void *cookie) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') --len;
+    if (len + 2 >= sizeof(path) ||
+            snprintf(tmp, sizeof(tmp), "%s.tmp", manifest_path) >=
+                    (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(store, 0755) && errno != EEXIST) {
+        LOGE("Can't create %s (%s)\n", store, strerror(errno));
+        return -1;
+    }
+
+    SnapshotWriter w;
+    memset(&w, 0, sizeof(w));
+    w.store = store;
+    w.exclude = exclude;
+    w.callback = progress;
+    w.cookie = cookie;
+    if (previous != NULL) {
+        if (read_manifest(previous, keep_previous, &w) == 0) {
+            qsort(w.previous, w.nprevious, sizeof(*w.previous),
+                    compare_entries);
+        } else {
+            LOGW("Can't use %s; reading every file\n", previous);
+            free_previous(&w);
+        }
+    }
+    w.data = malloc(SNAPSHOT_CHUNK_SIZE);
+    w.packed = malloc(compressBound(SNAPSHOT_CHUNK_SIZE));
+    w.manifest = fopen(tmp, "w");
+
+    int ret = -1;
+    int err = errno;
+    if (w.data != NULL && w.packed != NULL && w.manifest != NULL) {
+        memcpy(path, dir, len);
+        path[len] = '\0';
+        count_tree(&w, path, len);
+
+        fputs(MANIFEST_MAGIC, w.manifest);
+        ret = add_tree(&w, path, len);
+        err = errno;
+        if (w.callback != NULL) w.callback(&w.progress, w.cookie);
+    } else {
+        LOGE("Can't create %s (%s)\n", tmp, strerror(err));
+    }
+
+    if (w.manifest != NULL) {
+        // The chunks' renames must be on the card before a manifest
+        // names them
+        if (ret == 0) sync();
+        if (ret == 0 && (fflush(w.manifest) || fsync(fileno(w.manifest)))) {
+            err = errno;
+            ret = -1;
+        }
+        if (fclose(w.manifest) && ret == 0) {
+            err = errno;
+            ret = -1;
+        }
+        if (ret == 0 && rename(tmp, manifest_path)) {
+            err = errno;
+            ret = -1;
+        }
+        if (ret != 0) unlink(tmp);
+    }
+    if (ret == 0) {
+        LOGI("snapshot: %d entries (%d files unchanged), %lld bytes; "
+                "%d new chunks, %lld bytes stored\n", w.progress.files,
+                w.unchanged, w.progress.bytes, w.new_chunks, w.new_bytes);
+    }
+
+    free_previous(&w);
+    free(w.chunks);
+    free(w.packed);
+    free(w.data);
+    errno = err;
+    return ret;
+}
+
+typedef struct {
+    const char *store;
+    unsigned char *data;
+    unsigned char *packed;
+    TarProgress progress;
+    TarProgressFunction callback;
+    void *cookie;
+} SnapshotReader;
+
+static int count_entry(const SnapshotEntry *e, void *cookie) {
+    SnapshotReader *r = (SnapshotReader *) cookie;
+    ++r->progress.total_files;
+    r->progress.total_bytes += e->size;
+    return 0;
+}
+
+// Read, inflate and check one chunk; returns its length or -1.
+static long load_chunk(SnapshotReader *r, const ChunkId id) {
+    char path[PATH_MAX];
+    chunk_path(r->store, id, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Missing chunk %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t packed_len = read_fully(fd, r->packed,
+            compressBound(SNAPSHOT_CHUNK_SIZE));
+    close(fd);
+
+    uLongf len = SNAPSHOT_CHUNK_SIZE;
+    ChunkId digest;
+    if (packed_len < 0 ||
+            uncompress(r->data, &len, r->packed, packed_len) != Z_OK ||
+            memcmp(SHA(r->data, len, digest), id, SHA_DIGEST_SIZE) != 0) {
+        LOGE("Corrupt chunk %s\n", path);
+        return -1;
+    }
+    return len;
+}
+
+static int restore_file(SnapshotReader *r, const char *path,
+        const SnapshotEntry *e) {
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    long long left = e->size;
+    int i;
+    for (i = 0; i < e->nchunks; ++i) {
+        long len = load_chunk(r, e->chunks[i]);
+        if (len < 0 || len > left) {
+            if (len >= 0) LOGE("%s is longer than recorded\n", path);
+            close(fd);
+            return -1;
+        }
+        if (write_fully(fd, r->data, len)) {
+            LOGE("Can't write %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        left -= len;
+        r->progress.bytes += len;
+        if (r->callback != NULL) r->callback(&r->progress, r->cookie);
+    }
+    if (left != 0) {
+        LOGE("%s is shorter than recorded\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fchown(fd, e->uid, e->gid) || fchmod(fd, e->mode & 07777)) {
+        LOGW("Can't set owner/mode of %s (%s)\n", path, strerror(errno));
+    }
+    if (close(fd)) {
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int restore_entry(const SnapshotEntry *e, void *cookie) {
+    SnapshotReader *r = (SnapshotReader *) cookie;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "/%s", e->path) >= (int) sizeof(path)) {
+        LOGE("Path too long: %s\n", e->path);
+        return -1;
+    }
+
+    int ret = 0;
+    switch (e->type) {
+        case 'd':
+            if (mkdir(path, 0700) && errno != EEXIST) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            if (chown(path, e->uid, e->gid) || chmod(path, e->mode & 07777)) {
+                LOGW("Can't set owner/mode of %s (%s)\n", path, strerror(errno));
+            }
+            break;
+
+        case 'f':
+            ret = restore_file(r, path, e);
+            break;
+
+        case 'l':
+            unlink(path);
+            if (symlink(e->target, path)) {
+                LOGE("Can't link %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            if (lchown(path, e->uid, e->gid)) {
+                LOGW("Can't set owner of %s (%s)\n", path, strerror(errno));
+            }
+            break;
+
+        case 'n':
+            unlink(path);
+            if (mknod(path, e->mode, e->rdev)) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            if (chown(path, e->uid, e->gid) || chmod(path, e->mode & 07777)) {
+                LOGW("Can't set owner/mode of %s (%s)\n", path, strerror(errno));
+            }
+            break;
+    }
+
+    if (ret == 0 && (e->type == 'f' || e->type == 'n')) {
+        struct utimbuf times = { e->mtime, e->mtime };
+        utime(path, &times);
+    }
+    if (ret == 0) ++r->progress.files;
+    return ret;
+}
+
+int snapshot_restore(const char *manifest_path, const char *store,
+        TarProgressFunction progress, void *cookie) {
+    SnapshotReader r;
+    memset(&r, 0, sizeof(r));
+    r.store = store;
+    r.callback = progress;
+    r.cookie = cookie;
+    r.data = malloc(SNAPSHOT_CHUNK_SIZE);
+    r.packed = malloc(compressBound(SNAPSHOT_CHUNK_SIZE));
+
+    int ret = -1;
+    if (r.data != NULL && r.packed != NULL &&
+            read_manifest(manifest_path, count_entry, &r) == 0) {
+        ret = read_manifest(manifest_path, restore_entry, &r);
+        if (r.callback != NULL) r.callback(&r.progress, r.cookie);
+    }
+    free(r.packed);
+    free(r.data);
+    return ret;
+}
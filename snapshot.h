@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_SNAPSHOT_H
+#define _RECOVERY_SNAPSHOT_H
+
+#include "tar.h"
+
+/* Incremental backups.
+ *
+ * File contents are cut into SNAPSHOT_CHUNK_SIZE pieces, and each piece
+ * is kept (compressed) exactly once in a chunk store directory, named
+ * by its SHA-1.  A snapshot is a small text manifest listing every
+ * entry of the tree and the chunks that make up each file, so a backup
+ * taken when little has changed writes little more than its manifest.
+ */
+
+#define SNAPSHOT_CHUNK_SIZE (1024 * 1024)
+
+/* Record the directory "dir" (e.g. "/data") in the manifest
+ * "manifest_path", adding any chunks it needs to "store".  "exclude" is
+ * as for tar_create().  Files whose size and mtime match their entry in
+ * the manifest "previous" (if not NULL) reuse its chunks without being
+ * read.  "progress" counts every file byte, read or not.
+ *
+ * Returns 0 on success, -1 with errno set (and no manifest) on failure.
+ */
+int snapshot_create(const char *manifest_path, const char *dir,
+        const char *exclude, const char *store, const char *previous,
+        TarProgressFunction progress, void *cookie);
+
+/* Recreate the tree recorded in "manifest_path" under "/", reading
+ * chunks from "store".  Returns 0 on success, -1 on failure.
+ */
+int snapshot_restore(const char *manifest_path, const char *store,
+        TarProgressFunction progress, void *cookie);
+
+#endif  /* _RECOVERY_SNAPSHOT_H */
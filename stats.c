@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "stats.h"
+
+#define STATS_MAX_PHASES 16
+
+typedef struct {
+    const char *name;
+    int runs;
+    double wall;
+    double cpu;
+    long long bytes;
+    long long files;
+    long long io;
+} StatsPhase;
+
+static StatsPhase gPhases[STATS_MAX_PHASES];
+static int gNumPhases = 0;
+
+static double tv_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// CPU seconds and block I/O bytes used so far by us and our children.
+static void usage_now(double *cpu, long long *io) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    *cpu = tv_seconds(&self.ru_utime) + tv_seconds(&self.ru_stime) +
+            tv_seconds(&children.ru_utime) + tv_seconds(&children.ru_stime);
+    *io = 512LL * (self.ru_inblock + self.ru_oublock +
+            children.ru_inblock + children.ru_oublock);
+}
+
+static int find_phase(const char *name) {
+    int i;
+    for (i = 0; i < gNumPhases; ++i) {
+        if (!strcmp(gPhases[i].name, name)) return i;
+    }
+    if (gNumPhases == STATS_MAX_PHASES) return -1;
+    memset(&gPhases[gNumPhases], 0, sizeof(gPhases[gNumPhases]));
+    gPhases[gNumPhases].name = name;
+    return gNumPhases++;
+}
+
+void stats_reset(void) {
+    gNumPhases = 0;
+}
+
+void stats_start(StatsTimer *t, const char *phase) {
+    t->phase = find_phase(phase);
+    gettimeofday(&t->wall, NULL);
+    usage_now(&t->cpu, &t->io);
+}
+
+void stats_stop(StatsTimer *t, long long bytes, long long files) {
+    if (t->phase < 0) return;
+
+    struct timeval now;
+    double cpu;
+    long long io;
+    gettimeofday(&now, NULL);
+    usage_now(&cpu, &io);
+
+    StatsPhase *p = &gPhases[t->phase];
+    p->runs++;
+    p->wall += tv_seconds(&now) - tv_seconds(&t->wall);
+    p->cpu += cpu - t->cpu;
+    p->io += io - t->io;
+    p->bytes += bytes;
+    p->files += files;
+    t->phase = -1;
+}
+
+int stats_write(FILE *f, const char *package, int status, int benchmark) {
+    fprintf(f, "package=%s\n", package);
+    fprintf(f, "status=%d\n", status);
+    fprintf(f, "benchmark=%d\n", benchmark);
+    int i;
+    for (i = 0; i < gNumPhases; ++i) {
+        const StatsPhase *p = &gPhases[i];
+        fprintf(f, "phase=%s runs=%d wall_ms=%lld cpu_ms=%lld bytes=%lld "
+                "files=%lld io_bytes=%lld\n", p->name, p->runs,
+                (long long) (p->wall * 1000), (long long) (p->cpu * 1000),
+                p->bytes, p->files, p->io);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+void stats_show(void) {
+    int i;
+    for (i = 0; i < gNumPhases; ++i) {
+        const StatsPhase *p = &gPhases[i];
+        ui_print("%-8s %6.2fs (cpu %.2fs) %lld KB, %lld files\n",
+                p->name, p->wall, p->cpu, p->bytes >> 10, p->files);
+    }
+}
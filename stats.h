@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_STATS_H
+#define _RECOVERY_STATS_H
+
+#include <stdio.h>
+#include <sys/time.h>
+
+/* Where the time in an install goes.
+ *
+ * Each phase ("mount", "open", "verify", "extract", "flash", ...) adds
+ * up wall and CPU time, the bytes its caller says it moved, the files
+ * it touched, and the block I/O the kernel saw.  CPU time and I/O
+ * include children, so they cover an update binary too.  Phases may
+ * nest; each one's figures include those of the phases inside it.
+ */
+
+typedef struct {
+    int phase;                  // index into the table
+    struct timeval wall;
+    double cpu;                 // seconds, self plus children
+    long long io;               // bytes, self plus children
+} StatsTimer;
+
+// Forget everything recorded so far, before a new install.
+void stats_reset(void);
+
+void stats_start(StatsTimer *t, const char *phase);
+
+/* Add the time since stats_start() to the timer's phase, with "bytes"
+ * moved and "files" touched (0 if the phase can't tell).
+ */
+void stats_stop(StatsTimer *t, long long bytes, long long files);
+
+/* Write the record of the last install to "f": "key=value" lines for
+ * the package and result, then one line per phase, in the order the
+ * phases first ran.  Returns 0, or -1 if "f" has an error.
+ */
+int stats_write(FILE *f, const char *package, int status, int benchmark);
+
+// Print the phases on the screen.
+void stats_show(void);
+
+#endif  /* _RECOVERY_STATS_H */
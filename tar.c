@@ -0,0 +1,1015 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>         // for offsetof()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>  // for major(), minor()
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "gzblock.h"
+#include "manifest.h"
+#include "tar.h"
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_RECORD_SIZE     (TAR_BLOCK_SIZE * 20)   // tar's default blocking
+
+// Archive data is gathered here and written out in large pieces; file
+// contents are read straight into it.
+#define TAR_BUFFER_SIZE     (256 * 1024)
+
+// Buffers each tar_create_multi() stream may have waiting for the writer
+#define TAR_STREAM_QUEUE    16
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+typedef struct TarStreams TarStreams;
+
+typedef struct {
+    int fd;
+    GzBlockWriter *gz;          // compressing, if not NULL
+    char *buffer;
+    size_t used;
+    long long archived;         // bytes passed to write(), for padding
+    const char *exclude;
+    TarProgress progress;
+    TarProgressFunction callback;
+    void *cookie;
+    TarStreams *streams;        // a tar_create_multi() stream, if not NULL
+    int stream;
+    int owning;                 // handed off part of an entry
+    int recording;              // keeping a manifest (TAR_MANIFEST)
+    FILE *manifest;             // where entries go, if not a stream
+    ManifestEntry *entries;     // a stream's, not yet handed off
+    int entry_count, entry_alloc;
+} TarWriter;
+
+static int hand_off(TarWriter *w, int boundary);
+
+static int write_fully(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int flush_buffer(TarWriter *w) {
+    if (w->streams != NULL) return hand_off(w, 0);
+    if (w->gz != NULL) {
+        if (gzblock_write(w->gz, w->buffer, w->used)) return -1;
+    } else if (write_fully(w->fd, w->buffer, w->used)) {
+        LOGE("Can't write backup (%s)\n", strerror(errno));
+        return -1;
+    }
+    w->archived += w->used;
+    w->used = 0;
+    if (w->callback != NULL) w->callback(&w->progress, w->cookie);
+    return 0;
+}
+
+static int append(TarWriter *w, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        if (w->used == TAR_BUFFER_SIZE && flush_buffer(w)) return -1;
+        size_t n = TAR_BUFFER_SIZE - w->used;
+        if (n > len) n = len;
+        memcpy(w->buffer + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Zero-fill up to the next multiple of "unit" bytes of archive.
+static int pad_to(TarWriter *w, long long unit) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    long long n = (w->archived + w->used) % unit;
+    if (n == 0) return 0;
+    for (n = unit - n; n > 0; n -= TAR_BLOCK_SIZE) {
+        if (append(w, zeros, n < TAR_BLOCK_SIZE ? n : TAR_BLOCK_SIZE)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Octal, NUL-terminated, as every tar reads it; values too big for that
+ * (only sizes of 8GB and up, in practice) use the base-256 extension.
+ */
+static void put_number(char *field, size_t len, unsigned long long value) {
+    if (value >> (3 * (len - 1)) == 0) {
+        snprintf(field, len, "%0*llo", (int) len - 1, value);
+        return;
+    }
+    size_t i;
+    for (i = len - 1; i > 0; --i) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = 0x80;
+}
+
+static int write_header(TarWriter *w, const char *name, const char *link,
+        const struct stat *st, char type, long long size);
+
+// GNU tar's "././@LongLink" entry, for names ustar can't hold.
+static int write_long_name(TarWriter *w, char type, const char *name) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    size_t len = strlen(name) + 1;
+    if (write_header(w, "././@LongLink", NULL, &st, type, len) ||
+        append(w, name, len) || pad_to(w, TAR_BLOCK_SIZE)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int write_header(TarWriter *w, const char *name, const char *link,
+        const struct stat *st, char type, long long size) {
+    TarHeader h;
+    memset(&h, 0, sizeof(h));
+
+    size_t len = strlen(name);
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, name, len);
+    } else {
+        // Split at a '/' into prefix and name, if there's one that fits
+        const char *slash = name + len - sizeof(h.name) - 1;
+        while (*slash != '\0' && *slash != '/') ++slash;
+        if (*slash == '/' && slash - name <= (int) sizeof(h.prefix) &&
+                slash[1] != '\0') {
+            memcpy(h.prefix, name, slash - name);
+            memcpy(h.name, slash + 1, len - (slash + 1 - name));
+        } else {
+            if (write_long_name(w, 'L', name)) return -1;
+            memcpy(h.name, name, sizeof(h.name));
+        }
+    }
+    if (link != NULL) {
+        size_t link_len = strlen(link);
+        if (link_len > sizeof(h.linkname)) {
+            if (write_long_name(w, 'K', link)) return -1;
+            link_len = sizeof(h.linkname);
+        }
+        memcpy(h.linkname, link, link_len);
+    }
+
+    put_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    put_number(h.uid, sizeof(h.uid), st->st_uid);
+    put_number(h.gid, sizeof(h.gid), st->st_gid);
+    put_number(h.size, sizeof(h.size), size);
+    put_number(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    if (type == '3' || type == '4') {
+        put_number(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        put_number(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+
+    // The checksum is computed with its own field full of spaces
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned int sum = 0;
+    const unsigned char *p = (const unsigned char *) &h;
+    size_t i;
+    for (i = 0; i < sizeof(h); ++i) sum += p[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+    return append(w, &h, sizeof(h));
+}
+
+// Copy "size" bytes of the file at "path" into the archive.  A file
+// that shrinks while we read it is padded out with zeros, one that grows
+// is cut off, so the header stays true.
+static int write_file_data(TarWriter *w, const char *path, long long size,
+        uint8_t *digest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    if (digest != NULL) SHA_init(&ctx);
+    long long left = size;
+    while (left > 0) {
+        if (w->used == TAR_BUFFER_SIZE && flush_buffer(w)) {
+            close(fd);
+            return -1;
+        }
+        size_t n = TAR_BUFFER_SIZE - w->used;
+        if ((long long) n > left) n = left;
+        ssize_t got = read(fd, w->buffer + w->used, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            LOGE("Can't read %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (got == 0) {
+            LOGW("%s shrank while being archived\n", path);
+            got = n;
+            memset(w->buffer + w->used, 0, n);
+        }
+        if (digest != NULL) SHA_update(&ctx, w->buffer + w->used, got);
+        w->used += got;
+        left -= got;
+        w->progress.bytes += got;
+    }
+    close(fd);
+    if (digest != NULL) memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return pad_to(w, TAR_BLOCK_SIZE);
+}
+
+/* Note an entry that has been added, starting "offset" bytes into this
+ * writer's output.  A stream keeps its entries until the buffer they end
+ * in is handed off (see hand_off()); otherwise they're written now.
+ */
+static int record_entry(TarWriter *w, long long offset, char type,
+        long long size, const uint8_t *digest, const char *name) {
+    if (!w->recording) return 0;
+    ManifestEntry e;
+    memset(&e, 0, sizeof(e));
+    e.offset = offset;
+    e.size = size;
+    e.type = type;
+    if (digest != NULL) memcpy(e.digest, digest, SHA_DIGEST_SIZE);
+    if (w->streams == NULL) {
+        e.name = (char *) name;
+        if (manifest_put_entry(w->manifest, &e)) {
+            LOGE("Can't write backup manifest (%s)\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (w->entry_count == w->entry_alloc) {
+        int alloc = w->entry_alloc ? w->entry_alloc * 2 : 64;
+        ManifestEntry *more = realloc(w->entries, alloc * sizeof(*more));
+        if (more == NULL) return -1;
+        w->entries = more;
+        w->entry_alloc = alloc;
+    }
+    e.name = strdup(name);
+    if (e.name == NULL) return -1;
+    w->entries[w->entry_count++] = e;
+    return 0;
+}
+
+static void free_entries(ManifestEntry *entries, int count) {
+    int i;
+    for (i = 0; i < count; ++i) free(entries[i].name);
+    free(entries);
+}
+
+/* A whole entry has been added.  A stream hands its buffer off once it's
+ * half full, and at once if it had to hand off part of this entry: the
+ * writer can't take anything from the other streams until it gets here.
+ */
+static int end_entry(TarWriter *w) {
+    if (w->streams == NULL) return 0;
+    if (!w->owning && w->used < TAR_BUFFER_SIZE / 2) return 0;
+    return hand_off(w, 1);
+}
+
+// Name of the entry for "path": relative to "/", as tar run from / has it.
+static const char *entry_name(const char *path) {
+    while (*path == '/') ++path;
+    return path;
+}
+
+static int add_tree(TarWriter *w, char *path, size_t len) {
+    struct stat st;
+    if (lstat(path, &st)) {
+        if (errno == ENOENT) return 0;  // removed since we read its directory
+        LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    const char *name = entry_name(path);
+    if (w->exclude != NULL && strcmp(name, w->exclude) == 0) return 0;
+
+    long long offset = w->archived + w->used;
+    int ret = 0;
+    if (S_ISREG(st.st_mode)) {
+        uint8_t digest[SHA_DIGEST_SIZE];
+        ret = write_header(w, name, NULL, &st, '0', st.st_size) ||
+                write_file_data(w, path, st.st_size,
+                        w->recording ? digest : NULL) ||
+                record_entry(w, offset, '0', st.st_size, digest, name);
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t n = readlink(path, link, sizeof(link) - 1);
+        if (n < 0) {
+            LOGE("Can't read link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        link[n] = '\0';
+        ret = write_header(w, name, link, &st, '2', 0) ||
+                record_entry(w, offset, '2', 0, NULL, name);
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) ||
+            S_ISFIFO(st.st_mode)) {
+        char type = S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6';
+        ret = write_header(w, name, NULL, &st, type, 0) ||
+                record_entry(w, offset, type, 0, NULL, name);
+    } else if (S_ISDIR(st.st_mode)) {
+        // tar names directories with a trailing slash
+        path[len] = '/';
+        path[len + 1] = '\0';
+        ret = write_header(w, entry_name(path), NULL, &st, '5', 0);
+        path[len] = '\0';
+        if (ret == 0) ret = record_entry(w, offset, '5', 0, NULL, name) ||
+                end_entry(w);
+        if (ret == 0) {
+            DIR *d = opendir(path);
+            if (d == NULL) {
+                LOGE("Can't open %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            struct dirent *de;
+            while (ret == 0 && (de = readdir(d)) != NULL) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                    continue;
+                }
+                size_t name_len = strlen(de->d_name);
+                if (len + 1 + name_len + 1 >= PATH_MAX) {
+                    LOGE("Path too long under %s\n", path);
+                    ret = -1;
+                    break;
+                }
+                path[len] = '/';
+                memcpy(path + len + 1, de->d_name, name_len + 1);
+                ret = add_tree(w, path, len + 1 + name_len);
+                path[len] = '\0';
+            }
+            closedir(d);
+        }
+    } else {
+        return 0;  // sockets; tar skips them too
+    }
+    if (ret == 0 && !S_ISDIR(st.st_mode)) ret = end_entry(w);
+    if (ret == 0) ++w->progress.files;
+    return ret;
+}
+
+// Sizing pass, so progress can be shown as a fraction.
+static void count_tree(TarWriter *w, char *path, size_t len) {
+    struct stat st;
+    if (lstat(path, &st)) return;
+    if (w->exclude != NULL && strcmp(entry_name(path), w->exclude) == 0) {
+        return;
+    }
+    ++w->progress.total_files;
+    if (S_ISREG(st.st_mode)) {
+        w->progress.total_bytes += st.st_size;
+    } else if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (d == NULL) return;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                continue;
+            }
+            size_t name_len = strlen(de->d_name);
+            if (len + 1 + name_len + 1 >= PATH_MAX) continue;
+            path[len] = '/';
+            memcpy(path + len + 1, de->d_name, name_len + 1);
+            count_tree(w, path, len + 1 + name_len);
+            path[len] = '\0';
+        }
+        closedir(d);
+    }
+}
+
+static void manifest_path(char *path, const char *archive_path) {
+    snprintf(path, PATH_MAX, "%s%s", archive_path, MANIFEST_SUFFIX);
+}
+
+static int open_archive(TarWriter *w, const char *archive_path, int flags) {
+    char path[PATH_MAX];
+    manifest_path(path, archive_path);
+    unlink(path);  // a stale one would describe some other archive
+
+    w->fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        LOGE("Can't create %s (%s)\n", archive_path, strerror(errno));
+        return -1;
+    }
+    if (flags & TAR_GZIP) {
+        w->gz = gzblock_open_writer(w->fd, 0);
+        if (w->gz == NULL) {
+            close(w->fd);
+            unlink(archive_path);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if (flags & TAR_MANIFEST) {
+        w->manifest = fopen(path, "w");
+        if (w->manifest == NULL || manifest_put_header(w->manifest)) {
+            int err = errno;
+            LOGE("Can't create %s (%s)\n", path, strerror(err));
+            if (w->manifest != NULL) fclose(w->manifest);
+            w->manifest = NULL;
+            if (w->gz != NULL) gzblock_close_writer(w->gz);
+            w->gz = NULL;
+            close(w->fd);
+            unlink(archive_path);
+            unlink(path);
+            errno = err;
+            return -1;
+        }
+        w->recording = 1;
+    }
+    return 0;
+}
+
+// End the archive (if "ret" is 0 so far) and close it; returns 0 if it
+// was all written, otherwise -1 with errno set and the archive removed.
+static int close_archive(TarWriter *w, const char *archive_path, int ret) {
+    // Two zero blocks end the archive, then pad it to a whole record
+    static const char zeros[TAR_BLOCK_SIZE * 2];
+    if (ret == 0) ret = append(w, zeros, sizeof(zeros));
+    if (ret == 0) ret = pad_to(w, TAR_RECORD_SIZE);
+    if (ret == 0) ret = flush_buffer(w);
+    if (w->gz != NULL && gzblock_close_writer(w->gz)) ret = -1;
+    if (ret == 0 && fsync(w->fd)) ret = -1;
+
+    int err = errno;
+    if (close(w->fd) && ret == 0) {
+        err = errno;
+        ret = -1;
+    }
+    if (w->manifest != NULL) {
+        if (ret == 0 && (fflush(w->manifest) || fsync(fileno(w->manifest)))) {
+            err = errno;
+            ret = -1;
+        }
+        if (fclose(w->manifest) && ret == 0) {
+            err = errno;
+            ret = -1;
+        }
+        if (ret != 0) {
+            char path[PATH_MAX];
+            manifest_path(path, archive_path);
+            unlink(path);
+        }
+    }
+    if (ret != 0) unlink(archive_path);
+    errno = err;
+    return ret ? -1 : 0;
+}
+
+// Copy "dir" into "path", without any trailing '/'.
+static int set_dir(char *path, const char *dir, size_t *len) {
+    *len = strlen(dir);
+    while (*len > 1 && dir[*len - 1] == '/') --*len;  // "/data/" -> "/data"
+    if (*len + 2 >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, dir, *len);
+    path[*len] = '\0';
+    return 0;
+}
+
+int tar_create(const char *archive_path, const char *dir, const char *exclude,
+        int flags, TarProgressFunction progress, void *cookie) {
+    char path[PATH_MAX];
+    size_t len;
+    if (set_dir(path, dir, &len)) return -1;
+
+    TarWriter w;
+    memset(&w, 0, sizeof(w));
+    w.exclude = exclude;
+    w.callback = progress;
+    w.cookie = cookie;
+    w.buffer = malloc(TAR_BUFFER_SIZE);
+    if (w.buffer == NULL) return -1;
+
+    count_tree(&w, path, len);
+    if (open_archive(&w, archive_path, flags)) {
+        int err = errno;
+        free(w.buffer);
+        errno = err;
+        return -1;
+    }
+    int ret = close_archive(&w, archive_path, add_tree(&w, path, len));
+    int err = errno;
+    free(w.buffer);
+    errno = err;
+    return ret;
+}
+
+/* tar_create_multi() runs one TarWriter per directory, each on its own
+ * thread, and queues their full buffers for the calling thread to write
+ * to the archive.  Entries are kept whole: once the writer has taken a
+ * buffer that ends part way through an entry, it takes only from that
+ * stream until the entry is done.
+ */
+typedef struct TarChunk {
+    struct TarChunk *next;
+    char *data;
+    size_t len;
+    int boundary;               // ends at the end of an entry
+    int last;                   // the stream is finished
+    TarProgress progress;       // of the stream, as of this chunk
+    long long start;            // how far into the stream's output it is
+    ManifestEntry *entries;     // ending in it, offsets into the stream
+    int entry_count;
+} TarChunk;
+
+struct TarStreams {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a queue changed, or "failed" was set
+    int failed;
+    TarChunk *head[TAR_MAX_STREAMS];
+    TarChunk *tail[TAR_MAX_STREAMS];
+    int queued[TAR_MAX_STREAMS];
+};
+
+typedef struct {
+    TarWriter w;
+    char path[PATH_MAX];
+    size_t len;
+    pthread_t thread;
+    int started;
+    TarChunk *end;              // its last chunk, allocated up front
+} TarStream;
+
+static void free_chunk(TarChunk *c) {
+    free_entries(c->entries, c->entry_count);
+    free(c->data);
+    free(c);
+}
+
+static int queue_chunk(TarWriter *w, TarChunk *c) {
+    TarStreams *s = w->streams;
+    int i = w->stream;
+    pthread_mutex_lock(&s->lock);
+    while (!s->failed && s->queued[i] >= TAR_STREAM_QUEUE) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    if (s->failed && !c->last) {
+        pthread_mutex_unlock(&s->lock);
+        free_chunk(c);
+        return -1;
+    }
+    if (s->tail[i] != NULL) {
+        s->tail[i]->next = c;
+    } else {
+        s->head[i] = c;
+    }
+    s->tail[i] = c;
+    ++s->queued[i];
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int hand_off(TarWriter *w, int boundary) {
+    TarChunk *c = calloc(1, sizeof(*c));
+    char *buffer = malloc(TAR_BUFFER_SIZE);
+    if (c == NULL || buffer == NULL) {
+        free(c);
+        free(buffer);
+        pthread_mutex_lock(&w->streams->lock);
+        w->streams->failed = 1;
+        pthread_cond_broadcast(&w->streams->cond);
+        pthread_mutex_unlock(&w->streams->lock);
+        return -1;
+    }
+    c->data = w->buffer;
+    c->len = w->used;
+    c->boundary = boundary;
+    c->progress = w->progress;
+    c->start = w->archived;
+    c->entries = w->entries;
+    c->entry_count = w->entry_count;
+    w->entries = NULL;
+    w->entry_count = w->entry_alloc = 0;
+    w->buffer = buffer;
+    w->archived += w->used;
+    w->used = 0;
+    w->owning = !boundary;
+    return queue_chunk(w, c);
+}
+
+static void *stream_thread(void *cookie) {
+    TarStream *t = (TarStream *) cookie;
+    TarWriter *w = &t->w;
+    count_tree(w, t->path, t->len);
+    int ret = add_tree(w, t->path, t->len);
+    if (ret == 0) ret = hand_off(w, 1);
+
+    // Always tell the writer we're done, even after a failure; the chunk
+    // that says so was allocated before the thread started, so it can't
+    // fail to be sent
+    TarChunk *c = t->end;
+    t->end = NULL;
+    if (ret != 0) {
+        pthread_mutex_lock(&w->streams->lock);
+        w->streams->failed = 1;
+        pthread_cond_broadcast(&w->streams->cond);
+        pthread_mutex_unlock(&w->streams->lock);
+    }
+    c->boundary = c->last = 1;
+    c->progress = w->progress;
+    queue_chunk(w, c);
+    return NULL;
+}
+
+// Take the next chunk for the writer: from "owner" if it's >= 0, otherwise
+// from whichever stream after "last" has one.  Sets "*failed" if any
+// stream has failed; the rest of the chunks must still be taken.
+static TarChunk *next_chunk(TarStreams *s, int count, int owner, int last,
+        int *stream, int *failed) {
+    TarChunk *c = NULL;
+    pthread_mutex_lock(&s->lock);
+    while (c == NULL) {
+        int i;
+        for (i = 1; i <= count && c == NULL; ++i) {
+            int j = owner >= 0 && !s->failed ? owner : (last + i) % count;
+            if (s->head[j] != NULL) {
+                c = s->head[j];
+                *stream = j;
+            }
+        }
+        if (c == NULL) pthread_cond_wait(&s->cond, &s->lock);
+    }
+    s->head[*stream] = c->next;
+    if (s->head[*stream] == NULL) s->tail[*stream] = NULL;
+    --s->queued[*stream];
+    *failed = s->failed;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return c;
+}
+
+int tar_create_multi(const char *archive_path, const char *const dirs[],
+        const char *const excludes[], int count, int flags,
+        TarProgressFunction progress, void *cookie) {
+    if (count < 1 || count > TAR_MAX_STREAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    TarWriter out;
+    memset(&out, 0, sizeof(out));
+    out.buffer = malloc(TAR_BUFFER_SIZE);
+    TarStream *streams = calloc(count, sizeof(*streams));
+    if (out.buffer == NULL || streams == NULL) {
+        free(out.buffer);
+        free(streams);
+        errno = ENOMEM;
+        return -1;
+    }
+    TarStreams s;
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    int ret = open_archive(&out, archive_path, flags);
+    int opened = ret == 0;
+    int i, live = 0;
+    for (i = 0; ret == 0 && i < count; ++i) {
+        TarStream *t = &streams[i];
+        t->w.exclude = excludes != NULL ? excludes[i] : NULL;
+        t->w.streams = &s;
+        t->w.stream = i;
+        t->w.recording = out.recording;
+        t->w.buffer = malloc(TAR_BUFFER_SIZE);
+        t->end = calloc(1, sizeof(*t->end));
+        if (t->w.buffer == NULL || t->end == NULL ||
+                set_dir(t->path, dirs[i], &t->len) ||
+                pthread_create(&t->thread, NULL, stream_thread, t)) {
+            ret = -1;
+            break;
+        }
+        t->started = 1;
+        ++live;
+    }
+    if (ret != 0) {
+        pthread_mutex_lock(&s.lock);
+        s.failed = 1;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+
+    // Write whatever the streams hand over until they've all finished
+    TarProgress done[TAR_MAX_STREAMS];
+    memset(done, 0, sizeof(done));
+    int owner = -1, last = count - 1;
+    while (live > 0) {
+        int stream, failed;
+        TarChunk *c = next_chunk(&s, count, owner, last, &stream, &failed);
+        if (c->last) --live;
+        if (failed) ret = -1;
+        done[stream] = c->progress;
+        // An entry is written out contiguously, so one that ends in this
+        // chunk starts where it says relative to the chunk
+        int j;
+        for (j = 0; ret == 0 && j < c->entry_count; ++j) {
+            ManifestEntry *e = &c->entries[j];
+            e->offset += out.archived - c->start;
+            if (manifest_put_entry(out.manifest, e)) {
+                LOGE("Can't write backup manifest (%s)\n", strerror(errno));
+                ret = -1;
+            }
+        }
+        if (ret == 0 && c->len > 0) {
+            if (out.gz != NULL) {
+                ret = gzblock_write(out.gz, c->data, c->len);
+            } else if (write_fully(out.fd, c->data, c->len)) {
+                LOGE("Can't write backup (%s)\n", strerror(errno));
+                ret = -1;
+            }
+            out.archived += c->len;
+        }
+        if (ret != 0 && !failed) {
+            pthread_mutex_lock(&s.lock);
+            s.failed = 1;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.lock);
+        }
+        owner = c->boundary ? -1 : stream;
+        last = stream;
+        free_chunk(c);
+
+        if (progress != NULL) {
+            TarProgress sum;
+            memset(&sum, 0, sizeof(sum));
+            for (i = 0; i < count; ++i) {
+                sum.files += done[i].files;
+                sum.bytes += done[i].bytes;
+                sum.total_files += done[i].total_files;
+                sum.total_bytes += done[i].total_bytes;
+            }
+            progress(&sum, cookie);
+        }
+    }
+    int err = errno;
+    for (i = 0; i < count; ++i) {
+        if (streams[i].started) pthread_join(streams[i].thread, NULL);
+        free(streams[i].w.buffer);
+        free(streams[i].end);
+        free_entries(streams[i].w.entries, streams[i].w.entry_count);
+    }
+    free(streams);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    errno = err;
+
+    if (opened) ret = close_archive(&out, archive_path, ret);
+    free(out.buffer);
+    return ret;
+}
+
+struct TarReader {
+    TarReadFunction read;
+    void *cookie;
+    long long offset;           // of the next byte read from the stream
+    long long left;             // contents of the current entry not yet read
+    long long padding;          // ...and the zeros after them
+    char *long_name;            // from GNU "././@LongLink" entries
+    char *long_link;
+    char name[sizeof(((TarHeader *) 0)->prefix) + 1 +
+            sizeof(((TarHeader *) 0)->name) + 1];
+    char link[sizeof(((TarHeader *) 0)->linkname) + 1];
+    char scratch[TAR_BLOCK_SIZE];
+};
+
+static ssize_t read_stream(TarReader *r, void *data, size_t len) {
+    ssize_t n = r->read(r->cookie, data, len);
+    if (n > 0) r->offset += n;
+    return n;
+}
+
+static int read_exactly(TarReader *r, void *data, size_t len) {
+    ssize_t n = read_stream(r, data, len);
+    if (n == (ssize_t) len) return 0;
+    if (n >= 0) LOGE("Backup is truncated\n");
+    return -1;
+}
+
+static int skip_bytes(TarReader *r, long long len) {
+    while (len > 0) {
+        size_t n = len < TAR_BLOCK_SIZE ? len : TAR_BLOCK_SIZE;
+        if (read_exactly(r, r->scratch, n)) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static long long get_number(const char *field, size_t len) {
+    const unsigned char *p = (const unsigned char *) field;
+    long long value = 0;
+    size_t i;
+    if (p[0] & 0x80) {
+        // base-256, as put_number() writes big values
+        value = p[0] & 0x3f;
+        for (i = 1; i < len; ++i) value = (value << 8) | p[i];
+        return value;
+    }
+    for (i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); ++i) continue;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+        value = (value << 3) | (p[i] - '0');
+    }
+    return value;
+}
+
+static int checksum_ok(const TarHeader *h) {
+    const unsigned char *p = (const unsigned char *) h;
+    const signed char *sp = (const signed char *) h;
+    unsigned int sum = 0;
+    int signed_sum = 0;
+    size_t i;
+    for (i = 0; i < sizeof(*h); ++i) {
+        int in_chksum = i >= offsetof(TarHeader, chksum) &&
+                i < offsetof(TarHeader, chksum) + sizeof(h->chksum);
+        sum += in_chksum ? ' ' : p[i];
+        signed_sum += in_chksum ? ' ' : sp[i];
+    }
+    // Some old tars summed signed chars
+    long long want = get_number(h->chksum, sizeof(h->chksum));
+    return want == sum || want == signed_sum;
+}
+
+// The contents of a long name entry.
+static char *read_long_name(TarReader *r, long long size) {
+    if (size <= 0 || size > 64 * 1024) {
+        LOGE("Bad long name in backup\n");
+        return NULL;
+    }
+    char *name = malloc(size + 1);
+    if (name == NULL) return NULL;
+    if (read_exactly(r, name, size) ||
+            skip_bytes(r, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) %
+                    TAR_BLOCK_SIZE)) {
+        free(name);
+        return NULL;
+    }
+    name[size] = '\0';
+    return name;
+}
+
+static void copy_field(char *out, const char *field, size_t len) {
+    size_t n = strnlen(field, len);
+    memcpy(out, field, n);
+    out[n] = '\0';
+}
+
+TarReader *tar_open_reader(TarReadFunction read, void *cookie) {
+    TarReader *r = calloc(1, sizeof(*r));
+    if (r == NULL) return NULL;
+    r->read = read;
+    r->cookie = cookie;
+    return r;
+}
+
+int tar_next_entry(TarReader *r, TarEntry *entry) {
+    if (skip_bytes(r, r->left + r->padding)) return -1;
+    r->left = r->padding = 0;
+    free(r->long_name);
+    free(r->long_link);
+    r->long_name = r->long_link = NULL;
+
+    TarHeader h;
+    for (;;) {
+        // An archive that just stops is fine too; tar would accept it
+        ssize_t n = read_stream(r, &h, sizeof(h));
+        if (n == 0) return 0;
+        if (n != sizeof(h)) {
+            if (n > 0) LOGE("Backup is truncated\n");
+            return -1;
+        }
+        if (h.name[0] == '\0' && h.chksum[0] == '\0') return 0;  // zero block
+        if (!checksum_ok(&h)) {
+            LOGE("Bad tar header checksum in backup\n");
+            return -1;
+        }
+
+        long long size = get_number(h.size, sizeof(h.size));
+        if (size < 0) return -1;
+        if (h.typeflag == 'L' || h.typeflag == 'K') {
+            char *name = read_long_name(r, size);
+            if (name == NULL) return -1;
+            char **slot = h.typeflag == 'L' ? &r->long_name : &r->long_link;
+            free(*slot);
+            *slot = name;
+            continue;
+        }
+        if (h.typeflag == 'x' || h.typeflag == 'g') {
+            // pax headers: nothing we need
+            if (skip_bytes(r, (size + TAR_BLOCK_SIZE - 1) /
+                    TAR_BLOCK_SIZE * TAR_BLOCK_SIZE)) {
+                return -1;
+            }
+            continue;
+        }
+
+        memset(entry, 0, sizeof(*entry));
+        if (r->long_name != NULL) {
+            entry->name = r->long_name;
+        } else {
+            r->name[0] = '\0';
+            if (memcmp(h.magic, "ustar", 5) == 0 && h.prefix[0] != '\0') {
+                copy_field(r->name, h.prefix, sizeof(h.prefix));
+                strcat(r->name, "/");
+            }
+            copy_field(r->name + strlen(r->name), h.name, sizeof(h.name));
+            entry->name = r->name;
+        }
+        if (r->long_link != NULL) {
+            entry->link = r->long_link;
+        } else {
+            copy_field(r->link, h.linkname, sizeof(h.linkname));
+            entry->link = r->link;
+        }
+        while (entry->name[0] == '/') ++entry->name;
+        while (entry->name[0] == '.' && entry->name[1] == '/') {
+            entry->name += 2;
+        }
+
+        entry->type = h.typeflag == '\0' || h.typeflag == '7' ? '0' : h.typeflag;
+        entry->mode = get_number(h.mode, sizeof(h.mode)) & 07777;
+        entry->uid = get_number(h.uid, sizeof(h.uid));
+        entry->gid = get_number(h.gid, sizeof(h.gid));
+        entry->mtime = get_number(h.mtime, sizeof(h.mtime));
+        entry->devmajor = get_number(h.devmajor, sizeof(h.devmajor));
+        entry->devminor = get_number(h.devminor, sizeof(h.devminor));
+
+        // Only plain files have contents worth reading; others are skipped
+        r->left = size;
+        r->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        entry->size = entry->type == '0' ? size : 0;
+        return 1;
+    }
+}
+
+ssize_t tar_read_data(TarReader *r, void *data, size_t len) {
+    if ((long long) len > r->left) len = r->left;
+    if (len == 0) return 0;
+    if (read_exactly(r, data, len)) return -1;
+    r->left -= len;
+    return len;
+}
+
+long long tar_reader_offset(TarReader *r) {
+    return r->offset + r->left + r->padding;
+}
+
+void tar_reader_reset(TarReader *r, long long offset) {
+    r->offset = offset;
+    r->left = r->padding = 0;
+}
+
+void tar_close_reader(TarReader *r) {
+    free(r->long_name);
+    free(r->long_link);
+    free(r);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_TAR_H
+#define _RECOVERY_TAR_H
+
+#include <sys/types.h>
+
+/* How far tar_create() has got.  The totals come from a quick lstat()
+ * pass over the tree before anything is written.
+ */
+typedef struct {
+    long long bytes;            // file data archived so far
+    long long total_bytes;
+    int files;                  // entries archived so far
+    int total_files;
+} TarProgress;
+
+typedef void (*TarProgressFunction)(const TarProgress *progress,
+        void *cookie);
+
+// Flags for tar_create()
+#define TAR_GZIP        0x1     // compress with gzblock (a .tar.gz)
+#define TAR_MANIFEST    0x2     // write a manifest next to it (manifest.h)
+
+/* Write a ustar archive of the directory "dir" (an absolute path such as
+ * "/data") to "archive_path", the way "cd / && tar -cf archive_path data"
+ * would: entry names are relative to "/".  An entry whose name equals
+ * "exclude" (if not NULL), and anything under it, is left out.  With
+ * TAR_GZIP in "flags" the archive is compressed on all cores.  "progress"
+ * (if not NULL) is called every few hundred KB and once at the end.
+ *
+ * Returns 0 on success.  On failure the partial archive is removed and
+ * -1 is returned with errno set.
+ */
+int tar_create(const char *archive_path, const char *dir, const char *exclude,
+        int flags, TarProgressFunction progress, void *cookie);
+
+#define TAR_MAX_STREAMS 4
+
+/* Like tar_create(), but for "count" directories (at most TAR_MAX_STREAMS)
+ * at once, each with its own "excludes" entry (or NULL).  Each directory
+ * is read on a thread of its own, typically from a separate device, and
+ * whole entries from all of them are interleaved into the one archive,
+ * which is written by the calling thread.  "progress" covers them all.
+ */
+int tar_create_multi(const char *archive_path, const char *const dirs[],
+        const char *const excludes[], int count, int flags,
+        TarProgressFunction progress, void *cookie);
+
+/* One entry of an archive being read.  The strings belong to the reader
+ * and last until the next tar_next_entry() call.
+ */
+typedef struct {
+    char type;                  // ustar typeflag; plain files are '0'
+    const char *name;           // with any leading "/" or "./" removed
+    const char *link;           // target of a symbolic ('2') or hard ('1') link
+    unsigned int mode;          // permission bits
+    unsigned int uid;
+    unsigned int gid;
+    long mtime;
+    long long size;             // contents, for plain files
+    unsigned int devmajor;      // for '3' and '4'
+    unsigned int devminor;
+} TarEntry;
+
+// Like read(2), but returns less than "len" only at the end of the data.
+typedef ssize_t (*TarReadFunction)(void *cookie, void *data, size_t len);
+
+typedef struct TarReader TarReader;
+
+TarReader *tar_open_reader(TarReadFunction read, void *cookie);
+
+/* Move on to the next entry, skipping whatever is left of this one.
+ * GNU long names are followed and pax headers skipped.  Returns 1 with
+ * "entry" filled in, 0 at the end of the archive, or -1 if the archive
+ * is truncated or corrupt.
+ */
+int tar_next_entry(TarReader *r, TarEntry *entry);
+
+/* Read up to "len" bytes of the current entry's contents.  Returns the
+ * number read (0 at the end of the entry), or -1 on error.
+ */
+ssize_t tar_read_data(TarReader *r, void *data, size_t len);
+
+/* Where in the stream the next entry's header starts, counting from the
+ * start (or from the "offset" of the last tar_reader_reset()).
+ */
+long long tar_reader_offset(TarReader *r);
+
+/* Forget the current entry, the stream having been moved to "offset"
+ * (at an entry's first header), e.g. with gzblock_seek().
+ */
+void tar_reader_reset(TarReader *r, long long offset);
+
+void tar_close_reader(TarReader *r);
+
+#endif  /* _RECOVERY_TAR_H */
@@ -0,0 +1,66 @@
+# Copyright (C) 2010 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# The same code as recovery, built for the host to compare changes
+# without a device, and for the device to measure the real thing.
+
+bench_src_files := \
+    recovery-bench.c \
+    ../../verifier.c \
+    ../../keys.c \
+    ../../sha1.c
+
+bench_c_includes := \
+    $(LOCAL_PATH)/../.. \
+    external/zlib \
+    external/safe-iop/include
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := recovery-bench
+LOCAL_SRC_FILES := $(bench_src_files) \
+    ../../minzip/Hash.c \
+    ../../minzip/SysUtil.c \
+    ../../minzip/DirUtil.c \
+    ../../minzip/Inlines.c \
+    ../../minzip/Inflate.c \
+    ../../minzip/Zip.c \
+    ../../mtdutils/mtdutils.c \
+    ../../mtdutils/mtdsim.c \
+    ../../mtdutils/mounts.c \
+    ../../sha1_lanes.c
+LOCAL_C_INCLUDES := $(bench_c_includes)
+LOCAL_CFLAGS += -DSHA1_HAVE_LANES
+LOCAL_STATIC_LIBRARIES := libmincrypt libz
+include $(BUILD_HOST_EXECUTABLE)
+
+ifneq ($(TARGET_SIMULATOR),true)
+
+include $(CLEAR_VARS)
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE := recovery-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_SRC_FILES := $(bench_src_files)
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_SRC_FILES += ../../sha1_lanes.c.neon
+LOCAL_CFLAGS += -DSHA1_HAVE_LANES
+endif
+LOCAL_C_INCLUDES := $(bench_c_includes)
+LOCAL_STATIC_LIBRARIES := libminzip libmtdutils libmincrypt libz \
+    libcutils libc
+include $(BUILD_EXECUTABLE)
+
+endif  # !TARGET_SIMULATOR
@@ -0,0 +1,727 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "keys.h"
+#include "sha1.h"
+#include "minzip/DirUtil.h"
+#include "minzip/Inflate.h"
+#include "minzip/Zip.h"
+#include "mtdutils/mtdutils.h"
+#include "verifier.h"
+
+/*
+ * Benchmarks of recovery's hot paths, on the host or the device.
+ *
+ * A synthetic package is written first: "entries" files of "bytes" in
+ * all, under system/, three in four of them compressible text
+ * (DEFLATED) and one in four random data (STORED), like the mix of
+ * libraries and APKs in a system update.  Each result is one line,
+ *
+ *     <name> <value> <unit>
+ *
+ * the best of "repeats" runs; lines starting with '#' are comments.
+ * verify_jar needs a real signed package (-p) and its keys (-k), since
+ * nothing here can sign one; mtd_write needs the name of an MTD
+ * partition it may overwrite (-m), which can be on simulated flash (-M).
+ * Before any of it, minzip's decoder is checked against zlib on a few
+ * corrupt streams, and the run fails if they disagree.
+ */
+
+static int gRepeats = 3;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *name, double value, const char *unit) {
+    printf("%s %.3f %s\n", name, value, unit);
+    fflush(stdout);
+}
+
+// verifier.c and keys.c report through the UI; here that's stderr.
+void ui_print(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void ui_set_progress(float fraction) {
+}
+
+/*
+ * The synthetic package.
+ */
+
+static unsigned gSeed = 1;
+
+static unsigned next_random(void) {
+    gSeed = gSeed * 1103515245 + 12345;
+    return gSeed >> 8;
+}
+
+static void fill_text(unsigned char *buf, size_t len) {
+    static const char *const words[] = {
+        "android", "recovery", "update", "system", "package", "install",
+        "verify", "extract", "partition", "cache", "data", "image", "\n",
+    };
+    const int count = sizeof(words) / sizeof(words[0]);
+    size_t pos = 0;
+    while (pos < len) {
+        const char *w = words[next_random() % count];
+        size_t n = strlen(w);
+        if (n > len - pos) n = len - pos;
+        memcpy(buf + pos, w, n);
+        pos += n;
+        if (pos < len) buf[pos++] = ' ';
+    }
+}
+
+static void fill_random(unsigned char *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) buf[i] = next_random();
+}
+
+static void put2(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char *p, unsigned long v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// One zip record header: the fixed part from "method" on, which the
+// local and central headers share.
+static void put_common(unsigned char *p, int method, unsigned long crc,
+                       unsigned long compLen, unsigned long len,
+                       unsigned nameLen) {
+    put2(p, method);
+    put4(p + 2, 0x3c210000);        // 2010-01-01
+    put4(p + 6, crc);
+    put4(p + 10, compLen);
+    put4(p + 14, len);
+    put2(p + 18, nameLen);
+    put2(p + 20, 0);                // extra
+}
+
+static int write_package(const char *path, int entries, long bytes) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    long size = bytes / entries + 1;
+    unsigned char *data = malloc(size);
+    unsigned char *comp = malloc(compressBound(size));
+    unsigned char *cen = malloc((size_t) entries * (46 + 64));
+    if (data == NULL || comp == NULL || cen == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    size_t cenLen = 0;
+    unsigned long offset = 0;
+    int i;
+    for (i = 0; i < entries; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "system/dir%03d/file%05d.%s",
+                 i / 100, i, i % 4 == 3 ? "apk" : "so");
+        unsigned nameLen = strlen(name);
+
+        int method = 0;
+        unsigned char *out = data;
+        unsigned long outLen = size;
+        if (i % 4 == 3) {
+            fill_random(data, size);
+        } else {
+            fill_text(data, size);
+
+            // raw deflate, as zip wants it
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY);
+            zs.next_in = data;
+            zs.avail_in = size;
+            zs.next_out = comp;
+            zs.avail_out = compressBound(size);
+            deflate(&zs, Z_FINISH);
+            outLen = zs.total_out;
+            deflateEnd(&zs);
+            out = comp;
+            method = 8;
+        }
+        unsigned long crc = crc32(crc32(0, NULL, 0), data, size);
+
+        unsigned char loc[30];
+        put4(loc, 0x04034b50);
+        put2(loc + 4, 20);
+        put2(loc + 6, 0);
+        put_common(loc + 8, method, crc, outLen, size, nameLen);
+        if (fwrite(loc, 1, sizeof(loc), f) != sizeof(loc) ||
+            fwrite(name, 1, nameLen, f) != nameLen ||
+            fwrite(out, 1, outLen, f) != outLen) {
+            break;
+        }
+
+        unsigned char *c = cen + cenLen;
+        put4(c, 0x02014b50);
+        put2(c + 4, 0x0314);        // made by unix
+        put2(c + 6, 20);
+        put2(c + 8, 0);
+        put_common(c + 10, method, crc, outLen, size, nameLen);
+        put2(c + 32, 0);            // comment
+        put2(c + 34, 0);            // disk
+        put2(c + 36, 0);            // internal attributes
+        put4(c + 38, 0100644UL << 16);
+        put4(c + 42, offset);
+        memcpy(c + 46, name, nameLen);
+        cenLen += 46 + nameLen;
+        offset += sizeof(loc) + nameLen + outLen;
+    }
+
+    unsigned char end[22];
+    put4(end, 0x06054b50);
+    put4(end + 4, 0);
+    put2(end + 8, entries);
+    put2(end + 10, entries);
+    put4(end + 12, cenLen);
+    put4(end + 16, offset);
+    put2(end + 20, 0);
+    int ok = !ferror(f) && fwrite(cen, 1, cenLen, f) == cenLen &&
+            fwrite(end, 1, sizeof(end), f) == sizeof(end);
+    if (fclose(f) != 0) ok = 0;
+    free(data);
+    free(comp);
+    free(cen);
+    if (!ok) fprintf(stderr, "can't write %s\n", path);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Inflate checks: hand-made dynamic-Huffman blocks that minzip's decoder
+ * must accept or refuse just as zlib does.  Nothing checks the CRC of a
+ * whole-buffer inflate, so a corrupt stream the decoder lets through
+ * would be handed on as the entry's data.
+ */
+
+typedef struct {
+    unsigned char buf[256];
+    int bit;
+} BitWriter;
+
+static void put_bits(BitWriter *w, unsigned v, int n) {
+    int i;
+    for (i = 0; i < n; ++i, ++w->bit) {
+        if (v & (1u << i)) w->buf[w->bit >> 3] |= 1 << (w->bit & 7);
+    }
+}
+
+// Canonical codes for "num" symbols of the given lengths (RFC 1951 3.2.2).
+static void make_codes(const unsigned char *lengths, int num,
+                       unsigned *codes) {
+    int count[16] = { 0 }, next[16];
+    int i, code = 0;
+    for (i = 0; i < num; ++i) count[lengths[i]]++;
+    count[0] = 0;
+    for (i = 1; i < 16; ++i) {
+        code = (code + count[i - 1]) << 1;
+        next[i] = code;
+    }
+    for (i = 0; i < num; ++i) {
+        if (lengths[i] != 0) codes[i] = next[lengths[i]]++;
+    }
+}
+
+// Huffman codes go in most significant bit first.
+static void put_code(BitWriter *w, const unsigned *codes,
+                     const unsigned char *lengths, int symbol) {
+    int i;
+    for (i = lengths[symbol] - 1; i >= 0; --i) {
+        put_bits(w, codes[symbol] >> i, 1);
+    }
+}
+
+typedef struct {
+    const char *name;
+    bool valid;             // what zlib says
+    int clDrop;             // code length code without this symbol, or -1
+    unsigned char lit[3];   // lengths of 'a', end of block, and 257
+    unsigned char dist[2];  // lengths of distance codes 0 and 1
+    int numDist;
+    bool match;             // a 3-byte match at distance 1 after the 'a'
+} InflateCase;
+
+// One final dynamic block: "aa", or "a" and a match, then end of block.
+static int write_block(const InflateCase *c, unsigned char *out) {
+    static const unsigned char kOrder[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    const int numLit = c->lit[2] != 0 ? 258 : 257;
+    unsigned char cl[19] = { 0 }, lengths[258 + 2] = { 0 };
+    unsigned clCodes[19], litCodes[258], distCodes[2];
+    BitWriter w;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    for (i = 0; i < 8; ++i) cl[i] = i == c->clDrop ? 0 : 3;
+    lengths['a'] = c->lit[0];
+    lengths[256] = c->lit[1];
+    if (numLit == 258) lengths[257] = c->lit[2];
+    memcpy(lengths + numLit, c->dist, c->numDist);
+    make_codes(cl, 19, clCodes);
+    make_codes(lengths, numLit, litCodes);
+    make_codes(lengths + numLit, c->numDist, distCodes);
+
+    put_bits(&w, 1, 1);                 // final
+    put_bits(&w, 2, 2);                 // dynamic
+    put_bits(&w, numLit - 257, 5);
+    put_bits(&w, c->numDist - 1, 5);
+    put_bits(&w, 19 - 4, 4);
+    for (i = 0; i < 19; ++i) put_bits(&w, cl[kOrder[i]], 3);
+    for (i = 0; i < numLit + c->numDist; ++i) {
+        put_code(&w, clCodes, cl, lengths[i]);
+    }
+    put_code(&w, litCodes, lengths, 'a');
+    if (c->match) {
+        put_code(&w, litCodes, lengths, 257);
+        put_code(&w, distCodes, lengths + numLit, 0);
+    } else {
+        put_code(&w, litCodes, lengths, 'a');
+    }
+    put_code(&w, litCodes, lengths, 256);
+    memcpy(out, w.buf, (w.bit + 7) / 8);
+    return (w.bit + 7) / 8;
+}
+
+static int check_inflate(void) {
+    static const InflateCase cases[] = {
+        { "complete",            true,  -1, { 1, 2, 2 }, { 1, 1 }, 2, true },
+        { "no_distances",        true,  -1, { 1, 1, 0 }, { 0 },    1, false },
+        { "one_distance",        true,  -1, { 1, 2, 2 }, { 1 },    1, true },
+        { "incomplete_lengths",  false,  7, { 1, 1, 0 }, { 0 },    1, false },
+        { "incomplete_literals", false, -1, { 1, 2, 0 }, { 0 },    1, false },
+        { "incomplete_distances", false, -1, { 1, 2, 2 }, { 2, 2 }, 2, true },
+    };
+    int failed = 0;
+    size_t i;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const InflateCase *c = &cases[i];
+        unsigned char in[256], fast[4], zlib[4];
+        size_t outLen = c->match ? 4 : 2;
+        int inLen = write_block(c, in);
+
+        memset(fast, 0, sizeof(fast));
+        memset(zlib, 0, sizeof(zlib));
+        mzSetInflateBackend(MZ_INFLATE_FAST);
+        bool fastOk = mzInflateBuffer(in, inLen, fast, outLen);
+        mzSetInflateBackend(MZ_INFLATE_ZLIB);
+        bool zlibOk = mzInflateBuffer(in, inLen, zlib, outLen);
+        mzSetInflateBackend(MZ_INFLATE_AUTO);
+
+        if (zlibOk != c->valid) {
+            fprintf(stderr, "inflate %s: zlib says %s\n", c->name,
+                    zlibOk ? "valid" : "corrupt");
+            ++failed;
+        } else if (fastOk != zlibOk ||
+                   (fastOk && memcmp(fast, "aaaa", outLen) != 0)) {
+            fprintf(stderr, "inflate %s: minzip %s it\n", c->name,
+                    fastOk ? "accepted" : "refused");
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+/*
+ * The benchmarks.
+ */
+
+static bool count_bytes(const unsigned char *data, int len, void *cookie) {
+    *(long long *) cookie += len;
+    return true;
+}
+
+static bool digest_bytes(const unsigned char *data, int len, void *cookie) {
+    sha1_update((Sha1Context *) cookie, data, len);
+    return true;
+}
+
+static void bench_open(const char *path) {
+    double best = 0;
+    int r;
+    for (r = 0; r <= gRepeats; ++r) {
+        ZipArchive za;
+        double start = now();
+        if (mzOpenZipArchive(path, &za) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            return;
+        }
+        double t = now() - start;
+        mzCloseZipArchive(&za);
+        if (r == 0) {
+            // the first open also builds and saves the index
+            result("zip_open_cold", t * 1000, "ms");
+        } else if (r == 1 || t < best) {
+            best = t;
+        }
+    }
+    result("zip_open", best * 1000, "ms");
+}
+
+static void bench_find(const ZipArchive *za) {
+    unsigned count = mzZipEntryCount(za);
+    char **names = malloc(count * sizeof(char *));
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        const ZipEntry *e = mzGetZipEntryAt(za, i);
+        names[i] = malloc(e->fileNameLen + 1);
+        memcpy(names[i], e->fileName, e->fileNameLen);
+        names[i][e->fileNameLen] = '\0';
+    }
+
+    const int rounds = 100;
+    double best = 0;
+    int r, k;
+    for (r = 0; r < gRepeats; ++r) {
+        double start = now();
+        for (k = 0; k < rounds; ++k) {
+            for (i = 0; i < count; ++i) {
+                if (mzFindZipEntry(za, names[i]) == NULL) {
+                    fprintf(stderr, "lost %s\n", names[i]);
+                    return;
+                }
+            }
+        }
+        double t = now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result("zip_find", (double) rounds * count / best, "lookups/s");
+    // The probe lengths behind that rate go to the log
+    mzZipProbeCount(za);
+
+    for (i = 0; i < count; ++i) free(names[i]);
+    free(names);
+}
+
+// Process every entry (of "method", or all if -1), and report MB/s of
+// uncompressed data.
+static void bench_contents(const ZipArchive *za, const char *name,
+                           int method, bool digest) {
+    unsigned count = mzZipEntryCount(za);
+    double best = 0;
+    long long bytes = 0;
+    int r;
+    for (r = 0; r < gRepeats; ++r) {
+        double start = now();
+        bytes = 0;
+        unsigned i;
+        for (i = 0; i < count; ++i) {
+            const ZipEntry *e = mzGetZipEntryAt(za, i);
+            if (method >= 0 && e->compression != method) continue;
+            bool ok;
+            if (digest) {
+                Sha1Context ctx;
+                uint8_t digest[SHA_DIGEST_SIZE];
+                sha1_init(&ctx);
+                ok = mzProcessZipEntryContents(za, e, digest_bytes, &ctx);
+                sha1_final(&ctx, digest);
+                bytes += e->uncompLen;
+            } else {
+                ok = mzProcessZipEntryContents(za, e, count_bytes, &bytes);
+            }
+            if (!ok) {
+                fprintf(stderr, "can't read %.*s\n",
+                        e->fileNameLen, e->fileName);
+                return;
+            }
+        }
+        double t = now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result(name, bytes / best / 1e6, "MB/s");
+}
+
+// Hash 16K messages (the size of most of a package's small files) with
+// each SHA-1 implementation there is, one at a time and SHA1_LANES at once.
+static void bench_sha1(long bytes) {
+    static const struct { int backend; const char *name; } backends[] = {
+        { SHA1_REFERENCE, "sha1_reference" },
+        { SHA1_SCALAR, "sha1_scalar" },
+        { SHA1_VECTOR, "sha1_vector" },
+    };
+    const size_t size = 16 * 1024;
+    int count = bytes / size;
+    if (count < 1) count = 1;
+    unsigned char *buf = malloc((size_t) count * size);
+    const void **data = malloc(count * sizeof(*data));
+    size_t *len = malloc(count * sizeof(*len));
+    uint8_t (*digests)[SHA_DIGEST_SIZE] = malloc(count * sizeof(*digests));
+    if (buf == NULL || data == NULL || len == NULL || digests == NULL) return;
+    fill_random(buf, (size_t) count * size);
+    int i;
+    for (i = 0; i < count; ++i) {
+        data[i] = buf + i * size;
+        len[i] = size;
+    }
+
+    unsigned b;
+    for (b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+        if (sha1_set_backend(backends[b].backend) != 0) {
+            printf("# %s skipped: not on this CPU or build\n",
+                   backends[b].name);
+            continue;
+        }
+        double best = 0;
+        int r;
+        for (r = 0; r < gRepeats; ++r) {
+            double start = now();
+            sha1_multi(count, data, len, digests);
+            double t = now() - start;
+            if (r == 0 || t < best) best = t;
+        }
+        result(backends[b].name, (double) count * size / best / 1e6, "MB/s");
+    }
+    sha1_set_backend(SHA1_AUTO);
+
+    free(digests);
+    free(len);
+    free(data);
+    free(buf);
+}
+
+static void bench_extract(const ZipArchive *za, const char *dir) {
+    double best = 0;
+    long long bytes = 0;
+    unsigned i, files = 0;
+    for (i = 0; i < mzZipEntryCount(za); ++i) {
+        bytes += mzGetZipEntryAt(za, i)->uncompLen;
+        ++files;
+    }
+
+    int r;
+    for (r = 0; r < gRepeats; ++r) {
+        dirUnlinkHierarchy(dir);
+        if (dirCreateHierarchy(dir, 0755, NULL, false) != 0) {
+            fprintf(stderr, "can't create %s\n", dir);
+            return;
+        }
+        double start = now();
+        bool ok = mzExtractRecursive(za, "system", dir, 0, NULL, NULL, NULL);
+        sync();
+        double t = now() - start;
+        if (!ok) {
+            fprintf(stderr, "can't extract to %s\n", dir);
+            return;
+        }
+        if (r == 0 || t < best) best = t;
+    }
+    dirUnlinkHierarchy(dir);
+    result("extract", files / best, "files/s");
+    result("extract_bytes", bytes / best / 1e6, "MB/s");
+}
+
+static void bench_verify(const char *package, const char *keys) {
+    KeyStore ks;
+    if (keystore_load(keys, &ks) != 0) return;
+
+    ZipArchive za;
+    if (mzOpenZipArchive(package, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", package);
+        keystore_free(&ks);
+        return;
+    }
+    long long bytes = 0;
+    unsigned i;
+    for (i = 0; i < mzZipEntryCount(&za); ++i) {
+        bytes += mzGetZipEntryAt(&za, i)->uncompLen;
+    }
+
+    double best = 0;
+    int r;
+    for (r = 0; r < gRepeats; ++r) {
+        double start = now();
+        bool ok = verify_jar_signature(&za, &ks);
+        double t = now() - start;
+        if (!ok) {
+            fprintf(stderr, "%s doesn't verify\n", package);
+            break;
+        }
+        if (r == 0 || t < best) best = t;
+    }
+    if (best > 0) result("verify_jar", bytes / best / 1e6, "MB/s");
+    mzCloseZipArchive(&za);
+    keystore_free(&ks);
+}
+
+static void bench_mtd(const char *partition, long bytes) {
+    if (mtd_scan_partitions() <= 0) {
+        printf("# mtd_write skipped: no MTD partitions\n");
+        return;
+    }
+    const MtdPartition *part = mtd_find_partition_by_name(partition);
+    size_t size;
+    if (part == NULL || mtd_partition_info(part, &size, NULL, NULL) != 0) {
+        fprintf(stderr, "can't find MTD partition \"%s\"\n", partition);
+        return;
+    }
+    if ((size_t) bytes > size) bytes = size;
+
+    const size_t chunk = 128 * 1024;
+    char *buf = malloc(chunk);
+    if (buf == NULL) return;
+    fill_random((unsigned char *) buf, chunk);
+
+    double best = 0;
+    int r;
+    for (r = 0; r < gRepeats; ++r) {
+        MtdWriteContext *write = mtd_write_partition(part);
+        if (write == NULL) {
+            fprintf(stderr, "can't open %s: %s\n", partition, strerror(errno));
+            break;
+        }
+        double start = now();
+        long done = 0;
+        while (done < bytes) {
+            size_t n = bytes - done < (long) chunk ? bytes - done : chunk;
+            if (mtd_write_data(write, buf, n) != (ssize_t) n) break;
+            done += n;
+        }
+        int closed = mtd_write_close(write);
+        double t = now() - start;
+        if (done < bytes || closed != 0) {
+            fprintf(stderr, "can't write %s: %s\n", partition, strerror(errno));
+            break;
+        }
+        if (r == 0 || t < best) best = t;
+    }
+    if (best > 0) result("mtd_write", bytes / best / 1e6, "MB/s");
+    free(buf);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: recovery-bench [options]\n"
+            "  -n entries   files in the synthetic package (1000)\n"
+            "  -s bytes     their total size (32M; k and M suffixes)\n"
+            "  -r repeats   runs of each benchmark, the best reported (3)\n"
+            "  -d dir       where to write the package and extract it (/tmp)\n"
+            "  -p package   a signed package to verify, with -k\n"
+            "  -k keys      the keys (as /res/keys) it's signed with\n"
+            "  -m name      benchmark writes to this MTD partition,\n"
+            "               DESTROYING WHAT IS ON IT\n"
+            "  -M config    use simulated flash instead (see mtdsim.c)\n");
+    exit(2);
+}
+
+static long parse_size(const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 0);
+    if (*end == 'k' || *end == 'K') n *= 1024;
+    if (*end == 'm' || *end == 'M') n *= 1024 * 1024;
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int entries = 1000;
+    long bytes = 32 * 1024 * 1024;
+    const char *dir = "/tmp";
+    const char *package = NULL, *keys = NULL, *partition = NULL;
+    const char *mtd_config = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:r:d:p:k:m:M:")) != -1) {
+        switch (opt) {
+            case 'n': entries = atoi(optarg); break;
+            case 's': bytes = parse_size(optarg); break;
+            case 'r': gRepeats = atoi(optarg); break;
+            case 'd': dir = optarg; break;
+            case 'p': package = optarg; break;
+            case 'k': keys = optarg; break;
+            case 'm': partition = optarg; break;
+            case 'M': mtd_config = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || entries <= 0 || entries > 65535 || bytes <= 0 ||
+        gRepeats <= 0 || (package == NULL) != (keys == NULL)) {
+        usage();
+    }
+    if (mtd_config != NULL && mtd_sim_init(mtd_config) != 0) return 1;
+
+    char path[PATH_MAX], target[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/recovery-bench.zip", dir);
+    snprintf(target, sizeof(target), "%s/recovery-bench.out", dir);
+
+    printf("# recovery-bench entries=%d bytes=%ld repeats=%d\n",
+           entries, bytes, gRepeats);
+    if (check_inflate() != 0) return 1;
+
+    double start = now();
+    if (write_package(path, entries, bytes) != 0) return 1;
+    result("zip_create", now() - start, "s");
+
+    bench_open(path);
+
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+    bench_find(&za);
+    bench_contents(&za, "zip_inflate", 8, false);
+    mzSetInflateBackend(MZ_INFLATE_ZLIB);
+    bench_contents(&za, "zip_inflate_zlib", 8, false);
+    mzSetInflateBackend(MZ_INFLATE_AUTO);
+    bench_contents(&za, "zip_stored", 0, false);
+    bench_contents(&za, "verify_digest", -1, true);
+    bench_sha1(bytes);
+    bench_extract(&za, target);
+    mzCloseZipArchive(&za);
+    unlink(path);
+
+    if (package != NULL) {
+        bench_verify(package, keys);
+    } else {
+        printf("# verify_jar skipped: no -p package -k keys\n");
+    }
+    if (partition != NULL) {
+        bench_mtd(partition, bytes);
+    } else {
+        printf("# mtd_write skipped: no -m partition\n");
+    }
+    return 0;
+}
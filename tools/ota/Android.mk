@@ -19,6 +19,17 @@ LOCAL_MODULE := make-update-script
 LOCAL_SRC_FILES := make-update-script.c
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := align-update-package
+LOCAL_SRC_FILES := align-update-package.c
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := make-key-store
+LOCAL_SRC_FILES := make-key-store.c ../../keys.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../..
+include $(BUILD_HOST_EXECUTABLE)
+
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Rewrite an update package so recovery reads it fastest:
+ *
+ *   - entries are in the order recovery uses them: META-INF/ (the
+ *     signature, checked first), then the rest by name, which is the
+ *     order package_extract_dir() goes through a directory in;
+ *   - the data of every STORED entry (raw images, APKs) starts on a
+ *     page boundary, padded out with the local header's extra field,
+ *     so minzip can map it straight from the file.
+ *
+ * Names, data and CRCs are copied unchanged, so a jarsigner signature
+ * is still good; a whole-file signature is not, so sign afterwards.
+ *
+ *     align-update-package [-a alignment] input.zip output.zip
+ */
+
+#define LOCSIG 0x04034b50
+#define LOCHDR 30
+#define CENSIG 0x02014b50
+#define CENHDR 46
+#define ENDSIG 0x06054b50
+#define ENDHDR 22
+
+#define STORED 0
+
+typedef struct {
+    const unsigned char *cen;   // its central directory record
+    const char *name;
+    unsigned nameLen;
+    unsigned method;
+    unsigned long compLen;
+    const unsigned char *data;
+    unsigned long newOffset;    // of the local header in the output
+} Entry;
+
+static unsigned get2(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get4(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+static void put2(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char *p, unsigned long v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int is_meta_inf(const Entry *e) {
+    return e->nameLen >= 9 && memcmp(e->name, "META-INF/", 9) == 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const Entry *x = (const Entry *) a, *y = (const Entry *) b;
+    int meta = is_meta_inf(y) - is_meta_inf(x);
+    if (meta != 0) return meta;
+    unsigned len = x->nameLen < y->nameLen ? x->nameLen : y->nameLen;
+    int cmp = memcmp(x->name, y->name, len);
+    if (cmp != 0) return cmp;
+    return (int) x->nameLen - (int) y->nameLen;
+}
+
+// Read all of "path"; returns the data, with its size in *size, or NULL.
+static unsigned char *read_file(const char *path, unsigned long *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        if (f != NULL) fclose(f);
+        return NULL;
+    }
+    long len = ftell(f);
+    unsigned char *data = len > 0 ? malloc(len) : NULL;
+    rewind(f);
+    if (data == NULL || fread(data, 1, len, f) != (size_t) len) {
+        fprintf(stderr, "can't read %s\n", path);
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+static int write_zeros(FILE *f, unsigned long count) {
+    static const unsigned char zeros[4096];
+    while (count > 0) {
+        unsigned long n = count < sizeof(zeros) ? count : sizeof(zeros);
+        if (fwrite(zeros, 1, n, f) != n) return -1;
+        count -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long alignment = 4096;
+    if (argc == 5 && strcmp(argv[1], "-a") == 0) {
+        alignment = strtoul(argv[2], NULL, 0);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3 || alignment == 0 || alignment > 32768) {
+        fprintf(stderr, "usage: align-update-package [-a alignment] "
+                "input.zip output.zip\n");
+        return 2;
+    }
+
+    unsigned long size;
+    unsigned char *zip = read_file(argv[1], &size);
+    if (zip == NULL) return 1;
+
+    // The end of central directory record, before any comment.
+    const unsigned char *end = NULL;
+    long pos;
+    for (pos = (long) size - ENDHDR; pos >= 0 && pos + 65557 >= (long) size;
+         --pos) {
+        if (get4(zip + pos) == ENDSIG &&
+            pos + ENDHDR + get2(zip + pos + 20) == (long) size) {
+            end = zip + pos;
+            break;
+        }
+    }
+    if (end == NULL) {
+        fprintf(stderr, "%s: not a zip file\n", argv[1]);
+        return 1;
+    }
+    unsigned count = get2(end + 10);
+    unsigned long cenSize = get4(end + 12), cenOffset = get4(end + 16);
+    if (get2(end + 4) != 0 || get2(end + 8) != count ||
+        count == 0xffff || cenOffset == 0xffffffff ||
+        cenOffset + cenSize > (unsigned long) (end - zip)) {
+        fprintf(stderr, "%s: multi-disk or zip64 archives aren't "
+                "supported\n", argv[1]);
+        return 1;
+    }
+
+    Entry *entries = calloc(count ? count : 1, sizeof(Entry));
+    if (entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    const unsigned char *cen = zip + cenOffset;
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        Entry *e = entries + i;
+        if (cen + CENHDR > end || get4(cen) != CENSIG) {
+            fprintf(stderr, "%s: bad central directory\n", argv[1]);
+            return 1;
+        }
+        e->cen = cen;
+        e->nameLen = get2(cen + 28);
+        e->name = (const char *) cen + CENHDR;
+        e->method = get2(cen + 10);
+        e->compLen = get4(cen + 20);
+
+        unsigned long loc = get4(cen + 42);
+        if (loc + LOCHDR > cenOffset || get4(zip + loc) != LOCSIG) {
+            fprintf(stderr, "%s: bad local header for %.*s\n",
+                    argv[1], e->nameLen, e->name);
+            return 1;
+        }
+        e->data = zip + loc + LOCHDR + get2(zip + loc + 26) +
+                get2(zip + loc + 28);
+        if (e->data + e->compLen > zip + cenOffset) {
+            fprintf(stderr, "%s: %.*s runs past the end\n",
+                    argv[1], e->nameLen, e->name);
+            return 1;
+        }
+        cen += CENHDR + e->nameLen + get2(cen + 30) + get2(cen + 32);
+    }
+    qsort(entries, count, sizeof(Entry), compare_entries);
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "can't create %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    // Local headers and data.  The sizes and CRC always go in the
+    // header, so no data descriptors are needed after the data.
+    unsigned long offset = 0, padded = 0;
+    for (i = 0; i < count; ++i) {
+        Entry *e = entries + i;
+        unsigned char loc[LOCHDR];
+        put4(loc, LOCSIG);
+        memcpy(loc + 4, e->cen + 6, 2);             // version needed
+        put2(loc + 6, get2(e->cen + 8) & ~0x0008);  // flags
+        memcpy(loc + 8, e->cen + 10, 18);           // method .. uncomp. size
+        put2(loc + 26, e->nameLen);
+
+        unsigned long pad = 0;
+        if (e->method == STORED) {
+            unsigned long start = offset + LOCHDR + e->nameLen;
+            pad = (alignment - start % alignment) % alignment;
+        }
+        put2(loc + 28, pad);
+
+        e->newOffset = offset;
+        if (fwrite(loc, 1, LOCHDR, out) != LOCHDR ||
+            fwrite(e->name, 1, e->nameLen, out) != e->nameLen ||
+            write_zeros(out, pad) != 0 ||
+            fwrite(e->data, 1, e->compLen, out) != e->compLen) {
+            break;
+        }
+        offset += LOCHDR + e->nameLen + pad + e->compLen;
+        padded += pad;
+    }
+
+    // The central directory, in the new order.
+    unsigned long newCenOffset = offset;
+    for (i = 0; i < count && !ferror(out); ++i) {
+        const Entry *e = entries + i;
+        unsigned long len = CENHDR + e->nameLen + get2(e->cen + 30) +
+                get2(e->cen + 32);
+        unsigned char hdr[CENHDR];
+        memcpy(hdr, e->cen, CENHDR);
+        put2(hdr + 8, get2(e->cen + 8) & ~0x0008);
+        put4(hdr + 42, e->newOffset);
+        if (fwrite(hdr, 1, CENHDR, out) != CENHDR ||
+            fwrite(e->cen + CENHDR, 1, len - CENHDR, out) != len - CENHDR) {
+            break;
+        }
+        offset += len;
+    }
+
+    unsigned char eocd[ENDHDR];
+    memcpy(eocd, end, ENDHDR);
+    put4(eocd + 12, offset - newCenOffset);
+    put4(eocd + 16, newCenOffset);
+    unsigned commentLen = get2(end + 20);
+    if (ferror(out) || fwrite(eocd, 1, ENDHDR, out) != ENDHDR ||
+        fwrite(end + ENDHDR, 1, commentLen, out) != commentLen ||
+        fclose(out) != 0) {
+        fprintf(stderr, "can't write %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    printf("%u entries, %lu bytes of padding\n", count, padded);
+    free(entries);
+    free(zip);
+    return 0;
+}
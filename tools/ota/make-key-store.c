@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keys.h"
+
+/*
+ * Convert the keys DumpPublicKey writes into the binary store recovery
+ * maps at startup.  The store is in this machine's byte order and
+ * RSAPublicKey layout, which must match the device's.
+ */
+
+// keys.c reports errors through recovery's ui_print().
+void ui_print(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <keys.txt> <keys.store>\n", argv[0]);
+        return 2;
+    }
+
+    KeyStore ks;
+    if (keystore_load(argv[1], &ks) != 0) return 1;
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (keystore_write(out, &ks) != 0 || fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    printf("%d key(s) written to %s\n", ks.count, argv[2]);
+    keystore_free(&ks);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define MAX_POINTS 64
+
+typedef struct {
+    const char *name;
+    struct timespec when;
+} TracePoint;
+
+static pthread_mutex_t gTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static TracePoint gPoints[MAX_POINTS];
+static int gNumPoints = 0;
+
+static double ts_seconds(const struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void trace_point(const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&gTraceMutex);
+    if (gNumPoints < MAX_POINTS) {
+        gPoints[gNumPoints].name = name;
+        gPoints[gNumPoints].when = now;
+        ++gNumPoints;
+    }
+    pthread_mutex_unlock(&gTraceMutex);
+}
+
+void trace_write(FILE *f) {
+    pthread_mutex_lock(&gTraceMutex);
+    int i;
+    for (i = 0; i < gNumPoints; ++i) {
+        double at = ts_seconds(&gPoints[i].when);
+        double gap = i > 0 ? at - ts_seconds(&gPoints[i-1].when) : 0;
+        fprintf(f, "%9.3f %+8.3f  %s\n", at, gap, gPoints[i].name);
+    }
+    pthread_mutex_unlock(&gTraceMutex);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_TRACE_H
+#define _RECOVERY_TRACE_H
+
+#include <stdio.h>
+
+/* A timeline of startup: named points, stamped with the monotonic
+ * clock, which counts from when the kernel booted.  The first point
+ * shows how long the kernel and init took; the gaps after it, where
+ * recovery's own time goes.
+ */
+
+// Record that "name" (which must outlive the trace, eg. a literal) was
+// reached.  Safe from any thread; points past the first 64 are dropped.
+void trace_point(const char *name);
+
+// Write the points so far to "f", one a line, in the order reached.
+void trace_write(FILE *f);
+
+#endif  /* _RECOVERY_TRACE_H */
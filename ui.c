@@ -37,14 +37,28 @@
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
 
+// The most often the screen is redrawn, however fast things change.
+#define UI_MAX_FPS 30
+
 enum { LEFT_SIDE, CENTER_TILE, RIGHT_SIDE, NUM_SIDES };
 
 static pthread_mutex_t gUpdateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The ui_*() calls only change the state below and say what needs
+// redrawing; the render thread does the drawing, at most UI_MAX_FPS
+// times a second, so a burst of changes costs one frame.
+enum { REDRAW_PROGRESS = 1, REDRAW_SCREEN = 2 };
+static pthread_cond_t gRedrawCond = PTHREAD_COND_INITIALIZER;
+static int gRedraw = 0;
 static gr_surface gBackgroundIcon[NUM_BACKGROUND_ICONS];
 static gr_surface gProgressBarIndeterminate[PROGRESSBAR_INDETERMINATE_STATES];
 static gr_surface gProgressBarEmpty[NUM_SIDES];
 static gr_surface gProgressBarFill[NUM_SIDES];
 
+// res/images, decoded when recovery is built (see minui/mkimages.c).
+extern const ResImage recovery_images[];
+extern const int recovery_image_count;
+
 static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
     { &gBackgroundIcon[BACKGROUND_ICON_INSTALLING], "icon_installing" },
     { &gBackgroundIcon[BACKGROUND_ICON_ERROR],      "icon_error" },
@@ -67,6 +81,30 @@ static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
     { NULL,                             NULL },
 };
 
+// Bitmaps are decoded the first time they're drawn; most sessions
+// never show some of them.
+static char gBitmapTried[sizeof(BITMAPS) / sizeof(BITMAPS[0])];
+
+// The bitmap in "*surface" (one of BITMAPS), loading it if need be.
+// NULL if it's missing.  Should only be called with gUpdateMutex locked.
+static gr_surface bitmap(gr_surface *surface)
+{
+    int i;
+    for (i = 0; BITMAPS[i].name != NULL; ++i) {
+        if (BITMAPS[i].surface != surface) continue;
+        if (!gBitmapTried[i]) {
+            gBitmapTried[i] = 1;
+            int result = res_create_surface(BITMAPS[i].name, surface);
+            if (result < 0) {
+                LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
+                *surface = NULL;
+            }
+        }
+        break;
+    }
+    return *surface;
+}
+
 static gr_surface gCurrentIcon = NULL;
 
 static enum ProgressBarType {
@@ -78,6 +116,8 @@ static enum ProgressBarType {
 // Progress bar scope of current operation
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static time_t gProgressScopeTime, gProgressScopeDuration;
+static int gIndeterminateFrame = 0;
+static char gProgressText[MAX_COLS];    // shown under the bar
 
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
@@ -115,64 +155,133 @@ static void draw_background_locked(gr_surface icon)
     }
 }
 
+// Where the progress bar goes; its text is in the CHAR_HEIGHT + 2 rows
+// below it, across the whole screen.
+static void get_progress_position(int *dx, int *dy, int *width, int *height)
+{
+    int iconHeight = gr_get_height(
+            bitmap(&gBackgroundIcon[BACKGROUND_ICON_INSTALLING]));
+    *width = gr_get_width(bitmap(&gProgressBarIndeterminate[0]));
+    *height = gr_get_height(bitmap(&gProgressBarIndeterminate[0]));
+
+    *dx = (gr_fb_width() - *width)/2;
+    *dy = (3*gr_fb_height() + iconHeight - 2 * *height)/4;
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
 
-    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-    int width = gr_get_width(gProgressBarIndeterminate[0]);
-    int height = gr_get_height(gProgressBarIndeterminate[0]);
-
-    int dx = (gr_fb_width() - width)/2;
-    int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+    int dx, dy, width, height;
+    get_progress_position(&dx, &dy, &width, &height);
 
     // Erase behind the progress bar (in case this was a progress-only update)
     gr_color(0, 0, 0, 255);
-    gr_fill(dx, dy, width, height);
+    gr_fill(dx, dy, dx + width, dy + height);
+    gr_fill(0, dy + height, gr_fb_width(), dy + height + CHAR_HEIGHT + 2);
+    if (gProgressText[0] != '\0') {
+        gr_color(193, 193, 193, 255);
+        gr_text((gr_fb_width() - gr_measure(gProgressText)) / 2,
+                dy + height + CHAR_HEIGHT, gProgressText);
+    }
 
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
         float progress = gProgressScopeStart + gProgress * gProgressScopeSize;
         int pos = (int) (progress * width);
 
-        gr_surface s = (pos ? gProgressBarFill : gProgressBarEmpty)[LEFT_SIDE];
+        gr_surface* side = pos ? gProgressBarFill : gProgressBarEmpty;
+        gr_surface s = bitmap(&side[LEFT_SIDE]);
         gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx, dy);
 
         int x = gr_get_width(s);
-        while (x + (int) gr_get_width(gProgressBarEmpty[RIGHT_SIDE]) < width) {
-            s = (pos > x ? gProgressBarFill : gProgressBarEmpty)[CENTER_TILE];
+        int right = gr_get_width(bitmap(&gProgressBarEmpty[RIGHT_SIDE]));
+        while (x + right < width) {
+            side = pos > x ? gProgressBarFill : gProgressBarEmpty;
+            s = bitmap(&side[CENTER_TILE]);
             gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx + x, dy);
             x += gr_get_width(s);
         }
 
-        s = (pos > x ? gProgressBarFill : gProgressBarEmpty)[RIGHT_SIDE];
+        side = pos > x ? gProgressBarFill : gProgressBarEmpty;
+        s = bitmap(&side[RIGHT_SIDE]);
         gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx + x, dy);
     }
 
     if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
-        static int frame = 0;
-        gr_blit(gProgressBarIndeterminate[frame], 0, 0, width, height, dx, dy);
-        frame = (frame + 1) % PROGRESSBAR_INDETERMINATE_STATES;
+        gr_blit(bitmap(&gProgressBarIndeterminate[gIndeterminateFrame]),
+                0, 0, width, height, dx, dy);
     }
 }
 
-static void draw_text_line(int row, const char* t) {
-  if (t[0] != '\0') {
-    gr_text(0, (row+1)*CHAR_HEIGHT-1, t);
+// Each row of the log and menu is rendered into a strip the first time
+// it's drawn with what it holds now, and only blitted after that; so is
+// the dimmed background behind them.  Scrolling the log only changes
+// which strip goes on which row.
+typedef struct {
+    gr_surface strip;
+    char text[MAX_COLS];    // what's in the strip
+} CachedLine;
+
+static CachedLine text_lines[MAX_ROWS];
+static CachedLine menu_lines[MAX_ROWS];
+static gr_surface gDimmedBackground = NULL;
+static gr_surface gDimmedIcon = NULL;      // what's in gDimmedBackground
+
+static void draw_text_line(CachedLine *line, int row, const char* t) {
+  if (t[0] == '\0') return;
+  if (line->strip == NULL || strcmp(line->text, t) != 0) {
+    gr_surface strip = gr_render_text(t, line->strip);
+    if (strip == NULL) {
+      line->text[0] = '\0';
+      gr_text(0, (row+1)*CHAR_HEIGHT-1, t);
+      return;
+    }
+    line->strip = strip;
+    strcpy(line->text, t);
   }
+  gr_text_blit(line->strip, 0, (row+1)*CHAR_HEIGHT-1);
 }
 
-// Redraw everything on the screen.  Does not flip pages.
+// The background icon darkened for the text to go over.
 // Should only be called with gUpdateMutex locked.
-static void draw_screen_locked(void)
+static void draw_dimmed_background_locked(void)
 {
+    if (gDimmedBackground != NULL && gDimmedIcon == gCurrentIcon) {
+        gPagesIdentical = 0;
+        gr_blit(gDimmedBackground, 0, 0, gr_fb_width(), gr_fb_height(), 0, 0);
+        return;
+    }
     draw_background_locked(gCurrentIcon);
-    draw_progress_locked();
+    gr_color(0, 0, 0, 160);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_surface copy = gr_copy_screen(gDimmedBackground);
+    if (copy != NULL) {
+        gDimmedBackground = copy;
+        gDimmedIcon = gCurrentIcon;
+    }
+}
 
-    if (show_text) {
-        gr_color(0, 0, 0, 160);
-        gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+// Redraw everything on the screen.  Does not flip pages.
+// Should only be called with gUpdateMutex locked.
+static void draw_screen_locked(void)
+{
+    if (!show_text) {
+        draw_background_locked(gCurrentIcon);
+        draw_progress_locked();
+    } else {
+        draw_dimmed_background_locked();
+        if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
+            // dim what the bar drew over as if it had been in the background
+            int dx, dy, width, height;
+            get_progress_position(&dx, &dy, &width, &height);
+            draw_progress_locked();
+            gr_color(0, 0, 0, 160);
+            gr_fill(dx, dy, dx + width, dy + height);
+            gr_fill(0, dy + height,
+                    gr_fb_width(), dy + height + CHAR_HEIGHT + 2);
+        }
 
         int i = 0;
         if (show_menu) {
@@ -183,10 +292,10 @@ static void draw_screen_locked(void)
             for (; i < menu_top + menu_items; ++i) {
                 if (i == menu_top + menu_sel) {
                     gr_color(255, 255, 255, 255);
-                    draw_text_line(i, menu[i]);
+                    draw_text_line(&menu_lines[i], i, menu[i]);
                     gr_color(122, 154, 29, 255);
                 } else {
-                    draw_text_line(i, menu[i]);
+                    draw_text_line(&menu_lines[i], i, menu[i]);
                 }
             }
             gr_fill(0, i*CHAR_HEIGHT+CHAR_HEIGHT/2-1,
@@ -197,7 +306,8 @@ static void draw_screen_locked(void)
         gr_color(193, 193, 193, 255);
 
         for (; i < text_rows; ++i) {
-            draw_text_line(i, text[(i+text_top) % text_rows]);
+            int line = (i+text_top) % text_rows;
+            draw_text_line(&text_lines[line], i, text[line]);
         }
     }
 }
@@ -223,89 +333,232 @@ static void update_progress_locked(void)
     gr_flip();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
-static void *progress_thread(void *cookie)
+// Ask the render thread to redraw "what" (REDRAW_*) at its next frame.
+// Should only be called with gUpdateMutex locked.
+static void request_redraw_locked(int what)
 {
-    for (;;) {
-        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
-        pthread_mutex_lock(&gUpdateMutex);
+    if (gRedraw == 0) pthread_cond_signal(&gRedrawCond);
+    gRedraw |= what;
+}
 
-        // update the progress bar animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
-            update_progress_locked();
+static struct timeval gLastAnimation;  // when the animation last moved
+
+static long usec_between(const struct timeval *a, const struct timeval *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000 + (b->tv_usec - a->tv_usec);
+}
+
+// Moves the progress bar animation and timed progress along.
+// Should only be called with gUpdateMutex locked.
+static void animate_progress_locked(const struct timeval *now)
+{
+    // update the progress bar animation, if active
+    // skip this if we have a text overlay (too expensive to update)
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text &&
+        usec_between(&gLastAnimation, now) >=
+                1000000 / PROGRESSBAR_INDETERMINATE_FPS) {
+        gLastAnimation = *now;
+        gIndeterminateFrame = (gIndeterminateFrame + 1) %
+                PROGRESSBAR_INDETERMINATE_STATES;
+        request_redraw_locked(REDRAW_PROGRESS);
+    }
+
+    // move the progress bar forward on timed intervals, if configured
+    int duration = gProgressScopeDuration;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
+        int elapsed = now->tv_sec - gProgressScopeTime;
+        float progress = 1.0 * elapsed / duration;
+        if (progress > 1.0) progress = 1.0;
+        if (progress > gProgress) {
+            gProgress = progress;
+            request_redraw_locked(REDRAW_PROGRESS);
+        }
+    }
+}
+
+// When animate_progress_locked() next has something to do, in
+// "until": the next animation frame, or the next second of timed
+// progress.  Returns 0 if nothing will happen until the state changes.
+// Should only be called with gUpdateMutex locked.
+static int next_animation_locked(const struct timeval *now,
+                                 struct timespec *until)
+{
+    struct timeval next;
+    int have = 0;
+
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
+        long usec = gLastAnimation.tv_usec +
+                1000000 / PROGRESSBAR_INDETERMINATE_FPS;
+        next.tv_sec = gLastAnimation.tv_sec + usec / 1000000;
+        next.tv_usec = usec % 1000000;
+        have = 1;
+    }
+
+    int duration = gProgressScopeDuration;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0 &&
+        gProgress < 1.0 && now->tv_sec - gProgressScopeTime < duration) {
+        // elapsed time is counted in whole seconds
+        time_t tick = now->tv_sec + 1;
+        if (tick < gProgressScopeTime + 1) tick = gProgressScopeTime + 1;
+        if (!have || tick < next.tv_sec) {
+            next.tv_sec = tick;
+            next.tv_usec = 0;
         }
+        have = 1;
+    }
+
+    if (have) {
+        until->tv_sec = next.tv_sec;
+        until->tv_nsec = next.tv_usec * 1000;
+    }
+    return have;
+}
 
-        // move the progress bar forward on timed intervals, if configured
-        int duration = gProgressScopeDuration;
-        if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
-            int elapsed = time(NULL) - gProgressScopeTime;
-            float progress = 1.0 * elapsed / duration;
-            if (progress > 1.0) progress = 1.0;
-            if (progress > gProgress) {
-                gProgress = progress;
-                update_progress_locked();
+// Draws whatever has changed, no more than UI_MAX_FPS times a second,
+// and keeps the progress bar updated even when the process is busy.
+// With nothing animating it sleeps until someone asks for a redraw.
+static void *render_thread(void *cookie)
+{
+    pthread_mutex_lock(&gUpdateMutex);
+    for (;;) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        animate_progress_locked(&now);
+
+        if (gRedraw == 0) {
+            struct timespec until;
+            if (next_animation_locked(&now, &until)) {
+                pthread_cond_timedwait(&gRedrawCond, &gUpdateMutex, &until);
+            } else {
+                pthread_cond_wait(&gRedrawCond, &gUpdateMutex);
             }
+            continue;
         }
 
+        if (gRedraw & REDRAW_SCREEN) {
+            update_screen_locked();
+        } else {
+            update_progress_locked();
+        }
+        gRedraw = 0;
+
+        // Anything that changes meanwhile waits for the next frame.
         pthread_mutex_unlock(&gUpdateMutex);
+        usleep(1000000 / UI_MAX_FPS);
+        pthread_mutex_lock(&gUpdateMutex);
     }
     return NULL;
 }
 
+// Held navigation keys repeat after KEY_REPEAT_DELAY ms, starting
+// every KEY_REPEAT_START ms and speeding up to every KEY_REPEAT_MIN,
+// so that a long list of files can be crossed without a press a line.
+#define KEY_REPEAT_DELAY 400
+#define KEY_REPEAT_START 120
+#define KEY_REPEAT_MIN 30
+
+// Trackball motion for one fake up/down press, and the most presses
+// one report of motion can make.
+#define TRACKBALL_STEP 4
+#define TRACKBALL_MAX_KEYS 8
+
+static int key_repeats(int code)
+{
+    switch (code) {
+        case KEY_UP:
+        case KEY_DOWN:
+        case KEY_DREAM_VOLUMEUP:
+        case KEY_DREAM_VOLUMEDOWN:
+        case KEY_I5700_UP:
+        case KEY_I5700_DOWN:
+            return 1;
+    }
+    return 0;
+}
+
+static void msec_from_now(struct timeval *tv, int msec)
+{
+    gettimeofday(tv, NULL);
+    tv->tv_usec += msec * 1000;
+    tv->tv_sec += tv->tv_usec / 1000000;
+    tv->tv_usec %= 1000000;
+}
+
+// Adds "code" to the key queue; if "only_if_empty", only when nothing
+// is waiting to be read, so repeats never run ahead of the menu.
+static void queue_key(int code, int only_if_empty)
+{
+    pthread_mutex_lock(&key_queue_mutex);
+    const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
+    if (key_queue_len < (only_if_empty ? 1 : queue_max)) {
+        key_queue[key_queue_len++] = code;
+        pthread_cond_signal(&key_queue_cond);
+    }
+    pthread_mutex_unlock(&key_queue_mutex);
+}
+
 // Reads input events, handles special hot keys, and adds to the key queue.
 static void *input_thread(void *cookie)
 {
     int rel_sum = 0;
-    int fake_key = 0;
+    int repeat_key = -1;        // the held key being repeated, if any
+    int repeat_interval = 0;    // ms
+    struct timeval repeat_at;   // when it next repeats
     for (;;) {
-        // wait for the next key event
         struct input_event ev;
-        do {
-            ev_get(&ev, 0);
-
-            if (ev.type == EV_SYN) {
-                continue;
-            } else if (ev.type == EV_REL) {
-                if (ev.code == REL_Y) {
-                    // accumulate the up or down motion reported by
-                    // the trackball.  When it exceeds a threshold
-                    // (positive or negative), fake an up/down
-                    // key event.
-                    rel_sum += ev.value;
-                    if (rel_sum > 3) {
-                        fake_key = 1;
-                        ev.type = EV_KEY;
-                        ev.code = KEY_DOWN;
-                        ev.value = 1;
-                        rel_sum = 0;
-                    } else if (rel_sum < -3) {
-                        fake_key = 1;
-                        ev.type = EV_KEY;
-                        ev.code = KEY_UP;
-                        ev.value = 1;
-                        rel_sum = 0;
-                    }
-                }
-            } else {
-                rel_sum = 0;
+        int timeout = -1;
+        if (repeat_key >= 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long left = usec_between(&now, &repeat_at) / 1000;
+            timeout = left > 0 ? left : 0;
+        }
+
+        if (ev_wait(&ev, timeout) != 0) {
+            // the held key is due to repeat
+            queue_key(repeat_key, 1);
+            msec_from_now(&repeat_at, repeat_interval);
+            repeat_interval = repeat_interval * 3 / 4;
+            if (repeat_interval < KEY_REPEAT_MIN) {
+                repeat_interval = KEY_REPEAT_MIN;
             }
-        } while (ev.type != EV_KEY || ev.code > KEY_MAX);
-
-        pthread_mutex_lock(&key_queue_mutex);
-        if (!fake_key) {
-            // our "fake" keys only report a key-down event (no
-            // key-up), so don't record them in the key_pressed
-            // table.
-            key_pressed[ev.code] = ev.value;
+            continue;
         }
-        fake_key = 0;
-        const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
-        if (ev.value > 0 && key_queue_len < queue_max) {
-            key_queue[key_queue_len++] = ev.code;
-            pthread_cond_signal(&key_queue_cond);
+
+        if (ev.type == EV_REL) {
+            // accumulate the up or down motion reported by the
+            // trackball, until the report is complete
+            if (ev.code == REL_Y) rel_sum += ev.value;
+            continue;
+        } else if (ev.type == EV_SYN) {
+            // fake an up/down key press for every TRACKBALL_STEP of
+            // motion; the rest counts towards the next one.  Our fake
+            // keys have no key-up, so they aren't in key_pressed.
+            int keys = rel_sum / TRACKBALL_STEP;
+            rel_sum -= keys * TRACKBALL_STEP;
+            int code = keys > 0 ? KEY_DOWN : KEY_UP;
+            if (keys < 0) keys = -keys;
+            if (keys > TRACKBALL_MAX_KEYS) keys = TRACKBALL_MAX_KEYS;
+            while (keys-- > 0) queue_key(code, 0);
+            continue;
+        }
+        rel_sum = 0;
+        if (ev.type != EV_KEY || ev.code > KEY_MAX) continue;
+
+        key_pressed[ev.code] = ev.value;
+        if (key_repeats(ev.code)) {
+            // we repeat these ourselves; ignore the kernel's repeats
+            if (ev.value == 1) {
+                queue_key(ev.code, 0);
+                repeat_key = ev.code;
+                repeat_interval = KEY_REPEAT_START;
+                msec_from_now(&repeat_at, KEY_REPEAT_DELAY);
+            } else if (ev.value == 0 && ev.code == repeat_key) {
+                repeat_key = -1;
+            }
+        } else if (ev.value > 0) {
+            queue_key(ev.code, 0);
         }
-        pthread_mutex_unlock(&key_queue_mutex);
 
         // Alt+L or Home+End: toggle log display
         int alt = key_pressed[KEY_LEFTALT] || key_pressed[KEY_RIGHTALT];
@@ -313,7 +566,7 @@ static void *input_thread(void *cookie)
             (key_pressed[KEY_HOME] && ev.code == KEY_END && ev.value > 0)) {
             pthread_mutex_lock(&gUpdateMutex);
             show_text = !show_text;
-            update_screen_locked();
+            request_redraw_locked(REDRAW_SCREEN);
             pthread_mutex_unlock(&gUpdateMutex);
         }
 
@@ -332,6 +585,8 @@ void ui_init(void)
     gr_init();
     ev_init();
 
+    // ui_print() may be running already, on another thread
+    pthread_mutex_lock(&gUpdateMutex);
     text_col = text_row = 0;
     text_rows = gr_fb_height() / CHAR_HEIGHT;
     if (text_rows > MAX_ROWS) text_rows = MAX_ROWS;
@@ -339,24 +594,18 @@ void ui_init(void)
 
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
+    pthread_mutex_unlock(&gUpdateMutex);
 
-    int i;
-    for (i = 0; BITMAPS[i].name != NULL; ++i) {
-        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
-            *BITMAPS[i].surface = NULL;
-        }
-    }
+    res_set_images(recovery_images, recovery_image_count);
 
     pthread_t t;
-    pthread_create(&t, NULL, progress_thread, NULL);
+    pthread_create(&t, NULL, render_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
-    draw_background_locked(gBackgroundIcon[icon]);
+    draw_background_locked(bitmap(&gBackgroundIcon[icon]));
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -367,6 +616,7 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     } else {
         memcpy(ret, gr_fb_data(), size);
     }
+    request_redraw_locked(REDRAW_SCREEN);   // put back what was there
     pthread_mutex_unlock(&gUpdateMutex);
     return ret;
 }
@@ -374,8 +624,8 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
 void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
-    gCurrentIcon = gBackgroundIcon[icon];
-    update_screen_locked();
+    gCurrentIcon = bitmap(&gBackgroundIcon[icon]);
+    request_redraw_locked(REDRAW_SCREEN);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -384,7 +634,7 @@ void ui_show_indeterminate_progress()
     pthread_mutex_lock(&gUpdateMutex);
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
-        update_progress_locked();
+        request_redraw_locked(REDRAW_PROGRESS);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -398,7 +648,7 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeTime = time(NULL);
     gProgressScopeDuration = seconds;
     gProgress = 0;
-    update_progress_locked();
+    request_redraw_locked(REDRAW_PROGRESS);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -409,11 +659,23 @@ void ui_set_progress(float fraction)
     if (fraction > 1.0) fraction = 1.0;
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
         // Skip updates that aren't visibly different.
-        int width = gr_get_width(gProgressBarIndeterminate[0]);
+        int width = gr_get_width(bitmap(&gProgressBarIndeterminate[0]));
         float scale = width * gProgressScopeSize;
         if ((int) (gProgress * scale) != (int) (fraction * scale)) {
             gProgress = fraction;
-            update_progress_locked();
+            request_redraw_locked(REDRAW_PROGRESS);
+        }
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
+void ui_set_progress_text(const char *text)
+{
+    pthread_mutex_lock(&gUpdateMutex);
+    if (strncmp(gProgressText, text, sizeof(gProgressText) - 1) != 0) {
+        strncpy(gProgressText, text, sizeof(gProgressText) - 1);
+        if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
+            request_redraw_locked(REDRAW_PROGRESS);
         }
     }
     pthread_mutex_unlock(&gUpdateMutex);
@@ -423,10 +685,11 @@ void ui_reset_progress()
 {
     pthread_mutex_lock(&gUpdateMutex);
     gProgressBarType = PROGRESSBAR_TYPE_NONE;
+    gProgressText[0] = '\0';
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
     gProgress = 0;
-    update_screen_locked();
+    request_redraw_locked(REDRAW_SCREEN);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -438,13 +701,18 @@ void ui_print(const char *fmt, ...)
     vsnprintf(buf, 256, fmt, ap);
     va_end(ap);
 
-    fputs(buf, stderr);
+    ui_print_text(buf, strlen(buf));
+}
+
+void ui_print_text(const char *str, size_t len)
+{
+    fwrite(str, 1, len, stderr);
 
     // This can get called before ui_init(), so be careful.
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
+        const char *ptr;
+        for (ptr = str; ptr < str + len; ++ptr) {
             if (*ptr == '\n' || text_col >= text_cols) {
                 text[text_row][text_col] = '\0';
                 text_col = 0;
@@ -454,7 +722,7 @@ void ui_print(const char *fmt, ...)
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        request_redraw_locked(REDRAW_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -477,7 +745,7 @@ void ui_start_menu(char** headers, char** items) {
         menu_items = i - menu_top;
         show_menu = 1;
         menu_sel = 0;
-        update_screen_locked();
+        request_redraw_locked(REDRAW_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -491,7 +759,7 @@ int ui_menu_select(int sel) {
         if (menu_sel < 0) menu_sel = 0;
         if (menu_sel >= menu_items) menu_sel = menu_items-1;
         sel = menu_sel;
-        if (menu_sel != old_sel) update_screen_locked();
+        if (menu_sel != old_sel) request_redraw_locked(REDRAW_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
     return sel;
@@ -502,7 +770,7 @@ void ui_end_menu() {
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
         show_menu = 0;
-        update_screen_locked();
+        request_redraw_locked(REDRAW_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -3,7 +3,9 @@
 LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
+	cmd_pipe.c \
 	install.c \
+	plan.c \
 	updater.c
 
 #
@@ -28,3 +30,32 @@ LOCAL_MODULE := updater
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+#
+# Host checks of the install plan (test_plan.c)
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	test_plan.c \
+	plan.c \
+	../edify/expr.c \
+	../minzip/Hash.c \
+	../minzip/SysUtil.c \
+	../minzip/DirUtil.c \
+	../minzip/Inlines.c \
+	../minzip/Inflate.c \
+	../minzip/Zip.c \
+	../mtdutils/mtdutils.c \
+	../mtdutils/mtdsim.c \
+	../mtdutils/mounts.c
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_STATIC_LIBRARIES := libz
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE := test_plan
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "updater.h"
+
+// Frames are held back this long, so a burst of them goes in one write
+// and recovery redraws once for the lot.
+#define FLUSH_DELAY_US  (50 * 1000)
+#define BATCH_SIZE      (16 * 1024)
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gPending = PTHREAD_COND_INITIALIZER;
+static int gFramed;             // recovery takes frames
+static int gFd = -1;
+static char* gBatch;            // frames not yet written
+static size_t gUsed;
+static size_t gLastPrint;       // offset of a PRINT frame ending gBatch, or -1
+static int gHaveFraction;       // a set_progress waiting to be added
+static float gFraction;
+
+static void WriteFully(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(gFd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;     // recovery's gone; nothing to be done
+        data += n;
+        len -= n;
+    }
+}
+
+static void AppendFrame(uint32_t type, const void* payload, size_t len) {
+    if (gUsed + sizeof(UpdaterFrameHeader) + len > BATCH_SIZE && gUsed > 0) {
+        WriteFully(gBatch, gUsed);
+        gUsed = 0;
+    }
+    UpdaterFrameHeader h;
+    h.type = type;
+    h.length = len;
+    if (sizeof(h) + len > BATCH_SIZE) {
+        WriteFully((const char*) &h, sizeof(h));
+        WriteFully(payload, len);
+        gLastPrint = (size_t) -1;
+        return;
+    }
+    gLastPrint = type == UPDATER_FRAME_PRINT ? gUsed : (size_t) -1;
+    memcpy(gBatch + gUsed, &h, sizeof(h));
+    memcpy(gBatch + gUsed + sizeof(h), payload, len);
+    gUsed += sizeof(h) + len;
+}
+
+// Only the last set_progress before anything else matters.
+static void AddFraction() {
+    if (!gHaveFraction) return;
+    UpdaterProgress p;
+    p.fraction = gFraction;
+    p.seconds = 0;
+    gHaveFraction = 0;
+    AppendFrame(UPDATER_FRAME_SET_PROGRESS, &p, sizeof(p));
+}
+
+static void FlushLocked() {
+    AddFraction();
+    if (gUsed > 0) WriteFully(gBatch, gUsed);
+    gUsed = 0;
+    gLastPrint = (size_t) -1;
+}
+
+static void* FlushThread(void* cookie) {
+    pthread_mutex_lock(&gLock);
+    for (;;) {
+        while (gUsed == 0 && !gHaveFraction) {
+            pthread_cond_wait(&gPending, &gLock);
+        }
+        pthread_mutex_unlock(&gLock);
+        usleep(FLUSH_DELAY_US);
+        pthread_mutex_lock(&gLock);
+        FlushLocked();
+    }
+    return NULL;
+}
+
+// Add text to the PRINT frame ending the batch, or start one.
+static void AppendPrint(const char* text, size_t len) {
+    while (len > 0) {
+        size_t n = len < UPDATER_FRAME_MAX ? len : UPDATER_FRAME_MAX;
+        if (gLastPrint == (size_t) -1) {
+            AppendFrame(UPDATER_FRAME_PRINT, text, n);
+        } else {
+            // Frames needn't be aligned in the batch
+            UpdaterFrameHeader h;
+            memcpy(&h, gBatch + gLastPrint, sizeof(h));
+            size_t room = BATCH_SIZE - gUsed;
+            if (UPDATER_FRAME_MAX - h.length < room) {
+                room = UPDATER_FRAME_MAX - h.length;
+            }
+            if (n > room) n = room;
+            if (n == 0) {
+                gLastPrint = (size_t) -1;   // full; start another
+                continue;
+            }
+            memcpy(gBatch + gUsed, text, n);
+            gUsed += n;
+            h.length += n;
+            memcpy(gBatch + gLastPrint, &h, sizeof(h));
+        }
+        text += n;
+        len -= n;
+    }
+}
+
+void InitCommandPipe(UpdaterInfo* ui, int fd) {
+    gFd = fd;
+    ui->cmd_pipe = fdopen(fd, "wb");
+    setlinebuf(ui->cmd_pipe);
+
+    const char* protocol = getenv(UPDATER_PROTOCOL_ENV);
+    unsetenv(UPDATER_PROTOCOL_ENV);
+    if (protocol == NULL || strcmp(protocol, "1") != 0) return;
+    gBatch = malloc(BATCH_SIZE);
+    pthread_t thread;
+    if (gBatch == NULL ||
+            pthread_create(&thread, NULL, FlushThread, NULL) != 0) {
+        free(gBatch);
+        gBatch = NULL;
+        return;         // text it is, then
+    }
+    pthread_detach(thread);
+    gFramed = 1;
+    gLastPrint = (size_t) -1;
+    WriteFully(UPDATER_PROTOCOL_MAGIC, UPDATER_PROTOCOL_MAGIC_LEN);
+}
+
+void SendProgress(UpdaterInfo* ui, float fraction, int seconds) {
+    if (!gFramed) {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", fraction, seconds);
+        return;
+    }
+    UpdaterProgress p;
+    p.fraction = fraction;
+    p.seconds = seconds;
+    pthread_mutex_lock(&gLock);
+    AddFraction();      // belongs to the segment before this one
+    AppendFrame(UPDATER_FRAME_PROGRESS, &p, sizeof(p));
+    pthread_cond_signal(&gPending);
+    pthread_mutex_unlock(&gLock);
+}
+
+void SendSetProgress(UpdaterInfo* ui, float fraction) {
+    if (!gFramed) {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", fraction);
+        return;
+    }
+    pthread_mutex_lock(&gLock);
+    gFraction = fraction;
+    gHaveFraction = 1;
+    pthread_cond_signal(&gPending);
+    pthread_mutex_unlock(&gLock);
+}
+
+void SendFirmware(UpdaterInfo* ui, const char* type, const char* filename) {
+    if (!gFramed) {
+        fprintf(ui->cmd_pipe, "firmware %s %s\n", type, filename);
+        return;
+    }
+    size_t type_len = strlen(type) + 1;
+    size_t len = type_len + strlen(filename) + 1;
+    char* payload = malloc(len);
+    if (payload == NULL) return;
+    memcpy(payload, type, type_len);
+    strcpy(payload + type_len, filename);
+    pthread_mutex_lock(&gLock);
+    AddFraction();
+    AppendFrame(UPDATER_FRAME_FIRMWARE, payload, len);
+    FlushLocked();
+    pthread_mutex_unlock(&gLock);
+    free(payload);
+}
+
+void SendPrint(UpdaterInfo* ui, const char* text) {
+    if (!gFramed) {
+        // One command per line, then a bare one to end it
+        char* copy = strdup(text);
+        if (copy == NULL) return;
+        char* saveptr;
+        char* line = strtok_r(copy, "\n", &saveptr);
+        while (line) {
+            fprintf(ui->cmd_pipe, "ui_print %s\n", line);
+            line = strtok_r(NULL, "\n", &saveptr);
+        }
+        fprintf(ui->cmd_pipe, "ui_print\n");
+        free(copy);
+        return;
+    }
+
+    pthread_mutex_lock(&gLock);
+    AppendPrint(text, strlen(text));
+    AppendPrint("\n", 1);
+    pthread_cond_signal(&gPending);
+    pthread_mutex_unlock(&gLock);
+}
+
+void FlushCommandPipe(UpdaterInfo* ui) {
+    if (!gFramed) {
+        fflush(ui->cmd_pipe);
+        return;
+    }
+    pthread_mutex_lock(&gLock);
+    FlushLocked();
+    pthread_mutex_unlock(&gLock);
+}
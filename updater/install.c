@@ -16,12 +16,14 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -31,8 +33,17 @@
 #include "minzip/DirUtil.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "plan.h"
 #include "updater.h"
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Held while a builtin mounts or unmounts something, or looks at the
+// mounted-volume table: branches of parallel() share that table, and
+// one's rescan would free the entries another is still using.
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // mount(type, location, mount_point)
 //
@@ -65,6 +76,8 @@ char* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     mkdir(mount_point, 0755);
 
+    pthread_mutex_lock(&mounts_lock);
+    dirForgetStats();       // the device numbers may be reused
     if (strcmp(type, "MTD") == 0) {
         mtd_scan_partitions();
         const MtdPartition* mtd;
@@ -72,29 +85,37 @@ char* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
         if (mtd == NULL) {
             fprintf(stderr, "%s: no mtd partition named \"%s\"",
                     name, location);
-            result = strdup("");
-            goto done;
-        }
-        if (mtd_mount_partition(mtd, mount_point, "yaffs2", 0 /* rw */) != 0) {
+            result = EmptyValue();
+        } else if (mtd_mount_partition(mtd, mount_point, "yaffs2",
+                                       0 /* rw */) != 0) {
             fprintf(stderr, "mtd mount of %s failed: %s\n",
                     location, strerror(errno));
-            result = strdup("");
-            goto done;
+            result = EmptyValue();
+        } else {
+            result = mount_point;
         }
-        result = mount_point;
     } else {
+        invalidate_mounted_volumes();
         if (mount(location, mount_point, type,
                   MS_NOATIME | MS_NODEV | MS_NODIRATIME, "") < 0) {
-            result = strdup("");
+            result = EmptyValue();
         } else {
             result = mount_point;
         }
     }
+    pthread_mutex_unlock(&mounts_lock);
+
+    // Better to stop now than with the partition half written.
+    char* errmsg;
+    if (result == mount_point && !CheckPlannedSpace(mount_point, &errmsg)) {
+        result = ErrorAbort(state, "%s", errmsg);
+        free(errmsg);
+    }
 
 done:
-    free(type);
-    free(location);
-    if (result != mount_point) free(mount_point);
+    FreeValue(type);
+    FreeValue(location);
+    if (result != mount_point) FreeValue(mount_point);
     return result;
 }
 
@@ -114,16 +135,18 @@ char* IsMountedFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    pthread_mutex_lock(&mounts_lock);
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
-        result = strdup("");
+        result = EmptyValue();
     } else {
         result = mount_point;
     }
+    pthread_mutex_unlock(&mounts_lock);
 
 done:
-    if (result != mount_point) free(mount_point);
+    if (result != mount_point) FreeValue(mount_point);
     return result;
 }
 
@@ -142,18 +165,21 @@ char* UnmountFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    pthread_mutex_lock(&mounts_lock);
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
         fprintf(stderr, "unmount of %s failed; no such volume\n", mount_point);
-        result = strdup("");
+        result = EmptyValue();
     } else {
+        dirForgetStats();
         unmount_mounted_volume(vol);
         result = mount_point;
     }
+    pthread_mutex_unlock(&mounts_lock);
 
 done:
-    if (result != mount_point) free(mount_point);
+    if (result != mount_point) FreeValue(mount_point);
     return result;
 }
 
@@ -182,29 +208,30 @@ char* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (strcmp(type, "MTD") == 0) {
+        dirForgetStats();
         mtd_scan_partitions();
         const MtdPartition* mtd = mtd_find_partition_by_name(location);
         if (mtd == NULL) {
             fprintf(stderr, "%s: no mtd partition named \"%s\"",
                     name, location);
-            result = strdup("");
+            result = EmptyValue();
             goto done;
         }
         MtdWriteContext* ctx = mtd_write_partition(mtd);
         if (ctx == NULL) {
             fprintf(stderr, "%s: can't write \"%s\"", name, location);
-            result = strdup("");
+            result = EmptyValue();
             goto done;
         }
         if (mtd_erase_blocks(ctx, -1) == -1) {
             mtd_write_close(ctx);
             fprintf(stderr, "%s: failed to erase \"%s\"", name, location);
-            result = strdup("");
+            result = EmptyValue();
             goto done;
         }
         if (mtd_write_close(ctx) != 0) {
             fprintf(stderr, "%s: failed to close \"%s\"", name, location);
-            result = strdup("");
+            result = EmptyValue();
             goto done;
         }
         result = location;
@@ -213,8 +240,8 @@ char* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    free(type);
-    if (result != location) free(location);
+    FreeValue(type);
+    if (result != location) FreeValue(location);
     return result;
 }
 
@@ -226,8 +253,8 @@ char* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
         paths[i] = Evaluate(state, argv[i]);
         if (paths[i] == NULL) {
             int j;
-            for (j = 0; j < i; ++i) {
-                free(paths[j]);
+            for (j = 0; j < i; ++j) {
+                FreeValue(paths[j]);
             }
             free(paths);
             return NULL;
@@ -236,11 +263,12 @@ char* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     bool recursive = (strcmp(name, "delete_recursive") == 0);
 
+    dirForgetStats();       // the inodes may be reused
     int success = 0;
     for (i = 0; i < argc; ++i) {
         if ((recursive ? dirUnlinkHierarchy(paths[i]) : unlink(paths[i])) == 0)
             ++success;
-        free(paths[i]);
+        FreeValue(paths[i]);
     }
     free(paths);
 
@@ -250,6 +278,49 @@ char* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Inside parallel(), each branch has show_progress() segments of its
+// own.  Recovery's bar only has one, so a branch moves the bar on by
+// handing it each bit of progress as a small segment, filled at once,
+// that starts where the other branches' bits left off.  (So the
+// "seconds" of a show_progress() in a branch are ignored.)
+typedef struct {
+    UpdaterInfo* ui;
+    double segment;     // from the branch's last show_progress()
+    double done;        // how much of it the bar has been given
+} ProgressBranch;
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void AdvanceProgress(ProgressBranch* b, double fraction) {
+    if (fraction > 1.0) fraction = 1.0;
+    if (fraction <= b->done) return;
+    double amount = b->segment * (fraction - b->done);
+    b->done = fraction;
+    if (amount <= 0) return;
+    pthread_mutex_lock(&progress_lock);
+    SendProgress(b->ui, amount, 0);
+    SendSetProgress(b->ui, 1.0);
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static void* StartProgressBranch(State* state, int index) {
+    ProgressBranch* b = malloc(sizeof(ProgressBranch));
+    if (b != NULL) {
+        b->ui = (UpdaterInfo*)(state->cookie);
+        b->segment = 0;
+        b->done = 0;
+    }
+    return b;
+}
+
+// Whatever the branch's last segment didn't get to, it has now done.
+static void EndProgressBranch(State* state, void* data) {
+    ProgressBranch* b = (ProgressBranch*) data;
+    if (b == NULL) return;
+    AdvanceProgress(b, 1.0);
+    free(b);
+}
+
 char* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 2) {
         return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
@@ -263,10 +334,19 @@ char* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
     int sec = strtol(sec_str, NULL, 10);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    ProgressBranch* b = (ProgressBranch*) CurrentBranchData();
+    if (PlanDrivesProgress()) {
+        // the bar follows the planned bytes instead
+    } else if (b != NULL) {
+        AdvanceProgress(b, 1.0);
+        b->segment = frac;
+        b->done = 0;
+    } else {
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        SendProgress(ui, frac, sec);
+    }
 
-    free(sec_str);
+    FreeValue(sec_str);
     return frac_str;
 }
 
@@ -281,12 +361,41 @@ char* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     double frac = strtod(frac_str, NULL);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    ProgressBranch* b = (ProgressBranch*) CurrentBranchData();
+    if (PlanDrivesProgress()) {
+        // the bar follows the planned bytes instead
+    } else if (b != NULL) {
+        AdvanceProgress(b, frac);
+    } else {
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        SendSetProgress(ui, frac);
+    }
 
     return frac_str;
 }
 
+// Each file package_extract_dir() unpacks is that many planned bytes
+// done; its entry is the destination path with the zip path in place
+// of the destination directory.
+typedef struct {
+    ZipArchive* za;
+    const char* zip_path;
+    size_t dest_len;
+} ExtractProgress;
+
+static void ExtractedFile(const char* fn, void* cookie) {
+    ExtractProgress* p = (ExtractProgress*) cookie;
+    const char* rest = fn + p->dest_len;
+    if (*rest == '/') ++rest;
+    size_t len = strlen(p->zip_path);
+    char entry_name[len + strlen(rest) + 2];
+    strcpy(entry_name, p->zip_path);
+    if (len > 0 && entry_name[len-1] != '/') entry_name[len++] = '/';
+    strcpy(entry_name + len, rest);
+    const ZipEntry* entry = mzFindZipEntry(p->za, entry_name);
+    if (entry != NULL) PlanProgress(entry->uncompLen);
+}
+
 // package_extract_dir(package_path, destination_path)
 char* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
@@ -297,17 +406,29 @@ char* PackageExtractDirFn(const char* name, State* state,
     char* dest_path;
     if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ZipArchive* za = ui->package_zip;
 
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-    bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL);
-    free(zip_path);
-    free(dest_path);
-    return strdup(success ? "t" : "");
+    ExtractProgress progress = { za, zip_path, strlen(dest_path) };
+    bool success = mzExtractRecursiveParallel(za, zip_path, dest_path,
+                                              MZ_EXTRACT_FILES_ONLY |
+                                              MZ_EXTRACT_SYNC, &timestamp,
+                                              PlanDrivesProgress() ?
+                                                  ExtractedFile : NULL,
+                                              &progress, ui->threads);
+    if (success && ProfilingEnabled()) {
+        unsigned int first, count, i;
+        count = mzFindZipEntriesWithPrefix(za, zip_path, &first);
+        for (i = 0; i < count; ++i) {
+            ProfileBytes(mzGetSortedZipEntry(za, first + i)->uncompLen);
+        }
+    }
+    FreeValue(zip_path);
+    FreeValue(dest_path);
+    return BoolValue(success);
 }
 
 
@@ -338,11 +459,15 @@ char* PackageExtractFileFn(const char* name, State* state,
     }
     success = mzExtractZipEntryToFile(za, entry, fileno(f));
     fclose(f);
+    if (success) {
+        ProfileBytes(entry->uncompLen);
+        PlanProgress(entry->uncompLen);
+    }
 
   done:
-    free(zip_path);
-    free(dest_path);
-    return strdup(success ? "t" : "");
+    FreeValue(zip_path);
+    FreeValue(dest_path);
+    return BoolValue(success);
 }
 
 
@@ -357,17 +482,17 @@ char* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char** srcs = ReadVarArgs(state, argc-1, argv+1);
     if (srcs == NULL) {
-        free(target);
+        FreeValue(target);
         return NULL;
     }
 
     int i;
     for (i = 0; i < argc-1; ++i) {
         symlink(target, srcs[i]);
-        free(srcs[i]);
+        FreeValue(srcs[i]);
     }
     free(srcs);
-    return strdup("");
+    return EmptyValue();
 }
 
 
@@ -412,8 +537,10 @@ char* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
+        int threads = ((UpdaterInfo*)(state->cookie))->threads;
         for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
+            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode,
+                                       threads);
         }
     } else {
         int mode = strtoul(args[2], &end, 0);
@@ -422,16 +549,17 @@ char* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
+        dirForgetStats();
         for (i = 3; i < argc; ++i) {
             chown(args[i], uid, gid);
             chmod(args[i], mode);
         }
     }
-    result = strdup("");
+    result = EmptyValue();
 
 done:
     for (i = 0; i < argc; ++i) {
-        free(args[i]);
+        FreeValue(args[i]);
     }
     free(args);
 
@@ -449,7 +577,7 @@ char* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char value[PROPERTY_VALUE_MAX];
     property_get(key, value, "");
-    free(key);
+    FreeValue(key);
 
     return strdup(value);
 }
@@ -507,7 +635,8 @@ char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fclose(f);
 
-    char* line = strtok(buffer, "\n");
+    char* saveptr;
+    char* line = strtok_r(buffer, "\n", &saveptr);
     do {
         // skip whitespace at start of line
         while (*line && isspace(*line)) ++line;
@@ -542,13 +671,13 @@ char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup(val_start);
         break;
 
-    } while ((line = strtok(NULL, "\n")));
+    } while ((line = strtok_r(NULL, "\n", &saveptr)));
 
-    if (result == NULL) result = strdup("");
+    if (result == NULL) result = EmptyValue();
 
   done:
-    free(filename);
-    free(key);
+    FreeValue(filename);
+    FreeValue(key);
     free(buffer);
     return result;
 }
@@ -585,57 +714,85 @@ char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     const MtdPartition* mtd = mtd_find_partition_by_name(partition);
     if (mtd == NULL) {
         fprintf(stderr, "%s: no mtd partition named \"%s\"\n", name, partition);
-        result = strdup("");
+        result = EmptyValue();
         goto done;
     }
 
-    MtdWriteContext* ctx = mtd_write_partition(mtd);
+    // Opened first: once the writer is started, it has to be closed.
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: can't open %s: %s\n",
+                name, filename, strerror(errno));
+        result = EmptyValue();
+        goto done;
+    }
+
+    MtdWriteContext* ctx = mtd_write_partition_async(mtd, 0);
     if (ctx == NULL) {
         fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
                 name, partition);
-        result = strdup("");
+        fclose(f);
+        result = EmptyValue();
         goto done;
     }
+    // Check the whole image once at the end instead of every block as
+    // it's written; that halves the NAND traffic for big images.
+    mtd_write_set_verify(ctx, MTD_VERIFY_DEFERRED);
+    mtd_write_set_skip_unchanged(ctx, 1);
+    mtd_write_set_skip_erased(ctx, 1);
 
     bool success;
 
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "%s: can't open %s: %s\n",
-                name, filename, strerror(errno));
-        result = strdup("");
-        goto done;
-    }
-
-    success = true;
-    char* buffer = malloc(BUFSIZ);
-    int read;
-    while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-        int wrote = mtd_write_data(ctx, buffer, read);
-        success = success && (wrote == read);
+    // Read whole erase blocks, so mtd_write_data() hands each one to the
+    // writer without copying it into a partial block first.
+    size_t erase_size;
+    if (mtd_partition_info(mtd, NULL, &erase_size, NULL) != 0) {
+        erase_size = BUFSIZ;
+    }
+    const size_t buffer_size = erase_size * 4;
+    char* buffer = malloc(buffer_size);
+    success = buffer != NULL;
+    setvbuf(f, NULL, _IONBF, 0);
+    size_t read;
+    while (success && (read = fread(buffer, 1, buffer_size, f)) > 0) {
+        ssize_t wrote = mtd_write_data(ctx, buffer, read);
+        success = success && (wrote == (ssize_t) read);
+        if (wrote > 0) {
+            ProfileBytes(wrote);
+            PlanProgress(wrote);
+        }
         if (!success) {
             fprintf(stderr, "mtd_write_data to %s failed: %s\n",
                     partition, strerror(errno));
         }
     }
+    if (ferror(f)) {
+        fprintf(stderr, "%s: error reading %s\n", name, filename);
+        success = false;
+    }
     free(buffer);
     fclose(f);
 
+    // Writes are asynchronous, so failures may only show up here.
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
+        success = false;
     }
+    printf("%s: %d unchanged blocks of %s left alone\n",
+           name, mtd_write_skipped_blocks(ctx), partition);
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "%s: error closing write of %s\n", name, partition);
+        success = false;
     }
 
     printf("%s %s partition from %s\n",
            success ? "wrote" : "failed to write", partition, filename);
 
-    result = success ? partition : strdup("");
+    result = success ? partition : EmptyValue();
 
 done:
-    if (result != partition) free(partition);
-    free(filename);
+    if (result != partition) FreeValue(partition);
+    FreeValue(filename);
     return result;
 }
 
@@ -664,24 +821,64 @@ char* WriteFirmwareImageFn(const char* name, State* state,
         goto done;
     }
 
-    FILE* cmd = ((UpdaterInfo*)(state->cookie))->cmd_pipe;
-    fprintf(cmd, "firmware %s %s\n", partition, filename);
+    SendFirmware((UpdaterInfo*)(state->cookie), partition, filename);
 
     printf("will write %s firmware from %s\n", partition, filename);
     result = partition;
 
 done:
-    if (result != partition) free(partition);
-    free(filename);
+    if (result != partition) FreeValue(partition);
+    FreeValue(filename);
     return result;
 }
 
 
 extern int applypatch(int argc, char** argv);
 
+// applypatch keeps state in globals and stages sources at one fixed
+// path on /cache, so parallel() branches take turns calling it.
+static pthread_mutex_t applypatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inflate the package entry "entry_name" into a file applypatch can
+// open as /proc/self/fd/<fd>.  Where the kernel has memfd_create() it
+// lives only in memory, so nothing is staged on /tmp or /cache.
+// Returns the fd, or -1.
+static int OpenPackagePatch(ZipArchive* za, const char* entry_name) {
+    const ZipEntry* entry = mzFindZipEntry(za, entry_name);
+    if (entry == NULL) {
+        fprintf(stderr, "apply_patch: no %s in package\n", entry_name);
+        return -1;
+    }
+
+    int fd = -1;
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "patch", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+        char path[] = "/tmp/patch-XXXXXX";
+        fd = mkstemp(path);
+        if (fd >= 0) unlink(path);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "apply_patch: can't make file for %s: %s\n",
+                entry_name, strerror(errno));
+        return -1;
+    }
+    if (!mzExtractZipEntryToFile(za, entry, fd)) {
+        fprintf(stderr, "apply_patch: can't extract %s\n", entry_name);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 // apply_patch(srcfile, tgtfile, tgtsha1, tgtsize, sha1:patch, ...)
 // apply_patch_check(file, sha1, ...)
 // apply_patch_space(bytes)
+//
+// A patch given as "sha1:PACKAGE:<entry>" is read straight from the
+// package instead of a file the script extracted first; it takes no
+// space on any filesystem, so apply_patch_space() needn't count it.
 char* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     printf("in applypatchfn (%s)\n", name);
 
@@ -694,6 +891,43 @@ char* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) return NULL;
+    long long target_size = (prepend == NULL && argc > 3) ?
+            strtoll(args[3], NULL, 10) : 0;
+
+    // applypatch splits its arguments in place.
+    int i;
+    for (i = 0; i < argc; ++i) {
+        args[i] = OwnValue(args[i]);
+    }
+    int patch_fds[argc > 4 ? argc - 4 : 1];
+    int num_patch_fds = 0;
+    int result = 0;
+    if (prepend == NULL) {
+        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        for (i = 4; i < argc; ++i) {
+            char* colon = strchr(args[i], ':');
+            if (colon == NULL || strncmp(colon+1, "PACKAGE:", 8) != 0) {
+                continue;
+            }
+            int fd = OpenPackagePatch(za, colon+9);
+            if (fd < 0) {
+                result = 1;
+                break;
+            }
+            patch_fds[num_patch_fds++] = fd;
+
+            char* arg = malloc((colon - args[i]) + 32);
+            if (arg == NULL) {
+                fprintf(stderr, "apply_patch: out of memory\n");
+                result = 1;
+                break;
+            }
+            sprintf(arg, "%.*s:/proc/self/fd/%d",
+                    (int)(colon - args[i]), args[i], fd);
+            FreeValue(args[i]);
+            args[i] = arg;
+        }
+    }
 
     // insert the "program name" argv[0] and a copy of the "prepend"
     // string (if any) at the start of the args.
@@ -709,20 +943,28 @@ char* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     args = temp;
     argc += extra;
 
-    printf("calling applypatch\n");
-    fflush(stdout);
-    int result = applypatch(argc, args);
-    printf("applypatch returned %d\n", result);
+    if (result == 0) {
+        printf("calling applypatch\n");
+        fflush(stdout);
+        pthread_mutex_lock(&applypatch_lock);
+        dirForgetStats();   // it replaces files
+        result = applypatch(argc, args);
+        pthread_mutex_unlock(&applypatch_lock);
+        printf("applypatch returned %d\n", result);
+    }
 
-    int i;
     for (i = 0; i < argc; ++i) {
-        free(args[i]);
+        FreeValue(args[i]);
     }
     free(args);
+    for (i = 0; i < num_patch_fds; ++i) {
+        close(patch_fds[i]);
+    }
 
     switch (result) {
-        case 0:   return strdup("t");
-        case 1:   return strdup("");
+        case 0:   PlanProgress(target_size);
+                  return BoolValue(true);
+        case 1:   return EmptyValue();
         default:  return ErrorAbort(state, "applypatch couldn't parse args");
     }
 }
@@ -743,18 +985,12 @@ char* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         strcpy(buffer+size, args[i]);
         size += strlen(args[i]);
-        free(args[i]);
+        FreeValue(args[i]);
     }
     free(args);
     buffer[size] = '\0';
 
-    char* line = strtok(buffer, "\n");
-    while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
-    }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    SendPrint((UpdaterInfo*)(state->cookie), buffer);
 
     return buffer;
 }
@@ -785,4 +1021,6 @@ void RegisterInstallFunctions() {
     RegisterFunction("apply_patch_space", ApplyPatchFn);
 
     RegisterFunction("ui_print", UIPrintFn);
+
+    SetParallelHooks(StartProgressBranch, EndProgressBranch);
 }
@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "minzip/Zip.h"
+#include "mtdutils/mtdutils.h"
+#include "plan.h"
+
+// Where planned bytes go: a mount point of the script's, or an MTD
+// partition written with write_raw_image().  Names point into the
+// parse tree, which outlives the plan.
+typedef struct {
+    const char* name;
+    bool raw;
+    bool formatted;         // format()ted before it was mounted
+    long long extract;
+    long long patch;
+    long long flash;
+} PlanTarget;
+
+// A file the script extracts, so a later write_raw_image() of it knows
+// how big it is.
+typedef struct {
+    const char* path;
+    long long size;
+} PlanFile;
+
+typedef struct {
+    PlanTarget* targets;
+    int num_targets;
+    PlanFile* files;
+    int num_files;
+    const char** formats;   // format()ted, not yet mounted
+    int num_formats;
+    long long elsewhere;    // to places the script doesn't mount
+    long long total;
+    bool complete;          // every sizable call was sized
+} Plan;
+
+static Plan plan;
+
+static UpdaterInfo* progress_ui;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long progress_done;
+static float progress_shown;
+
+// The smallest move of the bar worth telling recovery about.
+#define PROGRESS_STEP (1.0f / 200)
+
+static void* Grow(void* array, int count, size_t size) {
+    // Room for 4, then doubled whenever "count" (the number in use)
+    // reaches a power of two.
+    if (count != 0 && (count < 4 || (count & (count - 1)) != 0)) {
+        return array;
+    }
+    void* grown = realloc(array, (count ? count * 2 : 4) * size);
+    if (grown == NULL) {
+        fprintf(stderr, "out of memory planning script\n");
+        exit(1);
+    }
+    return grown;
+}
+
+static PlanTarget* FindTarget(const char* name, bool raw, bool create) {
+    int i;
+    for (i = 0; i < plan.num_targets; ++i) {
+        PlanTarget* t = plan.targets + i;
+        if (t->raw == raw && strcmp(t->name, name) == 0) return t;
+    }
+    if (!create) return NULL;
+    plan.targets = Grow(plan.targets, plan.num_targets, sizeof(PlanTarget));
+    PlanTarget* t = plan.targets + plan.num_targets++;
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->raw = raw;
+    return t;
+}
+
+// The mount point "path" is under, or NULL if it isn't under one the
+// script mounts (eg. /tmp).
+static PlanTarget* TargetForPath(const char* path) {
+    PlanTarget* best = NULL;
+    size_t best_len = 0;
+    int i;
+    for (i = 0; i < plan.num_targets; ++i) {
+        PlanTarget* t = plan.targets + i;
+        size_t len = strlen(t->name);
+        if (t->raw || len <= best_len || strncmp(path, t->name, len) != 0) {
+            continue;
+        }
+        if (path[len] == '/' || path[len] == '\0' || t->name[len-1] == '/') {
+            best = t;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+// The literal value of argument "i" of "e", or NULL if it isn't one.
+static const char* LiteralArg(Expr* e, int i) {
+    if (i >= e->argc || e->argv[i]->fn != Literal) return NULL;
+    return e->argv[i]->name;
+}
+
+static void AddBytes(long long* where, long long bytes) {
+    *where += bytes;
+    plan.total += bytes;
+}
+
+static void PlanExtractDir(ZipArchive* za, Expr* e) {
+    const char* zip_path = LiteralArg(e, 0);
+    const char* dest_path = LiteralArg(e, 1);
+    if (zip_path == NULL || dest_path == NULL) {
+        plan.complete = false;
+        return;
+    }
+
+    // Only what's under zip_path/, as mzExtractRecursive() sees it.
+    size_t len = strlen(zip_path);
+    char prefix[len + 2];
+    strcpy(prefix, zip_path);
+    if (len > 0 && prefix[len-1] != '/') strcpy(prefix + len, "/");
+
+    long long bytes = 0;
+    unsigned int first, count, i;
+    count = mzFindZipEntriesWithPrefix(za, prefix, &first);
+    for (i = 0; i < count; ++i) {
+        bytes += mzGetSortedZipEntry(za, first + i)->uncompLen;
+    }
+
+    PlanTarget* t = TargetForPath(dest_path);
+    AddBytes(t != NULL ? &t->extract : &plan.elsewhere, bytes);
+}
+
+static void PlanExtractFile(ZipArchive* za, Expr* e) {
+    const char* zip_path = LiteralArg(e, 0);
+    const char* dest_path = LiteralArg(e, 1);
+    if (zip_path == NULL || dest_path == NULL) {
+        plan.complete = false;
+        return;
+    }
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) return;      // it'll fail when it runs
+
+    plan.files = Grow(plan.files, plan.num_files, sizeof(PlanFile));
+    plan.files[plan.num_files].path = dest_path;
+    plan.files[plan.num_files].size = entry->uncompLen;
+    ++plan.num_files;
+
+    PlanTarget* t = TargetForPath(dest_path);
+    AddBytes(t != NULL ? &t->extract : &plan.elsewhere, entry->uncompLen);
+}
+
+static void PlanWriteRawImage(Expr* e) {
+    const char* filename = LiteralArg(e, 0);
+    const char* partition = LiteralArg(e, 1);
+    if (filename == NULL || partition == NULL) {
+        plan.complete = false;
+        return;
+    }
+
+    // The image is usually extracted by the script first; if not, it
+    // must be there already.
+    long long size = -1;
+    int i;
+    for (i = plan.num_files - 1; i >= 0; --i) {
+        if (strcmp(plan.files[i].path, filename) == 0) {
+            size = plan.files[i].size;
+            break;
+        }
+    }
+    struct stat st;
+    if (size < 0 && stat(filename, &st) == 0) size = st.st_size;
+    if (size < 0) {
+        plan.complete = false;
+        return;
+    }
+    AddBytes(&FindTarget(partition, true, true)->flash, size);
+}
+
+static void PlanApplyPatch(Expr* e) {
+    // apply_patch(srcfile, tgtfile, tgtsha1, tgtsize, sha1:patch, ...)
+    const char* src = LiteralArg(e, 0);
+    const char* tgt = LiteralArg(e, 1);
+    const char* size = LiteralArg(e, 3);
+    if (src == NULL || tgt == NULL || size == NULL) {
+        plan.complete = false;
+        return;
+    }
+    if (strcmp(tgt, "-") == 0) tgt = src;
+    PlanTarget* t = TargetForPath(tgt);
+    AddBytes(t != NULL ? &t->patch : &plan.elsewhere, strtoll(size, NULL, 10));
+}
+
+static void PlanFormat(Expr* e) {
+    const char* location = LiteralArg(e, 1);
+    if (location == NULL) return;
+    plan.formats = Grow(plan.formats, plan.num_formats, sizeof(char*));
+    plan.formats[plan.num_formats++] = location;
+}
+
+static void PlanMount(Expr* e) {
+    const char* location = LiteralArg(e, 1);
+    const char* mount_point = LiteralArg(e, 2);
+    if (location == NULL || mount_point == NULL) return;
+
+    PlanTarget* t = FindTarget(mount_point, false, true);
+    int i;
+    for (i = 0; i < plan.num_formats; ++i) {
+        if (strcmp(plan.formats[i], location) == 0) {
+            // Fresh; and mounting it again later doesn't make it so.
+            t->formatted = true;
+            plan.formats[i] = plan.formats[--plan.num_formats];
+            break;
+        }
+    }
+}
+
+static void PlanExpr(ZipArchive* za, Expr* e);
+
+static PlanTarget* CopyTargets(void) {
+    PlanTarget* copy = malloc((plan.num_targets + 1) * sizeof(PlanTarget));
+    if (copy == NULL) {
+        fprintf(stderr, "out of memory planning script\n");
+        exit(1);
+    }
+    memcpy(copy, plan.targets, plan.num_targets * sizeof(PlanTarget));
+    return copy;
+}
+
+static void Larger(long long* where, long long bytes) {
+    if (bytes > *where) *where = bytes;
+}
+
+// Only one side of an if/else runs, and the plan can't tell which, so
+// it takes whichever needs more: each side is planned from where the
+// condition leaves off, then every count is the larger of the two.
+// That can't refuse a script that fits either way.
+static void PlanIfElse(ZipArchive* za, Expr* e) {
+    PlanExpr(za, e->argv[0]);
+    int before_targets = plan.num_targets;
+    PlanTarget* before = CopyTargets();
+    long long before_elsewhere = plan.elsewhere;
+    long long before_total = plan.total;
+
+    PlanExpr(za, e->argv[1]);
+    int then_targets = plan.num_targets;
+    PlanTarget* then = CopyTargets();
+    long long then_elsewhere = plan.elsewhere;
+    long long then_total = plan.total;
+
+    // Targets the "then" side added stay, with nothing in them yet.
+    int i;
+    for (i = 0; i < then_targets; ++i) {
+        PlanTarget* t = plan.targets + i;
+        t->extract = i < before_targets ? before[i].extract : 0;
+        t->patch = i < before_targets ? before[i].patch : 0;
+        t->flash = i < before_targets ? before[i].flash : 0;
+    }
+    plan.elsewhere = before_elsewhere;
+    plan.total = before_total;
+
+    PlanExpr(za, e->argv[2]);
+    for (i = 0; i < then_targets; ++i) {
+        PlanTarget* t = plan.targets + i;
+        Larger(&t->extract, then[i].extract);
+        Larger(&t->patch, then[i].patch);
+        Larger(&t->flash, then[i].flash);
+    }
+    Larger(&plan.elsewhere, then_elsewhere);
+    Larger(&plan.total, then_total);
+    free(before);
+    free(then);
+}
+
+// Visit the calls in "e" in the order they'd run.
+static void PlanExpr(ZipArchive* za, Expr* e) {
+    if (e->fn == Literal) return;
+    if (e->fn == IfElseFn && e->argc == 3) {
+        PlanIfElse(za, e);
+        return;
+    }
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        PlanExpr(za, e->argv[i]);
+    }
+
+    if (strcmp(e->name, "package_extract_dir") == 0) {
+        PlanExtractDir(za, e);
+    } else if (strcmp(e->name, "package_extract_file") == 0) {
+        PlanExtractFile(za, e);
+    } else if (strcmp(e->name, "write_raw_image") == 0) {
+        PlanWriteRawImage(e);
+    } else if (strcmp(e->name, "apply_patch") == 0) {
+        PlanApplyPatch(e);
+    } else if (strcmp(e->name, "format") == 0) {
+        PlanFormat(e);
+    } else if (strcmp(e->name, "mount") == 0) {
+        PlanMount(e);
+    }
+}
+
+static char* Message(const char* format, const char* name,
+                     long long need, long long have) {
+    char* msg = malloc(strlen(format) + strlen(name) + 64);
+    if (msg != NULL) sprintf(msg, format, name, need, have);
+    return msg;
+}
+
+bool PlanInstall(UpdaterInfo* ui, Expr* root, char** errmsg) {
+    memset(&plan, 0, sizeof(plan));
+    plan.complete = true;
+    PlanExpr(ui->package_zip, root);
+
+    *errmsg = NULL;
+    bool scanned = false;
+    int i;
+    for (i = 0; i < plan.num_targets; ++i) {
+        const PlanTarget* t = plan.targets + i;
+        printf("plan: %s%s: extract %lld, patch %lld, flash %lld bytes\n",
+               t->raw ? "mtd:" : "", t->name, t->extract, t->patch, t->flash);
+        if (!t->raw || *errmsg != NULL) continue;
+
+        if (!scanned) {
+            mtd_scan_partitions();
+            scanned = true;
+        }
+        const MtdPartition* mtd = mtd_find_partition_by_name(t->name);
+        size_t size;
+        if (mtd == NULL || mtd_partition_info(mtd, &size, NULL, NULL) != 0) {
+            continue;               // write_raw_image() will say why
+        }
+        if (t->flash > (long long) size) {
+            *errmsg = Message("%s image is %lld bytes; the partition holds "
+                              "only %lld", t->name, t->flash, size);
+        }
+    }
+    printf("plan: %lld bytes elsewhere, %lld in all%s\n",
+           plan.elsewhere, plan.total,
+           plan.complete ? "" : " (some calls not sized)");
+    if (*errmsg != NULL) return false;
+
+    progress_ui = ui;
+    if (PlanDrivesProgress()) {
+        // One segment for the whole script, filled as the bytes go by.
+        SendProgress(ui, 1.0, 0);
+        SendSetProgress(ui, 0.0);
+    }
+    return true;
+}
+
+bool CheckPlannedSpace(const char* mount_point, char** errmsg) {
+    const PlanTarget* t = FindTarget(mount_point, false, false);
+    if (t == NULL || t->extract == 0) return true;
+
+    struct statfs sf;
+    if (statfs(mount_point, &sf) != 0) return true;
+
+    // Files the script replaces give back their space, so unless the
+    // filesystem was just formatted only its size is a hard limit.
+    long long have = (long long) sf.f_bsize *
+            (t->formatted ? sf.f_bavail : sf.f_blocks);
+    if (t->extract <= have) return true;
+    *errmsg = Message(t->formatted ?
+                      "%s needs %lld bytes; only %lld are free" :
+                      "%s needs %lld bytes; it holds only %lld",
+                      mount_point, t->extract, have);
+    return false;
+}
+
+long long PlannedExtract(const char* mount_point) {
+    const PlanTarget* t = FindTarget(mount_point, false, false);
+    return t != NULL ? t->extract : 0;
+}
+
+bool PlanDrivesProgress() {
+    return plan.complete && plan.total > 0;
+}
+
+void PlanProgress(long long bytes) {
+    if (!PlanDrivesProgress() || bytes <= 0) return;
+    pthread_mutex_lock(&progress_lock);
+    progress_done += bytes;
+    float fraction = (float) progress_done / plan.total;
+    if (fraction > 1.0f) fraction = 1.0f;
+    if (fraction - progress_shown >= PROGRESS_STEP ||
+            (fraction == 1.0f && progress_shown < 1.0f)) {
+        progress_shown = fraction;
+        SendSetProgress(progress_ui, fraction);
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PLAN_H_
+#define _UPDATER_PLAN_H_
+
+#include <stdbool.h>
+
+#include "edify/expr.h"
+#include "updater.h"
+
+// A look through the parsed script, before any of it runs, for the
+// bytes it will extract, patch and flash, and where they'll go.  Only
+// calls whose arguments are string literals can be sized this way,
+// which in generated scripts is nearly all of them.
+//
+// The plan is used twice: a partition too small for what the script
+// puts on it fails the install up front (MTD images before anything
+// runs, filesystems as soon as the script mounts them), and if every
+// sizable call was sized, the progress bar follows the bytes instead
+// of the script's show_progress() guesses.
+
+// Plan the script "root" against the package in "ui".  Returns false,
+// with a malloc'd message in *errmsg, if the install can't fit.
+bool PlanInstall(UpdaterInfo* ui, Expr* root, char** errmsg);
+
+// Called when the script has mounted "mount_point"; returns false,
+// with a malloc'd message in *errmsg, if what the plan puts there
+// won't fit.
+bool CheckPlannedSpace(const char* mount_point, char** errmsg);
+
+// The bytes the plan extracts under "mount_point", once planned.
+long long PlannedExtract(const char* mount_point);
+
+// True if the bar is following the plan, so show_progress() and
+// set_progress() should leave it alone.
+bool PlanDrivesProgress();
+
+// "bytes" of the planned work are done.  Safe from any thread.
+void PlanProgress(long long bytes);
+
+#endif
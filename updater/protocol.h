@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PROTOCOL_H_
+#define _UPDATER_PROTOCOL_H_
+
+#include <stdint.h>
+
+/* What the updater sends recovery down the pipe it gets in argv[2].
+ *
+ * Recovery has always taken text commands there, one per line (see
+ * try_update_binary() in recovery's install.c).  If it sets
+ * UPDATER_PROTOCOL_ENV to "1" in the updater's environment, it will
+ * also take the frames below, which an updater asks for by writing
+ * UPDATER_PROTOCOL_MAGIC before anything else.  No text command starts
+ * with a NUL, so recovery can tell which it's getting from the first
+ * bytes.
+ *
+ * Frames let the updater send any amount of text at once, and write
+ * progress and messages a batch at a time instead of a line at a time.
+ * Both ends are the same device, so fields are in its byte order.
+ */
+
+#define UPDATER_PROTOCOL_ENV        "UPDATE_PROTOCOL"
+#define UPDATER_PROTOCOL_MAGIC      "\0UPDFRM1"
+#define UPDATER_PROTOCOL_MAGIC_LEN  8
+
+// Largest payload of a frame; longer text is sent in several.
+#define UPDATER_FRAME_MAX           (64 * 1024)
+
+enum {
+    UPDATER_FRAME_PROGRESS = 1,     // UpdaterProgress: the bar's next segment
+    UPDATER_FRAME_SET_PROGRESS,     // UpdaterProgress, "seconds" unused
+    UPDATER_FRAME_FIRMWARE,         // "<type>\0<filename>\0"
+    UPDATER_FRAME_PRINT,            // text for the screen, newlines and all
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t length;                // of the payload that follows
+} UpdaterFrameHeader;
+
+typedef struct {
+    float fraction;
+    int32_t seconds;
+} UpdaterProgress;
+
+#endif
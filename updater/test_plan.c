@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "plan.h"
+
+// Host checks of the install plan.  The planner only walks the parse
+// tree, so the scripts here are built as trees rather than parsed, and
+// planned against a package holding one file, "image".
+
+#define IMAGE_SIZE 1000
+
+// Recovery isn't listening; the plan's progress goes nowhere.
+void SendProgress(UpdaterInfo* ui, float fraction, int seconds) {
+}
+
+void SendSetProgress(UpdaterInfo* ui, float fraction) {
+}
+
+// A call of "name"; "fn" matters only for literals and operators, as
+// nothing here is evaluated.
+static Expr* Node(const char* name, Function fn, int argc, ...) {
+    Expr* e = calloc(1, sizeof(Expr));
+    e->fn = fn;
+    e->name = (char*) name;
+    e->argc = argc;
+    e->argv = malloc(argc * sizeof(Expr*));
+    va_list ap;
+    va_start(ap, argc);
+    int i;
+    for (i = 0; i < argc; ++i) e->argv[i] = va_arg(ap, Expr*);
+    va_end(ap);
+    return e;
+}
+
+static Expr* Lit(const char* value) {
+    return Node(value, Literal, 0);
+}
+
+static Expr* Seq(Expr* a, Expr* b) {
+    return Node(";", SequenceFn, 2, a, b);
+}
+
+static Expr* Mount(const char* mount_point) {
+    return Node("mount", NULL, 3, Lit("ext4"), Lit("/dev/block/test"),
+                Lit(mount_point));
+}
+
+static Expr* Extract(const char* dest) {
+    return Node("package_extract_file", NULL, 2, Lit("image"), Lit(dest));
+}
+
+static Expr* If(Expr* then, Expr* otherwise) {
+    Expr* cond = Node("==", EqualityFn, 2, Lit("a"), Lit("b"));
+    if (otherwise == NULL) return Node("ifelse", IfElseFn, 2, cond, then);
+    return Node("ifelse", IfElseFn, 3, cond, then, otherwise);
+}
+
+static void put2(unsigned char* p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char* p, unsigned long v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// A package with "image" STORED in it, IMAGE_SIZE bytes of zeroes.
+static int WritePackage(const char* path) {
+    static const char name[] = "image";
+    const unsigned nameLen = sizeof(name) - 1;
+    unsigned char data[IMAGE_SIZE];
+    unsigned char loc[30], cen[46], end[22];
+
+    memset(data, 0, sizeof(data));
+    unsigned long crc = crc32(crc32(0, NULL, 0), data, sizeof(data));
+    memset(loc, 0, sizeof(loc));
+    put4(loc, 0x04034b50);
+    put2(loc + 4, 10);
+    put4(loc + 14, crc);
+    put4(loc + 18, sizeof(data));
+    put4(loc + 22, sizeof(data));
+    put2(loc + 26, nameLen);
+    memset(cen, 0, sizeof(cen));
+    put4(cen, 0x02014b50);
+    put2(cen + 4, 10);
+    put2(cen + 6, 10);
+    put4(cen + 16, crc);
+    put4(cen + 20, sizeof(data));
+    put4(cen + 24, sizeof(data));
+    put2(cen + 28, nameLen);
+    memset(end, 0, sizeof(end));
+    put4(end, 0x06054b50);
+    put2(end + 8, 1);
+    put2(end + 10, 1);
+    put4(end + 12, sizeof(cen) + nameLen);
+    put4(end + 16, sizeof(loc) + nameLen + sizeof(data));
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    bool ok = fwrite(loc, sizeof(loc), 1, f) == 1 &&
+            fwrite(name, nameLen, 1, f) == 1 &&
+            fwrite(data, sizeof(data), 1, f) == 1 &&
+            fwrite(cen, sizeof(cen), 1, f) == 1 &&
+            fwrite(name, nameLen, 1, f) == 1 &&
+            fwrite(end, sizeof(end), 1, f) == 1;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+static void expect(UpdaterInfo* ui, const char* what, Expr* script,
+                   long long expected, int* errors) {
+    char* errmsg;
+    if (!PlanInstall(ui, script, &errmsg)) {
+        fprintf(stderr, "%s: plan failed: %s\n", what, errmsg);
+        free(errmsg);
+        ++*errors;
+        return;
+    }
+    long long planned = PlannedExtract("/system");
+    if (planned != expected) {
+        fprintf(stderr, "%s: planned %lld bytes for /system, not %lld\n",
+                what, planned, expected);
+        ++*errors;
+    }
+}
+
+int main(int argc, char** argv) {
+    char path[] = "/tmp/test_plan.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || WritePackage(path) != 0) {
+        fprintf(stderr, "can't write %s\n", path);
+        return 1;
+    }
+    close(fd);
+
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", path);
+        unlink(path);
+        return 1;
+    }
+    UpdaterInfo ui;
+    memset(&ui, 0, sizeof(ui));
+    ui.package_zip = &za;
+
+    int errors = 0;
+    expect(&ui, "sequence",
+           Seq(Mount("/system"),
+               Seq(Extract("/system/a.img"), Extract("/system/b.img"))),
+           2 * IMAGE_SIZE, &errors);
+
+    // Either side of the if/else fits, so both together mustn't count.
+    expect(&ui, "if/else",
+           Seq(Mount("/system"),
+               If(Extract("/system/a.img"), Extract("/system/b.img"))),
+           IMAGE_SIZE, &errors);
+    expect(&ui, "if/else after an extract",
+           Seq(Mount("/system"),
+               Seq(Extract("/system/a.img"),
+                   If(Extract("/system/b.img"), Extract("/system/c.img")))),
+           2 * IMAGE_SIZE, &errors);
+    expect(&ui, "if/else, bigger else",
+           Seq(Mount("/system"),
+               If(Extract("/system/a.img"),
+                  Seq(Extract("/system/b.img"), Extract("/system/c.img")))),
+           2 * IMAGE_SIZE, &errors);
+    expect(&ui, "mount in one side",
+           If(Seq(Mount("/system"), Extract("/system/a.img")),
+              Extract("/system/b.img")),
+           IMAGE_SIZE, &errors);
+    expect(&ui, "if without else",
+           Seq(Mount("/system"),
+               Seq(If(Extract("/system/a.img"), NULL),
+                   Extract("/system/b.img"))),
+           2 * IMAGE_SIZE, &errors);
+
+    mzCloseZipArchive(&za);
+    unlink(path);
+    printf("%s\n", errors == 0 ? "plan tests passed" : "plan tests FAILED");
+    return errors != 0;
+}
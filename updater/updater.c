@@ -14,19 +14,116 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "plan.h"
+#include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
 
 // Where in the package we expect to find the edify script to execute.
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Recovery may hand over the package already open, with the index it
+// parsed (see try_update_binary() in recovery's install.c); that saves
+// going through the central directory again.
+static int open_package(const char* path, ZipArchive* za) {
+    const char* package_fd = getenv("UPDATE_PACKAGE_FD");
+    const char* index_fd = getenv("UPDATE_INDEX_FD");
+    if (package_fd != NULL && index_fd != NULL) {
+        int fd = atoi(package_fd);
+        int ifd = atoi(index_fd);
+        unsetenv("UPDATE_PACKAGE_FD");  // not for programs we run
+        unsetenv("UPDATE_INDEX_FD");
+
+        // Only if it really is the package we were told to install
+        struct stat inherited, named;
+        if (fstat(fd, &inherited) == 0 && stat(path, &named) == 0 &&
+                inherited.st_dev == named.st_dev &&
+                inherited.st_ino == named.st_ino) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            int err = mzOpenZipArchiveFd(fd, ifd, za);
+            close(ifd);
+            return err;
+        }
+    }
+    return mzOpenZipArchive(path, za);
+}
+
+// flex's, from the lexer
+typedef struct yy_buffer_state* YY_BUFFER_STATE;
+YY_BUFFER_STATE yy_scan_buffer(char* base, size_t size);
+void yy_delete_buffer(YY_BUFFER_STATE buffer);
+int yyparse(Expr** root, int* error_count);
+
+// The script, with the two NULs after it that yy_scan_buffer() needs
+// so the lexer can work on it in place.  A stored script is mapped
+// straight from the package (privately, since the lexer writes into
+// its buffer as it goes); otherwise it's inflated into one buffer.
+typedef struct {
+    char* data;
+    size_t length;
+    void* map;              // or NULL if "data" is malloc()ed
+    size_t map_length;
+} Script;
+
+static bool LoadScript(ZipArchive* za, const ZipEntry* entry, Script* s) {
+    s->length = mzGetZipEntryUncompLen(entry);
+    s->map = NULL;
+
+    // Only if the NULs land in the file, or mapping them would fault.
+    off_t offset = mzGetZipEntryOffset(entry);
+    if (mzIsZipEntryStored(entry) &&
+            offset + s->length + 2 <= za->fileLength) {
+        long page = sysconf(_SC_PAGESIZE);
+        off_t start = offset & ~(off_t)(page - 1);
+        size_t skip = offset - start;
+        s->map_length = skip + s->length + 2;
+        s->map = mmap(NULL, s->map_length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, za->fd, start);
+        if (s->map != MAP_FAILED) {
+            s->data = (char*)s->map + skip;
+            if (crc32(0L, (const Bytef*)s->data, s->length) ==
+                    (uLong)mzGetZipEntryCrc32(entry)) {
+                s->data[s->length] = s->data[s->length + 1] = '\0';
+                return true;
+            }
+            fprintf(stderr, "script is corrupt (bad CRC)\n");
+            munmap(s->map, s->map_length);
+            return false;
+        }
+        s->map = NULL;
+    }
+
+    s->data = malloc(s->length + 2);
+    if (s->data == NULL ||
+            !mzReadZipEntry(za, entry, s->data, s->length)) {
+        free(s->data);
+        return false;
+    }
+    s->data[s->length] = s->data[s->length + 1] = '\0';
+    return true;
+}
+
+static void FreeScript(Script* s) {
+    if (s->map != NULL) {
+        munmap(s->map, s->map_length);
+    } else {
+        free(s->data);
+    }
+}
+
 int main(int argc, char** argv) {
     if (argc != 4) {
         fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
@@ -43,16 +140,25 @@ int main(int argc, char** argv) {
 
     // Set up the pipe for sending commands back to the parent process.
 
-    int fd = atoi(argv[2]);
-    FILE* cmd_pipe = fdopen(fd, "wb");
-    setlinebuf(cmd_pipe);
+    UpdaterInfo updater_info;
+    InitCommandPipe(&updater_info, atoi(argv[2]));
+
+    // From recovery; an older one doesn't say.
+    const char* threads = getenv("UPDATE_THREADS");
+    updater_info.threads = threads != NULL && atoi(threads) > 0 ?
+            atoi(threads) : MZ_EXTRACT_THREADS;
+
+    // So set_perm_recursive() needn't stat what package_extract_dir()
+    // just wrote; the builtins that could change those files behind
+    // its back forget what was remembered.
+    dirEnableStatMemory();
 
     // Extract the script from the package.
 
     char* package_data = argv[3];
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    err = open_package(package_data, &za);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
@@ -65,12 +171,12 @@ int main(int argc, char** argv) {
         return 4;
     }
 
-    char* script = malloc(script_entry->uncompLen+1);
-    if (!mzReadZipEntry(&za, script_entry, script, script_entry->uncompLen)) {
+    Script loaded;
+    if (!LoadScript(&za, script_entry, &loaded)) {
         fprintf(stderr, "failed to read script from package\n");
         return 5;
     }
-    script[script_entry->uncompLen] = '\0';
+    char* script = loaded.data;
 
     // Configure edify's functions.
 
@@ -82,8 +188,10 @@ int main(int argc, char** argv) {
 
     Expr* root;
     int error_count = 0;
-    yy_scan_string(script);
+    ExprArena* arena = NewExprArena(loaded.length);
+    YY_BUFFER_STATE buffer = yy_scan_buffer(script, loaded.length + 2);
     int error = yyparse(&root, &error_count);
+    yy_delete_buffer(buffer);
     if (error != 0 || error_count > 0) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
@@ -91,38 +199,49 @@ int main(int argc, char** argv) {
 
     // Evaluate the parsed script.
 
-    UpdaterInfo updater_info;
-    updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
 
+    // Size up the work first; if it can't fit, nothing gets touched.
+    char* plan_error;
+    if (!PlanInstall(&updater_info, root, &plan_error)) {
+        fprintf(stderr, "script aborted: %s\n", plan_error);
+        SendPrint(&updater_info, plan_error);
+        free(plan_error);
+        FlushCommandPipe(&updater_info);
+        return 7;
+    }
+
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
+    // UPDATE_PROFILE=1 in the environment says where the time went.
+    const char* profile = getenv("UPDATE_PROFILE");
+    if (profile != NULL && strcmp(profile, "1") == 0) EnableProfiling();
+
     char* result = Evaluate(&state, root);
+    if (ProfilingEnabled()) PrintProfile(stderr, script);
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            SendPrint(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
-            char* line = strtok(state.errmsg, "\n");
-            while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
-                line = strtok(NULL, "\n");
-            }
-            fprintf(cmd_pipe, "ui_print\n");
+            SendPrint(&updater_info, state.errmsg);
         }
         free(state.errmsg);
+        FlushCommandPipe(&updater_info);
         return 7;
     } else {
         fprintf(stderr, "script result was [%s]\n", result);
-        free(result);
+        FreeValue(result);
     }
 
+    FlushCommandPipe(&updater_info);
+    FreeExprArena(arena);
+    FreeScript(&loaded);
     mzCloseZipArchive(&za);
-    free(script);
 
     return 0;
 }
@@ -23,6 +23,16 @@
 typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
+    int threads;            // to extract and set permissions on
 } UpdaterInfo;
 
+// Commands to recovery (see protocol.h), framed and sent in batches if
+// recovery can take them, otherwise as text.
+void InitCommandPipe(UpdaterInfo* ui, int fd);
+void SendProgress(UpdaterInfo* ui, float fraction, int seconds);
+void SendSetProgress(UpdaterInfo* ui, float fraction);
+void SendFirmware(UpdaterInfo* ui, const char* type, const char* filename);
+void SendPrint(UpdaterInfo* ui, const char* text);    // a line, or lines
+void FlushCommandPipe(UpdaterInfo* ui);
+
 #endif
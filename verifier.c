@@ -14,7 +14,11 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE      /* for memmem() */
+
 #include "common.h"
+#include "keys.h"
+#include "sha1.h"
 #include "verifier.h"
 
 #include "minzip/Zip.h"
@@ -22,8 +26,10 @@
 #include "mincrypt/sha.h"
 
 #include <netinet/in.h>  /* required for resolv.h */
+#include <pthread.h>
 #include <resolv.h>      /* for base64 codec */
 #include <string.h>
+#include <unistd.h>
 
 /* Return an allocated buffer with the contents of a zip file entry. */
 static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
@@ -53,42 +59,67 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
 }
 
 
-struct DigestContext {
-    SHA_CTX digest;
-    unsigned *doneBytes;
+/* Byte counts for the progress bar, shared by all verification threads. */
+struct DigestProgress {
+    pthread_mutex_t lock;
+    unsigned doneBytes;
     unsigned totalBytes;
 };
 
 
+struct DigestContext {
+    Sha1Context digest;
+    struct DigestProgress *progress;
+};
+
+
+/* The bar is set while the lock is held, so values from different
+ * threads reach it in order and it never jumps backwards.
+ */
+static void addProgress(struct DigestProgress *progress, int dataLen) {
+    if (progress != NULL) {
+        pthread_mutex_lock(&progress->lock);
+        progress->doneBytes += dataLen;
+        if (progress->totalBytes > 0) {
+            ui_set_progress(progress->doneBytes * 1.0 / progress->totalBytes);
+        }
+        pthread_mutex_unlock(&progress->lock);
+    }
+}
+
+
 /* mzProcessZipEntryContents callback to update an SHA-1 hash context. */
 static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
     struct DigestContext *context = (struct DigestContext *) cookie;
-    SHA_update(&context->digest, data, dataLen);
-    if (context->doneBytes != NULL) {
-        *context->doneBytes += dataLen;
-        if (context->totalBytes > 0) {
-            ui_set_progress(*context->doneBytes * 1.0 / context->totalBytes);
-        }
-    }
+    sha1_update(&context->digest, data, dataLen);
+    addProgress(context->progress, dataLen);
     return true;
 }
 
 
-/* Get the SHA-1 digest of a zip file entry. */
+/* Get the SHA-1 digest of a zip file entry.  If crcOk is non-NULL, the
+ * entry's CRC is checked in the same pass and the result stored there.
+ */
 static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
-        unsigned *doneBytes, unsigned totalBytes,
-        uint8_t digest[SHA_DIGEST_SIZE]) {
+        struct DigestProgress *progress,
+        uint8_t digest[SHA_DIGEST_SIZE], bool *crcOk) {
     struct DigestContext context;
-    SHA_init(&context.digest);
-    context.doneBytes = doneBytes;
-    context.totalBytes = totalBytes;
-    if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context)) {
+    sha1_init(&context.digest);
+    context.progress = progress;
+    bool ok;
+    if (crcOk != NULL) {
+        ok = mzProcessZipEntryContentsCheckCrc(pArchive, pEntry,
+                updateHash, &context, crcOk);
+    } else {
+        ok = mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context);
+    }
+    if (!ok) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
         LOGE("Can't digest %.*s\n", fn.len, fn.str);
         return false;
     }
 
-    memcpy(digest, SHA_final(&context.digest), SHA_DIGEST_SIZE);
+    sha1_final(&context.digest, digest);
 
 #ifdef LOG_VERBOSE
     UnterminatedString fn = mzGetZipEntryFileName(pEntry);
@@ -103,7 +134,7 @@ static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
 
 /* Find a /META-INF/xxx.SF signature file signed by a matching xxx.RSA file. */
 static const ZipEntry *verifySignature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, unsigned int numKeys) {
+        const KeyStore *pKeys) {
     static const char prefix[] = "META-INF/";
     static const char rsa[] = ".RSA", sf[] = ".SF";
 
@@ -136,20 +167,35 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
             free(sfName);
 
             uint8_t sfDigest[SHA_DIGEST_SIZE];
-            if (!digestEntry(pArchive, sfEntry, NULL, 0, sfDigest)) continue;
+            if (!digestEntry(pArchive, sfEntry, NULL, sfDigest, NULL)) continue;
 
             char *rsaBuf = slurpEntry(pArchive, rsaEntry);
             if (rsaBuf == NULL) continue;
 
-            /* Try to verify the signature with all the keys. */
+            /* The signer's certificate, ahead of the signature, holds its
+             * modulus.  Try the keys whose ids appear there; only if none
+             * do is every key tried.
+             */
             uint8_t *sig = (uint8_t *) rsaBuf + rsaLen - RSANUMBYTES;
-            for (j = 0; j < numKeys; ++j) {
-                if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, sfDigest)) {
-                    free(rsaBuf);
-                    LOGI("Verified %.*s\n", rsaName.len, rsaName.str);
-                    return sfEntry;
+            bool matched = false, verified = false;
+            for (j = 0; j < (unsigned int) pKeys->count && !verified; ++j) {
+                if (memmem(rsaBuf, rsaLen - RSANUMBYTES,
+                           pKeys->ids[j], KEY_ID_SIZE) != NULL) {
+                    matched = true;
+                    verified = RSA_verify(&pKeys->keys[j], sig, RSANUMBYTES,
+                                          sfDigest);
                 }
             }
+            for (j = 0; j < (unsigned int) pKeys->count && !matched &&
+                        !verified; ++j) {
+                verified = RSA_verify(&pKeys->keys[j], sig, RSANUMBYTES,
+                                      sfDigest);
+            }
+            if (verified) {
+                free(rsaBuf);
+                LOGI("Verified %.*s\n", rsaName.len, rsaName.str);
+                return sfEntry;
+            }
 
             free(rsaBuf);
             LOGW("Can't verify %.*s\n", rsaName.len, rsaName.str);
@@ -200,7 +246,7 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
         return NULL;
     }
 
-    if (!digestEntry(pArchive, mfEntry, NULL, 0, actual)) return NULL;
+    if (!digestEntry(pArchive, mfEntry, NULL, actual, NULL)) return NULL;
     if (memcmp(expected, actual, SHA_DIGEST_SIZE)) {
         UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
         LOGE("Wrong digest for %s in %.*s\n", mfName, fn.len, fn.str);
@@ -212,13 +258,227 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
 }
 
 
-/* Verify all the files in a Zip archive against the manifest. */
-static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
+/* One manifest stanza: an archive entry and the digest it must have. */
+struct VerifyJob {
+    const ZipArchive *pArchive;
+    const ZipEntry *entry;
+    char *name;
+    uint8_t expected[SHA_DIGEST_SIZE];
+    bool checked;  // pipelined mode: the digest has already matched
+};
+
+
+/* State shared by the threads checking the digests of a list of jobs. */
+struct VerifyWork {
+    struct VerifyJob *jobs;
+    int numJobs;
+
+    pthread_mutex_t lock;  // guards nextJob, failed and failedArchive
+    int nextJob;
+    bool failed;
+    const ZipArchive *failedArchive;  // where the first bad file was
+
+    struct DigestProgress progress;
+};
+
+
+static int gVerifyThreads = 0;
+
+void verify_set_threads(int threads) {
+    gVerifyThreads = threads;
+}
+
+
+/* Check one entry's digest (and CRC) against the manifest. */
+static bool verifyJob(struct VerifyWork *work, const struct VerifyJob *job) {
+    uint8_t actual[SHA_DIGEST_SIZE];
+    bool intact;
+
+    // The CRC is checked while the digest is computed, so the
+    // entry only has to be inflated once.
+    if (!digestEntry(job->pArchive, job->entry, &work->progress, actual,
+                     &intact) || !intact) {
+        LOGE("Corrupt file:\n  %s\n", job->name);
+        return false;
+    }
+    if (memcmp(job->expected, actual, SHA_DIGEST_SIZE) != 0) {
+        LOGE("Wrong digest:\n  %s\n", job->name);
+        return false;
+    }
+
+    LOGI("Verified %s\n", job->name);
+    return true;
+}
+
+
+/* Small files are inflated whole and then hashed VERIFY_BATCH at once by
+ * sha1_multi(), when it can hash several messages faster than one by one.
+ */
+#define VERIFY_BATCH (SHA1_LANES * 2)
+#define VERIFY_BATCH_MAX_SIZE (64 * 1024)
+
+struct EntryBuffer {
+    unsigned char *data;
+    int len;
+    int size;
+    struct DigestProgress *progress;
+};
+
+
+/* mzProcessZipEntryContents callback to collect an entry in memory. */
+static bool copyData(const unsigned char *data, int dataLen, void *cookie) {
+    struct EntryBuffer *buffer = (struct EntryBuffer *) cookie;
+    if (dataLen > buffer->size - buffer->len) return false;
+    memcpy(buffer->data + buffer->len, data, dataLen);
+    buffer->len += dataLen;
+    addProgress(buffer->progress, dataLen);
+    return true;
+}
+
+
+static bool isBatchable(const struct VerifyJob *job) {
+    return mzGetZipEntryUncompLen(job->entry) <= VERIFY_BATCH_MAX_SIZE;
+}
+
+
+/* Like verifyJob(), for "count" small files.  Returns the index of the
+ * first one that fails, or -1 if they're all good.
+ */
+static int verifyJobBatch(struct VerifyWork *work,
+        const struct VerifyJob *jobs, int count) {
+    struct EntryBuffer buffers[VERIFY_BATCH];
+    const void *data[VERIFY_BATCH];
+    size_t len[VERIFY_BATCH];
+    uint8_t actual[VERIFY_BATCH][SHA_DIGEST_SIZE];
+    int i, bad = -1;
+
+    unsigned char *space = (unsigned char *) malloc(
+            count * VERIFY_BATCH_MAX_SIZE);
+    if (space == NULL) {
+        for (i = 0; i < count; ++i) {
+            if (!verifyJob(work, &jobs[i])) return i;
+        }
+        return -1;
+    }
+
+    for (i = 0; i < count && bad < 0; ++i) {
+        struct EntryBuffer *buffer = &buffers[i];
+        bool intact;
+        buffer->data = space + i * VERIFY_BATCH_MAX_SIZE;
+        buffer->len = 0;
+        buffer->size = VERIFY_BATCH_MAX_SIZE;
+        buffer->progress = &work->progress;
+        if (!mzProcessZipEntryContentsCheckCrc(jobs[i].pArchive, jobs[i].entry,
+                copyData, buffer, &intact) || !intact) {
+            LOGE("Corrupt file:\n  %s\n", jobs[i].name);
+            bad = i;
+        }
+        data[i] = buffer->data;
+        len[i] = buffer->len;
+    }
+
+    if (bad < 0) {
+        sha1_multi(count, data, len, actual);
+        for (i = 0; i < count; ++i) {
+            if (memcmp(jobs[i].expected, actual[i], SHA_DIGEST_SIZE) != 0) {
+                LOGE("Wrong digest:\n  %s\n", jobs[i].name);
+                bad = i;
+                break;
+            }
+            LOGI("Verified %s\n", jobs[i].name);
+        }
+    }
+
+    free(space);
+    return bad;
+}
+
+
+/* Take jobs off the shared list until it's empty or something has failed. */
+static void *verifyWorker(void *cookie) {
+    struct VerifyWork *work = (struct VerifyWork *) cookie;
+    const bool batch = sha1_get_backend() == SHA1_VECTOR;
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        int i = work->failed ? work->numJobs : work->nextJob;
+        int n = 1;
+        if (batch && i < work->numJobs && isBatchable(&work->jobs[i])) {
+            while (n < VERIFY_BATCH && i + n < work->numJobs &&
+                   isBatchable(&work->jobs[i + n])) {
+                ++n;
+            }
+        }
+        if (i < work->numJobs) work->nextJob = i + n;
+        pthread_mutex_unlock(&work->lock);
+        if (i >= work->numJobs) break;
+
+        int bad = -1;
+        if (n > 1) {
+            bad = verifyJobBatch(work, &work->jobs[i], n);
+        } else if (!verifyJob(work, &work->jobs[i])) {
+            bad = 0;
+        }
+        if (bad >= 0) {
+            pthread_mutex_lock(&work->lock);
+            if (!work->failed) {
+                work->failedArchive = work->jobs[i + bad].pArchive;
+            }
+            work->failed = true;
+            pthread_mutex_unlock(&work->lock);
+        }
+    }
+    return NULL;
+}
+
+
+/* Run all the jobs, on the calling thread plus (threads - 1) helpers. */
+static bool runVerifyJobs(struct VerifyWork *work, int threads) {
+    pthread_t *helpers = NULL;
+    int i, started = 0;
+
+    if (threads > work->numJobs) threads = work->numJobs;
+    if (threads > 1) {
+        helpers = (pthread_t *) malloc((threads - 1) * sizeof(*helpers));
+    }
+    if (helpers != NULL) {
+        for (i = 0; i < threads - 1; ++i) {
+            if (pthread_create(&helpers[started], NULL, verifyWorker, work)) {
+                LOGW("Can't start verifier thread %d\n", i);
+                break;
+            }
+            ++started;
+        }
+    }
+
+    verifyWorker(work);
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    LOGV("Checked %d digests on %d threads (%s SHA-1)\n", work->numJobs,
+            started + 1, sha1_backend_name());
+    return !work->failed;
+}
+
+
+/* Parse the manifest into a list of digest jobs, one per file, and
+ * check it for missing, unexpected and undigested files.  "work" is
+ * set up here, and must be released with freeVerifyWork() whatever
+ * the result.
+ */
+static bool parseManifest(const ZipArchive *pArchive, const ZipEntry *mfEntry,
+        struct VerifyWork *work) {
     static const char namePrefix[] = "Name: ";
     static const char contPrefix[] = " ";  // Continuation of the filename
     static const char digestPrefix[] = "SHA1-Digest: ";
     static const char eol[] = "\r\n";
 
+    memset(work, 0, sizeof(*work));
+    pthread_mutex_init(&work->lock, NULL);
+    pthread_mutex_init(&work->progress.lock, NULL);
+
     char *mfBuf = slurpEntry(pArchive, mfEntry);
     if (mfBuf == NULL) return false;
 
@@ -231,11 +491,14 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
     }
 
     /* Mark all the files in the archive that need to be verified.
-     * As we scan the manifest and check signatures, we'll unset these flags.
-     * At the end, we'll make sure that all the flags are unset.
+     * As we scan the manifest and queue up digests to check, we'll unset
+     * these flags.  Before checking anything, we'll make sure that all the
+     * flags are unset.
      */
 
-    unsigned i, totalBytes = 0;
+    int jobsAllocd = 0;
+
+    unsigned i;
     for (i = 0; i < mzZipEntryCount(pArchive); ++i) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
         UnterminatedString fn = mzGetZipEntryFileName(entry);
@@ -253,11 +516,10 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
             LOGV("Skipping signature %.*s\n", fn.len, fn.str);
         } else {
             unverified[i] = true;
-            totalBytes += len;
+            work->progress.totalBytes += len;
         }
     }
 
-    unsigned doneBytes = 0;
     char *line, *save, *name = NULL;
     for (line = strtok_r(mfBuf, eol, &save); line != NULL;
          line = strtok_r(NULL, eol, &save)) {
@@ -300,31 +562,37 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
                 LOGE("Missing file:\n  %s\n", name);
                 break;
             }
-            if (!mzIsZipEntryIntact(pArchive, entry)) {
-                LOGE("Corrupt file:\n  %s\n", name);
-                break;
-            }
             if (!unverified[mzGetZipEntryIndex(pArchive, entry)]) {
                 LOGE("Unexpected file:\n  %s\n", name);
                 break;
             }
 
-            uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
+            uint8_t expected[SHA_DIGEST_SIZE + 3];
             int n = b64_pton(base64, expected, sizeof(expected));
             if (n != SHA_DIGEST_SIZE) {
                 LOGE("Invalid base64:\n  %s\n  %s\n", name, base64);
                 break;
             }
 
-            if (!digestEntry(pArchive, entry, &doneBytes, totalBytes, actual) ||
-                memcmp(expected, actual, SHA_DIGEST_SIZE) != 0) {
-                LOGE("Wrong digest:\n  %s\n", name);
-                break;
+            if (work->numJobs == jobsAllocd) {
+                int newAllocd = jobsAllocd ? jobsAllocd * 2 : 64;
+                struct VerifyJob *newJobs = (struct VerifyJob *)
+                        realloc(work->jobs, newAllocd * sizeof(*newJobs));
+                if (newJobs == NULL) {
+                    LOGE("Can't allocate %d digest jobs\n", newAllocd);
+                    break;
+                }
+                work->jobs = newJobs;
+                jobsAllocd = newAllocd;
             }
 
-            LOGI("Verified %s\n", name);
+            struct VerifyJob *job = &work->jobs[work->numJobs++];
+            job->pArchive = pArchive;
+            job->entry = entry;
+            job->name = name;
+            memcpy(job->expected, expected, SHA_DIGEST_SIZE);
+            job->checked = false;
             unverified[mzGetZipEntryIndex(pArchive, entry)] = false;
-            free(name);
             name = NULL;
         }
     }
@@ -336,22 +604,57 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
     free(unverified);
 
     // This means we didn't get to the end of the manifest successfully.
-    if (line != NULL) return false;
+    bool ok = (line == NULL);
 
-    if (i < mzZipEntryCount(pArchive)) {
+    if (ok && i < mzZipEntryCount(pArchive)) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
         UnterminatedString fn = mzGetZipEntryFileName(entry);
         LOGE("No digest for %.*s\n", fn.len, fn.str);
-        return false;
+        ok = false;
     }
 
-    return true;
+    return ok;
+}
+
+
+static void freeVerifyWork(struct VerifyWork *work) {
+    int j;
+    for (j = 0; j < work->numJobs; ++j) {
+        free(work->jobs[j].name);
+    }
+    free(work->jobs);
+    pthread_mutex_destroy(&work->lock);
+    pthread_mutex_destroy(&work->progress.lock);
+}
+
+
+/* Run the jobs on a pool of verify_set_threads() threads.  The result
+ * is the same regardless of how many threads are used.
+ */
+static bool runVerifyWork(struct VerifyWork *work) {
+    int threads = gVerifyThreads;
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    return runVerifyJobs(work, threads);
 }
 
 
-bool verify_jar_signature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, int numKeys) {
-    const ZipEntry *sfEntry = verifySignature(pArchive, pKeys, numKeys);
+/* Verify all the files in a Zip archive against the manifest.
+ *
+ * The manifest is parsed and checked for missing, unexpected and
+ * undigested files first; the digests themselves are then computed on
+ * a pool of threads.
+ */
+static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
+    struct VerifyWork work;
+    bool ok = parseManifest(pArchive, mfEntry, &work) && runVerifyWork(&work);
+    freeVerifyWork(&work);
+    return ok;
+}
+
+
+bool verify_jar_signature(const ZipArchive *pArchive, const KeyStore *pKeys) {
+    const ZipEntry *sfEntry = verifySignature(pArchive, pKeys);
     if (sfEntry == NULL) return false;
 
     const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
@@ -359,3 +662,260 @@ bool verify_jar_signature(const ZipArchive *pArchive,
 
     return verifyArchive(pArchive, mfEntry);
 }
+
+
+int verify_jar_signatures(const ZipArchive *const *archives, int count,
+        const KeyStore *pKeys) {
+    struct VerifyWork all;
+    memset(&all, 0, sizeof(all));
+    pthread_mutex_init(&all.lock, NULL);
+    pthread_mutex_init(&all.progress.lock, NULL);
+    int jobsAllocd = 0;
+
+    // The signatures and manifests are quick; check them one at a time.
+    int i, bad = -1;
+    for (i = 0; i < count && bad < 0; ++i) {
+        const ZipEntry *sfEntry = verifySignature(archives[i], pKeys);
+        const ZipEntry *mfEntry =
+                sfEntry ? verifyManifest(archives[i], sfEntry) : NULL;
+        struct VerifyWork one;
+        if (mfEntry == NULL || !parseManifest(archives[i], mfEntry, &one)) {
+            if (mfEntry != NULL) freeVerifyWork(&one);
+            bad = i;
+            break;
+        }
+
+        if (all.numJobs + one.numJobs > jobsAllocd) {
+            int newAllocd = (all.numJobs + one.numJobs) * 2;
+            struct VerifyJob *newJobs = (struct VerifyJob *)
+                    realloc(all.jobs, newAllocd * sizeof(*newJobs));
+            if (newJobs == NULL) {
+                LOGE("Can't allocate %d digest jobs\n", newAllocd);
+                freeVerifyWork(&one);
+                bad = i;
+                break;
+            }
+            all.jobs = newJobs;
+            jobsAllocd = newAllocd;
+        }
+
+        // The names go with the jobs.
+        memcpy(all.jobs + all.numJobs, one.jobs,
+                one.numJobs * sizeof(*one.jobs));
+        all.numJobs += one.numJobs;
+        all.progress.totalBytes += one.progress.totalBytes;
+        one.numJobs = 0;
+        freeVerifyWork(&one);
+    }
+
+    // Then all the files of all the packages share the threads.
+    if (bad < 0 && !runVerifyWork(&all)) {
+        for (i = 0; i < count && archives[i] != all.failedArchive; ++i) ;
+        bad = i < count ? i : 0;
+    }
+
+    freeVerifyWork(&all);
+    return bad;
+}
+
+
+/* The package being checked by pipelined verification, if any.  Each
+ * file's digest is computed by the extraction observer in the same pass
+ * that writes it out; verify_pipelined_commit() computes the rest.
+ */
+static struct {
+    bool active;
+    ZipArchive *pArchive;
+    struct VerifyWork work;     // work.lock guards work.failed and "checked"
+    int *jobOf;                 // job index of each entry, or -1 if none
+    ZipExtractObserver observer;
+} gPipeline;
+
+
+struct PipelineDigest {
+    Sha1Context digest;
+    struct VerifyJob *job;
+};
+
+
+/* Record the outcome of checking a job's digest.  Returns "match". */
+static bool pipelineResult(struct VerifyJob *job, bool match) {
+    pthread_mutex_lock(&gPipeline.work.lock);
+    if (match) {
+        job->checked = true;
+    } else {
+        gPipeline.work.failed = true;
+    }
+    pthread_mutex_unlock(&gPipeline.work.lock);
+    if (!match) LOGE("Wrong digest:\n  %s\n", job->name);
+    return match;
+}
+
+
+static struct VerifyJob *pipelineJob(const ZipEntry *pEntry) {
+    int j = gPipeline.jobOf[mzGetZipEntryIndex(gPipeline.pArchive, pEntry)];
+    if (j < 0) return NULL;  // not covered by the manifest
+
+    struct VerifyJob *job = &gPipeline.work.jobs[j];
+    pthread_mutex_lock(&gPipeline.work.lock);
+    bool checked = job->checked;
+    pthread_mutex_unlock(&gPipeline.work.lock);
+    return checked ? NULL : job;
+}
+
+
+static void *pipelineBegin(const ZipEntry *pEntry, void *cookie) {
+    struct VerifyJob *job = pipelineJob(pEntry);
+    if (job == NULL) return NULL;
+
+    // If this fails, the entry is simply left for verify_pipelined_commit().
+    struct PipelineDigest *state =
+            (struct PipelineDigest *) malloc(sizeof(*state));
+    if (state == NULL) return NULL;
+    sha1_init(&state->digest);
+    state->job = job;
+    return state;
+}
+
+
+static void pipelineUpdate(void *cookie, const unsigned char *data, int len) {
+    struct PipelineDigest *state = (struct PipelineDigest *) cookie;
+    sha1_update(&state->digest, data, len);
+}
+
+
+static bool pipelineEnd(void *cookie, bool ok) {
+    struct PipelineDigest *state = (struct PipelineDigest *) cookie;
+    bool match = true;
+    if (ok) {  // else only part of the entry was seen, and it's failed anyway
+        uint8_t actual[SHA_DIGEST_SIZE];
+        sha1_final(&state->digest, actual);
+        match = pipelineResult(state->job,
+                !memcmp(actual, state->job->expected, SHA_DIGEST_SIZE));
+    }
+    free(state);
+    return match;
+}
+
+
+bool verify_pipelined_begin(ZipArchive *pArchive, const KeyStore *pKeys) {
+    verify_pipelined_end();
+
+    const ZipEntry *sfEntry = verifySignature(pArchive, pKeys);
+    if (sfEntry == NULL) return false;
+
+    const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
+    if (mfEntry == NULL) return false;
+
+    struct VerifyWork *work = &gPipeline.work;
+    unsigned int count = mzZipEntryCount(pArchive);
+    gPipeline.jobOf = (int *) malloc(count * sizeof(int));
+    if (gPipeline.jobOf == NULL) {
+        LOGE("Can't allocate job index\n");
+        return false;
+    }
+    if (!parseManifest(pArchive, mfEntry, work)) {
+        freeVerifyWork(work);
+        free(gPipeline.jobOf);
+        gPipeline.jobOf = NULL;
+        return false;
+    }
+
+    unsigned int i;
+    int j;
+    for (i = 0; i < count; ++i) gPipeline.jobOf[i] = -1;
+    for (j = 0; j < work->numJobs; ++j) {
+        gPipeline.jobOf[mzGetZipEntryIndex(pArchive, work->jobs[j].entry)] = j;
+    }
+
+    gPipeline.pArchive = pArchive;
+    gPipeline.observer.begin = pipelineBegin;
+    gPipeline.observer.update = pipelineUpdate;
+    gPipeline.observer.end = pipelineEnd;
+    gPipeline.observer.cookie = NULL;
+    mzSetExtractObserver(pArchive, &gPipeline.observer);
+    gPipeline.active = true;
+
+    LOGI("Checking %d files as they're installed\n", work->numJobs);
+    return true;
+}
+
+
+bool verify_pipelined_buffer(const ZipEntry *pEntry,
+        const char *data, int len) {
+    if (!gPipeline.active) return true;
+
+    struct VerifyJob *job = pipelineJob(pEntry);
+    if (job == NULL) return !verify_pipelined_failed();
+
+    Sha1Context digest;
+    uint8_t actual[SHA_DIGEST_SIZE];
+    sha1_init(&digest);
+    sha1_update(&digest, data, len);
+    sha1_final(&digest, actual);
+    return pipelineResult(job, !memcmp(actual, job->expected, SHA_DIGEST_SIZE));
+}
+
+
+bool verify_pipelined_commit(void) {
+    if (!gPipeline.active) return true;
+
+    struct VerifyWork *work = &gPipeline.work;
+    struct VerifyWork rest;
+    memset(&rest, 0, sizeof(rest));
+    rest.jobs = (struct VerifyJob *) malloc(
+            (work->numJobs > 0 ? work->numJobs : 1) * sizeof(*rest.jobs));
+    if (rest.jobs == NULL) {
+        LOGE("Can't allocate %d digest jobs\n", work->numJobs);
+        return false;
+    }
+
+    // The rest are copies; their names still belong to gPipeline.work.
+    int j;
+    pthread_mutex_lock(&work->lock);
+    bool failed = work->failed;
+    for (j = 0; j < work->numJobs; ++j) {
+        if (!work->jobs[j].checked) rest.jobs[rest.numJobs++] = work->jobs[j];
+    }
+    pthread_mutex_unlock(&work->lock);
+
+    bool ok = !failed;
+    if (ok && rest.numJobs > 0) {
+        ui_print("Verifying rest of package...\n");
+        pthread_mutex_init(&rest.lock, NULL);
+        pthread_mutex_init(&rest.progress.lock, NULL);
+        ok = runVerifyWork(&rest);
+        pthread_mutex_destroy(&rest.lock);
+        pthread_mutex_destroy(&rest.progress.lock);
+
+        pthread_mutex_lock(&work->lock);
+        if (ok) {
+            for (j = 0; j < work->numJobs; ++j) work->jobs[j].checked = true;
+        } else {
+            work->failed = true;
+        }
+        pthread_mutex_unlock(&work->lock);
+    }
+    free(rest.jobs);
+
+    if (ok) LOGI("Verified all %d files\n", work->numJobs);
+    return ok;
+}
+
+
+bool verify_pipelined_failed(void) {
+    if (!gPipeline.active) return false;
+    pthread_mutex_lock(&gPipeline.work.lock);
+    bool failed = gPipeline.work.failed;
+    pthread_mutex_unlock(&gPipeline.work.lock);
+    return failed;
+}
+
+
+void verify_pipelined_end(void) {
+    if (!gPipeline.active) return;
+    mzSetExtractObserver(gPipeline.pArchive, NULL);
+    freeVerifyWork(&gPipeline.work);
+    free(gPipeline.jobOf);
+    memset(&gPipeline, 0, sizeof(gPipeline));
+}
@@ -17,14 +17,54 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include "keys.h"
 #include "minzip/Zip.h"
-#include "mincrypt/rsa.h"
 
 /*
  * Check the digital signature (as applied by jarsigner) on a Zip archive.
  * Every file in the archive must be signed by one of the supplied RSA keys.
  */
-bool verify_jar_signature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, int numKeys);
+bool verify_jar_signature(const ZipArchive *pArchive, const KeyStore *pKeys);
+
+/*
+ * Check several archives at once.  Their files are digested together,
+ * on one pool of threads and one progress bar.  Returns the index of
+ * an archive that fails, or -1 if they all verify.
+ */
+int verify_jar_signatures(const ZipArchive *const *archives, int count,
+        const KeyStore *pKeys);
+
+/*
+ * Set the number of threads used to check the digests of the files in
+ * the archive.  Zero (the default) uses one thread per online CPU; one
+ * checks every file on the calling thread.
+ */
+void verify_set_threads(int threads);
+
+/*
+ * Pipelined verification, for installing a package with one read of it
+ * instead of two.
+ *
+ * verify_pipelined_begin() checks the signature chain down to
+ * META-INF/MANIFEST.MF and that the manifest lists every file, then
+ * checks each file's digest as mzExtractZipEntryToFile() writes it.
+ * Data read some other way should be passed to verify_pipelined_buffer()
+ * before it's used.  Anything that can't be redone by installing the
+ * package again must wait for verify_pipelined_commit(), which digests
+ * the files that haven't been read yet and returns true only if the
+ * whole package is good.
+ *
+ * Without an active session, commit and buffer return true.
+ */
+bool verify_pipelined_begin(ZipArchive *pArchive, const KeyStore *pKeys);
+bool verify_pipelined_buffer(const ZipEntry *pEntry,
+        const char *data, int len);
+bool verify_pipelined_commit(void);
+
+/* True if a file checked so far has had the wrong digest. */
+bool verify_pipelined_failed(void);
+
+/* Stop watching the package and release everything. */
+void verify_pipelined_end(void);
 
 #endif  /* _RECOVERY_VERIFIER_H */